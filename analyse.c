@@ -0,0 +1,344 @@
+#include "globals.h"
+#include "audio.h"
+#include "analyse.h"
+#include <math.h>
+
+/*
+ * MP3 pre-analysis
+ * ----------------
+ * Most of the production suite is already mono 128K at -18 LUFS with no
+ * leading silence, so running it through FFMPEG_FILTERS again spends the
+ * Pi's CPU on an encode that changes nothing. Before audio.c transcodes a
+ * file it asks, cheapest first:
+ *
+ *   1. Is every MPEG frame already MPEG-1 Layer III, mono, at the output's
+ *      sample and bit rates? A walk over the frame headers, no decoding.
+ *   2. If the ID3v2 tag has ReplayGain values, do they put the track
+ *      within tolerance of the target, and its peak under the ceiling?
+ *      ReplayGain 2 uses -18 LUFS as its reference, so the track gain is
+ *      how far the loudness is from our target.
+ *   3. A decode-only pass through ANALYSE_FILTERS (ebur128 and
+ *      silencedetect), which is a fraction of the cost of the transcode:
+ *      is the integrated loudness within tolerance of the target, the true
+ *      peak and loudness range no more than tolerance above their limits,
+ *      and is there no silence at the start for silenceremove to trim?
+ *
+ * A file that passes all three is used as it is. The gentle agate in
+ * FFMPEG_FILTERS is not checked; a file that has been through this chain
+ * before has had it already.
+ *
+ * The measurements in (3) are kept with the processed file cache under the
+ * file's content hash, and the tolerance is applied afresh each time, so
+ * changing it doesn't need the files measuring again.
+ *
+ * analyse_duration() estimates a file's playing time from its first frame
+ * alone, cheaply enough to run over the master before it is copied, for
+ * the bit rate planner (budget.c).
+ */
+
+#define ANALYSE_VERSION 1           // of the text kept in the cache
+
+#define DURATION_READ_BYTES 4096    // from the first frame, enough for a Xing or VBRI header
+
+// One Layer III frame header
+typedef struct {
+    int version;                    // 3 for MPEG-1, 2 for MPEG-2, 0 for MPEG-2.5
+    int kbps;
+    int rate;
+    bool mono;
+    int length;                     // of the frame in bytes
+    int samples;                    // per frame
+} FrameStruct;
+
+static const int layer3_kbps[16] = { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 };
+static const int layer3_lsf_kbps[16] = { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 };
+static const int mpeg1_rates[4] = { 44100, 48000, 32000, 0 };
+
+
+//------------------------------
+// Frame headers and tags
+//------------------------------
+
+static size_t syncsafe32(const uint8_t* p)
+{
+    return ((size_t)(p[0] & 0x7F) << 21) | ((p[1] & 0x7F) << 14) | ((p[2] & 0x7F) << 7) | (p[3] & 0x7F);
+}
+
+
+static size_t be32(const uint8_t* p)
+{
+    return ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+}
+
+
+// Size of the ID3v2 tag at the start of the file, or 0 if there isn't one
+static size_t id3v2_size(const uint8_t* data, size_t len)
+{
+    if (len < 10 || memcmp(data, "ID3", 3) != 0) return 0;
+    size_t size = 10 + syncsafe32(data + 6);
+    if (data[5] & 0x10) size += 10;         // footer
+    return (size > len) ? len : size;
+}
+
+
+// Reads a Layer III frame header. Returns false if it isn't one.
+static bool parse_header(const uint8_t* header, FrameStruct* frame_p)
+{
+    if (header[0] != 0xFF || (header[1] & 0xE0) != 0xE0) return false;
+
+    int version = (header[1] >> 3) & 3;
+    int layer = (header[1] >> 1) & 3;
+    int kbps_index = header[2] >> 4;
+    int rate_index = (header[2] >> 2) & 3;
+    if (version == 1 || layer != 1 || kbps_index == 0 || kbps_index == 15 || rate_index == 3) return false;
+
+    bool mpeg1 = (version == 3);
+    frame_p->version = version;
+    frame_p->kbps = mpeg1 ? layer3_kbps[kbps_index] : layer3_lsf_kbps[kbps_index];
+    frame_p->rate = mpeg1_rates[rate_index] / (mpeg1 ? 1 : (version == 2) ? 2 : 4);
+    frame_p->mono = ((header[3] >> 6) == 3);
+    frame_p->samples = mpeg1 ? 1152 : 576;
+    frame_p->length = frame_p->samples / 8 * frame_p->kbps * 1000 / frame_p->rate + ((header[2] >> 1) & 1);
+    return true;
+}
+
+
+// Finds the ReplayGain track gain (dB) and peak (linear) in the TXXX frames
+// of an ID3v2.3 or 2.4 tag. Leaves them at NAN if they aren't there.
+static void read_replaygain(const uint8_t* tag, size_t tag_len, double* gain_p, double* peak_p)
+{
+    *gain_p = NAN;
+    *peak_p = NAN;
+    if (tag_len < 10) return;
+
+    // Unsynchronised tags and extended headers are rare enough to leave to the measurement
+    int version = tag[3];
+    if (version < 3 || version > 4 || (tag[5] & 0xC0)) return;
+
+    size_t pos = 10;
+    while (pos + 10 <= tag_len && tag[pos] != '\0') {
+        const uint8_t* frame = tag + pos;
+        size_t size = (version == 4) ? syncsafe32(frame + 4) : be32(frame + 4);
+        if (size > tag_len - pos - 10) break;
+
+        // Encoding, description, '\0', value. Only ISO-8859-1 and UTF-8.
+        if (memcmp(frame, "TXXX", 4) == 0 && size > 1 && (frame[10] == 0 || frame[10] == 3)) {
+            const char* text = (const char*)frame + 11;
+            const char* nul = memchr(text, '\0', size - 1);
+            if (nul) {
+                char value[32];
+                snprintf(value, sizeof(value), "%.*s", (int)(text + size - 1 - (nul + 1)), nul + 1);
+                if (strcasecmp(text, "REPLAYGAIN_TRACK_GAIN") == 0) sscanf(value, "%lf", gain_p);
+                if (strcasecmp(text, "REPLAYGAIN_TRACK_PEAK") == 0) sscanf(value, "%lf", peak_p);
+            }
+        }
+        pos += 10 + size;
+    }
+}
+
+
+// Checks every frame from pos on matches the output format. Tags after the
+// last frame are fine; anything else means the stream needs repairing.
+static bool check_frames(const uint8_t* data, size_t len, size_t pos, int bit_rate, char* reason, size_t reason_len)
+{
+    int frames = 0;
+    FrameStruct frame;
+
+    while (pos + 4 <= len) {
+        const uint8_t* header = data + pos;
+        if (header[0] != 0xFF || (header[1] & 0xE0) != 0xE0) break;
+
+        if (!parse_header(header, &frame) || frame.version != 3) {
+            snprintf(reason, reason_len, "not MPEG-1 Layer III");
+            return false;
+        }
+        if (frame.kbps * 1000 != bit_rate) {
+            snprintf(reason, reason_len, "%d kbps", frame.kbps);
+            return false;
+        }
+        if (frame.rate != AUDIO_SAMPLE_RATE) {
+            snprintf(reason, reason_len, "%d Hz", frame.rate);
+            return false;
+        }
+        if (!frame.mono) {
+            snprintf(reason, reason_len, "stereo");
+            return false;
+        }
+
+        pos += frame.length;
+        frames++;
+    }
+
+    if (frames == 0) {
+        snprintf(reason, reason_len, "no MPEG audio found");
+        return false;
+    }
+    if (pos < len) {
+        const char* rest = (const char*)data + pos;
+        size_t rest_len = len - pos;
+        bool tag = (rest_len <= 128) ||
+                   (memcmp(rest, "TAG", 3) == 0) ||
+                   (rest_len >= 8 && memcmp(rest, "APETAGEX", 8) == 0) ||
+                   (rest_len >= 11 && memcmp(rest, "LYRICSBEGIN", 11) == 0);
+        if (!tag) {
+            snprintf(reason, reason_len, "damaged at byte %zu", pos);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Steps 1 and 2: checks the stream format, at bit_rate, and any ReplayGain
+// tags. Returns true if the file might pass, false with the reason if it
+// needs transcoding.
+bool analyse_format(const char* path, int bit_rate, double tolerance, char* reason, size_t len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(reason, len, "can't open: %s", strerror(errno));
+        return false;
+    }
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1 || statbuf.st_size == 0) {
+        snprintf(reason, len, "empty");
+        close(fd);
+        return false;
+    }
+    size_t size = statbuf.st_size;
+    const uint8_t* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        snprintf(reason, len, "can't map: %s", strerror(errno));
+        return false;
+    }
+
+    size_t tag_len = id3v2_size(data, size);
+    bool ok = check_frames(data, size, tag_len, bit_rate, reason, len);
+
+    double gain;
+    double peak;
+    read_replaygain(data, tag_len, &gain, &peak);
+    munmap((void*)data, size);
+
+    if (ok && !isnan(gain) && fabs(gain) > tolerance) {
+        snprintf(reason, len, "ReplayGain puts it at %.1f LUFS", ANALYSE_TARGET_LUFS - gain);
+        ok = false;
+    }
+    if (ok && peak > 0 && 20 * log10(peak) > ANALYSE_MAX_PEAK_DB + tolerance) {
+        snprintf(reason, len, "ReplayGain peak %.1f dBFS", 20 * log10(peak));
+        ok = false;
+    }
+    return ok;
+}
+
+
+// Estimates how long a file plays for, from just its first frame: the frame
+// count in its Xing, Info or VBRI header if it has one, otherwise its size
+// at the first frame's bit rate. Sets *tag_bytes_p to the size of its
+// ID3v2 tag. Returns seconds, or -1 if it doesn't look like an MP3 file.
+double analyse_duration(const char* path, off_t* tag_bytes_p)
+{
+    *tag_bytes_p = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct stat statbuf;
+    uint8_t buffer[DURATION_READ_BYTES];
+    ssize_t n = -1;
+    if (fstat(fd, &statbuf) == 0) n = pread(fd, buffer, 10, 0);
+
+    // The tag may hold pictures, so skip it rather than read it
+    off_t start = 0;
+    if (n == 10 && memcmp(buffer, "ID3", 3) == 0) {
+        start = 10 + syncsafe32(buffer + 6) + ((buffer[5] & 0x10) ? 10 : 0);
+    }
+    if (n >= 0) n = pread(fd, buffer, sizeof(buffer), start);
+    close(fd);
+    if (n < 4) return -1;
+    *tag_bytes_p = start;
+
+    FrameStruct frame;
+    ssize_t pos = 0;
+    while (pos + 4 <= n && !parse_header(buffer + pos, &frame)) pos++;
+    if (pos + 4 > n) return -1;
+
+    // The Xing or Info header follows the side information, VBRI sits at a fixed place
+    int side_info = (frame.version == 3) ? (frame.mono ? 17 : 32) : (frame.mono ? 9 : 17);
+    const uint8_t* xing = buffer + pos + 4 + side_info;
+    const uint8_t* vbri = buffer + pos + 4 + 32;
+    uint32_t frames = 0;
+    if (xing + 12 <= buffer + n && (memcmp(xing, "Xing", 4) == 0 || memcmp(xing, "Info", 4) == 0) && (xing[7] & 1)) {
+        frames = be32(xing + 8);
+    }
+    else if (vbri + 18 <= buffer + n && memcmp(vbri, "VBRI", 4) == 0) {
+        frames = be32(vbri + 14);
+    }
+    if (frames > 0) return (double)frames * frame.samples / frame.rate;
+
+    off_t audio_bytes = statbuf.st_size - start - pos;
+    return (audio_bytes > 0) ? audio_bytes * 8.0 / (frame.kbps * 1000) : 0;
+}
+
+
+//------------------------------
+// Loudness
+//------------------------------
+
+// Picks the figures out of one line of the ffmpeg command's output
+void analyse_read_line(LoudnessStruct* loudness_p, const char* line)
+{
+    double value;
+    const char* silence = strstr(line, "silence_start:");
+
+    if (silence && sscanf(silence, "silence_start: %lf", &value) == 1) {
+        if (value < ANALYSE_START_SECONDS) loudness_p->leading_silence = true;
+    }
+    else if (sscanf(line, " I: %lf LUFS", &value) == 1) {
+        loudness_p->integrated = value;
+        loudness_p->measured = true;
+    }
+    else if (sscanf(line, " LRA: %lf LU", &value) == 1) {
+        loudness_p->range = value;
+    }
+    else if (sscanf(line, " Peak: %lf dBFS", &value) == 1) {
+        loudness_p->true_peak = value;
+    }
+}
+
+
+// Step 3: judges a measurement. Returns true if the file can be used as it
+// is. Either way, reason describes it.
+bool analyse_loudness(const LoudnessStruct* loudness_p, double tolerance, char* reason, size_t len)
+{
+    snprintf(reason, len, "%.1f LUFS, LRA %.1f LU, peak %.1f dBTP%s", loudness_p->integrated, loudness_p->range,
+             loudness_p->true_peak, loudness_p->leading_silence ? ", silence at the start" : "");
+
+    return fabs(loudness_p->integrated - ANALYSE_TARGET_LUFS) <= tolerance &&
+           loudness_p->true_peak <= ANALYSE_MAX_PEAK_DB + tolerance &&
+           loudness_p->range <= ANALYSE_MAX_RANGE_LU + tolerance &&
+           !loudness_p->leading_silence;
+}
+
+
+// A measurement as one line of text, for the cache
+void analyse_to_text(const LoudnessStruct* loudness_p, char* text, size_t len)
+{
+    snprintf(text, len, "analysis %d I=%.2f LRA=%.2f TP=%.2f silence=%d\n", ANALYSE_VERSION,
+             loudness_p->integrated, loudness_p->range, loudness_p->true_peak, loudness_p->leading_silence ? 1 : 0);
+}
+
+
+// Reads back analyse_to_text(). Returns false if it's damaged or out of date.
+bool analyse_from_text(const char* text, LoudnessStruct* loudness_p)
+{
+    int version;
+    int silence;
+    if (sscanf(text, "analysis %d I=%lf LRA=%lf TP=%lf silence=%d", &version, &loudness_p->integrated,
+               &loudness_p->range, &loudness_p->true_peak, &silence) != 5) return false;
+    if (version != ANALYSE_VERSION) return false;
+
+    loudness_p->leading_silence = (silence != 0);
+    loudness_p->measured = true;
+    return true;
+}
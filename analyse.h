@@ -0,0 +1,28 @@
+#ifndef ANALYSE_H
+#define ANALYSE_H
+
+// What FFMPEG_FILTERS aims for: loudnorm=I=-18:TP=-2:LRA=7, and silenceremove
+// trimming more than 0.7s below -35dB from the start
+#define ANALYSE_TARGET_LUFS (-18.0)
+#define ANALYSE_MAX_PEAK_DB (-2.0)
+#define ANALYSE_MAX_RANGE_LU 7.0
+#define ANALYSE_START_SECONDS 0.1   // silence found before this is at the start
+#define ANALYSE_FILTERS "silencedetect=n=-35dB:d=0.7, ebur128=peak=true:metadata=1:framelog=verbose"
+
+// A decode-only pass through ANALYSE_FILTERS
+typedef struct {
+    bool measured;                  // ebur128 gave an integrated loudness
+    double integrated;              // LUFS
+    double range;                   // LRA, LU
+    double true_peak;               // dBTP
+    bool leading_silence;           // silenceremove would trim the start
+} LoudnessStruct;
+
+bool analyse_format(const char* path, int bit_rate, double tolerance, char* reason, size_t len);
+double analyse_duration(const char* path, off_t* tag_bytes_p);
+void analyse_read_line(LoudnessStruct* loudness_p, const char* line);
+bool analyse_loudness(const LoudnessStruct* loudness_p, double tolerance, char* reason, size_t len);
+void analyse_to_text(const LoudnessStruct* loudness_p, char* text, size_t len);
+bool analyse_from_text(const char* text, LoudnessStruct* loudness_p);
+
+#endif // ANALYSE_H
@@ -0,0 +1,769 @@
+#include "globals.h"
+#include "utilities.h"
+#include "shm.h"
+#include "trace.h"
+#include "probes.h"
+#include "cache.h"
+#include "queue.h"
+#include "audio.h"
+#include "analyse.h"
+#include <limits.h>
+#ifdef HAVE_LIBAV
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/channel_layout.h>
+#endif
+
+/*
+ * MP3 optimisation
+ * ----------------
+ * Before the master is copied, every MP3 file that ingest.c copies from it
+ * to the ramdrive is run through ffmpeg with FFMPEG_FILTERS, which evens
+ * out the loudness, trims leading silence and quietens the gaps.
+ *
+ * ingest.c copies the MP3 files largest first and submits each as soon as
+ * its copy lands, to a bounded queue feeding a fixed pool of worker
+ * threads, each running one ffmpeg at a time, so transcoding overlaps
+ * reading the master. Taking the jobs longest first keeps a long recording
+ * from being started last and deciding when the step ends. The pool has
+ * one worker per online core, fewer if MemAvailable can't hold that many
+ * ffmpeg processes.
+ *
+ * When built with the libav* libraries (HAVE_LIBAV) each worker decodes,
+ * filters and encodes in-process: packets stream from the decoder through
+ * an abuffer -> FFMPEG_FILTERS -> aformat graph into the MP3 encoder, with
+ * no process spawned per file. Otherwise the worker runs the ffmpeg command
+ * and reads how far it has got through the input from /proc/<pid>/fdinfo.
+ * Either way the output goes to a temporary file next to the original and
+ * is renamed over it, so a file is never seen half written, and progress
+ * is counted in bytes of input, within each file as well as across them,
+ * in the shared ffmpeg_* counters.
+ *
+ * With the cache on (see cache.c), a file whose source and settings have
+ * been processed before is copied back from the cache instead.
+ *
+ * With [audio] passthrough on, a file that is already in the output format
+ * and within [audio] tolerance of the loudness targets (see analyse.c) is
+ * left as it is, and the decision logged. Telling takes a decode-only pass
+ * for files that look right from their headers; its bytes count towards
+ * the progress, so one that then needs transcoding runs ahead of the bar.
+ */
+
+#define AUDIO_WORKER_MEMORY_MB 96   // allowance for each ffmpeg process
+#define AUDIO_POLL_MS 250           // how often a worker reads ffmpeg's progress
+#define AUDIO_QUEUE_LENGTH 64
+
+typedef struct {
+    char* path;
+    off_t size;
+    void* tag;                      // handed back to done_cb
+} AudioJobStruct;
+
+static SharedDataStruct* shared_data_p = NULL;
+static BoundedQueueStruct job_queue;
+static audio_done_cb done_cb = NULL;
+static pthread_t* threads = NULL;
+static int thread_count = 0;
+static atomic_int cache_hits;
+static atomic_int passed_count;
+static bool passthrough = false;
+static int bit_rate = AUDIO_BIT_RATE;
+static double tolerance = 0;
+static char audio_settings[STRING_LEN * 2];     // everything that affects the output, for the cache key
+static char settings_text[STRING_LEN * 3];      // and whether files may pass through, for the manifest
+
+
+// One worker per online core, as many as the free memory allows
+static int pool_size(int files)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = (cores > 0) ? cores : 1;
+
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (file) {
+        char line[STRING_LEN];
+        unsigned long available_kb;
+        while (fgets(line, sizeof(line), file)) {
+            if (sscanf(line, "MemAvailable: %lu kB", &available_kb) == 1) {
+                int fit = available_kb / 1024 / AUDIO_WORKER_MEMORY_MB;
+                if (fit < workers) workers = fit;
+                break;
+            }
+        }
+        fclose(file);
+    }
+
+    if (workers > files) workers = files;
+    return (workers < 1) ? 1 : workers;
+}
+
+
+// Adds how far a job has got through its input to ffmpeg_bytes_done
+static void count_progress(const AudioJobStruct* job_p, off_t position, off_t* counted_p)
+{
+    if (position > job_p->size) position = job_p->size;
+    if (position > *counted_p) {
+        atomic_fetch_add(&shared_data_p->ffmpeg_bytes_done, position - *counted_p);
+        *counted_p = position;
+    }
+}
+
+
+#ifdef HAVE_LIBAV
+
+//------------------------------
+// In-process transcoding
+//------------------------------
+
+typedef struct {
+    AVFormatContext* in_ctx;
+    AVFormatContext* out_ctx;
+    AVCodecContext* dec_ctx;
+    AVCodecContext* enc_ctx;
+    AVFilterGraph* graph;
+    AVFilterContext* src_ctx;
+    AVFilterContext* sink_ctx;
+    AVPacket* packet;
+    AVFrame* frame;
+    int stream_index;
+    LoudnessStruct* loudness;       // measuring rather than encoding
+} TranscodeStruct;
+
+
+static void log_av_error(const char* what, const char* mp3_file, int err)
+{
+    char text[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(err, text, sizeof(text));
+    fprintf(stderr, "ERROR: %s failed on %s: %s\n", what, mp3_file, text);
+}
+
+
+static int open_decoder(TranscodeStruct* t, const char* mp3_file)
+{
+    int err = avformat_open_input(&t->in_ctx, mp3_file, NULL, NULL);
+    if (err < 0) return err;
+    if ((err = avformat_find_stream_info(t->in_ctx, NULL)) < 0) return err;
+
+    const AVCodec* decoder = NULL;
+    t->stream_index = av_find_best_stream(t->in_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &decoder, 0);
+    if (t->stream_index < 0) return t->stream_index;
+
+    t->dec_ctx = avcodec_alloc_context3(decoder);
+    if (!t->dec_ctx) return AVERROR(ENOMEM);
+    err = avcodec_parameters_to_context(t->dec_ctx, t->in_ctx->streams[t->stream_index]->codecpar);
+    if (err < 0) return err;
+    t->dec_ctx->pkt_timebase = t->in_ctx->streams[t->stream_index]->time_base;
+    return avcodec_open2(t->dec_ctx, decoder, NULL);
+}
+
+
+// The encoder's preferred sample format. sample_fmts is deprecated from
+// libavcodec 61.13 (FFmpeg 7.1).
+static enum AVSampleFormat encoder_sample_format(const AVCodec* encoder)
+{
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(61, 13, 100)
+    const void* formats = NULL;
+    int count = 0;
+    if (avcodec_get_supported_config(NULL, encoder, AV_CODEC_CONFIG_SAMPLE_FORMAT, 0, &formats, &count) >= 0 &&
+        formats && count > 0) {
+        return ((const enum AVSampleFormat*)formats)[0];
+    }
+    return AV_SAMPLE_FMT_S16P;
+#else
+    return encoder->sample_fmts ? encoder->sample_fmts[0] : AV_SAMPLE_FMT_S16P;
+#endif
+}
+
+
+// Mono MP3 at 44.1kHz and bit_rate, as the ffmpeg command line used
+static int open_encoder(TranscodeStruct* t, const char* temp_file)
+{
+    const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_MP3);
+    if (!encoder) return AVERROR_ENCODER_NOT_FOUND;
+
+    t->enc_ctx = avcodec_alloc_context3(encoder);
+    if (!t->enc_ctx) return AVERROR(ENOMEM);
+    t->enc_ctx->sample_rate = AUDIO_SAMPLE_RATE;
+    t->enc_ctx->bit_rate = bit_rate;
+    t->enc_ctx->sample_fmt = encoder_sample_format(encoder);
+    t->enc_ctx->time_base = (AVRational){ 1, AUDIO_SAMPLE_RATE };
+    t->enc_ctx->thread_count = 1;       // the pool is the parallelism
+    av_channel_layout_default(&t->enc_ctx->ch_layout, 1);
+
+    int err = avformat_alloc_output_context2(&t->out_ctx, NULL, "mp3", temp_file);
+    if (err < 0) return err;
+    if (t->out_ctx->oformat->flags & AVFMT_GLOBALHEADER) t->enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if ((err = avcodec_open2(t->enc_ctx, encoder, NULL)) < 0) return err;
+
+    AVStream* stream = avformat_new_stream(t->out_ctx, NULL);
+    if (!stream) return AVERROR(ENOMEM);
+    stream->time_base = t->enc_ctx->time_base;
+    if ((err = avcodec_parameters_from_context(stream->codecpar, t->enc_ctx)) < 0) return err;
+
+    // Keep the ID3 tags, as the command line did
+    av_dict_copy(&t->out_ctx->metadata, t->in_ctx->metadata, 0);
+
+    if ((err = avio_open(&t->out_ctx->pb, temp_file, AVIO_FLAG_WRITE)) < 0) return err;
+    return avformat_write_header(t->out_ctx, NULL);
+}
+
+
+// abuffer -> description -> abuffersink
+static int open_filters(TranscodeStruct* t, const char* description)
+{
+    char args[STRING_LEN];
+    char layout[64];
+    AVFilterInOut* outputs = avfilter_inout_alloc();
+    AVFilterInOut* inputs = avfilter_inout_alloc();
+    int err = AVERROR(ENOMEM);
+
+    t->graph = avfilter_graph_alloc();
+    if (!outputs || !inputs || !t->graph) goto done;
+    t->graph->nb_threads = 1;
+
+    av_channel_layout_describe(&t->dec_ctx->ch_layout, layout, sizeof(layout));
+    snprintf(args, sizeof(args), "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
+             t->dec_ctx->pkt_timebase.num, t->dec_ctx->pkt_timebase.den, t->dec_ctx->sample_rate,
+             av_get_sample_fmt_name(t->dec_ctx->sample_fmt), layout);
+    err = avfilter_graph_create_filter(&t->src_ctx, avfilter_get_by_name("abuffer"), "in", args, NULL, t->graph);
+    if (err < 0) goto done;
+    err = avfilter_graph_create_filter(&t->sink_ctx, avfilter_get_by_name("abuffersink"), "out", NULL, NULL, t->graph);
+    if (err < 0) goto done;
+
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = t->src_ctx;
+    outputs->pad_idx = 0;
+    outputs->next = NULL;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = t->sink_ctx;
+    inputs->pad_idx = 0;
+    inputs->next = NULL;
+
+    if ((err = avfilter_graph_parse_ptr(t->graph, description, &inputs, &outputs, NULL)) < 0) goto done;
+    if ((err = avfilter_graph_config(t->graph, NULL)) < 0) goto done;
+
+    // The MP3 encoder takes whole frames only
+    if (t->enc_ctx) av_buffersink_set_frame_size(t->sink_ctx, t->enc_ctx->frame_size);
+
+done:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    return err;
+}
+
+
+// Encodes one filtered frame, or flushes the encoder if frame is NULL
+static int encode_frame(TranscodeStruct* t, AVFrame* frame)
+{
+    int err = avcodec_send_frame(t->enc_ctx, frame);
+    if (err < 0) return err;
+
+    AVPacket* packet = av_packet_alloc();
+    if (!packet) return AVERROR(ENOMEM);
+    while ((err = avcodec_receive_packet(t->enc_ctx, packet)) == 0) {
+        packet->stream_index = 0;
+        av_packet_rescale_ts(packet, t->enc_ctx->time_base, t->out_ctx->streams[0]->time_base);
+        if ((err = av_interleaved_write_frame(t->out_ctx, packet)) < 0) break;
+    }
+    av_packet_free(&packet);
+    return (err == AVERROR(EAGAIN) || err == AVERROR_EOF) ? 0 : err;
+}
+
+
+// Keeps the latest ebur128 figures, and notes any silence found at the start
+static void read_loudness(LoudnessStruct* loudness_p, const AVFrame* frame)
+{
+    const AVDictionaryEntry* entry;
+    if ((entry = av_dict_get(frame->metadata, "lavfi.r128.I", NULL, 0))) {
+        loudness_p->integrated = strtod(entry->value, NULL);
+        loudness_p->measured = true;
+    }
+    if ((entry = av_dict_get(frame->metadata, "lavfi.r128.LRA", NULL, 0))) {
+        loudness_p->range = strtod(entry->value, NULL);
+    }
+    if ((entry = av_dict_get(frame->metadata, "lavfi.r128.true_peaks_ch0", NULL, 0))) {
+        loudness_p->true_peak = strtod(entry->value, NULL);
+    }
+    if ((entry = av_dict_get(frame->metadata, "lavfi.silence_start", NULL, 0)) &&
+        strtod(entry->value, NULL) < ANALYSE_START_SECONDS) {
+        loudness_p->leading_silence = true;
+    }
+}
+
+
+// Passes a decoded frame, or NULL at the end, through the filters and on to
+// the encoder, or the measurement
+static int filter_frame(TranscodeStruct* t, AVFrame* frame)
+{
+    int err = av_buffersrc_add_frame(t->src_ctx, frame);
+    if (err < 0) return err;
+
+    AVFrame* filtered = av_frame_alloc();
+    if (!filtered) return AVERROR(ENOMEM);
+    while ((err = av_buffersink_get_frame(t->sink_ctx, filtered)) >= 0) {
+        if (t->loudness) {
+            read_loudness(t->loudness, filtered);
+        }
+        else {
+            if (filtered->pts != AV_NOPTS_VALUE) {
+                filtered->pts = av_rescale_q(filtered->pts, av_buffersink_get_time_base(t->sink_ctx), t->enc_ctx->time_base);
+            }
+            err = encode_frame(t, filtered);
+        }
+        av_frame_unref(filtered);
+        if (err < 0) break;
+    }
+    av_frame_free(&filtered);
+    return (err == AVERROR(EAGAIN) || err == AVERROR_EOF) ? 0 : err;
+}
+
+
+// Decodes a packet, or flushes the decoder if packet is NULL
+static int decode_packet(TranscodeStruct* t, AVPacket* packet)
+{
+    // Skip a damaged packet, as the ffmpeg command line does
+    int err = avcodec_send_packet(t->dec_ctx, packet);
+    if (err == AVERROR_INVALIDDATA) return 0;
+    if (err < 0) return err;
+
+    while ((err = avcodec_receive_frame(t->dec_ctx, t->frame)) == 0) {
+        err = filter_frame(t, t->frame);
+        av_frame_unref(t->frame);
+        if (err < 0) return err;
+    }
+    return (err == AVERROR(EAGAIN) || err == AVERROR_EOF) ? 0 : err;
+}
+
+
+// Reads the whole input through the decoder and the filters, then drains them
+static int read_input(TranscodeStruct* t, const AudioJobStruct* job_p, off_t* counted_p)
+{
+    t->packet = av_packet_alloc();
+    t->frame = av_frame_alloc();
+    if (!t->packet || !t->frame) return AVERROR(ENOMEM);
+
+    int err;
+    while ((err = av_read_frame(t->in_ctx, t->packet)) >= 0) {
+        if (t->packet->stream_index == t->stream_index) err = decode_packet(t, t->packet);
+        av_packet_unref(t->packet);
+        count_progress(job_p, avio_tell(t->in_ctx->pb), counted_p);
+        if (err < 0) return err;
+    }
+    if (err != AVERROR_EOF) return err;
+
+    if ((err = decode_packet(t, NULL)) < 0) return err;
+    return filter_frame(t, NULL);
+}
+
+
+static void close_transcode(TranscodeStruct* t)
+{
+    if (t->out_ctx && t->out_ctx->pb) avio_closep(&t->out_ctx->pb);
+    avformat_free_context(t->out_ctx);
+    avformat_close_input(&t->in_ctx);
+    avcodec_free_context(&t->dec_ctx);
+    avcodec_free_context(&t->enc_ctx);
+    avfilter_graph_free(&t->graph);
+    av_packet_free(&t->packet);
+    av_frame_free(&t->frame);
+}
+
+
+// Streams a file through decoder, filter graph and encoder in this thread.
+// Returns 0, or a negative AVERROR.
+static int transcode_file(const AudioJobStruct* job_p, const char* mp3_file, const char* temp_file, off_t* counted_p)
+{
+    TranscodeStruct t = { .stream_index = -1 };
+    char description[STRING_LEN * 2];
+    const char* stage = "opening";
+
+    int err = open_decoder(&t, mp3_file);
+    if (err >= 0) { stage = "setting up the encoder"; err = open_encoder(&t, temp_file); }
+    if (err >= 0) {
+        // FFMPEG_FILTERS, then resample to the encoder's format
+        stage = "setting up the filters";
+        snprintf(description, sizeof(description), "%s, aresample=%d, aformat=sample_fmts=%s:channel_layouts=mono",
+                 FFMPEG_FILTERS, AUDIO_SAMPLE_RATE, av_get_sample_fmt_name(t.enc_ctx->sample_fmt));
+        err = open_filters(&t, description);
+    }
+    if (err >= 0) { stage = "transcoding"; err = read_input(&t, job_p, counted_p); }
+    if (err >= 0) err = encode_frame(&t, NULL);
+    if (err >= 0) err = av_write_trailer(t.out_ctx);
+    if (err < 0) log_av_error(stage, mp3_file, err);
+
+    close_transcode(&t);
+    return err;
+}
+
+
+// Decodes a file through ANALYSE_FILTERS, without encoding it.
+// Returns 0, or a negative AVERROR.
+static int measure_file(const AudioJobStruct* job_p, const char* mp3_file, LoudnessStruct* loudness_p, off_t* counted_p)
+{
+    TranscodeStruct t = { .stream_index = -1, .loudness = loudness_p };
+    const char* stage = "opening";
+
+    int err = open_decoder(&t, mp3_file);
+    if (err >= 0) { stage = "setting up the analysis"; err = open_filters(&t, ANALYSE_FILTERS); }
+    if (err >= 0) { stage = "analysing"; err = read_input(&t, job_p, counted_p); }
+    if (err >= 0 && !loudness_p->measured) err = AVERROR_INVALIDDATA;
+    if (err < 0) log_av_error(stage, mp3_file, err);
+
+    close_transcode(&t);
+    return err;
+}
+
+#else
+
+//------------------------------
+// ffmpeg subprocess, when built without libav
+//------------------------------
+
+// Starts ffmpeg, without a shell so any file name is safe, with its
+// stderr sent to log_fd unless that is -1. Returns its pid, or -1.
+static pid_t start_ffmpeg(const char* const args[], int log_fd)
+{
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    int dev_null = open("/dev/null", O_RDONLY);
+    if (dev_null >= 0) {
+        dup2(dev_null, STDIN_FILENO);
+        close(dev_null);
+    }
+    if (log_fd >= 0) dup2(log_fd, STDERR_FILENO);
+
+    // The server blocks SIGCHLD and SIGUSR1 for its signalfd
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    execvp("ffmpeg", (char* const*)args);
+    fprintf(stderr, "ERROR: Failed to execute ffmpeg: %s\n", strerror(errno));
+    _exit(127);
+}
+
+
+// Returns how far a process has read into a file, or -1 if it doesn't have it open
+static off_t read_position(pid_t pid, const char* path)
+{
+    char fd_dir[64];
+    snprintf(fd_dir, sizeof(fd_dir), "/proc/%d/fd", (int)pid);
+    DIR* dir = opendir(fd_dir);
+    if (!dir) return -1;
+
+    struct dirent* entry;
+    char link_path[PATH_LEN];
+    char target[PATH_MAX];
+    off_t position = -1;
+
+    while ((entry = readdir(dir)) && position < 0) {
+        snprintf(link_path, sizeof(link_path), "%s/%s", fd_dir, entry->d_name);
+        ssize_t len = readlink(link_path, target, sizeof(target) - 1);
+        if (len <= 0) continue;
+        target[len] = '\0';
+        if (strcmp(target, path) != 0) continue;
+
+        snprintf(link_path, sizeof(link_path), "/proc/%d/fdinfo/%s", (int)pid, entry->d_name);
+        FILE* file = fopen(link_path, "r");
+        if (!file) continue;
+        long long pos;
+        if (fscanf(file, "pos: %lld", &pos) == 1) position = pos;
+        fclose(file);
+    }
+    closedir(dir);
+    return position;
+}
+
+
+// Runs ffmpeg on one file, following its progress through /proc.
+// Returns ffmpeg's exit code.
+static int run_ffmpeg(const AudioJobStruct* job_p, const char* mp3_file, const char* const args[], int log_fd,
+                      off_t* counted_p)
+{
+    pid_t pid = start_ffmpeg(args, log_fd);
+    if (pid < 0) {
+        perror("fork ffmpeg");
+        return -1;
+    }
+
+    while (true) {
+        int status;
+        pid_t done = waitpid(pid, &status, WNOHANG);
+        if (done == pid) {
+            int ret = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            if (ret != 0) fprintf(stderr, "ERROR: ffmpeg failed with exit code %d on %s\n", ret, mp3_file);
+            return ret;
+        }
+        if ((done < 0) && (errno != EINTR)) {
+            perror("waitpid ffmpeg");
+            return -1;
+        }
+
+        count_progress(job_p, read_position(pid, mp3_file), counted_p);
+        usleep(AUDIO_POLL_MS * 1000);
+    }
+}
+
+
+// Transcodes a file to mono at bit_rate
+static int transcode_file(const AudioJobStruct* job_p, const char* mp3_file, const char* temp_file, off_t* counted_p)
+{
+    char bit_rate_text[16];
+    snprintf(bit_rate_text, sizeof(bit_rate_text), "%dk", bit_rate / 1000);
+    const char* const args[] = { "ffmpeg", "-nostdin", "-i", mp3_file, "-y", "-loglevel", "error",
+                                 "-af", FFMPEG_FILTERS, "-f", "mp3", "-ar", "44.1K", "-ab", bit_rate_text, "-ac", "1",
+                                 temp_file, NULL };
+    return run_ffmpeg(job_p, mp3_file, args, -1, counted_p);
+}
+
+
+// Decodes a file through ANALYSE_FILTERS, which print their findings
+static int measure_file(const AudioJobStruct* job_p, const char* mp3_file, LoudnessStruct* loudness_p, off_t* counted_p)
+{
+    const char* const args[] = { "ffmpeg", "-nostdin", "-hide_banner", "-nostats", "-loglevel", "info",
+                                 "-i", mp3_file, "-af", ANALYSE_FILTERS, "-f", "null", "-", NULL };
+    FILE* log = tmpfile();
+    if (!log) {
+        perror("tmpfile");
+        return -1;
+    }
+
+    int ret = run_ffmpeg(job_p, mp3_file, args, fileno(log), counted_p);
+    char line[STRING_LEN];
+    rewind(log);
+    while (fgets(line, sizeof(line), log)) {
+        analyse_read_line(loudness_p, line);
+    }
+    fclose(log);
+
+    if (ret == 0 && !loudness_p->measured) {
+        fprintf(stderr, "ERROR: No loudness measured for %s\n", mp3_file);
+        ret = -1;
+    }
+    return ret;
+}
+
+#endif // HAVE_LIBAV
+
+
+// Whether a file can be used as it is. Measurements are cached under key,
+// if there is one.
+static bool is_compliant(const AudioJobStruct* job_p, const char* mp3_file, const char* key, off_t* counted_p)
+{
+    char reason[STRING_LEN];
+    char note[STRING_LEN];
+    LoudnessStruct loudness = { 0 };
+
+    bool ok = analyse_format(mp3_file, bit_rate, tolerance, reason, sizeof(reason));
+    if (ok) {
+        bool cached = key && cache_read_note(key, note, sizeof(note)) && analyse_from_text(note, &loudness);
+        if (!cached) {
+            trace_begin(TRACE_COMMAND, mp3_file);
+            int ret = measure_file(job_p, mp3_file, &loudness, counted_p);
+            trace_end(TRACE_COMMAND, ret);
+            if (ret != 0) loudness.measured = false;
+            if (loudness.measured && key) {
+                analyse_to_text(&loudness, note, sizeof(note));
+                cache_write_note(key, note);
+            }
+        }
+        if (loudness.measured) {
+            ok = analyse_loudness(&loudness, tolerance, reason, sizeof(reason));
+        }
+        else {
+            snprintf(reason, sizeof(reason), "loudness not measured");
+            ok = false;
+        }
+    }
+
+    printf("%s %s: %s\n", ok ? "Passing through" : "Transcoding", mp3_file, reason);
+    return ok;
+}
+
+
+// Processes one file and replaces the original with the result, unless it
+// can be used as it is. Returns 0 if it is done.
+static int process_file(const AudioJobStruct* job_p)
+{
+    char mp3_file[PATH_MAX];
+    char temp_file[PATH_LEN];
+    off_t counted = 0;
+
+    // /proc shows the input by its full path
+    if (!realpath(job_p->path, mp3_file)) snprintf(mp3_file, sizeof(mp3_file), "%s", job_p->path);
+    const char* last_dot = strrchr(mp3_file, '.');
+    snprintf(temp_file, sizeof(temp_file), "%.*s.tmp", (int)(last_dot - mp3_file), mp3_file);
+
+    uint64_t start_ms = shm_now_ms();
+    char key[CACHE_KEY_LEN];
+    bool have_key = cache_key(mp3_file, audio_settings, key);
+    bool from_cache = have_key && cache_restore(key, temp_file);
+    bool passed = !from_cache && passthrough && is_compliant(job_p, mp3_file, have_key ? key : NULL, &counted);
+    int ret = 0;
+
+    if (!from_cache && !passed) {
+        trace_begin(TRACE_COMMAND, mp3_file);
+        PROBE1(ffmpeg_entry, mp3_file);
+        ret = transcode_file(job_p, mp3_file, temp_file, &counted);
+        PROBE2(ffmpeg_return, mp3_file, ret);
+        trace_end(TRACE_COMMAND, ret);
+        if ((ret == 0) && have_key) cache_store(key, temp_file);
+    }
+    count_progress(job_p, job_p->size, &counted);
+
+    if (ret != 0) {
+        unlink(temp_file);
+        return ret;
+    }
+    if (passed) {
+        atomic_fetch_add(&passed_count, 1);
+        return 0;
+    }
+    if (rename(temp_file, mp3_file) != 0) {
+        fprintf(stderr, "ERROR renaming %s to %s: %s\n", temp_file, mp3_file, strerror(errno));
+        unlink(temp_file);
+        return -1;
+    }
+
+    if (from_cache) atomic_fetch_add(&cache_hits, 1);
+    printf("%s %s (%.1fMB) in %.1fs\n", from_cache ? "Restored from the cache" : "Optimised", mp3_file,
+           job_p->size / 1024.0 / 1024.0, (shm_now_ms() - start_ms) / 1000.0);
+    return 0;
+}
+
+
+static void run_job(AudioJobStruct* job_p)
+{
+    atomic_fetch_add(&shared_data_p->ffmpeg_running, 1);
+    int ret = process_file(job_p);
+    atomic_fetch_sub(&shared_data_p->ffmpeg_running, 1);
+    atomic_fetch_add(&shared_data_p->ffmpeg_done, 1);
+    if (done_cb) done_cb(job_p->tag, ret);
+    free(job_p->path);
+    free(job_p);
+}
+
+
+static void* audio_worker_function(void* arg)
+{
+    AudioJobStruct* job_p;
+    while ((job_p = queue_pop(&job_queue))) {
+        run_job(job_p);
+    }
+    return NULL;
+}
+
+
+// Everything that affects the processed files, as text
+const char* audio_settings_text(void)
+{
+    snprintf(audio_settings, sizeof(audio_settings), "filters=%s rate=%d bitrate=%d channels=1 format=mp3",
+             FFMPEG_FILTERS, AUDIO_SAMPLE_RATE, bit_rate);
+    if (passthrough) {
+        snprintf(settings_text, sizeof(settings_text), "%s passthrough=%.2f", audio_settings, tolerance);
+    }
+    else {
+        snprintf(settings_text, sizeof(settings_text), "%s", audio_settings);
+    }
+    return settings_text;
+}
+
+
+// Sets whether files already within tolerance of the targets are left as they are
+void audio_init(bool passthrough_on, double loudness_tolerance)
+{
+    passthrough = passthrough_on;
+    tolerance = loudness_tolerance;
+}
+
+
+// Sets the bit rate of the processed files, in bits per second. Call before
+// ingest_master(), as it changes the settings the ramdrive is checked against.
+void audio_set_bit_rate(int rate)
+{
+    bit_rate = rate;
+}
+
+
+// Starts the worker pool for the given number of files and bytes to come.
+// cb, if not NULL, is called on a worker thread as each file is finished.
+void audio_start(SharedDataStruct* sdp, int files, uint64_t bytes, audio_done_cb cb)
+{
+    shared_data_p = sdp;
+    done_cb = cb;
+    thread_count = 0;
+#ifdef HAVE_LIBAV
+    av_log_set_level(AV_LOG_ERROR);
+#endif
+    atomic_store(&cache_hits, 0);
+    atomic_store(&passed_count, 0);
+    audio_settings_text();
+    shared_data_p->ffmpeg_done = 0;
+    shared_data_p->ffmpeg_running = 0;
+    shared_data_p->ffmpeg_bytes = bytes;
+    shared_data_p->ffmpeg_bytes_done = 0;
+    shared_data_p->ffmpeg_files = files;
+    shared_data_p->ffmpeg_workers = 0;
+    if (files == 0) return;
+
+    int workers = pool_size(files);
+    threads = malloc(workers * sizeof(pthread_t));
+    if (!threads || !queue_init(&job_queue, AUDIO_QUEUE_LENGTH)) {
+        fprintf(stderr, "ERROR: Out of memory starting the MP3 workers\n");
+        free(threads);
+        threads = NULL;
+        return;
+    }
+    for (; thread_count < workers; thread_count++) {
+        if (pthread_create(&threads[thread_count], NULL, audio_worker_function, NULL) != 0) {
+            perror("pthread_create failed");
+            break;
+        }
+    }
+    shared_data_p->ffmpeg_workers = thread_count;
+    printf("Optimising %d MP3 files (%.1fMB) with %d workers\n", files, bytes / 1024.0 / 1024.0, thread_count);
+}
+
+
+// Queues a file for the workers, waiting if they are too far behind
+void audio_submit(const char* path, off_t size, void* tag)
+{
+    AudioJobStruct* job_p = malloc(sizeof(AudioJobStruct));
+    if (job_p) job_p->path = strdup(path);
+    if (!job_p || !job_p->path) {
+        fprintf(stderr, "ERROR: Out of memory queueing %s\n", path);
+        free(job_p);
+        if (done_cb) done_cb(tag, -1);
+        return;
+    }
+    job_p->size = size;
+    job_p->tag = tag;
+
+    // With no pool, do it here
+    if (thread_count == 0 || !queue_push(&job_queue, job_p)) run_job(job_p);
+}
+
+
+// Waits for the workers to finish every file submitted
+void audio_finish(void)
+{
+    if (!threads) return;
+
+    queue_close(&job_queue);
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            perror("pthread_join failed");
+        }
+    }
+    printf("Optimised %d MP3 files, %d from the cache, %d passed through\n", (int)shared_data_p->ffmpeg_done,
+           (int)cache_hits, (int)passed_count);
+
+    queue_destroy(&job_queue);
+    free(threads);
+    threads = NULL;
+    thread_count = 0;
+}
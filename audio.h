@@ -0,0 +1,18 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+// The processed files are mono MP3 at 44.1kHz, 128K unless the bit rate
+// planner (budget.c) picks a lower rate
+#define AUDIO_SAMPLE_RATE 44100
+#define AUDIO_BIT_RATE 128000
+
+const char* audio_settings_text(void);
+typedef void (*audio_done_cb)(void* tag, int ret);
+
+void audio_init(bool passthrough, double tolerance);
+void audio_set_bit_rate(int rate);
+void audio_start(SharedDataStruct* shared_data_p, int files, uint64_t bytes, audio_done_cb cb);
+void audio_submit(const char* path, off_t size, void* tag);
+void audio_finish(void);
+
+#endif // AUDIO_H
@@ -0,0 +1,132 @@
+#include "globals.h"
+#include "utilities.h"
+#include "shm.h"
+#include "blockstat.h"
+
+/*
+ * Block layer statistics
+ * ----------------------
+ * bytes_copied counts what sendfile() has handed to the page cache, which
+ * can run far ahead of the drive: the progress bar used to reach 100% and
+ * then sit there through a long sync. While a client is running the server
+ * reads /sys/block/sdX/stat for its drive, and records in the channel
+ *
+ *   - media_bytes:      sectors written since the job started
+ *   - media_copy_bytes: sectors written since COPYING started, i.e. the
+ *                       files plus the FAT updates that go with them
+ *   - io_in_flight:     write requests the drive has yet to complete, from
+ *                       /sys/block/sdX/inflight (the stat file's in
+ *                       flight count includes reads)
+ *
+ * channel_progress_bytes() and channel_write_amplification() in shm.c turn
+ * these into honest progress and media bytes per payload byte.
+ */
+
+#define BLOCKSTAT_INTERVAL_MS 500
+#define SECTOR_SIZE 512             // /sys/block/.../stat always counts 512 byte sectors
+
+typedef struct {
+    bool job_started;           // job_sectors has been read
+    uint64_t job_sectors;       // sectors written before the job started
+    uint64_t copy_sectors;      // sectors written before COPYING started
+    bool copy_started;
+} BlockstatChannelStruct;
+
+static BlockstatChannelStruct blockstat_channels[MAX_USB_CHANNELS];
+static uint64_t last_sample_ms = 0;
+
+
+// Reads the sectors written and writes in flight for a disk such as "/dev/sda"
+static bool read_disk_stat(const char* device_name, uint64_t* sectors_written_p, uint32_t* in_flight_p)
+{
+    const char* name = strrchr(device_name, '/');
+    name = name ? name + 1 : device_name;
+    if (name[0] == '\0') return false;
+
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "/sys/block/%s/stat", name);
+    FILE* file = fopen(path, "r");
+    if (!file) return false;
+
+    // read I/Os, merges, sectors, ticks, write I/Os, merges, sectors, ticks, in flight ...
+    unsigned long long field[9];
+    int n = fscanf(file, "%llu %llu %llu %llu %llu %llu %llu %llu %llu",
+                   &field[0], &field[1], &field[2], &field[3], &field[4],
+                   &field[5], &field[6], &field[7], &field[8]);
+    fclose(file);
+    if (n != 9) return false;
+
+    *sectors_written_p = field[6];
+
+    // inflight holds the reads and writes in flight
+    unsigned reads, writes;
+    snprintf(path, sizeof(path), "/sys/block/%s/inflight", name);
+    file = fopen(path, "r");
+    if (!file) return false;
+    n = fscanf(file, "%u %u", &reads, &writes);
+    fclose(file);
+    if (n != 2) return false;
+
+    *in_flight_p = writes;
+    return true;
+}
+
+
+// Takes the starting point for a new job's figures. Called by the server
+// just before it starts the client.
+void blockstat_start_job(ChannelInfoStruct* channel_info_p)
+{
+    BlockstatChannelStruct* blockstat_p = &blockstat_channels[channel_info_p->device_id];
+    char name[STRING_LEN];
+    char path[STRING_LEN];
+    uint32_t in_flight;
+
+    channel_get_device(channel_info_p, name, path);
+    blockstat_p->job_started = read_disk_stat(name, &blockstat_p->job_sectors, &in_flight);
+    blockstat_p->copy_started = false;
+
+    channel_info_p->media_bytes = 0;
+    channel_info_p->media_copy_bytes = 0;
+    channel_info_p->io_in_flight = 0;
+}
+
+
+// Called on each reactor wake-up. Samples the drive of every running client,
+// at most every BLOCKSTAT_INTERVAL_MS.
+void blockstat_sample(SharedDataStruct* shared_data_p)
+{
+    uint64_t now_ms = shm_now_ms();
+    if (now_ms - last_sample_ms < BLOCKSTAT_INTERVAL_MS) return;
+    last_sample_ms = now_ms;
+
+    for (int i = 0; i < shared_data_p->channel_count; i++) {
+        ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[i];
+        BlockstatChannelStruct* blockstat_p = &blockstat_channels[i];
+
+        if (channel_info_p->pid <= 0) continue;
+
+        char name[STRING_LEN];
+        char path[STRING_LEN];
+        ChannelStateEnum state = channel_get_device(channel_info_p, name, path);
+
+        uint64_t sectors;
+        uint32_t in_flight;
+        if (!read_disk_stat(name, &sectors, &in_flight)) continue;
+
+        // In case the drive couldn't be read when the job started
+        if (!blockstat_p->job_started) {
+            blockstat_p->job_sectors = sectors;
+            blockstat_p->job_started = true;
+        }
+        if ((state == COPYING) && !blockstat_p->copy_started) {
+            blockstat_p->copy_sectors = sectors;
+            blockstat_p->copy_started = true;
+        }
+
+        channel_info_p->media_bytes = (sectors - blockstat_p->job_sectors) * SECTOR_SIZE;
+        if (blockstat_p->copy_started) {
+            channel_info_p->media_copy_bytes = (sectors - blockstat_p->copy_sectors) * SECTOR_SIZE;
+        }
+        channel_info_p->io_in_flight = in_flight;
+    }
+}
@@ -0,0 +1,7 @@
+#ifndef BLOCKSTAT_H
+#define BLOCKSTAT_H
+
+void blockstat_start_job(ChannelInfoStruct* channel_info_p);
+void blockstat_sample(SharedDataStruct* shared_data_p);
+
+#endif // BLOCKSTAT_H
@@ -0,0 +1,123 @@
+#include "globals.h"
+#include "audio.h"
+#include "analyse.h"
+#include "budget.h"
+
+/*
+ * Bit rate planner
+ * ----------------
+ * With fourteen sticks written at once, the bytes on each stick decide how
+ * long a batch takes, and nearly all of them are MP3 audio. If [audio]
+ * target_minutes is set, the master is surveyed before it is copied:
+ *
+ *   - the playing time of each MP3 file, from its first frame (see
+ *     analyse_duration), and the size of its tag, which is kept
+ *   - the size of everything else, which is copied as it is
+ *
+ * and the MP3 bit rates from AUDIO_BIT_RATE down to [audio] min_kbps are
+ * tried in turn, highest first. The first whose processed master can be
+ * written to a stick within the target, at the copy rate learned from
+ * earlier jobs (see eta.c), is used. If none can, the floor is used and the
+ * target is reported as missed.
+ *
+ * Only constant bit rates are planned: the size of a VBR encode depends on
+ * the audio, so it couldn't be promised in advance.
+ */
+
+#define MB (1024.0 * 1024.0)
+
+typedef struct {
+    int mp3_files;
+    double seconds;                 // MP3 playing time
+    uint64_t tag_bytes;             // MP3 tags, copied into the processed files
+    uint64_t other_bytes;           // everything else
+} SurveyStruct;
+
+static const int cbr_kbps[] = { 320, 256, 224, 192, 160, 128, 112, 96, 80, 64, 56, 48, 40, 32 };
+
+
+static bool is_mp3(const char* filename)
+{
+    size_t len = strlen(filename);
+    return len >= 4 && strcasecmp(filename + len - 4, ".mp3") == 0;
+}
+
+
+// Adds up the files under a directory on the master. Returns false if it can't be read.
+static bool survey_directory(const char* dir_path, SurveyStruct* survey_p)
+{
+    if (strstr(dir_path, "System Volume Information")) return true;
+
+    DIR* dir = opendir(dir_path);
+    if (!dir) {
+        fprintf(stderr, "ERROR: Failed to open source directory '%s'\n", dir_path);
+        return false;
+    }
+
+    struct dirent* entry;
+    struct stat statbuf;
+    char path[PATH_LEN];
+    bool ok = true;
+
+    while (ok && (entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (strlen(dir_path) + strlen(entry->d_name) + 2 > sizeof(path)) continue;     // ingest reports it
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-truncation"
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+#pragma GCC diagnostic pop
+        if (stat(path, &statbuf) < 0) continue;
+
+        if (S_ISDIR(statbuf.st_mode)) {
+            ok = survey_directory(path, survey_p);
+        }
+        else if (S_ISREG(statbuf.st_mode)) {
+            off_t tag_bytes;
+            double seconds = is_mp3(entry->d_name) ? analyse_duration(path, &tag_bytes) : -1;
+            if (seconds >= 0) {
+                survey_p->mp3_files++;
+                survey_p->seconds += seconds;
+                survey_p->tag_bytes += tag_bytes;
+            }
+            else {
+                survey_p->other_bytes += statbuf.st_size;
+            }
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+
+// Picks the highest bit rate, between min_kbps and AUDIO_BIT_RATE, at which
+// the master mounted at mount_point can be written to a stick within
+// target_seconds at ms_per_mb. Returns false if the master can't be read.
+bool budget_plan(const char* mount_point, int target_seconds, int min_kbps, double ms_per_mb, BudgetPlanStruct* plan_p)
+{
+    SurveyStruct survey = { 0 };
+    memset(plan_p, 0, sizeof(BudgetPlanStruct));
+    if (!survey_directory(mount_point, &survey)) return false;
+
+    plan_p->mp3_files = survey.mp3_files;
+    plan_p->seconds = survey.seconds;
+
+    int count = sizeof(cbr_kbps) / sizeof(cbr_kbps[0]);
+    for (int i = 0; i < count; i++) {
+        int kbps = cbr_kbps[i];
+        if (kbps * 1000 > AUDIO_BIT_RATE) continue;
+        if (kbps < min_kbps) break;
+
+        plan_p->kbps = kbps;
+        plan_p->bytes = survey.other_bytes + survey.tag_bytes + (uint64_t)(survey.seconds * kbps * 1000 / 8);
+        plan_p->write_seconds = (int)(plan_p->bytes / MB * ms_per_mb / 1000 + 0.5);
+        plan_p->met = (plan_p->write_seconds <= target_seconds);
+        if (plan_p->met) break;
+    }
+
+    printf("Bit rate plan: %d MP3 files, %.0f minutes, and %.1fMB of other files\n", survey.mp3_files,
+           survey.seconds / 60, survey.other_bytes / MB);
+    printf("Bit rate plan: %d kbps, %.1fMB per stick, %d:%02d to write at %.1fMB/s%s\n", plan_p->kbps,
+           plan_p->bytes / MB, plan_p->write_seconds / 60, plan_p->write_seconds % 60, 1000 / ms_per_mb,
+           plan_p->met ? "" : ", over the target");
+    return true;
+}
@@ -0,0 +1,16 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+// The bit rate chosen for a master, and what it should cost each stick
+typedef struct {
+    int kbps;                       // CBR bit rate for the MP3 files
+    bool met;                       // the target can be met at or above the floor
+    int mp3_files;
+    double seconds;                 // playing time of the MP3 files
+    uint64_t bytes;                 // expected size of the master once processed
+    int write_seconds;              // expected time to write it to a stick
+} BudgetPlanStruct;
+
+bool budget_plan(const char* mount_point, int target_seconds, int min_kbps, double ms_per_mb, BudgetPlanStruct* plan_p);
+
+#endif // BUDGET_H
@@ -0,0 +1,454 @@
+#include "globals.h"
+#include "utilities.h"
+#include "cache.h"
+
+/*
+ * Processed file cache
+ * --------------------
+ * Transcoding the master's MP3 files is the slowest part of start-up, and
+ * every boot or crash restart used to do it all again. If [cache] dir is
+ * set in copier.ini, each processed file is also kept there, on the SD
+ * card or an SSD, named by a hash of
+ *
+ *   - the contents of the source file, and
+ *   - the processing settings (filters, sample rate, bit rate ...)
+ *
+ * so a file whose source and settings are unchanged is copied back from
+ * the cache instead of being transcoded. Changing either gives a new key,
+ * so stale entries are never used; they just age out. Each hit touches the
+ * entry, and the least recently used entries are deleted when the cache
+ * grows past [cache] max_mb.
+ *
+ * Alongside the processed files the cache keeps short notes under the same
+ * keys, such as the loudness measured by analyse.c, so a file is analysed
+ * once however many masters it turns up on.
+ *
+ * Everything is written under a temporary name, flushed to the card and
+ * then renamed into place. Each processed file also gets a check file
+ * holding its size and CRC, and a file that doesn't match its check is
+ * never restored, so a power cut can't send a short file to the sticks.
+ */
+
+#define CACHE_SUFFIX ".mp3"
+#define CACHE_NOTE_SUFFIX ".txt"
+#define CACHE_CHECK_SUFFIX ".crc"
+#define CACHE_TEMP_SUFFIX ".tmp"
+#define CACHE_TRIM_PERCENT 90       // evict down to this much of max_mb
+
+typedef struct {
+    char name[CACHE_KEY_LEN + sizeof(CACHE_SUFFIX) + sizeof(CACHE_NOTE_SUFFIX)];
+    time_t mtime;
+    off_t size;
+} CacheEntryStruct;
+
+static char cache_dir[STRING_LEN] = "";
+static off_t cache_max_bytes = 0;
+static off_t cache_bytes = 0;               // total size of the entries
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int temp_count = 0;
+
+extern uint32_t crc32_table[256];
+
+
+//------------------------------
+// Content hash
+//------------------------------
+
+// Two independent 64-bit lanes over 8-byte words. Not cryptographic, but
+// 128 bits makes an accidental collision between masters vanishingly rare.
+typedef struct {
+    uint64_t a;
+    uint64_t b;
+    uint64_t length;
+} HashStruct;
+
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+
+static void hash_word(HashStruct* hash_p, uint64_t word)
+{
+    hash_p->a = rotl64((hash_p->a ^ word) * 0x9E3779B97F4A7C15ULL, 27);
+    hash_p->b = rotl64(hash_p->b + word * 0xC2B2AE3D27D4EB4FULL, 31) * 0x165667B19E3779F9ULL;
+}
+
+
+static void hash_bytes(HashStruct* hash_p, const uint8_t* data, size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash_word(hash_p, word);
+    }
+    if (i < len) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, len - i);
+        hash_word(hash_p, word ^ ((uint64_t)(len - i) << 56));
+    }
+    hash_p->length += len;
+}
+
+
+// Reads until the buffer is full or the file ends, so the words hashed
+// don't depend on how read() splits the file
+static ssize_t read_full(int fd, uint8_t* buffer, size_t len)
+{
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = read(fd, buffer + total, len - total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        total += n;
+    }
+    return total;
+}
+
+
+// Computes the cache key of a source file processed with the given
+// settings. Returns false if the cache is off or the file can't be read.
+bool cache_key(const char* path, const char* settings, char* key)
+{
+    if (cache_dir[0] == '\0') return false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint8_t* buffer = malloc(COPY_BUFFER_SIZE);
+    if (!buffer) {
+        close(fd);
+        return false;
+    }
+
+    HashStruct hash = { .a = 0x243F6A8885A308D3ULL, .b = 0x13198A2E03707344ULL, .length = 0 };
+    hash_bytes(&hash, (const uint8_t*)settings, strlen(settings) + 1);
+
+    ssize_t n;
+    while ((n = read_full(fd, buffer, COPY_BUFFER_SIZE)) > 0) {
+        hash_bytes(&hash, buffer, n);
+        if (n < COPY_BUFFER_SIZE) break;
+    }
+    free(buffer);
+    close(fd);
+    if (n < 0) return false;
+
+    uint64_t a = mix64(hash.a ^ hash.length);
+    uint64_t b = mix64(hash.b ^ rotl64(hash.length, 32) ^ a);
+    snprintf(key, CACHE_KEY_LEN, "%016llx-%016llx", (unsigned long long)a, (unsigned long long)b);
+    return true;
+}
+
+
+//------------------------------
+// Entries
+//------------------------------
+
+static int compare_entries(const void* x, const void* y)
+{
+    time_t mtime_x = ((const CacheEntryStruct*)x)->mtime;
+    time_t mtime_y = ((const CacheEntryStruct*)y)->mtime;
+    return (mtime_x > mtime_y) - (mtime_x < mtime_y);     // oldest first
+}
+
+
+// Whether a file name is a key followed by suffix
+static bool is_entry(const char* name, size_t len, const char* suffix)
+{
+    return (len == CACHE_KEY_LEN - 1 + strlen(suffix)) && (strcmp(name + CACHE_KEY_LEN - 1, suffix) == 0);
+}
+
+
+// Lists the entries in the cache. Returns the number found, with a malloc'd
+// array in *entries_p, and their total size in *bytes_p. With remove_temp,
+// also deletes entries left half written by a crash.
+static int list_entries(CacheEntryStruct** entries_p, off_t* bytes_p, bool remove_temp)
+{
+    *entries_p = NULL;
+    *bytes_p = 0;
+
+    DIR* dir = opendir(cache_dir);
+    if (!dir) return 0;
+
+    int count = 0;
+    int capacity = 0;
+    struct dirent* entry;
+    struct stat statbuf;
+    char path[PATH_LEN];
+
+    while ((entry = readdir(dir))) {
+        size_t len = strlen(entry->d_name);
+        if (remove_temp && len > strlen(CACHE_TEMP_SUFFIX) &&
+            strcmp(entry->d_name + len - strlen(CACHE_TEMP_SUFFIX), CACHE_TEMP_SUFFIX) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name);
+            unlink(path);
+            continue;
+        }
+        if (!is_entry(entry->d_name, len, CACHE_SUFFIX) && !is_entry(entry->d_name, len, CACHE_NOTE_SUFFIX) &&
+            !is_entry(entry->d_name, len, CACHE_CHECK_SUFFIX)) continue;
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name);
+        if (stat(path, &statbuf) == -1 || !S_ISREG(statbuf.st_mode)) continue;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            CacheEntryStruct* grown = realloc(*entries_p, capacity * sizeof(CacheEntryStruct));
+            if (!grown) break;
+            *entries_p = grown;
+        }
+        CacheEntryStruct* entry_p = &(*entries_p)[count++];
+        snprintf(entry_p->name, sizeof(entry_p->name), "%s", entry->d_name);
+        entry_p->mtime = statbuf.st_mtime;
+        entry_p->size = statbuf.st_size;
+        *bytes_p += statbuf.st_size;
+    }
+    closedir(dir);
+    return count;
+}
+
+
+// Deletes the least recently used entries until the cache is back under
+// CACHE_TRIM_PERCENT of its limit. Called with cache_mutex held.
+static void evict(void)
+{
+    CacheEntryStruct* entries;
+    int count = list_entries(&entries, &cache_bytes, false);
+    if (count > 0) qsort(entries, count, sizeof(CacheEntryStruct), compare_entries);
+
+    off_t target = cache_max_bytes / 100 * CACHE_TRIM_PERCENT;
+    char path[PATH_LEN];
+    int removed = 0;
+    for (int i = 0; i < count && cache_bytes > target; i++) {
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, entries[i].name);
+        if (unlink(path) == 0) {
+            cache_bytes -= entries[i].size;
+            removed++;
+        }
+    }
+    free(entries);
+    printf("Cache: removed %d old entries, %lldMB in use\n", removed, (long long)(cache_bytes / 1024 / 1024));
+}
+
+
+// Turns the cache on if dir is set, creating the directory if need be
+void cache_init(const char* dir, int max_mb)
+{
+    if (!dir || dir[0] == '\0') return;
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: Cannot create cache directory %s: %s\n", dir, strerror(errno));
+        return;
+    }
+    snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+    initialise_crc_table();
+    cache_max_bytes = (off_t)max_mb * 1024 * 1024;
+
+    CacheEntryStruct* entries;
+    int count = list_entries(&entries, &cache_bytes, true);
+    free(entries);
+    printf("Cache: %d entries, %lldMB in %s\n", count, (long long)(cache_bytes / 1024 / 1024), cache_dir);
+}
+
+
+// Copies src_path to dest_path, with its size and the CRC of all of it.
+// With sync, dest_path is on the disk before this returns.
+static bool copy_checked(const char* src_path, const char* dest_path, bool sync, off_t* size_p, uint32_t* crc_p)
+{
+    int src_fd = open(src_path, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0) return false;
+    int dest_fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dest_fd < 0) {
+        close(src_fd);
+        return false;
+    }
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint8_t* buffer = malloc(COPY_BUFFER_SIZE);
+    uint32_t crc = 0xFFFFFFFF;
+    off_t size = 0;
+    ssize_t n = 0;
+    bool ok = (buffer != NULL);
+    while (ok && (n = read(src_fd, buffer, COPY_BUFFER_SIZE)) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            crc = (crc << 8) ^ crc32_table[((crc >> 24) ^ buffer[i]) & 0xFF];
+        }
+        size += n;
+        ok = (write(dest_fd, buffer, n) == n);
+    }
+    if (ok && sync) ok = (fsync(dest_fd) == 0);
+    free(buffer);
+
+    close(src_fd);
+    if (close(dest_fd) != 0) ok = false;
+    *size_p = size;
+    *crc_p = crc ^ 0xFFFFFFFF;
+    return ok;
+}
+
+
+// Makes the renames in the cache directory survive a power cut
+static void sync_dir(void)
+{
+    int fd = open(cache_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    if (fsync(fd) != 0) {
+        fprintf(stderr, "ERROR: Cannot sync %s: %s\n", cache_dir, strerror(errno));
+    }
+    close(fd);
+}
+
+
+// Reads the line kept under key with suffix into text. Returns false if there isn't one.
+static bool read_text(const char* key, const char* suffix, char* text, size_t len)
+{
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s%s", cache_dir, key, suffix);
+    FILE* file = fopen(path, "r");
+    if (!file) return false;
+    bool ok = (fgets(text, len, file) != NULL);
+    fclose(file);
+
+    if (ok) utimensat(AT_FDCWD, path, NULL, 0);     // recently used
+    return ok;
+}
+
+
+// Written under another name first, so a crash can't leave a short entry.
+// Two workers may store the same key at once.
+static void temp_name(const char* key, char* temp_path, size_t len)
+{
+    snprintf(temp_path, len, "%s/%s.%d%s", cache_dir, key, atomic_fetch_add(&temp_count, 1), CACHE_TEMP_SUFFIX);
+}
+
+
+// Counts a new entry, evicting old ones if the cache has grown too big
+static void added(off_t bytes)
+{
+    pthread_mutex_lock(&cache_mutex);
+    cache_bytes += bytes;
+    if (cache_max_bytes > 0 && cache_bytes > cache_max_bytes) evict();
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+
+// Keeps a line of text under key with suffix
+static bool write_text(const char* key, const char* suffix, const char* text)
+{
+    char path[PATH_LEN];
+    char temp_path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s%s", cache_dir, key, suffix);
+    temp_name(key, temp_path, sizeof(temp_path));
+
+    FILE* file = fopen(temp_path, "w");
+    bool ok = file && (fputs(text, file) >= 0) && (fflush(file) == 0) && (fsync(fileno(file)) == 0);
+    if (file && fclose(file) != 0) ok = false;
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return false;
+    }
+    sync_dir();
+    added(strlen(text));
+    return true;
+}
+
+
+// Copies the entry for key, if there is one, to dest_path. Returns true if
+// it did. An entry that doesn't match its check file is deleted.
+bool cache_restore(const char* key, const char* dest_path)
+{
+    char path[PATH_LEN];
+    char check[STRING_LEN];
+    long long expected_size;
+    unsigned int expected_crc;
+
+    snprintf(path, sizeof(path), "%s/%s%s", cache_dir, key, CACHE_SUFFIX);
+    if (access(path, R_OK) != 0) return false;
+    if (!read_text(key, CACHE_CHECK_SUFFIX, check, sizeof(check)) ||
+        sscanf(check, "%lld %x", &expected_size, &expected_crc) != 2) {
+        return false;
+    }
+
+    off_t size;
+    uint32_t crc;
+    if (!copy_checked(path, dest_path, false, &size, &crc)) {
+        unlink(dest_path);
+        return false;
+    }
+    if (size != expected_size || crc != expected_crc) {
+        fprintf(stderr, "ERROR: Cache entry %s is damaged (%lld bytes, CRC %08x), deleting it\n",
+                path, (long long)size, (unsigned int)crc);
+        unlink(dest_path);
+        unlink(path);
+        return false;
+    }
+
+    utimensat(AT_FDCWD, path, NULL, 0);     // recently used
+    return true;
+}
+
+
+// Adds a processed file to the cache under key, with its check file
+void cache_store(const char* key, const char* src_path)
+{
+    if (cache_dir[0] == '\0') return;
+
+    char path[PATH_LEN];
+    char temp_path[PATH_LEN];
+    char check[STRING_LEN];
+    snprintf(path, sizeof(path), "%s/%s%s", cache_dir, key, CACHE_SUFFIX);
+    temp_name(key, temp_path, sizeof(temp_path));
+
+    off_t size;
+    uint32_t crc;
+    if (!copy_checked(src_path, temp_path, true, &size, &crc) || rename(temp_path, path) != 0) {
+        fprintf(stderr, "ERROR: Cannot add %s to the cache: %s\n", src_path, strerror(errno));
+        unlink(temp_path);
+        return;
+    }
+    sync_dir();
+    added(size);
+
+    // Written once the file is on the disk, so an entry is never trusted
+    // on a check meant for something else
+    snprintf(check, sizeof(check), "%lld %08x\n", (long long)size, (unsigned int)crc);
+    if (!write_text(key, CACHE_CHECK_SUFFIX, check)) {
+        fprintf(stderr, "ERROR: Cannot add the check for %s to the cache: %s\n", src_path, strerror(errno));
+        unlink(path);
+    }
+}
+
+
+// Reads the note kept under key into text. Returns false if there isn't one.
+bool cache_read_note(const char* key, char* text, size_t len)
+{
+    if (cache_dir[0] == '\0') return false;
+    return read_text(key, CACHE_NOTE_SUFFIX, text, len);
+}
+
+
+// Keeps a line of text under key
+void cache_write_note(const char* key, const char* text)
+{
+    if (cache_dir[0] == '\0') return;
+    if (!write_text(key, CACHE_NOTE_SUFFIX, text)) {
+        fprintf(stderr, "ERROR: Cannot add a note to the cache: %s\n", strerror(errno));
+    }
+}
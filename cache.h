@@ -0,0 +1,13 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CACHE_KEY_LEN 34            // two 64-bit hashes in hex joined by '-', and a '\0'
+
+void cache_init(const char* dir, int max_mb);
+bool cache_key(const char* path, const char* settings, char* key);
+bool cache_restore(const char* key, const char* dest_path);
+void cache_store(const char* key, const char* src_path);
+bool cache_read_note(const char* key, char* text, size_t len);
+void cache_write_note(const char* key, const char* text);
+
+#endif // CACHE_H
@@ -1,15 +1,38 @@
 #include "globals.h"
 #include "utilities.h"
+#include "shm.h"
+#include "trace.h"
+#include "probes.h"
+#include <sys/syscall.h>
 
 
 ChannelInfoStruct* client_info_p = NULL;
 SharedDataStruct* shared_data_p = NULL;
 int device_id = -1;
 int shm_fd = -1;
+size_t shm_size = 0;
 
 char buffer[STRING_LEN*2];
 extern uint32_t crc32_table[256];
 
+#define PAUSE_POLL_MS 1000      // re-check halt at least this often while paused
+#define FILE_WAIT_POLL_MS 100   // re-check a master file being processed this often
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_WHO_PROCESS 1
+
+// Commands in force, from the server
+static bool paused = false;
+static int throttle_kb = 0;
+static struct timeval throttle_start;
+static off_t throttle_start_bytes;
+
+// Files copied so far, for EVENT_FILE_DONE
+static int files_started = 0;
+static char current_file[STRING_LEN];
+
+static pthread_t sampler_thread;
+
 
 
 // Reports the error message back to the server and shuts down the client program
@@ -28,12 +51,19 @@ void failed(char* errormessage) {
     fprintf(stderr, "%s", temp_str);
     
     if (client_info_p) {
+		channel_start_phase(client_info_p, NUMBER_OF_PHASES);
+		channel_post_event(shared_data_p, client_info_p, EVENT_ERROR, 0, temp_str);
+		PROBE4(state_change, device_id, (int)client_info_p->state, (int)FAILED, (int64_t)client_info_p->bytes_copied);
         client_info_p->state = FAILED;
+		trace_instant(TRACE_PHASE, FAILED, get_state_name(FAILED));
 		client_info_p->halt = true;
+		if (client_info_p->fail_reason == FAIL_NONE) {
+			client_info_p->fail_reason = FAIL_ERROR;
+		}
     }
     
     if (shared_data_p && (shared_data_p != MAP_FAILED)) {
-        munmap(shared_data_p, sizeof(SharedDataStruct));
+        munmap(shared_data_p, shm_size);
     }
     
     if (shm_fd >= 0) {
@@ -44,6 +74,221 @@ void failed(char* errormessage) {
 }
 
 
+// Sets the best effort I/O priority of this client and the commands it runs,
+// 0 (highest) to 7
+void set_io_priority(int level) {
+	if (level < 0) level = 0;
+	if (level > 7) level = 7;
+	
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | level) == -1) {
+		fprintf(stderr, "ERROR: [%d] ioprio_set %d: %s\n", device_id, level, strerror(errno));
+	}
+	else {
+		printf("[%d] I/O priority %d\n", device_id, level);
+	}
+}
+
+
+// Sleeps as needed to keep the copy rate under throttle_kb KB/s. Sleeps at
+// most one second at a time so commands are still seen.
+void apply_throttle(void) {
+	if (throttle_kb <= 0) return;
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	int64_t elapsed_ms = (now.tv_sec - throttle_start.tv_sec) * 1000LL + (now.tv_usec - throttle_start.tv_usec) / 1000;
+	int64_t due_ms = (int64_t)(client_info_p->bytes_copied - throttle_start_bytes) * 1000 / 1024 / throttle_kb;
+
+	if (due_ms > elapsed_ms) {
+		int64_t sleep_ms = due_ms - elapsed_ms;
+		if (sleep_ms > 1000) sleep_ms = 1000;
+		usleep(sleep_ms * 1000);
+	}
+}
+
+
+// Acts on any commands from the server. Called between copy chunks and
+// phases. Blocks while paused, waking as soon as another command arrives.
+void process_commands(void) {
+	ChannelCommandStruct command;
+
+	do {
+		while (channel_get_command(client_info_p, &command)) {
+			switch (command.command) {
+				case CMD_HALT:
+					printf("[%d] Halt\n", device_id);
+					client_info_p->halt = true;
+					break;
+				case CMD_PAUSE:
+					printf("[%d] Paused\n", device_id);
+					paused = true;
+					break;
+				case CMD_RESUME:
+					printf("[%d] Resumed\n", device_id);
+					paused = false;
+					break;
+				case CMD_THROTTLE:
+					printf("[%d] Throttle %dKB/s\n", device_id, command.value);
+					throttle_kb = command.value;
+					gettimeofday(&throttle_start, NULL);
+					throttle_start_bytes = client_info_p->bytes_copied;
+					client_info_p->throttle_kb = throttle_kb;
+					break;
+				case CMD_PRIORITY:
+					set_io_priority(command.value);
+					break;
+				default:
+					fprintf(stderr, "ERROR: [%d] Unknown command %u\n", device_id, command.command);
+					break;
+			}
+		}
+
+		client_info_p->paused = paused && !client_info_p->halt;
+		if (client_info_p->paused) {
+			channel_wait_command(client_info_p, PAUSE_POLL_MS);
+		}
+	} while (client_info_p->paused);
+
+	apply_throttle();
+}
+
+
+// Once a second, records how many KB were copied or verified in that second
+void* sampler_thread_function(void* arg) {
+	(void)arg;
+	
+	off_t last_bytes = 0;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (true) {
+		next.tv_sec++;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		
+		off_t bytes = client_info_p->bytes_copied + client_info_p->bytes_verified;
+		off_t delta = (bytes > last_bytes) ? bytes - last_bytes : 0;
+		channel_add_throughput(client_info_p, delta / 1024);
+		last_bytes = bytes;
+	}
+	
+	return NULL;
+}
+
+
+// Reports progress to the server. Once the server's watchdog has failed this
+// channel the state is left alone, so a stuck client that eventually wakes up
+// can't overwrite FAILED with a later phase or SUCCESS.
+void set_client_state(ChannelStateEnum state) {
+	if (client_info_p->fail_reason != FAIL_SLOW) {
+		channel_start_phase(client_info_p, get_phase(state));
+		PROBE4(state_change, device_id, (int)client_info_p->state, (int)state, (int64_t)client_info_p->bytes_copied);
+		client_info_p->state = state;
+		trace_instant(TRACE_PHASE, state, get_state_name(state));
+		channel_post_event(shared_data_p, client_info_p, EVENT_PHASE, state, NULL);
+	}
+	process_commands();
+}
+
+
+// Called as each file starts, so the one before it has finished
+void file_started(const char* filename) {
+	if (files_started > 0) {
+		channel_post_event(shared_data_p, client_info_p, EVENT_FILE_DONE, files_started, current_file);
+	}
+	snprintf(current_file, sizeof(current_file), "%s", filename);
+	files_started++;
+	channel_set_file(client_info_p, files_started, filename);
+}
+
+
+// Waits until the server has finished file number index in FILE_LIST, or
+// every file if index is negative. Returns false if halted meanwhile, and
+// fails the job if the master couldn't be loaded.
+bool wait_for_file(int index) {
+	bool waiting = false;
+
+	while (!client_info_p->halt) {
+		if (shared_data_p->master_failed) {
+			client_info_p->waiting = false;
+			failed("The master failed to load");
+		}
+		if (shared_data_p->master_ready) break;
+		if ((index >= 0) && (index < MAX_MASTER_FILES) && (index < shared_data_p->master_files) &&
+		    (shared_data_p->file_state[index] == FILE_CHECKSUMMED)) break;
+
+		if (!waiting) {
+			printf("[%d] Waiting for the server to finish %s\n", device_id, (index < 0) ? "the master" : "a file");
+			waiting = true;
+			client_info_p->waiting = true;
+		}
+		channel_wait_command(client_info_p, FILE_WAIT_POLL_MS);
+		process_commands();
+	}
+
+	client_info_p->waiting = false;
+	return !client_info_p->halt;
+}
+
+
+// Creates the directories above a file, as needed
+int make_parent_directories(const char* path, size_t root_len) {
+	char dir[PATH_LEN*2];
+	snprintf(dir, sizeof(dir), "%s", path);
+
+	for (char* slash = strchr(dir + root_len + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if ((mkdir(dir, 0755) < 0) && (errno != EEXIST)) {
+			return -1;
+		}
+		*slash = '/';
+	}
+	return 0;
+}
+
+
+// Copies the master from the ramdrive in the order of FILE_LIST, which is
+// the order copy_directory would use. The server may still be processing
+// later files, so waits at each one until it is final.
+// Returns 0 on success or halted, -1 on failure.
+int copy_master_files(const char* mount_point) {
+	FILE* list = fopen(FILE_LIST, "r");
+	if (!list) {
+		fprintf(stderr, "ERROR: [%d] Cannot open %s\n", device_id, FILE_LIST);
+		return -1;
+	}
+
+	char line[PATH_LEN];
+	char src_path[PATH_LEN*2];
+	char dest_path[PATH_LEN*2];
+	int index = 0;
+	int ret = 0;
+
+	while ((ret == 0) && fgets(line, sizeof(line), list)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '\0') continue;
+		if (!wait_for_file(index++)) break;
+
+		snprintf(src_path, sizeof(src_path), "%s/%s", shared_data_p->master_dir, line);
+		snprintf(dest_path, sizeof(dest_path), "%s/%s", mount_point, line);
+		if (make_parent_directories(dest_path, strlen(mount_point)) != 0) {
+			fprintf(stderr, "ERROR: [%d] Failed to create the directories for '%s'\n", device_id, dest_path);
+			ret = -1;
+			break;
+		}
+
+		const char* leaf = strrchr(line, '/');
+		file_started(leaf ? leaf + 1 : line);
+		if (copy_file(src_path, dest_path, &client_info_p->halt, &client_info_p->bytes_copied) < 0) {
+			fprintf(stderr, "ERROR: [%d] Failed to copy file: '%s' -> '%s'\n", device_id, src_path, dest_path);
+			ret = -1;
+		}
+	}
+
+	fclose(list);
+	return ret;
+}
+
+
 // -------------------------------------------------------------------------------------------
 // -------------------------------------------------------------------------------------------
 // -------------------------------------------------------------------------------------------
@@ -81,6 +326,7 @@ bool verify(char* partition_name, char *mount_point) {
 	static struct timeval end_time;
 
 	uint32_t expected_crc, actual_crc;
+	int file_index = 0;
 	char filename[PATH_LEN];
 	char tmpstr[PATH_LEN];
 
@@ -90,6 +336,11 @@ bool verify(char* partition_name, char *mount_point) {
 
 	initialise_crc_table();
 	
+	// crc.txt is written once the server has finished every file
+	if (!wait_for_file(-1)) {
+		return false;
+	}
+
 	// Open the CRC file in the Ramdrive
 	FILE *crc_file = fopen(CRC_FILE, "r");
     if (!crc_file) {
@@ -122,7 +373,8 @@ bool verify(char* partition_name, char *mount_point) {
 		strcat(tmpstr, "/");
 		strcat(tmpstr, filename);			
 	
-		actual_crc = compute_crc32(tmpstr);
+		channel_set_file(client_info_p, ++file_index, filename);
+		actual_crc = compute_crc32(tmpstr, &client_info_p->bytes_verified);
 					
 		if (expected_crc != actual_crc) {
 			fprintf(stderr, "VERIFY ERROR: CRC Invalid. File='%s'\n", filename);
@@ -186,7 +438,7 @@ int main(int argc, char *argv[]) {
 	char *endptr;
 	device_id = strtol(startptr, &endptr, 10); // Base 10 conversion
 	
-	if ((endptr == startptr) || (*endptr != '\0') || (device_id<0) || (device_id>=MAX_USB_CHANNELS))
+	if ((endptr == startptr) || (*endptr != '\0') || (device_id<0))
 	{		
         snprintf(buffer, sizeof(buffer), "device_id %s is invalid\n", startptr);
 		failed(buffer);
@@ -199,8 +451,15 @@ int main(int argc, char *argv[]) {
 		failed("shm_open failed. Ensure server is running first");
     }
 
+    // The server sizes the shared memory for the configured hub topology
+    struct stat shm_stat;
+    if ((fstat(shm_fd, &shm_stat) == -1) || (shm_stat.st_size < (off_t)sizeof(SharedDataStruct))) {
+		failed("Shared memory is not initialised. Ensure server is running first");
+    }
+    shm_size = shm_stat.st_size;
+
     // Map shared memory
-	shared_data_p = mmap(0, sizeof(SharedDataStruct), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	shared_data_p = mmap(0, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
     if (shared_data_p == MAP_FAILED) {
 		failed("shm_open failed. Ensure server is running first");
     }
@@ -210,35 +469,67 @@ int main(int argc, char *argv[]) {
 		failed("Failed to close shared memory file descriptor");
     }
 
+	// Check the server has the same shared memory layout as this client
+	if (!shm_check_header(shared_data_p, shm_size)) {
+		failed("Shared memory layout does not match. Rebuild server and client together");
+	}
+
+	if (device_id >= shared_data_p->channel_count)
+	{
+        snprintf(buffer, sizeof(buffer), "device_id %d is invalid for %d channels\n", device_id, shared_data_p->channel_count);
+		failed(buffer);
+	}
+
 	client_info_p = &shared_data_p->channel_info[device_id];
+	probe_device_id = device_id;
+
+	// Record a timeline of this job if the server has tracing on
+	char trace_label[24];
+	snprintf(trace_label, sizeof(trace_label), "client%02d", device_id);
+	trace_init(trace_label, device_id, shared_data_p->trace_events);
+
+	// Run in a process group of our own so the watchdog can stop this client
+	// and any command it is waiting on. Fails harmlessly if sudo has already
+	// made us a session leader.
+	setpgid(0, 0);
+	client_info_p->worker_pid = getpid();
+
+	// Act on pause, throttle etc. from the server between copy chunks
+	set_copy_chunk_hook(process_commands);
+
+	// Take a consistent copy of the drive details, in case the USB thread is
+	// changing them
+	char device_name[STRING_LEN];
+	char device_path[STRING_LEN];
+	channel_get_device(client_info_p, device_name, device_path);
 
 
 	//------------------------------------------------------------
 	// Start of main program
 	//------------------------------------------------------------	
 
-	if (strlen(client_info_p->device_name) < 4)
+	if (strlen(device_name) < 4)
 	{
-		snprintf(buffer, sizeof(buffer), "device_name '%s' is invalid", client_info_p->device_name);
+		snprintf(buffer, sizeof(buffer), "device_name '%s' is invalid", device_name);
 		failed(buffer);
 	}
 		
-	if (strlen(client_info_p->device_path) < 2)
+	if (strlen(device_path) < 2)
 	{
-        snprintf(buffer, sizeof(buffer), "device_path '%s' is invalid", client_info_p->device_path);
+        snprintf(buffer, sizeof(buffer), "device_path '%s' is invalid", device_path);
 		failed(buffer);
 	}
 	
-	printf("[%d] Client starting. Pid=%d, device=%s path=%s\n", device_id, getpid(), client_info_p->device_name, client_info_p->device_path);
+	printf("[%d] Client starting. Pid=%d, device=%s path=%s\n", device_id, getpid(), device_name, device_path);
 
 	
     // Step 0: Get the name of the mount point
 	// i.e. if device name is /dev/sda then the mount point will be /mnt/usb/sda1
 	char mount_point[30];
-	const char* last_slash = strrchr(client_info_p->device_name, '/');
+	const char* last_slash = strrchr(device_name, '/');
 	if (!last_slash)
 	{
-        snprintf(buffer, sizeof(buffer), "device_name '%s' is not in expected format", client_info_p->device_name);
+        snprintf(buffer, sizeof(buffer), "device_name '%s' is not in expected format", device_name);
 		failed(buffer);
 	}
 		
@@ -246,13 +537,19 @@ int main(int argc, char *argv[]) {
 	
 	// Append 1 to the device name to get the partition name, i.e. /dev/sdb1
 	char partition_name[257];
-	snprintf(partition_name, sizeof(partition_name), "%s1", client_info_p->device_name);	
+	snprintf(partition_name, sizeof(partition_name), "%s1", device_name);	
 	printf("[%d] Mount Point=%s Partition=%s\n", device_id, mount_point, partition_name);
 
 	// Step 1: Unmount the device if it is already mounted (it shouldn't be)
-	client_info_p->state = STARTING;
 	client_info_p->halt = false;
 	client_info_p->bytes_copied = 0;
+	channel_reset_stats(client_info_p);
+	set_client_state(STARTING);
+
+	if (pthread_create(&sampler_thread, NULL, sampler_thread_function, NULL) != 0) {
+		failed("Failed to create the throughput sampler thread");
+	}
+	pthread_detach(sampler_thread);
 	
 	if (!client_info_p->halt)
 	{		
@@ -263,7 +560,7 @@ int main(int argc, char *argv[]) {
 #if PARTITION
 	// Step 2: Get the size of the device
     uint64_t device_size = 0;
-    int fd = open(client_info_p->device_name, O_RDONLY);
+    int fd = open(device_name, O_RDONLY);
     if (fd >= 0) {
 		ioctl(fd, BLKGETSIZE64, &device_size);
 		close(fd);
@@ -274,8 +571,8 @@ int main(int argc, char *argv[]) {
 	// Step 3: Erase the device
 	if (!client_info_p->halt)
 	{
-		client_info_p->state = ERASING;
-		snprintf(buffer, sizeof(buffer), "wipefs -a %s", client_info_p->device_name);
+		set_client_state(ERASING);
+		snprintf(buffer, sizeof(buffer), "wipefs -a %s", device_name);
 		if (execute_command(device_id, buffer, false) != 0) {
 			failed("Erasing device");
 		}
@@ -285,7 +582,7 @@ int main(int argc, char *argv[]) {
     // Step 4: Create a primary partition. 
 	if (!client_info_p->halt)
 	{
-		client_info_p->state = PARTITIONING;
+		set_client_state(PARTITIONING);
 
 		if ((device_size - shared_data_p->total_size ) > (200*1024*1024))
 		{
@@ -294,13 +591,13 @@ int main(int argc, char *argv[]) {
 			// only use 90% of the remaining space to improve the drive's wear leveling
 			int start_offset = (1 + (rand() % 16)) * 4;	
 			snprintf(buffer, sizeof(buffer), "parted -s %s mklabel msdos mkpart primary fat32 %uMiB 90%% >/dev/null", 
-				client_info_p->device_name, start_offset);		
+				device_name, start_offset);		
 		}
 		else
 		{
 			// Small disks .... use all the space
 			snprintf(buffer, sizeof(buffer), "parted -s %s mklabel msdos mkpart primary fat32 1MiB 100%% >/dev/null", 
-				client_info_p->device_name);		
+				device_name);		
 		}
 		if (execute_command(device_id, buffer, false) != 0) {
 			failed("Creating primary partition");
@@ -312,7 +609,7 @@ int main(int argc, char *argv[]) {
     // Step 5: Format the partition as FAT32
 	if (!client_info_p->halt)
 	{
-		client_info_p->state = FORMATING;
+		set_client_state(FORMATING);
 		snprintf(buffer, sizeof(buffer), "mkfs.vfat -n TALKINGNEWS -F 32 %s >/dev/null", partition_name);
 		if (execute_command(device_id, buffer, false) != 0) {
 			failed("Formatting partition");
@@ -323,7 +620,7 @@ int main(int argc, char *argv[]) {
     // Step 6: Create mount point if it doesn't exist/
 	if (!client_info_p->halt)
 	{
-		client_info_p->state = MOUNTING;
+		set_client_state(MOUNTING);
 		snprintf(buffer, sizeof(buffer), "mkdir -p %s", mount_point);
 		if (execute_command(device_id, buffer, false) != 0) {
 			failed("Creating mount point");
@@ -342,7 +639,7 @@ int main(int argc, char *argv[]) {
 #if !FORMAT
 	if (!client_info_p->halt)
 	{
-		client_info_p->state = ERASING;
+		set_client_state(ERASING);
 		snprintf(buffer, sizeof(buffer), "rm -rf %s/{*,.*}", mount_point);
 		if (execute_command(device_id, buffer, false) != 0) {
 			failed("deleting files");
@@ -350,18 +647,22 @@ int main(int argc, char *argv[]) {
 	}
 #endif
 
-    // Step 8: Copy all files from Ramdrive to the USB drive, alphabetically sorted
+    // Step 8: Copy all files from Ramdrive to the USB drive, alphabetically sorted,
+	// each as soon as the server has finished it
 	if (!client_info_p->halt)
 	{	
 		printf("[%d] Copying files\n", device_id);
-		client_info_p->state = COPYING;
-		if (copy_directory(RAMDIR_PATH, mount_point, &client_info_p->halt, &client_info_p->bytes_copied, NULL) != 0) {
+		set_client_state(COPYING);
+		if (copy_master_files(mount_point) != 0) {
 			failed("Copying files");
 		}
+		if ((files_started > 0) && !client_info_p->halt) {
+			channel_post_event(shared_data_p, client_info_p, EVENT_FILE_DONE, files_started, current_file);
+		}
 	}
 
     // Step 9: Unmount the USB drive		
-	client_info_p->state = UNMOUNTING;
+	set_client_state(UNMOUNTING);
 	
 	snprintf(buffer, sizeof(buffer), "sync %s", mount_point);
 	if (execute_command(device_id, buffer, false) != 0) {
@@ -377,20 +678,22 @@ int main(int argc, char *argv[]) {
 #if VERIFY
 	// Step 10: Verify all files have been written (Optional)
 	if (!client_info_p->halt) {
-		client_info_p->state = VERIFYING;
+		set_client_state(VERIFYING);
+		PROBE2(verify_entry, device_id, partition_name);
 		bool crc_ok = verify(partition_name, mount_point);
+		PROBE4(verify_return, device_id, partition_name, (int64_t)client_info_p->bytes_verified, crc_ok);
 		if (crc_ok) {
-			client_info_p->state = client_info_p->halt ? FAILED : SUCCESS;	
+			set_client_state(client_info_p->halt ? FAILED : SUCCESS);	
 		}
 		else {
-			client_info_p->state = CRC_FAILED;
+			set_client_state(CRC_FAILED);
 		}		
 	}
 	else {
-		client_info_p->state  = FAILED;
+		set_client_state(FAILED);
 	}
 #else
-	client_info_p->state = client_info_p->halt ? FAILED : SUCCESS;
+	set_client_state(client_info_p->halt ? FAILED : SUCCESS);
 #endif
 
 	//------------------------------------------------------------
@@ -398,7 +701,7 @@ int main(int argc, char *argv[]) {
 	//------------------------------------------------------------
 	
     // Cleanup
-	if (munmap(shared_data_p, sizeof(SharedDataStruct)) == -1) {
+	if (munmap(shared_data_p, shm_size) == -1) {
 		failed("Failed to unmap shared memory");
 	}
  	
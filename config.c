@@ -0,0 +1,411 @@
+#include "globals.h"
+#include "utilities.h"
+#include "config.h"
+#include "audio.h"
+#include "ingest.h"
+#include "trace.h"
+
+/*
+ * Configuration file
+ * ------------------
+ * A small INI file describing the hardware, so hubs can be added without
+ * rebuilding. Missing settings keep the defaults below, which match the
+ * original two 7-port hub build.
+ *
+ *     [topology]
+ *     hubs = 2
+ *     ports_per_hub = 7
+ *
+ *     [hub0]
+ *     latch_gpio = 19
+ *     button = 1
+ *     led_bits = 24
+ *     ; red,yellow,green shift register bits for port 0, port 1, ...
+ *     led_map = 1,2,3 4,5,6 7,9,10 11,12,13 14,15,17 18,19,20 21,22,23
+ *
+ *     [watchdog]
+ *     min_copy_rate_kb = 1024
+ *     rate_window = 60
+ *     stall_timeout = 60
+ *     phase_timeout = 900
+ *     kill_grace = 15
+ *
+ *     [trace]
+ *     events = 16384
+ *
+ *     [metrics]
+ *     listen = 127.0.0.1:9101
+ *
+ *     [cache]
+ *     dir = /home/pi/copier/cache
+ *     max_mb = 4096
+ *
+ *     [audio]
+ *     passthrough = 1
+ *     tolerance = 1.0
+ *     target_minutes = 0
+ *     min_kbps = 64
+ *
+ *     [staging]
+ *     dir = /home/pi/copier/staging
+ *     cache_mb = 256
+ *
+ *     [ingest]
+ *     workers = 4
+ *     readahead_kb = 4096
+ *
+ * Lines starting with ';' or '#' are comments.
+ */
+
+ConfigStruct config;
+
+// Where each hub's led_map was set, and how many values it had, so its
+// length can be checked once ports_per_hub is known
+static int led_map_line[MAX_HUBS];
+static int led_map_count[MAX_HUBS];
+static int config_line = 0;         // line being parsed
+
+// LED bit map of the original LED boards
+static const int default_led_map[DEFAULT_PORTS_PER_HUB][3] = {
+	{1, 2, 3}, {4, 5, 6}, {7, 9, 10}, {11, 12, 13}, {14, 15, 17}, {18, 19, 20}, {21, 22, 23}
+};
+
+
+static void config_set_defaults(void)
+{
+	memset(&config, 0, sizeof(config));
+	memset(led_map_line, 0, sizeof(led_map_line));
+	memset(led_map_count, 0, sizeof(led_map_count));
+	config.number_of_hubs = DEFAULT_NUMBER_OF_HUBS;
+	config.ports_per_hub = DEFAULT_PORTS_PER_HUB;
+
+	for (int hub = 0; hub < MAX_HUBS; hub++) {
+		HubConfigStruct* hub_p = &config.hub[hub];
+		hub_p->latch_gpio = -1;
+		hub_p->button = (hub % 2 == 0) ? 1 : 0;
+		hub_p->led_bits = 24;
+		memcpy(hub_p->led_map, default_led_map, sizeof(default_led_map));
+	}
+	config.hub[0].latch_gpio = GPIO_LATCH1;
+	config.hub[1].latch_gpio = GPIO_LATCH0;
+
+	config.watchdog.min_copy_rate_kb = 1024;
+	config.watchdog.rate_window = 60;
+	config.watchdog.stall_timeout = 60;
+	config.watchdog.phase_timeout = 900;
+	config.watchdog.kill_grace = 15;
+
+	config.trace_events = TRACE_DEFAULT_EVENTS;
+	config.cache_max_mb = DEFAULT_CACHE_MAX_MB;
+	config.audio_passthrough = 1;
+	config.loudness_tolerance = DEFAULT_LOUDNESS_TOLERANCE;
+	config.target_minutes = 0;
+	config.min_kbps = DEFAULT_MIN_KBPS;
+	config.stage_cache_mb = DEFAULT_STAGE_CACHE_MB;
+	config.ingest_workers = INGEST_DEFAULT_WORKERS;
+	config.ingest_readahead_kb = DEFAULT_INGEST_READAHEAD_KB;
+}
+
+
+// Parses a list of integers separated by commas and/or spaces.
+// Returns the number of values read, or -1 if the list is malformed.
+static int parse_int_list(const char* value, int* out, int max_count)
+{
+	int count = 0;
+	const char* p = value;
+
+	while (*p) {
+		while (*p == ',' || isspace((unsigned char)*p)) p++;
+		if (*p == '\0') break;
+
+		char* end;
+		long n = strtol(p, &end, 10);
+		if (end == p || count >= max_count) return -1;
+		out[count++] = (int)n;
+		p = end;
+	}
+	return count;
+}
+
+
+static bool parse_int(const char* value, int* out)
+{
+	char* end;
+	long n = strtol(value, &end, 10);
+	if (end == value || *end != '\0') return false;
+	*out = (int)n;
+	return true;
+}
+
+
+static bool parse_double(const char* value, double* out)
+{
+	char* end;
+	double x = strtod(value, &end);
+	if (end == value || *end != '\0') return false;
+	*out = x;
+	return true;
+}
+
+
+// Applies one key=value setting. Returns false if it isn't recognised.
+static bool config_set(const char* section, const char* key, const char* value)
+{
+	if (strcmp(section, "topology") == 0) {
+		if (strcmp(key, "hubs") == 0)          return parse_int(value, &config.number_of_hubs);
+		if (strcmp(key, "ports_per_hub") == 0) return parse_int(value, &config.ports_per_hub);
+		return false;
+	}
+
+	if (strcmp(section, "watchdog") == 0) {
+		WatchdogConfigStruct* watchdog_p = &config.watchdog;
+		if (strcmp(key, "min_copy_rate_kb") == 0) return parse_int(value, &watchdog_p->min_copy_rate_kb);
+		if (strcmp(key, "rate_window") == 0)      return parse_int(value, &watchdog_p->rate_window);
+		if (strcmp(key, "stall_timeout") == 0)    return parse_int(value, &watchdog_p->stall_timeout);
+		if (strcmp(key, "phase_timeout") == 0)    return parse_int(value, &watchdog_p->phase_timeout);
+		if (strcmp(key, "kill_grace") == 0)       return parse_int(value, &watchdog_p->kill_grace);
+		return false;
+	}
+
+	if (strcmp(section, "trace") == 0) {
+		if (strcmp(key, "events") == 0) return parse_int(value, &config.trace_events);
+		return false;
+	}
+
+	if (strcmp(section, "metrics") == 0) {
+		if (strcmp(key, "listen") == 0) {
+			if (strlen(value) >= sizeof(config.metrics_listen)) return false;
+			strcpy(config.metrics_listen, value);
+			return true;
+		}
+		return false;
+	}
+
+	if (strcmp(section, "cache") == 0) {
+		if (strcmp(key, "dir") == 0) {
+			if (strlen(value) >= sizeof(config.cache_dir)) return false;
+			strcpy(config.cache_dir, value);
+			return true;
+		}
+		if (strcmp(key, "max_mb") == 0) return parse_int(value, &config.cache_max_mb);
+		return false;
+	}
+
+	if (strcmp(section, "audio") == 0) {
+		if (strcmp(key, "passthrough") == 0) return parse_int(value, &config.audio_passthrough);
+		if (strcmp(key, "tolerance") == 0)   return parse_double(value, &config.loudness_tolerance);
+		if (strcmp(key, "target_minutes") == 0) return parse_int(value, &config.target_minutes);
+		if (strcmp(key, "min_kbps") == 0)    return parse_int(value, &config.min_kbps);
+		return false;
+	}
+
+	if (strcmp(section, "staging") == 0) {
+		if (strcmp(key, "dir") == 0) {
+			if (strlen(value) >= sizeof(config.staging_dir)) return false;
+			strcpy(config.staging_dir, value);
+			return true;
+		}
+		if (strcmp(key, "cache_mb") == 0) return parse_int(value, &config.stage_cache_mb);
+		return false;
+	}
+
+	if (strcmp(section, "ingest") == 0) {
+		if (strcmp(key, "workers") == 0)      return parse_int(value, &config.ingest_workers);
+		if (strcmp(key, "readahead_kb") == 0) return parse_int(value, &config.ingest_readahead_kb);
+		return false;
+	}
+
+	int hub;
+	if (sscanf(section, "hub%d", &hub) == 1 && hub >= 0 && hub < MAX_HUBS) {
+		HubConfigStruct* hub_p = &config.hub[hub];
+		if (strcmp(key, "latch_gpio") == 0) return parse_int(value, &hub_p->latch_gpio);
+		if (strcmp(key, "button") == 0)     return parse_int(value, &hub_p->button);
+		if (strcmp(key, "led_bits") == 0)   return parse_int(value, &hub_p->led_bits);
+		if (strcmp(key, "led_map") == 0) {
+			int count = parse_int_list(value, &hub_p->led_map[0][0], MAX_PORTS_PER_HUB * 3);
+			led_map_line[hub] = config_line;
+			led_map_count[hub] = count;
+			return (count > 0) && (count % 3 == 0);
+		}
+		return false;
+	}
+
+	return false;
+}
+
+
+// Checks the settings are consistent. Exits with an error if not, as the
+// LEDs and channel numbering would be wrong.
+static void config_validate(void)
+{
+	bool ok = true;
+
+	if (config.number_of_hubs < 1 || config.number_of_hubs > MAX_HUBS) {
+		fprintf(stderr, "ERROR: config: hubs must be 1..%d\n", MAX_HUBS);
+		ok = false;
+	}
+	if (config.ports_per_hub < 1 || config.ports_per_hub > MAX_PORTS_PER_HUB) {
+		fprintf(stderr, "ERROR: config: ports_per_hub must be 1..%d\n", MAX_PORTS_PER_HUB);
+		ok = false;
+	}
+
+	for (int hub = 0; ok && hub < config.number_of_hubs; hub++) {
+		const HubConfigStruct* hub_p = &config.hub[hub];
+
+		if (hub_p->latch_gpio < 0) {
+			fprintf(stderr, "ERROR: config: [hub%d] latch_gpio is not set\n", hub);
+			ok = false;
+		}
+		if (hub_p->button < 0 || hub_p->button >= NUMBER_OF_BUTTONS) {
+			fprintf(stderr, "ERROR: config: [hub%d] button must be 0..%d\n", hub, NUMBER_OF_BUTTONS - 1);
+			ok = false;
+		}
+		// Ports missing from the map would silently get the default bits
+		if (led_map_line[hub] > 0 && led_map_count[hub] != config.ports_per_hub * 3) {
+			fprintf(stderr, "ERROR: config: line %d: [hub%d] led_map has %d values, expected %d (3 for each of %d ports)\n",
+				led_map_line[hub], hub, led_map_count[hub], config.ports_per_hub * 3, config.ports_per_hub);
+			ok = false;
+			continue;
+		}
+		if (led_map_line[hub] == 0 && config.ports_per_hub != DEFAULT_PORTS_PER_HUB) {
+			fprintf(stderr, "ERROR: config: [hub%d] led_map must be set when ports_per_hub isn't %d\n",
+				hub, DEFAULT_PORTS_PER_HUB);
+			ok = false;
+			continue;
+		}
+		if (hub_p->led_bits < 1 || hub_p->led_bits > MAX_LED_BITS) {
+			fprintf(stderr, "ERROR: config: [hub%d] led_bits must be 1..%d\n", hub, MAX_LED_BITS);
+			ok = false;
+			continue;
+		}
+		for (int port = 0; port < config.ports_per_hub; port++) {
+			for (int led = LED_RED; led <= LED_GREEN; led++) {
+				int bit = hub_p->led_map[port][led];
+				if (bit < 0 || bit >= hub_p->led_bits) {
+					fprintf(stderr, "ERROR: config: [hub%d] led_map bit %d for port %d is outside the chain\n",
+						hub, bit, port);
+					ok = false;
+				}
+			}
+		}
+	}
+
+	if (config.trace_events < 0 || config.trace_events > TRACE_MAX_EVENTS) {
+		fprintf(stderr, "ERROR: config: [trace] events must be 0..%d\n", TRACE_MAX_EVENTS);
+		ok = false;
+	}
+
+	if (config.cache_max_mb < 0) {
+		fprintf(stderr, "ERROR: config: [cache] max_mb must not be negative\n");
+		ok = false;
+	}
+
+	if (config.loudness_tolerance < 0) {
+		fprintf(stderr, "ERROR: config: [audio] tolerance must not be negative\n");
+		ok = false;
+	}
+	if (config.target_minutes < 0) {
+		fprintf(stderr, "ERROR: config: [audio] target_minutes must not be negative\n");
+		ok = false;
+	}
+	if (config.min_kbps < 32 || config.min_kbps > AUDIO_BIT_RATE / 1000) {
+		fprintf(stderr, "ERROR: config: [audio] min_kbps must be 32..%d\n", AUDIO_BIT_RATE / 1000);
+		ok = false;
+	}
+
+	if (config.stage_cache_mb < 0) {
+		fprintf(stderr, "ERROR: config: [staging] cache_mb must not be negative\n");
+		ok = false;
+	}
+
+	if (config.ingest_workers < 1 || config.ingest_workers > INGEST_MAX_WORKERS) {
+		fprintf(stderr, "ERROR: config: [ingest] workers must be 1..%d\n", INGEST_MAX_WORKERS);
+		ok = false;
+	}
+	if (config.ingest_readahead_kb < 0) {
+		fprintf(stderr, "ERROR: config: [ingest] readahead_kb must not be negative\n");
+		ok = false;
+	}
+
+	const WatchdogConfigStruct* watchdog_p = &config.watchdog;
+	if (watchdog_p->min_copy_rate_kb < 0 || watchdog_p->rate_window < 0 || watchdog_p->stall_timeout < 0 ||
+	    watchdog_p->phase_timeout < 0 || watchdog_p->kill_grace < 0) {
+		fprintf(stderr, "ERROR: config: [watchdog] settings must not be negative\n");
+		ok = false;
+	}
+	if (watchdog_p->min_copy_rate_kb > 0 && watchdog_p->rate_window == 0) {
+		fprintf(stderr, "ERROR: config: [watchdog] min_copy_rate_kb needs a rate_window\n");
+		ok = false;
+	}
+
+	if (!ok) {
+		exit(1);
+	}
+}
+
+
+// Loads the configuration file. A missing file is not an error - the
+// defaults describe the standard two hub copier.
+void config_load(const char* filename)
+{
+	char line[INI_MAX_LINE];
+	char section[INI_MAX_LINE] = "";
+	int line_number = 0;
+	bool ok = true;
+
+	config_set_defaults();
+
+	FILE* file = fopen(filename, "r");
+	if (!file) {
+		printf("No config file %s, using defaults\n", filename);
+		config_validate();
+		return;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		line_number++;
+		trim(line);
+
+		if (line[0] == '\0' || line[0] == ';' || line[0] == '#') continue;
+
+		if (line[0] == '[') {
+			char* close = strchr(line, ']');
+			if (!close) {
+				fprintf(stderr, "ERROR: %s:%d: missing ']'\n", filename, line_number);
+				ok = false;
+				continue;
+			}
+			*close = '\0';
+			snprintf(section, sizeof(section), "%s", line + 1);
+			trim(section);
+			continue;
+		}
+
+		char* equals = strchr(line, '=');
+		if (!equals) {
+			fprintf(stderr, "ERROR: %s:%d: expected key = value\n", filename, line_number);
+			ok = false;
+			continue;
+		}
+		*equals = '\0';
+		char* key = line;
+		char* value = equals + 1;
+		trim(key);
+		trim(value);
+
+		config_line = line_number;
+		if (!config_set(section, key, value)) {
+			fprintf(stderr, "ERROR: %s:%d: invalid setting [%s] %s = %s\n", filename, line_number, section, key, value);
+			ok = false;
+		}
+	}
+
+	fclose(file);
+
+	if (!ok) {
+		exit(1);
+	}
+
+	config_validate();
+	printf("Loaded %s: %d hubs x %d ports\n", filename, config.number_of_hubs, config.ports_per_hub);
+}
@@ -0,0 +1,60 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define MAX_LED_BITS 64     // longest 74HC595 chain on one LED board
+#define LED_RED 0
+#define LED_YELLOW 1
+#define LED_GREEN 2
+
+#define DEFAULT_CACHE_MAX_MB 4096
+#define DEFAULT_STAGE_CACHE_MB 256
+#define DEFAULT_INGEST_READAHEAD_KB 4096
+#define DEFAULT_LOUDNESS_TOLERANCE 1.0
+#define DEFAULT_MIN_KBPS 64
+
+
+// Settings for one USB hub and its LED board
+typedef struct {
+	int latch_gpio;                           // 74HC595 latch line for this hub's LED board
+	int button;                               // push button that starts this hub (0 = top, 1 = bottom)
+	int led_bits;                             // length of the shift register chain
+	int led_map[MAX_PORTS_PER_HUB][3];        // shift register bit of the red, yellow and green LED of each port
+} HubConfigStruct;
+
+
+// Stall watchdog thresholds. A value of 0 disables that check.
+typedef struct {
+	int min_copy_rate_kb;                     // slowest acceptable copy rate in KB/s ...
+	int rate_window;                          // ... averaged over this many seconds
+	int stall_timeout;                        // seconds without any bytes copied
+	int phase_timeout;                        // seconds in any other phase (format, sync, verify ...)
+	int kill_grace;                           // seconds to stop after halt before SIGTERM, then SIGKILL
+} WatchdogConfigStruct;
+
+
+// Settings read from CONFIG_FILE at start-up
+typedef struct {
+	int number_of_hubs;
+	int ports_per_hub;
+	HubConfigStruct hub[MAX_HUBS];
+	WatchdogConfigStruct watchdog;
+	int trace_events;                         // events kept per process by the trace recorder, 0 for none
+	char metrics_listen[STRING_LEN];          // "address:port" or "unix:path" for the metrics endpoint, "" for none
+	char cache_dir[STRING_LEN];               // processed file cache on persistent storage, "" for none
+	int cache_max_mb;                         // size limit of the cache, 0 for none
+	int audio_passthrough;                    // leave MP3 files that already meet the targets as they are
+	double loudness_tolerance;                // how far from the targets they may be, in LU or dB
+	int target_minutes;                       // plan the MP3 bit rate to write a stick in this time, 0 for 128K
+	int min_kbps;                             // lowest bit rate the plan may choose
+	char staging_dir[STRING_LEN];             // where masters too big for the ramdrive go, "" for none
+	int stage_cache_mb;                       // memory used to cache a staged master, 0 to leave it to the kernel
+	int ingest_workers;                       // files read from the master at once
+	int ingest_readahead_kb;                  // read-ahead of the master stick while it is read, 0 to leave it
+} ConfigStruct;
+
+
+extern ConfigStruct config;
+
+void config_load(const char* filename);
+
+#endif // CONFIG_H
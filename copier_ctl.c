@@ -0,0 +1,129 @@
+#include "globals.h"
+#include "shm.h"
+#include <signal.h>
+
+/*
+ * copier_ctl
+ * ----------
+ * Sends a command to the client copying a stick, for use over SSH:
+ *
+ *     ./copier_ctl <channel|all> halt
+ *     ./copier_ctl <channel|all> pause
+ *     ./copier_ctl <channel|all> resume
+ *     ./copier_ctl <channel|all> throttle <KB/s>    0 removes the limit
+ *     ./copier_ctl <channel|all> prio <0-7>         best effort I/O priority, 0 highest
+ *
+ * The channel is the first column of copier_top, and the number in square
+ * brackets in the server log. The request is queued on the server as
+ * CONTROL_SIGNAL (see shm.c), which sends the command to the client, so it
+ * must be run as the server's user or with sudo. The server logs each
+ * request it acts on.
+ */
+
+
+// Reads the server's pid and number of channels from its shared memory
+static bool read_server(pid_t* server_pid_p, int* channel_count_p)
+{
+	int shm_fd = shm_open(SHM_NAME, O_RDONLY, 0);
+	if (shm_fd < 0) {
+		fprintf(stderr, "ERROR: The server isn't running: %s\n", strerror(errno));
+		return false;
+	}
+
+	struct stat shm_stat;
+	if ((fstat(shm_fd, &shm_stat) == -1) || (shm_stat.st_size < (off_t)sizeof(SharedDataStruct))) {
+		fprintf(stderr, "ERROR: The server hasn't started yet\n");
+		close(shm_fd);
+		return false;
+	}
+
+	SharedDataStruct* shared_data_p = mmap(NULL, shm_stat.st_size, PROT_READ, MAP_SHARED, shm_fd, 0);
+	close(shm_fd);
+	if (shared_data_p == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+
+	bool ok = shm_check_header(shared_data_p, shm_stat.st_size);
+	if (ok) {
+		*server_pid_p = shared_data_p->server_pid;
+		*channel_count_p = shared_data_p->channel_count;
+	}
+	munmap(shared_data_p, shm_stat.st_size);
+	return ok;
+}
+
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s <channel|all> halt|pause|resume|throttle <KB/s>|prio <0-7>\n", name);
+}
+
+
+// Parses a whole number from min to max. Returns false if it isn't one.
+static bool parse_number(const char* text, int min, int max, int* value_p)
+{
+	char* end;
+	errno = 0;
+	long value = strtol(text, &end, 10);
+	if ((errno != 0) || (end == text) || (*end != '\0') || (value < min) || (value > max)) return false;
+	*value_p = (int)value;
+	return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ChannelCommandEnum command;
+	int value = 0;
+	int value_max = 0;
+	if (strcmp(argv[2], "halt") == 0) command = CMD_HALT;
+	else if (strcmp(argv[2], "pause") == 0) command = CMD_PAUSE;
+	else if (strcmp(argv[2], "resume") == 0) command = CMD_RESUME;
+	else if (strcmp(argv[2], "throttle") == 0) {
+		command = CMD_THROTTLE;
+		value_max = CONTROL_MAX_VALUE;
+	}
+	else if (strcmp(argv[2], "prio") == 0) {
+		command = CMD_PRIORITY;
+		value_max = 7;
+	}
+	else {
+		usage(argv[0]);
+		return 1;
+	}
+
+	bool needs_value = (value_max > 0);
+	if ((argc != (needs_value ? 4 : 3)) || (needs_value && !parse_number(argv[3], 0, value_max, &value))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	pid_t server_pid;
+	int channel_count;
+	if (!read_server(&server_pid, &channel_count)) return 1;
+
+	int first = 0;
+	int last = channel_count - 1;
+	if (strcmp(argv[1], "all") != 0) {
+		if (!parse_number(argv[1], 0, channel_count - 1, &first)) {
+			fprintf(stderr, "ERROR: The channel must be 0 to %d, or all\n", channel_count - 1);
+			return 1;
+		}
+		last = first;
+	}
+
+	for (int device_id = first; device_id <= last; device_id++) {
+		union sigval request = { .sival_int = control_pack(device_id, command, value) };
+		if (sigqueue(server_pid, CONTROL_SIGNAL, request) == -1) {
+			fprintf(stderr, "ERROR: Cannot signal the server (pid %d): %s\n", (int)server_pid, strerror(errno));
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include "globals.h"
+#include "utilities.h"
+#include "stickdb.h"
+
+/*
+ * copier_sticks
+ * -------------
+ * Prints what the stick database (see stickdb.c) knows about each model of
+ * stick: jobs, success rate, average write, read and format times, and
+ * whether it is flagged as slow or unreliable.
+ *
+ *     ./copier_sticks              report from the working copy in tmpfs,
+ *                                  or the saved copy after a reboot
+ *     ./copier_sticks -r [file]    every job as CSV, then the report
+ */
+
+
+static void print_record(const StickRecordStruct* record_p)
+{
+	char when[32];
+	time_t time = record_p->time;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&time));
+
+	printf("%s,%04x,%04x,%s,\"%s\",%llu,%u,%d.%d,%s,%s,%llu,%llu", when, record_p->vendor_id,
+		record_p->product_id, record_p->serial, record_p->product, (unsigned long long)record_p->capacity,
+		record_p->speed_mbps, record_p->hub_number, record_p->port_number,
+		get_state_name(record_p->state), get_fail_reason_name(record_p->fail_reason),
+		(unsigned long long)record_p->payload_bytes, (unsigned long long)record_p->verified_bytes);
+	for (int phase = 0; phase < NUMBER_OF_PHASES; phase++) {
+		printf(",%u", record_p->phase_ms[phase]);
+	}
+	printf("\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+	bool records = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "rh")) != -1) {
+		switch (opt) {
+			case 'r':
+				records = true;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-r] [database file]\n", argv[0]);
+				fprintf(stderr, "  Prints the per-model report, and with -r every job as CSV.\n");
+				fprintf(stderr, "  Reads %s, or %s if that doesn't exist.\n", STICKDB_TMPFS_FILE, STICKDB_FILE);
+				return 1;
+		}
+	}
+
+	const char* filename = (optind < argc) ? argv[optind] :
+		(access(STICKDB_TMPFS_FILE, R_OK) == 0) ? STICKDB_TMPFS_FILE : STICKDB_FILE;
+
+	if (records) {
+		printf("time,vendor_id,product_id,serial,product,capacity,speed_mbps,port,state,fail_reason,payload_bytes,verified_bytes");
+		for (int phase = 0; phase < NUMBER_OF_PHASES; phase++) {
+			printf(",%s_ms", get_phase_name(phase));
+		}
+		printf("\n");
+	}
+
+	if (!stickdb_read(filename, records ? print_record : NULL)) {
+		fprintf(stderr, "ERROR: Cannot read %s: %s\n", filename, strerror(errno));
+		return 1;
+	}
+
+	if (records) printf("\n");
+	stickdb_print_report(stdout);
+	return 0;
+}
@@ -0,0 +1,299 @@
+#include "globals.h"
+#include "utilities.h"
+#include "shm.h"
+#include <curses.h>
+#include <sys/statvfs.h>
+
+/*
+ * copier_top
+ * ----------
+ * A live view of every port for use over SSH, e.g. to spot a slow stick in
+ * the middle of a batch:
+ *
+ *     ./copier_top [refresh ms]
+ *
+ * ETAs come from the server's progress model (see eta.c).
+ * It maps the server's shared memory read only, so it never changes
+ * anything and adds no work to the copy. Press q to quit.
+ */
+
+#define TOP_REFRESH_MS 250          // default redraw interval
+#define SPARKLINE_LEN 16            // seconds of throughput history shown
+#define SERVER_WAIT_MS 1000         // retry interval while the server is down
+
+static const char sparkline_levels[] = " _.-=+*#";
+
+static SharedDataStruct* shared_data_p = NULL;
+static size_t shm_size = 0;
+
+
+// Maps the segment if the server has initialised it. Returns false if not.
+static bool attach(void)
+{
+	int shm_fd = shm_open(SHM_NAME, O_RDONLY, 0);
+	if (shm_fd < 0) return false;
+
+	struct stat shm_stat;
+	if ((fstat(shm_fd, &shm_stat) == -1) || (shm_stat.st_size < (off_t)sizeof(SharedDataStruct))) {
+		close(shm_fd);
+		return false;
+	}
+
+	void* p = mmap(NULL, shm_stat.st_size, PROT_READ, MAP_SHARED, shm_fd, 0);
+	close(shm_fd);
+	if (p == MAP_FAILED) return false;
+
+	// shm_check_header explains any mismatch on stderr, which curses owns
+	int saved_stderr = dup(STDERR_FILENO);
+	int dev_null = open("/dev/null", O_WRONLY);
+	if (dev_null >= 0) {
+		dup2(dev_null, STDERR_FILENO);
+		close(dev_null);
+	}
+	bool ok = shm_check_header(p, shm_stat.st_size);
+	if (saved_stderr >= 0) {
+		dup2(saved_stderr, STDERR_FILENO);
+		close(saved_stderr);
+	}
+
+	if (!ok) {
+		munmap(p, shm_stat.st_size);
+		return false;
+	}
+	shared_data_p = p;
+	shm_size = shm_stat.st_size;
+	return true;
+}
+
+
+static void detach(void)
+{
+	if (shared_data_p) munmap(shared_data_p, shm_size);
+	shared_data_p = NULL;
+}
+
+
+// Throughput in KB/s for the last second, or 0
+static uint32_t latest_rate_kb(const ChannelInfoStruct* channel_info_p)
+{
+	uint32_t count = channel_info_p->throughput_count;
+	if (count == 0) return 0;
+	return channel_info_p->throughput_kb[(count - 1) % THROUGHPUT_SAMPLES];
+}
+
+
+static void draw_sparkline(const ChannelInfoStruct* channel_info_p)
+{
+	uint32_t count = channel_info_p->throughput_count;
+	uint32_t first = (count > SPARKLINE_LEN) ? count - SPARKLINE_LEN : 0;
+	uint32_t peak = 1;
+
+	for (uint32_t i = first; i < count; i++) {
+		uint32_t kb = channel_info_p->throughput_kb[i % THROUGHPUT_SAMPLES];
+		if (kb > peak) peak = kb;
+	}
+	for (uint32_t i = first + SPARKLINE_LEN; i > count; i--) addch(' ');
+	for (uint32_t i = first; i < count; i++) {
+		uint32_t kb = channel_info_p->throughput_kb[i % THROUGHPUT_SAMPLES];
+		addch(sparkline_levels[(uint64_t)kb * (sizeof(sparkline_levels) - 2) / peak]);
+	}
+}
+
+
+static void format_duration(char* str, size_t len, long seconds)
+{
+	if (seconds < 0) snprintf(str, len, "-");
+	else if (seconds >= 3600) snprintf(str, len, "%ld:%02ld:%02ld", seconds / 3600, (seconds / 60) % 60, seconds % 60);
+	else snprintf(str, len, "%ld:%02ld", seconds / 60, seconds % 60);
+}
+
+
+static bool is_busy(ChannelStateEnum state)
+{
+	return (state >= STARTING) && (state <= VERIFYING);
+}
+
+
+static void draw_header(void)
+{
+	char line[STRING_LEN];
+	time_t now = time(NULL);
+
+	attron(A_BOLD);
+	mvprintw(0, 0, "USB copier  server pid %d  master %luMB  %d hubs x %d ports",
+		shared_data_p->server_pid, (unsigned long)(shared_data_p->total_size / 1024 / 1024),
+		shared_data_p->number_of_hubs, shared_data_p->ports_per_hub);
+	attroff(A_BOLD);
+	strftime(line, sizeof(line), "%H:%M:%S", localtime(&now));
+	mvprintw(0, COLS - 9, "%s", line);
+
+	move(1, 0);
+	int files = shared_data_p->ffmpeg_files;
+	if (files > 0) {
+		uint64_t bytes = shared_data_p->ffmpeg_bytes;
+		printw("ffmpeg %d/%d done, %d/%d running, %d%%   ", (int)shared_data_p->ffmpeg_done, files,
+			(int)shared_data_p->ffmpeg_running, shared_data_p->ffmpeg_workers,
+			bytes ? (int)(shared_data_p->ffmpeg_bytes_done * 100 / bytes) : 0);
+	}
+	struct statvfs ramdrive;
+	if (statvfs(RAMDIR_PATH, &ramdrive) == 0) {
+		uint64_t size = (uint64_t)ramdrive.f_blocks * ramdrive.f_frsize;
+		uint64_t used = size - (uint64_t)ramdrive.f_bfree * ramdrive.f_frsize;
+		printw("ramdrive %lu/%luMB (%d%%)", (unsigned long)(used / 1024 / 1024), (unsigned long)(size / 1024 / 1024),
+			size ? (int)(used * 100 / size) : 0);
+	}
+	clrtoeol();
+}
+
+
+static int draw_hubs(int row)
+{
+	attron(A_BOLD);
+	mvprintw(row++, 0, "%-4s %5s %4s %4s %4s %9s %8s %8s", "HUB", "BUSY", "OK", "BAD", "IDLE", "MB/S", "COPIED", "ETA");
+	attroff(A_BOLD);
+
+	for (int hub = 0; hub < shared_data_p->number_of_hubs; hub++) {
+		int busy = 0, ok = 0, bad = 0, idle = 0;
+		uint64_t rate_kb = 0;
+		off_t copied = 0;
+		long eta = -1;
+
+		for (int port = 0; port < shared_data_p->ports_per_hub; port++) {
+			const ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[hub * shared_data_p->ports_per_hub + port];
+			ChannelStateEnum state = channel_info_p->state;
+			if (is_busy(state)) {
+				busy++;
+				rate_kb += latest_rate_kb(channel_info_p);
+				if (channel_info_p->eta_seconds > eta) eta = channel_info_p->eta_seconds;
+			}
+			else if (state == SUCCESS) ok++;
+			else if ((state == FAILED) || (state == CRC_FAILED)) bad++;
+			else idle++;
+			copied += channel_info_p->bytes_copied;
+		}
+
+		char eta_str[32];
+		format_duration(eta_str, sizeof(eta_str), eta);
+		mvprintw(row++, 0, "%-4d %5d %4d %4d %4d %9.1f %7luM %8s", hub, busy, ok, bad, idle,
+			rate_kb / 1024.0, (unsigned long)(copied / 1024 / 1024), eta_str);
+		clrtoeol();
+	}
+	return row;
+}
+
+
+static int draw_channels(int row)
+{
+	attron(A_BOLD);
+	mvprintw(row++, 0, "%-3s %-5s %-9s %-12s %8s %7s %-*s %7s %7s %7s  %s",
+		"CH", "PORT", "DEVICE", "STATE", "ELAPSED", "MB/S", SPARKLINE_LEN, "HISTORY", "COPIED", "VERIFY", "ETA", "FILE");
+	attroff(A_BOLD);
+
+	time_t now = time(NULL);
+	uint64_t now_ms = shm_now_ms();
+
+	for (int i = 0; i < shared_data_p->channel_count && row < LINES; i++) {
+		ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[i];
+		char name[STRING_LEN];
+		char path[STRING_LEN];
+		char file[STRING_LEN];
+		char elapsed[32];
+		char eta[32];
+		char state_str[32];
+
+		ChannelStateEnum state = channel_get_device(channel_info_p, name, path);
+		const char* device = strrchr(name, '/');
+		device = device ? device + 1 : name;
+		bool busy = is_busy(state);
+
+		// Time in the current phase, after the state name
+		snprintf(state_str, sizeof(state_str), "%s", get_state_name(state));
+		for (int phase = 0; busy && phase < NUMBER_OF_PHASES; phase++) {
+			uint64_t start_ms = channel_info_p->phase_time[phase].start_ms;
+			if ((start_ms > 0) && (channel_info_p->phase_time[phase].end_ms == 0) && (now_ms > start_ms)) {
+				snprintf(state_str, sizeof(state_str), "%.8s %lus", get_state_name(state),
+					(unsigned long)((now_ms - start_ms) / 1000));
+			}
+		}
+		if (busy && channel_info_p->paused) {
+			snprintf(state_str, sizeof(state_str), "PAUSED");
+		}
+
+		format_duration(elapsed, sizeof(elapsed), (busy && channel_info_p->start_time) ? (long)(now - channel_info_p->start_time) : -1);
+		format_duration(eta, sizeof(eta), busy ? channel_info_p->eta_seconds : -1);
+		file[0] = '\0';
+		if (busy) channel_get_file(channel_info_p, file);
+
+		int colour = 0;
+		if ((state == FAILED) || (state == CRC_FAILED)) colour = 1;
+		else if (state == SUCCESS) colour = 2;
+		else if (busy) colour = 3;
+		if (colour && has_colors()) attron(COLOR_PAIR(colour));
+
+		mvprintw(row, 0, "%-3d %d.%-3d %-9.9s %-12.12s %8s %7.1f ", i, channel_info_p->hub_number,
+			channel_info_p->port_number, device, state_str, elapsed,
+			busy ? latest_rate_kb(channel_info_p) / 1024.0 : 0.0);
+		draw_sparkline(channel_info_p);
+		printw(" %6luM %6luM %7s  %.*s", (unsigned long)(channel_info_p->bytes_copied / 1024 / 1024),
+			(unsigned long)(channel_info_p->bytes_verified / 1024 / 1024), eta,
+			(COLS > 100) ? COLS - 100 : 0, file);
+		clrtoeol();
+
+		if (colour && has_colors()) attroff(COLOR_PAIR(colour));
+		row++;
+	}
+	return row;
+}
+
+
+int main(int argc, char* argv[])
+{
+	int refresh_ms = TOP_REFRESH_MS;
+
+	if (argc > 2 || (argc == 2 && (refresh_ms = atoi(argv[1])) <= 0)) {
+		fprintf(stderr, "Usage: %s [refresh ms]\n", argv[0]);
+		return 1;
+	}
+
+	if (!attach()) {
+		fprintf(stderr, "Waiting for the server to start ...\n");
+	}
+
+	initscr();
+	cbreak();
+	noecho();
+	curs_set(0);
+	if (has_colors()) {
+		start_color();
+		use_default_colors();
+		init_pair(1, COLOR_RED, -1);
+		init_pair(2, COLOR_GREEN, -1);
+		init_pair(3, COLOR_YELLOW, -1);
+	}
+
+	while (true) {
+		// Follow the server through a restart, which replaces the segment
+		if (shared_data_p && (atomic_load(&shared_data_p->magic) != SHM_MAGIC)) detach();
+		if (!shared_data_p) attach();
+
+		erase();
+		if (shared_data_p) {
+			draw_header();
+			int row = draw_hubs(3);
+			draw_channels(row + 1);
+			timeout(refresh_ms);
+		}
+		else {
+			mvprintw(0, 0, "Waiting for the server (%s) ...", SHM_NAME);
+			timeout(SERVER_WAIT_MS);
+		}
+		refresh();
+
+		int key = getch();
+		if (key == 'q' || key == 'Q') break;
+	}
+
+	endwin();
+	detach();
+	return 0;
+}
@@ -0,0 +1,396 @@
+#include "globals.h"
+#include "trace.h"
+
+/*
+ * copier_trace
+ * ------------
+ * Merges the trace rings written by the server and clients (see trace.h)
+ * into one timeline.
+ *
+ *     ./copier_trace > trace.json       Chrome trace-event JSON, for
+ *                                       chrome://tracing or ui.perfetto.dev
+ *     ./copier_trace -s                 time spent in each phase and
+ *                                       operation, per channel and overall
+ *
+ * With no file arguments every trace file in TRACE_DIR is read. It can be
+ * run while a batch is copying.
+ */
+
+typedef struct {
+	TraceRecordStruct record;
+	int32_t pid;
+	int process;        // index into processes[]
+} EventStruct;
+
+typedef struct {
+	char label[16];
+	int32_t pid;
+	int32_t channel;
+} ProcessStruct;
+
+// Open spans, matched by thread
+#define MAX_OPEN_SPANS 4096
+typedef struct {
+	int32_t pid;
+	int32_t tid;
+	uint8_t type;
+	uint64_t time_ns;
+	char text[TRACE_TEXT_LEN];
+} OpenSpanStruct;
+
+typedef struct {
+	char name[TRACE_TEXT_LEN];
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+} StatStruct;
+
+#define MAX_PROCESSES (MAX_USB_CHANNELS + 1)
+#define MAX_STATS 64
+
+static ProcessStruct processes[MAX_PROCESSES];
+static int process_count = 0;
+static EventStruct* events = NULL;
+static size_t event_count = 0;
+static size_t event_capacity = 0;
+
+
+// Copies the complete records out of one trace file
+static void load_trace_file(const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "ERROR: Cannot open %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	struct stat file_stat;
+	if ((fstat(fd, &file_stat) == -1) || (file_stat.st_size < (off_t)sizeof(TraceBufferStruct))) {
+		fprintf(stderr, "ERROR: %s is not a trace file\n", path);
+		close(fd);
+		return;
+	}
+
+	const TraceBufferStruct* buffer_p = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (buffer_p == MAP_FAILED) {
+		perror("mmap");
+		return;
+	}
+
+	if ((atomic_load(&buffer_p->magic) != TRACE_MAGIC) || (buffer_p->version != TRACE_VERSION) ||
+		(buffer_p->record_size != sizeof(TraceRecordStruct)) ||
+		((size_t)file_stat.st_size < TRACE_FILE_SIZE(buffer_p->capacity))) {
+		fprintf(stderr, "ERROR: %s is not a version %d trace file\n", path, TRACE_VERSION);
+		munmap((void*)buffer_p, file_stat.st_size);
+		return;
+	}
+
+	if (process_count >= MAX_PROCESSES) {
+		fprintf(stderr, "ERROR: Too many trace files, ignoring %s\n", path);
+		munmap((void*)buffer_p, file_stat.st_size);
+		return;
+	}
+	ProcessStruct* process_p = &processes[process_count];
+	snprintf(process_p->label, sizeof(process_p->label), "%s", buffer_p->label);
+	process_p->pid = buffer_p->pid;
+	process_p->channel = buffer_p->channel;
+
+	uint64_t head = atomic_load_explicit(&buffer_p->head, memory_order_acquire);
+	uint64_t first = (head > buffer_p->capacity) ? head - buffer_p->capacity : 0;
+	if (first > 0) {
+		fprintf(stderr, "%s: ring wrapped, the first %lu events are lost\n", process_p->label, (unsigned long)first);
+	}
+
+	for (uint64_t index = first; index < head; index++) {
+		const TraceRecordStruct* record_p = &buffer_p->records[index % buffer_p->capacity];
+		if (atomic_load_explicit(&record_p->seq, memory_order_acquire) != index + 1) continue;
+
+		if (event_count == event_capacity) {
+			event_capacity = event_capacity ? event_capacity * 2 : 65536;
+			events = realloc(events, event_capacity * sizeof(EventStruct));
+			if (!events) {
+				fprintf(stderr, "ERROR: out of memory\n");
+				exit(1);
+			}
+		}
+		EventStruct* event_p = &events[event_count];
+		memcpy(&event_p->record, record_p, sizeof(TraceRecordStruct));
+
+		// Skip a record that was overwritten while it was being copied
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&record_p->seq, memory_order_relaxed) != index + 1) continue;
+
+		event_p->record.text[TRACE_TEXT_LEN - 1] = '\0';
+		event_p->pid = process_p->pid;
+		event_p->process = process_count;
+		event_count++;
+	}
+
+	process_count++;
+	munmap((void*)buffer_p, file_stat.st_size);
+}
+
+
+static void load_trace_dir(void)
+{
+	DIR* dir = opendir(TRACE_DIR);
+	if (!dir) {
+		fprintf(stderr, "ERROR: Cannot open %s\n", TRACE_DIR);
+		exit(1);
+	}
+
+	struct dirent* entry;
+	char path[PATH_LEN];
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, TRACE_PREFIX, strlen(TRACE_PREFIX)) == 0) {
+			snprintf(path, sizeof(path), "%s/%s", TRACE_DIR, entry->d_name);
+			load_trace_file(path);
+		}
+	}
+	closedir(dir);
+}
+
+
+static int compare_events(const void* a, const void* b)
+{
+	const EventStruct* event_a = a;
+	const EventStruct* event_b = b;
+	if (event_a->record.time_ns < event_b->record.time_ns) return -1;
+	if (event_a->record.time_ns > event_b->record.time_ns) return 1;
+	return 0;
+}
+
+
+//------------------------------
+// Chrome trace-event JSON
+//------------------------------
+
+static void print_json_string(const char* str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\') printf("\\%c", c);
+		else if (c < 0x20) printf("\\u%04x", c);
+		else putchar(c);
+	}
+	putchar('"');
+}
+
+
+// Each process is one row of the timeline. Its phases are drawn on a track
+// of their own (tid 0), so they read like a Gantt chart above the
+// operations done in each phase.
+static void write_chrome_json(void)
+{
+	uint64_t base_ns = (event_count > 0) ? events[0].record.time_ns : 0;
+	bool first = true;
+
+	printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	for (int i = 0; i < process_count; i++) {
+		printf("%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":", first ? "" : ",\n", processes[i].pid);
+		print_json_string(processes[i].label);
+		printf("}}");
+		printf(",\n{\"ph\":\"M\",\"name\":\"process_sort_index\",\"pid\":%d,\"args\":{\"sort_index\":%d}}",
+			processes[i].pid, processes[i].channel);
+		printf(",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"phases\"}}",
+			processes[i].pid);
+		first = false;
+	}
+
+	// Start of the current phase of each process, or -1
+	ssize_t phase_start[MAX_PROCESSES];
+	for (int i = 0; i < MAX_PROCESSES; i++) phase_start[i] = -1;
+
+	for (size_t i = 0; i < event_count; i++) {
+		const TraceRecordStruct* record_p = &events[i].record;
+		double ts = (record_p->time_ns - base_ns) / 1000.0;
+
+		if (record_p->type == TRACE_PHASE) {
+			ssize_t start = phase_start[events[i].process];
+			if (start >= 0) {
+				const TraceRecordStruct* start_p = &events[start].record;
+				printf(",\n{\"ph\":\"X\",\"cat\":\"phase\",\"pid\":%d,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f,\"name\":",
+					events[i].pid, (start_p->time_ns - base_ns) / 1000.0,
+					(record_p->time_ns - start_p->time_ns) / 1000.0);
+				print_json_string(start_p->text);
+				printf("}");
+			}
+			phase_start[events[i].process] = i;
+			continue;
+		}
+
+		const char* ph = (record_p->kind == TRACE_BEGIN) ? "B" : (record_p->kind == TRACE_END) ? "E" : "i";
+		printf(",\n{\"ph\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+			ph, get_trace_type_name(record_p->type), events[i].pid, record_p->tid, ts);
+		if (record_p->kind != TRACE_END) {
+			printf(",\"name\":");
+			print_json_string(record_p->text[0] ? record_p->text : get_trace_type_name(record_p->type));
+		}
+		if (record_p->kind == TRACE_INSTANT) printf(",\"s\":\"t\"");
+		printf(",\"args\":{\"channel\":%d,\"value\":%lld}}", record_p->channel, (long long)record_p->value);
+	}
+
+	// The final phase of each process (SUCCESS, FAILED ...) as a marker
+	for (int i = 0; i < process_count; i++) {
+		if (phase_start[i] < 0) continue;
+		const TraceRecordStruct* start_p = &events[phase_start[i]].record;
+		printf(",\n{\"ph\":\"i\",\"s\":\"t\",\"cat\":\"phase\",\"pid\":%d,\"tid\":0,\"ts\":%.3f,\"name\":",
+			processes[i].pid, (start_p->time_ns - base_ns) / 1000.0);
+		print_json_string(start_p->text);
+		printf("}");
+	}
+
+	printf("\n]}\n");
+}
+
+
+//------------------------------
+// Summary
+//------------------------------
+
+static StatStruct* find_stat(StatStruct* stats, int* count_p, const char* name)
+{
+	for (int i = 0; i < *count_p; i++) {
+		if (strcmp(stats[i].name, name) == 0) return &stats[i];
+	}
+	if (*count_p >= MAX_STATS) return NULL;
+	StatStruct* stat_p = &stats[(*count_p)++];
+	memset(stat_p, 0, sizeof(*stat_p));
+	snprintf(stat_p->name, sizeof(stat_p->name), "%s", name);
+	return stat_p;
+}
+
+
+static void add_stat(StatStruct* stats, int* count_p, const char* name, uint64_t ns)
+{
+	StatStruct* stat_p = find_stat(stats, count_p, name);
+	if (!stat_p) return;
+	stat_p->count++;
+	stat_p->total_ns += ns;
+	if (ns > stat_p->max_ns) stat_p->max_ns = ns;
+}
+
+
+static void print_stats(const char* title, const StatStruct* stats, int count)
+{
+	printf("\n%-20s %8s %12s %10s %10s\n", title, "count", "total (s)", "mean (ms)", "max (ms)");
+	for (int i = 0; i < count; i++) {
+		printf("%-20s %8lu %12.1f %10.1f %10.1f\n", stats[i].name, (unsigned long)stats[i].count,
+			stats[i].total_ns / 1e9, stats[i].total_ns / 1e6 / stats[i].count, stats[i].max_ns / 1e6);
+	}
+}
+
+
+static void write_summary(void)
+{
+	static StatStruct phase_stats[MAX_STATS];
+	static StatStruct type_stats[MAX_STATS];
+	static OpenSpanStruct open_spans[MAX_OPEN_SPANS];
+	int phase_stat_count = 0;
+	int type_stat_count = 0;
+	int open_span_count = 0;
+
+	ssize_t phase_start[MAX_PROCESSES];
+	uint64_t first_ns[MAX_PROCESSES] = {0};
+	uint64_t last_ns[MAX_PROCESSES] = {0};
+	char slowest_phase[MAX_PROCESSES][TRACE_TEXT_LEN] = {{0}};
+	uint64_t slowest_phase_ns[MAX_PROCESSES] = {0};
+	for (int i = 0; i < MAX_PROCESSES; i++) phase_start[i] = -1;
+
+	for (size_t i = 0; i < event_count; i++) {
+		const TraceRecordStruct* record_p = &events[i].record;
+		int process = events[i].process;
+
+		if (first_ns[process] == 0) first_ns[process] = record_p->time_ns;
+		last_ns[process] = record_p->time_ns;
+
+		if (record_p->type == TRACE_PHASE) {
+			ssize_t start = phase_start[process];
+			if (start >= 0) {
+				const TraceRecordStruct* start_p = &events[start].record;
+				uint64_t ns = record_p->time_ns - start_p->time_ns;
+				add_stat(phase_stats, &phase_stat_count, start_p->text, ns);
+				if (ns > slowest_phase_ns[process]) {
+					slowest_phase_ns[process] = ns;
+					snprintf(slowest_phase[process], TRACE_TEXT_LEN, "%s", start_p->text);
+				}
+			}
+			phase_start[process] = i;
+		}
+		else if (record_p->kind == TRACE_BEGIN) {
+			if (open_span_count < MAX_OPEN_SPANS) {
+				OpenSpanStruct* span_p = &open_spans[open_span_count++];
+				span_p->pid = events[i].pid;
+				span_p->tid = record_p->tid;
+				span_p->type = record_p->type;
+				span_p->time_ns = record_p->time_ns;
+				snprintf(span_p->text, sizeof(span_p->text), "%s", record_p->text);
+			}
+		}
+		else if (record_p->kind == TRACE_END) {
+			// Match the innermost open span of the same type on this thread
+			for (int j = open_span_count - 1; j >= 0; j--) {
+				OpenSpanStruct* span_p = &open_spans[j];
+				if ((span_p->pid == events[i].pid) && (span_p->tid == record_p->tid) && (span_p->type == record_p->type)) {
+					add_stat(type_stats, &type_stat_count, get_trace_type_name(record_p->type),
+						record_p->time_ns - span_p->time_ns);
+					open_spans[j] = open_spans[--open_span_count];
+					break;
+				}
+			}
+		}
+	}
+
+	printf("%-12s %8s %12s  %s\n", "process", "pid", "elapsed (s)", "slowest phase");
+	for (int i = 0; i < process_count; i++) {
+		printf("%-12s %8d %12.1f  ", processes[i].label, processes[i].pid, (last_ns[i] - first_ns[i]) / 1e9);
+		if (slowest_phase[i][0]) printf("%s (%.1fs)\n", slowest_phase[i], slowest_phase_ns[i] / 1e9);
+		else printf("-\n");
+	}
+
+	print_stats("phase", phase_stats, phase_stat_count);
+	print_stats("operation", type_stats, type_stat_count);
+}
+
+
+int main(int argc, char* argv[])
+{
+	bool summary = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "sh")) != -1) {
+		switch (opt) {
+			case 's':
+				summary = true;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-s] [trace file ...]\n", argv[0]);
+				fprintf(stderr, "  Writes Chrome trace-event JSON, or with -s a per-phase summary.\n");
+				fprintf(stderr, "  With no files, reads every %s/%s* file.\n", TRACE_DIR, TRACE_PREFIX);
+				return 1;
+		}
+	}
+
+	if (optind < argc) {
+		for (int i = optind; i < argc; i++) load_trace_file(argv[i]);
+	}
+	else {
+		load_trace_dir();
+	}
+
+	if (event_count == 0) {
+		fprintf(stderr, "No trace events found\n");
+		return 1;
+	}
+
+	qsort(events, event_count, sizeof(EventStruct), compare_events);
+
+	if (summary) write_summary();
+	else write_chrome_json();
+
+	free(events);
+	return 0;
+}
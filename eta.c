@@ -0,0 +1,280 @@
+#include "globals.h"
+#include "utilities.h"
+#include "shm.h"
+#include "eta.h"
+#include "stickdb.h"
+
+/*
+ * Progress and ETA model
+ * ----------------------
+ * Copying is only part of a job: formatting, the final sync and verifying
+ * can take as long again, so progress by bytes alone misleads. Each phase
+ * has an expected cost, learned from the jobs that have succeeded:
+ *
+ *   - copy and verify, in ms per MB of master files
+ *   - the rest (format, mount, sync ...), in ms
+ *
+ * The costs are smoothed over jobs and kept in ETA_HISTORY_FILE, so a
+ * restart doesn't lose them. For a running job:
+ *
+ *   remaining = what is left of the current phase + expected cost of the
+ *               phases still to come
+ *   progress  = time spent so far / (time spent so far + remaining)
+ *
+ * A stick whose model has a few successful jobs in the stick database (see
+ * stickdb.c) uses that model's costs instead. The copy phase uses the
+ * channel's own copy rate, smoothed over the last few seconds, so a slow
+ * stick gets a longer ETA straight away. The results go in each channel's
+ * progress_permille and eta_seconds.
+ */
+
+#define ETA_SMOOTHING 0.3           // weight of the newest job in the phase costs
+#define RATE_SMOOTHING 0.3          // weight of the newest second in the copy rate
+#define RATE_INTERVAL_MS 1000
+#define MIN_REMAINING_MS 1000       // a phase that overruns still has a little way to go
+#define MB (1024.0 * 1024.0)
+
+// The phases a job goes through, in order, with this build's options
+static const PhaseEnum job_phases[] = {
+#if PARTITION
+    PHASE_ERASE,
+    PHASE_PARTITION,
+#endif
+#if FORMAT
+    PHASE_FORMAT,
+#endif
+    PHASE_MOUNT,
+#if !FORMAT
+    PHASE_ERASE,
+#endif
+    PHASE_COPY,
+    PHASE_SYNC,
+#if VERIFY
+    PHASE_VERIFY,
+#endif
+};
+#define NUMBER_OF_JOB_PHASES (int)(sizeof(job_phases) / sizeof(job_phases[0]))
+
+// Starting costs, until some jobs have been measured
+static const double default_cost[NUMBER_OF_PHASES] = {
+    [PHASE_ERASE] = 3000,
+    [PHASE_PARTITION] = 3000,
+    [PHASE_FORMAT] = 5000,
+    [PHASE_MOUNT] = 1000,
+    [PHASE_COPY] = 125,             // 8MB/s
+    [PHASE_SYNC] = 15000,
+    [PHASE_VERIFY] = 15,
+};
+
+typedef struct {
+    double cost[NUMBER_OF_PHASES];  // phase_cost, or the costs of the stick's model
+    double rate;                // smoothed copy rate in bytes per ms, 0 until measured
+    off_t last_bytes;
+    uint64_t last_ms;
+} EtaChannelStruct;
+
+static double phase_cost[NUMBER_OF_PHASES];
+static EtaChannelStruct eta_channels[MAX_USB_CHANNELS];
+
+
+static bool cost_is_per_mb(PhaseEnum phase)
+{
+    return (phase == PHASE_COPY) || (phase == PHASE_VERIFY);
+}
+
+
+static double expected_ms(const EtaChannelStruct* eta_p, PhaseEnum phase, double total_mb)
+{
+    return cost_is_per_mb(phase) ? eta_p->cost[phase] * total_mb : eta_p->cost[phase];
+}
+
+
+static void eta_save(void)
+{
+    char temp_file[PATH_LEN];
+    snprintf(temp_file, sizeof(temp_file), "%s.tmp", ETA_HISTORY_FILE);
+
+    FILE* file = fopen(temp_file, "w");
+    if (!file) {
+        fprintf(stderr, "ERROR: Cannot create %s: %s\n", temp_file, strerror(errno));
+        return;
+    }
+
+    fprintf(file, "# Measured cost of each phase: ms per MB of master for copy and verify, ms for the rest\n");
+    for (int phase = 0; phase < NUMBER_OF_PHASES; phase++) {
+        fprintf(file, "%s=%.1f\n", get_phase_name(phase), phase_cost[phase]);
+    }
+
+    bool ok = (fclose(file) == 0);
+    if (!ok || rename(temp_file, ETA_HISTORY_FILE) != 0) {
+        fprintf(stderr, "ERROR: Cannot save %s: %s\n", ETA_HISTORY_FILE, strerror(errno));
+        unlink(temp_file);
+    }
+}
+
+
+// Loads the phase costs measured on earlier runs
+void eta_init(void)
+{
+    memcpy(phase_cost, default_cost, sizeof(phase_cost));
+
+    FILE* file = fopen(ETA_HISTORY_FILE, "r");
+    if (!file) return;
+
+    char line[STRING_LEN];
+    while (fgets(line, sizeof(line), file)) {
+        trim(line);
+        if (line[0] == '\0' || line[0] == '#') continue;
+
+        char* equals = strchr(line, '=');
+        if (!equals) continue;
+        *equals = '\0';
+
+        char* end;
+        double cost = strtod(equals + 1, &end);
+        for (int phase = 0; phase < NUMBER_OF_PHASES; phase++) {
+            if ((strcmp(line, get_phase_name(phase)) == 0) && (end != equals + 1) && (cost > 0)) {
+                phase_cost[phase] = cost;
+            }
+        }
+    }
+    fclose(file);
+}
+
+
+// The learned cost of copying to a stick, in ms per MB of master
+double eta_copy_cost(void)
+{
+    return phase_cost[PHASE_COPY];
+}
+
+
+// Forgets the last job's copy rate and picks the phase costs for the
+// stick. Called when a client is started, after stickdb_start_job().
+void eta_start_job(ChannelInfoStruct* channel_info_p)
+{
+    EtaChannelStruct* eta_p = &eta_channels[channel_info_p->device_id];
+
+    memset(eta_p, 0, sizeof(EtaChannelStruct));
+    if (!stickdb_model_costs(channel_info_p->device_id, eta_p->cost)) {
+        memcpy(eta_p->cost, phase_cost, sizeof(eta_p->cost));
+    }
+    channel_info_p->progress_permille = 0;
+    channel_info_p->eta_seconds = -1;
+}
+
+
+static void update_copy_rate(EtaChannelStruct* eta_p, off_t bytes, uint64_t now_ms)
+{
+    if (eta_p->last_ms == 0) {
+        eta_p->last_ms = now_ms;
+        eta_p->last_bytes = bytes;
+        return;
+    }
+    if (now_ms - eta_p->last_ms < RATE_INTERVAL_MS) return;
+
+    double rate = (double)(bytes - eta_p->last_bytes) / (now_ms - eta_p->last_ms);
+    eta_p->rate = (eta_p->rate > 0) ? (1 - RATE_SMOOTHING) * eta_p->rate + RATE_SMOOTHING * rate : rate;
+    eta_p->last_ms = now_ms;
+    eta_p->last_bytes = bytes;
+}
+
+
+// Updates progress_permille and eta_seconds for every running client.
+// Called on each reactor wake-up.
+void eta_update(SharedDataStruct* shared_data_p)
+{
+    uint64_t now_ms = shm_now_ms();
+    off_t total_size = shared_data_p->total_size;
+    double total_mb = total_size / MB;
+
+    for (int i = 0; i < shared_data_p->channel_count; i++) {
+        ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[i];
+        EtaChannelStruct* eta_p = &eta_channels[i];
+        ChannelStateEnum state = channel_info_p->state;
+
+        if ((state == SUCCESS) || (state == FAILED) || (state == CRC_FAILED)) {
+            channel_info_p->progress_permille = 1000;
+            channel_info_p->eta_seconds = -1;
+            continue;
+        }
+        if ((channel_info_p->pid <= 0) || (state < STARTING) || (state > VERIFYING)) {
+            channel_info_p->progress_permille = 0;
+            channel_info_p->eta_seconds = -1;
+            continue;
+        }
+
+        off_t progress = channel_progress_bytes(channel_info_p);
+        if (state == COPYING) update_copy_rate(eta_p, progress, now_ms);
+
+        PhaseEnum current = get_phase(state);
+        int current_index = NUMBER_OF_JOB_PHASES;
+        for (int j = 0; j < NUMBER_OF_JOB_PHASES; j++) {
+            if (job_phases[j] == current) current_index = j;
+        }
+        if (current == NUMBER_OF_PHASES) current_index = -1;     // STARTING
+
+        double done_ms = 0;
+        double remaining_ms = 0;
+        for (int j = 0; j < NUMBER_OF_JOB_PHASES; j++) {
+            PhaseEnum phase = job_phases[j];
+
+            if (j < current_index) {
+                done_ms += channel_phase_ms(channel_info_p, phase);
+            }
+            else if (j > current_index) {
+                remaining_ms += expected_ms(eta_p, phase, total_mb);
+            }
+            else {
+                uint64_t start_ms = channel_info_p->phase_time[phase].start_ms;
+                double elapsed_ms = (start_ms && now_ms > start_ms) ? now_ms - start_ms : 0;
+                double left_ms;
+
+                if (phase == PHASE_COPY) {
+                    double rate = (eta_p->rate > 0) ? eta_p->rate : MB / eta_p->cost[PHASE_COPY];
+                    left_ms = (progress < total_size) ? (total_size - progress) / rate : 0;
+                }
+                else {
+                    left_ms = expected_ms(eta_p, phase, total_mb) - elapsed_ms;
+                }
+                if (left_ms < MIN_REMAINING_MS) left_ms = MIN_REMAINING_MS;
+
+                done_ms += elapsed_ms;
+                remaining_ms += left_ms;
+            }
+        }
+
+        channel_info_p->progress_permille = (int32_t)(1000 * done_ms / (done_ms + remaining_ms));
+        channel_info_p->eta_seconds = (int32_t)((remaining_ms + 999) / 1000);
+    }
+}
+
+
+// Folds the phase times of a successful job into the costs
+void eta_job_finished(const SharedDataStruct* shared_data_p, const ChannelInfoStruct* channel_info_p)
+{
+    if (channel_info_p->state != SUCCESS) return;
+
+    double total_mb = shared_data_p->total_size / MB;
+
+    for (int j = 0; j < NUMBER_OF_JOB_PHASES; j++) {
+        PhaseEnum phase = job_phases[j];
+        uint64_t ms = channel_phase_ms(channel_info_p, phase);
+        if (ms == 0) continue;
+        if (cost_is_per_mb(phase) && (total_mb < 1)) continue;
+
+        double cost = cost_is_per_mb(phase) ? ms / total_mb : ms;
+        phase_cost[phase] = (1 - ETA_SMOOTHING) * phase_cost[phase] + ETA_SMOOTHING * cost;
+    }
+
+    eta_save();
+}
+
+
+// Formats a time to go as m:ss, or h:mm once it's over 100 minutes
+void format_eta(char* str, size_t len, int seconds)
+{
+    if (seconds < 0) snprintf(str, len, "--:--");
+    else if (seconds < 6000) snprintf(str, len, "%d:%02d", seconds / 60, seconds % 60);
+    else snprintf(str, len, "%dh%02d", seconds / 3600, (seconds / 60) % 60);
+}
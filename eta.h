@@ -0,0 +1,11 @@
+#ifndef ETA_H
+#define ETA_H
+
+void eta_init(void);
+double eta_copy_cost(void);
+void eta_start_job(ChannelInfoStruct* channel_info_p);
+void eta_update(SharedDataStruct* shared_data_p);
+void eta_job_finished(const SharedDataStruct* shared_data_p, const ChannelInfoStruct* channel_info_p);
+void format_eta(char* str, size_t len, int seconds);
+
+#endif // ETA_H
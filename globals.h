@@ -23,6 +23,9 @@
 #include <linux/fs.h> 
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sched.h>
 #include <mntent.h>
 #include <libudev.h>
 #include <time.h>
@@ -38,22 +41,38 @@
 #define CRC_SIZE 1*1024*1024   // CRCs will only be generated and checked for the first 1MB in each file
 
 #define SHM_NAME "/usb_copier_shm"
+#define SHM_MAGIC 0x59504F43        // "COPY". Written last, once the segment is initialised
+#define SHM_ABI_VERSION 13          // bump whenever SharedDataStruct or ChannelInfoStruct change
+#define CACHE_LINE_SIZE 64
+#define CHANNEL_RING_SIZE 16        // slots in each channel's command and event ring. Power of two
+#define EVENT_TEXT_LEN 120
+#define THROUGHPUT_SAMPLES 120      // seconds of per-channel throughput history
 #define RAMDIR_PATH "/var/ramdrive/master"
 #define MOUNT_POINT "/mnt/usb"
-//#define USB_CONFIG_FILE "./usb_ports.config"
+#define USB_PORT_MAP_FILE "./usb_ports.map"   // saved USB socket to channel mapping
+#define ETA_HISTORY_FILE "./eta_history.txt"  // measured cost of each phase, for the ETA
+#define STICKDB_FILE "./stickdb.dat"          // finished jobs by stick model, see stickdb.c
+#define STICKDB_TMPFS_FILE "/dev/shm/usb_copier_stickdb"   // working copy, appended to during a batch
 #define CRC_FILE "/var/ramdrive/crc.txt"
+#define FILE_LIST "/var/ramdrive/files.txt"   // the master's files, in the order the clients copy them
 #define FFMPEG_FILTERS "agate=mode=downward:ratio=1.2, silenceremove=start_periods=1:start_threshold=-35dB:start_silence=0.7, loudnorm=I=-18:TP=-2:LRA=7"
-#define NUMBER_OF_FFMPEG_THREADS 4
 
 	
 #define MAX_FILES 1024      // Maximum number of files/directories per directory
+#define MAX_MASTER_FILES 8192   // files in FILE_LIST whose progress is tracked in shared memory
 #define COPY_BUFFER_SIZE 1024*1024  // Buffer size for file copying
 #define STRING_LEN 256        // general name string length
 #define PATH_LEN 512          // Maximum path length
 
-#define NUMBER_OF_HUBS 2
-#define PORTS_PER_CHANNEL 7
-#define MAX_USB_CHANNELS (NUMBER_OF_HUBS * PORTS_PER_CHANNEL)  
+// The hub layout is read from CONFIG_FILE at start-up. These are the
+// defaults (two 7-port hubs) and the upper limits for sizing static tables.
+#define CONFIG_FILE "./copier.ini"
+#define DEFAULT_NUMBER_OF_HUBS 2
+#define DEFAULT_PORTS_PER_HUB 7
+#define MAX_HUBS 8
+#define MAX_PORTS_PER_HUB 16
+#define MAX_USB_CHANNELS (MAX_HUBS * MAX_PORTS_PER_HUB)  
+#define NUMBER_OF_BUTTONS 2
 
 
 #define GPIO_CHIP "gpiochip0"
@@ -61,8 +80,8 @@
 #define GPIO_BUTTON1 21   // bottom button
 #define GPIO_DATA 5       // 74HC595 data line
 #define GPIO_CLOCK 6      // 74HC595 clock line
-#define GPIO_LATCH0 13     // 74HC595 latch line
-#define GPIO_LATCH1 19     // 74HC595 latch line
+#define GPIO_LATCH0 13     // 74HC595 latch line (default for hub 1)
+#define GPIO_LATCH1 19     // 74HC595 latch line (default for hub 0)
 #define GPIO_SPEAKER 18   // speaker
 
 
@@ -97,6 +116,25 @@ typedef enum {
 } ChannelStateEnum ;
 
 
+// How far the server has got with each file in FILE_LIST. Clients copy a
+// file once it is FILE_CHECKSUMMED.
+typedef enum {
+		FILE_PENDING = 0,
+		FILE_INGESTED = 1,     // copied from the master
+		FILE_PROCESSED = 2,    // MP3 optimised
+		FILE_CHECKSUMMED = 3   // CRC known, so final
+} FileStateEnum;
+
+
+// Why a channel ended up FAILED
+typedef enum {
+		FAIL_NONE = 0,
+		FAIL_ERROR = 1,       // the client reported an error or died
+		FAIL_CANCELLED = 2,   // stopped with a long press of the button
+		FAIL_SLOW = 3         // stopped by the watchdog. Too slow or stuck in one phase
+} FailReasonEnum;
+
+
 typedef enum {
     BUTTON_NOT_PRESSED = 0,
     BUTTON_SHORT_PRESS = 1,
@@ -104,16 +142,124 @@ typedef enum {
 } ButtonStateEnum;
 
 
+// Steps of a copy job, for the per-channel timing history
+typedef enum {
+		PHASE_ERASE = 0,
+		PHASE_PARTITION = 1,
+		PHASE_FORMAT = 2,
+		PHASE_MOUNT = 3,
+		PHASE_COPY = 4,
+		PHASE_SYNC = 5,       // sync and unmount after copying
+		PHASE_VERIFY = 6,
+		NUMBER_OF_PHASES = 7
+} PhaseEnum;
+
+// Monotonic milliseconds (see shm_now_ms) when a phase started and ended,
+// both 0 if it hasn't run, end 0 while it is running
+typedef struct {
+	_Atomic uint64_t start_ms;
+	_Atomic uint64_t end_ms;
+} PhaseTimeStruct;
+
+
+// Commands from the server to a client
+typedef enum {
+		CMD_HALT = 1,         // stop as soon as possible (halt is also set)
+		CMD_PAUSE = 2,        // stop between copy chunks until resumed
+		CMD_RESUME = 3,
+		CMD_THROTTLE = 4,     // limit copying to value KB/s. 0 removes the limit
+		CMD_PRIORITY = 5      // best effort I/O priority, value 0 (highest) to 7
+} ChannelCommandEnum;
+
+typedef struct {
+	uint32_t command;     // ChannelCommandEnum
+	int32_t value;
+} ChannelCommandStruct;
+
+// copier_ctl asks the server to send a command with this queued signal,
+// the channel, command and value packed into its int (see shm.c)
+#define CONTROL_SIGNAL (SIGRTMIN + 1)
+#define CONTROL_MAX_VALUE 0xFFFFF     // the largest value copier_ctl can send
+
+
+// Events from a client to the server
+typedef enum {
+		EVENT_PHASE = 1,      // value is the new ChannelStateEnum
+		EVENT_FILE_DONE = 2,  // value is the file number, text the file name
+		EVENT_ERROR = 3       // text is the error message
+} ChannelEventEnum;
+
 typedef struct {
+	uint32_t event;       // ChannelEventEnum
+	int32_t value;
+	char text[EVENT_TEXT_LEN];
+} ChannelEventStruct;
+
+
+// Head and tail of a single producer, single consumer ring. Each is on its
+// own cache line as they are written by different processes.
+typedef struct {
+	_Alignas(CACHE_LINE_SIZE) atomic_uint head;   // next slot to write. Only changed by the producer
+	_Alignas(CACHE_LINE_SIZE) atomic_uint tail;   // next slot to read. Only changed by the consumer
+} RingIndexStruct;
+
+
+// One per USB port. Shared by the server, its GPIO and USB threads and the
+// client for that port, so anything written after start-up is either atomic
+// or published through device_seq (see shm.h).
+typedef struct {
+	// Hot fields, updated while copying. Each channel starts on its own cache
+	// line so clients on neighbouring ports don't contend for it.
+	_Alignas(CACHE_LINE_SIZE) _Atomic off_t bytes_copied;
+	_Atomic ChannelStateEnum state;
+	atomic_bool halt;
+	_Atomic FailReasonEnum fail_reason;
+	_Atomic pid_t worker_pid;    // pid of the client program itself, below sudo. Also its process group
+	atomic_bool paused;          // set by the client while a CMD_PAUSE is in force
+	atomic_bool waiting;         // set by the client while it waits for the server to finish a file
+	_Atomic int throttle_kb;     // copy rate limit the client is applying, 0 if none
+
+	// device_name, device_path and the state that goes with them are
+	// changed together under this seqlock
+	atomic_uint device_seq;
+	char device_name[STRING_LEN];
+	char device_path[STRING_LEN];
+
+	// Fixed at start-up, or only used by the server's main thread
 	int device_id;
 	int hub_number;
 	int port_number;
-	bool halt;
-	ChannelStateEnum state;
 	time_t start_time;
-	char device_name[STRING_LEN];
-	char device_path[STRING_LEN];
-	off_t bytes_copied;
+	pid_t pid;           // pid of the client process (0 if none has been started)
+	int exit_status;     // exit code of the last client, 128+signal if killed, -1 while running
+
+	// Timing and throughput history, written by the client and read by the
+	// server and monitoring tools
+	PhaseTimeStruct phase_time[NUMBER_OF_PHASES];
+	_Atomic off_t bytes_verified;
+	_Atomic int file_index;                        // number of the file being copied or verified, from 1
+	atomic_uint file_seq;                          // seqlock for current_file
+	char current_file[STRING_LEN];
+	_Atomic uint32_t throughput_count;             // samples written so far. The latest is
+	                                               // throughput_kb[(throughput_count-1) % THROUGHPUT_SAMPLES]
+	_Atomic uint32_t throughput_kb[THROUGHPUT_SAMPLES];   // KB/s copied or verified in each second
+
+	// What actually reached the drive, from the block layer. Sampled by the
+	// server (see blockstat.c)
+	_Atomic uint64_t media_bytes;        // written since the job started, formatting included
+	_Atomic uint64_t media_copy_bytes;   // written since COPYING started: the files plus FAT metadata
+	_Atomic uint32_t io_in_flight;       // write requests the drive has yet to complete
+
+	// Progress model, from the server (see eta.c)
+	_Atomic int32_t progress_permille;   // share of the job's expected time done, 0..1000
+	_Atomic int32_t eta_seconds;         // expected time to finish the job, -1 if not running
+
+	// Server to client commands and client to server events (see shm.c)
+	RingIndexStruct command_ring;
+	ChannelCommandStruct commands[CHANNEL_RING_SIZE];
+	RingIndexStruct event_ring;
+	ChannelEventStruct events[CHANNEL_RING_SIZE];
+	_Atomic uint32_t events_dropped;
 } ChannelInfoStruct;
 
 
@@ -124,9 +270,36 @@ typedef struct {
 
 
 typedef struct {
-	off_t total_size;    // total size of all files
-	ChannelInfoStruct channel_info[MAX_USB_CHANNELS];
+	// Header, so the client and external tools can check the layout before
+	// trusting anything else in the segment
+	_Atomic uint32_t magic;      // SHM_MAGIC once the server has finished initialising
+	uint32_t abi_version;        // SHM_ABI_VERSION
+	uint32_t header_size;        // sizeof(SharedDataStruct)
+	uint32_t channel_info_size;  // sizeof(ChannelInfoStruct)
+	uint64_t segment_size;       // SHARED_DATA_SIZE(channel_count)
+
+	int number_of_hubs;
+	int ports_per_hub;
+	int channel_count;   // number_of_hubs * ports_per_hub
+	pid_t server_pid;    // clients send SIGUSR1 here after posting an event
+	int trace_events;    // size of each process's trace ring, 0 if tracing is off
+	_Atomic off_t total_size;    // total size of all files
+	char master_dir[PATH_LEN];   // where the clients copy the master from: RAMDIR_PATH, or the staging directory
+	_Atomic int ffmpeg_files;    // MP3 files being optimised at start-up ...
+	_Atomic int ffmpeg_done;     // ... how many have finished ...
+	_Atomic int ffmpeg_running;  // ... and how many ffmpeg is working on now
+	int ffmpeg_workers;          // size of the ffmpeg worker pool
+	_Atomic uint64_t ffmpeg_bytes;       // total size of the MP3 files ...
+	_Atomic uint64_t ffmpeg_bytes_done;  // ... and how much ffmpeg has read
+	atomic_bool master_ready;    // every file is final and crc.txt written
+	atomic_bool master_failed;   // the last load failed, so the files can't be trusted
+	_Atomic int master_files;    // files in FILE_LIST ...
+	_Atomic uint8_t file_state[MAX_MASTER_FILES];   // ... and how far each has got, a FileStateEnum
+	ChannelInfoStruct channel_info[];
 } SharedDataStruct;
 
+// Size of the shared memory segment for the given number of channels
+#define SHARED_DATA_SIZE(channel_count) (sizeof(SharedDataStruct) + (channel_count) * sizeof(ChannelInfoStruct))
+
 
 #endif // GLOBALS_H
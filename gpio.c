@@ -2,9 +2,13 @@
 #include "utilities.h"
 #include "gpio.h"
 #include "lcd.h"
+#include "config.h"
+#include "shm.h"
 #include <ifaddrs.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 extern SharedDataStruct* shared_data_p;
 
@@ -13,17 +17,37 @@ struct gpiod_line  *button_line0;
 struct gpiod_line  *button_line1;
 struct gpiod_line  *clock_line;
 struct gpiod_line  *data_line;
-struct gpiod_line  *latch_line0;
-struct gpiod_line  *latch_line1;
+struct gpiod_line  **latch_lines;    // one per hub
 struct gpiod_line  *speaker_line;
 
 static pthread_mutex_t button_mutex = PTHREAD_MUTEX_INITIALIZER;
 static ButtonStateEnum button_state0;
 static ButtonStateEnum button_state1;
 
+// Signalled every time a button press has been classified, so the server's
+// main loop can react immediately instead of polling the button states.
+static int button_event_fd = -1;
+
+// Edge tracking for one push button. The buttons are active-low with
+// hardware pull-ups, so a falling edge is a press and a rising edge a release.
+typedef struct {
+    struct gpiod_line** line_pp;
+    ButtonStateEnum*    state_p;
+    uint64_t            press_start_time;
+    bool                is_pressed;
+    bool                wait_for_release;
+} ButtonTracker;
+
+static ButtonTracker button0 = { &button_line0, &button_state0, 0, false, false };
+static ButtonTracker button1 = { &button_line1, &button_state1, 0, false, false };
+
 static pthread_t gpio_thread;
 
-unsigned char bits[24*NUMBER_OF_HUBS];
+// LED shift register bits for every hub, hub 0 first. Sized from the config.
+static unsigned char* bits;
+static unsigned char* prev_bits;
+static int            bit_count;
+static int            hub_bit_offset[MAX_HUBS];
 
 volatile uint64_t milliseconds;
 
@@ -125,35 +149,27 @@ static void delay_us(uint32_t us) {
     }
 }
 
-static void send_led_data(unsigned char* bits, int bit_count)
+// Clocks each hub's bits into its shift register chain and latches them.
+// The data and clock lines are shared, so each hub must be latched straight
+// after its own bits have been shifted in.
+static void send_led_data(const unsigned char* bits)
 {
-    // Send the LED data to the bottom set of shift registers
-    for (int i=bit_count-1; i>=bit_count/2; i--)
-    {
-        gpiod_line_set_value(data_line, bits[i] ? 1 : 0);
-        delay_us(GPIO_DELAY);
-        gpiod_line_set_value(clock_line, 1);
-        delay_us(GPIO_DELAY);
-        gpiod_line_set_value(clock_line, 0);
-    }
-    gpiod_line_set_value(latch_line0, 1);
-    delay_us(GPIO_DELAY);
-    gpiod_line_set_value(latch_line0, 0);
-    delay_us(GPIO_DELAY);
+    for (int hub = 0; hub < config.number_of_hubs; hub++) {
+        const unsigned char* hub_bits = &bits[hub_bit_offset[hub]];
 
-    // Send the LED data to the top set of shift registers
-    for (int i=bit_count/2-1; i>=0; i--)
-    {
-        gpiod_line_set_value(data_line, bits[i] ? 1 : 0);
+        for (int i = config.hub[hub].led_bits - 1; i >= 0; i--)
+        {
+            gpiod_line_set_value(data_line, hub_bits[i] ? 1 : 0);
+            delay_us(GPIO_DELAY);
+            gpiod_line_set_value(clock_line, 1);
+            delay_us(GPIO_DELAY);
+            gpiod_line_set_value(clock_line, 0);
+        }
+        gpiod_line_set_value(latch_lines[hub], 1);
         delay_us(GPIO_DELAY);
-        gpiod_line_set_value(clock_line, 1);
+        gpiod_line_set_value(latch_lines[hub], 0);
         delay_us(GPIO_DELAY);
-        gpiod_line_set_value(clock_line, 0);
     }
-    gpiod_line_set_value(latch_line1, 1);
-    delay_us(GPIO_DELAY);
-    gpiod_line_set_value(latch_line1, 0);
-    delay_us(GPIO_DELAY);
 }
 
 void wait_for_button_release() {
@@ -265,17 +281,91 @@ void display_system_menu(void) {
     }
 }
 
-// Reads the buttons and updates the LEDs according to the contents of
-// shared_data every 50 milliseconds
+// Publishes a classified press and wakes the server's main loop
+static void set_button_state(ButtonTracker* button, ButtonStateEnum state)
+{
+    pthread_mutex_lock(&button_mutex);
+    *button->state_p = state;
+    pthread_mutex_unlock(&button_mutex);
+
+    uint64_t one = 1;
+    if (write(button_event_fd, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "ERROR: Failed to signal button event\n");
+    }
+}
+
+
+// Handles one edge event. Presses shorter than SHORT_PRESS_TIME are
+// ignored, which also debounces the contacts.
+static void button_edge(ButtonTracker* button, int event_type)
+{
+    if (event_type == GPIOD_LINE_EVENT_FALLING_EDGE) {            // pressed
+        button->wait_for_release = false;
+        button->press_start_time = milliseconds;
+        button->is_pressed       = true;
+    }
+    else if (event_type == GPIOD_LINE_EVENT_RISING_EDGE && button->is_pressed) {  // released
+        long press_duration = (long)(milliseconds - button->press_start_time);
+        if (!button->wait_for_release && press_duration >= SHORT_PRESS_TIME) {
+            set_button_state(button, BUTTON_SHORT_PRESS);
+        }
+        button->is_pressed = false;
+    }
+}
+
+
+// Reads all queued edge events for a button
+static void read_button_events(ButtonTracker* button)
+{
+    struct gpiod_line_event events[16];
+
+    int count = gpiod_line_event_read_multiple(*button->line_pp, events, 16);
+    if (count < 0) {
+        fprintf(stderr, "ERROR: Failed to read button events\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        button_edge(button, events[i].event_type);
+    }
+}
+
+
+// A long press has no edge of its own, so it is detected on each LED
+// frame while the button is still held down.
+static void check_long_press(ButtonTracker* button)
+{
+    if (button->is_pressed && !button->wait_for_release &&
+        (long)(milliseconds - button->press_start_time) >= LONG_PRESS_TIME) {
+        set_button_state(button, BUTTON_LONG_PRESS);
+        button->wait_for_release = true;
+    }
+}
+
+
+// Discards edges queued while the system menu was reading the lines directly
+static void flush_button_events(void)
+{
+    struct pollfd fds[2] = {
+        { .fd = gpiod_line_event_get_fd(button_line0), .events = POLLIN },
+        { .fd = gpiod_line_event_get_fd(button_line1), .events = POLLIN },
+    };
+    struct gpiod_line_event events[16];
+
+    while (poll(fds, 2, 0) > 0) {
+        if (fds[0].revents & POLLIN) gpiod_line_event_read_multiple(button_line0, events, 16);
+        if (fds[1].revents & POLLIN) gpiod_line_event_read_multiple(button_line1, events, 16);
+    }
+
+    button0.is_pressed = false;
+    button1.is_pressed = false;
+}
+
+
+// Waits for button edges and refreshes the LEDs according to the contents
+// of shared_data at least every GPIO_LED_INTERVAL_MS (needed for flashing)
 void* gpio_thread_function(void* arg) {
-    static uint64_t press_start_time0  = 0;
-    static uint64_t press_start_time1  = 0;
-    static bool     is_pressed0        = false;
-    static bool     is_pressed1        = false;
-    static bool     wait_for_release0  = false;
-    static bool     wait_for_release1  = false;
-    static int      prev_value0        = 1;   // 1 = not pressed (active-low buttons)
-    static int      prev_value1        = 1;
+    static bool prev_bits_valid = false;
 
     SharedDataStruct* shared_data_p = (SharedDataStruct*)arg;
     if (!shared_data_p) {
@@ -285,75 +375,28 @@ void* gpio_thread_function(void* arg) {
 
     printf("Started GPIO button and LED thread\n");
 
-    while (true) {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        milliseconds = (uint64_t)(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
-
-        // -------------------------
-        // Button 0
-        // -------------------------
-        int value0 = gpiod_line_get_value(button_line0);
-        if (value0 < 0) {
-            fprintf(stderr, "ERROR: Failed to read button0 value\n");
-            exit(1);
-        }
-
-        long press_duration0 = (long)(milliseconds - press_start_time0);
+    struct pollfd fds[2] = {
+        { .fd = gpiod_line_event_get_fd(button_line0), .events = POLLIN },
+        { .fd = gpiod_line_event_get_fd(button_line1), .events = POLLIN },
+    };
 
-        if (value0 == 0 && prev_value0 == 1) {           // Falling edge — pressed
-            wait_for_release0  = false;
-            press_start_time0  = milliseconds;
-            is_pressed0        = true;
-        }
-        else if (press_duration0 >= LONG_PRESS_TIME && value0 == 0 && !wait_for_release0) {
-            // BUG FIX G2: write button state under the mutex.
-            pthread_mutex_lock(&button_mutex);
-            button_state0 = BUTTON_LONG_PRESS;
-            pthread_mutex_unlock(&button_mutex);
-            wait_for_release0 = true;
-        }
-        else if (value0 == 1 && prev_value0 == 0 && is_pressed0) { // Rising edge — released
-            if (!wait_for_release0 && press_duration0 >= SHORT_PRESS_TIME) {
-                pthread_mutex_lock(&button_mutex);
-                button_state0 = BUTTON_SHORT_PRESS;
-                pthread_mutex_unlock(&button_mutex);
-            }
-            is_pressed0 = false;
-        }
-        prev_value0 = value0;
-
-        // -------------------------
-        // Button 1
-        // -------------------------
-        int value1 = gpiod_line_get_value(button_line1);
-        if (value1 < 0) {
-            fprintf(stderr, "ERROR: Failed to read button1 value\n");
+    while (true) {
+        int ready = poll(fds, 2, GPIO_LED_INTERVAL_MS);
+        if (ready < 0 && errno != EINTR) {
+            perror("GPIO poll failed");
             exit(1);
         }
 
-        long press_duration1 = (long)(milliseconds - press_start_time1);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        milliseconds = (uint64_t)(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
 
-        if (value1 == 0 && prev_value1 == 1) {           // Falling edge — pressed
-            wait_for_release1  = false;
-            press_start_time1  = milliseconds;
-            is_pressed1        = true;
-        }
-        else if (press_duration1 >= LONG_PRESS_TIME && value1 == 0 && !wait_for_release1) {
-            pthread_mutex_lock(&button_mutex);
-            button_state1 = BUTTON_LONG_PRESS;
-            pthread_mutex_unlock(&button_mutex);
-            wait_for_release1 = true;
-        }
-        else if (value1 == 1 && prev_value1 == 0 && is_pressed1) { // Rising edge — released
-            if (!wait_for_release1 && press_duration1 >= SHORT_PRESS_TIME) {
-                pthread_mutex_lock(&button_mutex);
-                button_state1 = BUTTON_SHORT_PRESS;
-                pthread_mutex_unlock(&button_mutex);
-            }
-            is_pressed1 = false;
+        if (ready > 0) {
+            if (fds[0].revents & POLLIN) read_button_events(&button0);
+            if (fds[1].revents & POLLIN) read_button_events(&button1);
         }
-        prev_value1 = value1;
+        check_long_press(&button0);
+        check_long_press(&button1);
 
         // Snapshot button states under the mutex for the dual-press check below
         pthread_mutex_lock(&button_mutex);
@@ -365,48 +408,45 @@ void* gpio_thread_function(void* arg) {
         if (((snap0 == BUTTON_LONG_PRESS) && (snap1 != BUTTON_NOT_PRESSED)) ||
             ((snap1 == BUTTON_LONG_PRESS) && (snap0 != BUTTON_NOT_PRESSED)))
         {
-            for (int device_id=0; device_id < MAX_USB_CHANNELS; device_id++) {
-                shared_data_p->channel_info[device_id].halt = true;
+            for (int device_id=0; device_id < shared_data_p->channel_count; device_id++) {
+                ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[device_id];
+                channel_info_p->halt = true;
+                if (channel_info_p->worker_pid > 0) {
+                    channel_send_command(channel_info_p, CMD_HALT, 0);
+                }
             }
-            memset(bits, 0, sizeof(bits));
-            send_led_data(bits, sizeof(bits));
+            memset(bits, 0, bit_count);
+            send_led_data(bits);
+            prev_bits_valid = false;
             long_beep();
             display_system_menu();
             wait_for_button_release();
+            flush_button_events();
         }
 
-        // Update the LEDs
-        memset(bits, 0, sizeof(bits));
-
-        // Map the Red, Yellow and Green LEDs for each channel to shift register bits
-        // (Shift register bits 0, 8, 16, 24, 32 and 40 are unused)
-        //
-        // CHAN 13 | CHAN 12 | CHAN 11 | CHAN 10 | CHAN 9  | CHAN 8  | CHAN 7
-        // R G Y  | R G Y  | R G Y  | R G Y  | R G Y  | R G Y  | R G Y
-        // --------+---------+---------+---------+---------+---------+---------
-        // 25 26 27| 28 29 30| 31 33 34| 35 36 37| 38 39 41| 42 43 44| 45 46 47
-        //
-        // CHAN 6  | CHAN 5  | CHAN 4  | CHAN 3  | CHAN 2  | CHAN 1  | CHAN 0
-        // R G Y  | R G Y  | R G Y  | R G Y  | R G Y  | R G Y  | R G Y
-        // --------+---------+---------+---------+---------+---------+---------
-        // 1  2  3 | 4  5  6 | 7  9 10 |11 12 13 |14 15 17 |18 19 20 |21 22 23
-
-        for (int i=0; i<NUMBER_OF_HUBS; i++) {
-            int base   = i * PORTS_PER_CHANNEL;
-            int offset = i * 24;
-
-            set_leds(0, shared_data_p->channel_info[base+0].state, &bits[offset+1],  &bits[offset+2],  &bits[offset+3]);
-            set_leds(1, shared_data_p->channel_info[base+1].state, &bits[offset+4],  &bits[offset+5],  &bits[offset+6]);
-            set_leds(2, shared_data_p->channel_info[base+2].state, &bits[offset+7],  &bits[offset+9],  &bits[offset+10]);
-            set_leds(3, shared_data_p->channel_info[base+3].state, &bits[offset+11], &bits[offset+12], &bits[offset+13]);
-            set_leds(4, shared_data_p->channel_info[base+4].state, &bits[offset+14], &bits[offset+15], &bits[offset+17]);
-            set_leds(5, shared_data_p->channel_info[base+5].state, &bits[offset+18], &bits[offset+19], &bits[offset+20]);
-            set_leds(6, shared_data_p->channel_info[base+6].state, &bits[offset+21], &bits[offset+22], &bits[offset+23]);
-        }
+        // Update the LEDs. The shift register bit for the red, yellow and
+        // green LED of each port comes from the led_map in the config.
+        memset(bits, 0, bit_count);
 
-        send_led_data(bits, sizeof(bits));
+        for (int hub = 0; hub < config.number_of_hubs; hub++) {
+            const HubConfigStruct* hub_p = &config.hub[hub];
+            unsigned char* hub_bits = &bits[hub_bit_offset[hub]];
+
+            for (int port = 0; port < config.ports_per_hub; port++) {
+                int device_id = hub * config.ports_per_hub + port;
+                set_leds(port, shared_data_p->channel_info[device_id].state,
+                         &hub_bits[hub_p->led_map[port][LED_RED]],
+                         &hub_bits[hub_p->led_map[port][LED_YELLOW]],
+                         &hub_bits[hub_p->led_map[port][LED_GREEN]]);
+            }
+        }
 
-        usleep(50000); // 50 ms — reduces CPU usage
+        // Only clock the shift registers when the pattern has changed
+        if (!prev_bits_valid || memcmp(bits, prev_bits, bit_count) != 0) {
+            send_led_data(bits);
+            memcpy(prev_bits, bits, bit_count);
+            prev_bits_valid = true;
+        }
     }
 }
 
@@ -415,10 +455,23 @@ void gpio_cleanup(void) {
     gpiod_line_release(button_line1);
     gpiod_line_release(clock_line);
     gpiod_line_release(data_line);
-    gpiod_line_release(latch_line0);
-    gpiod_line_release(latch_line1);
+    for (int hub = 0; hub < config.number_of_hubs; hub++) {
+        gpiod_line_release(latch_lines[hub]);
+    }
     gpiod_line_release(speaker_line);
     gpiod_chip_close(chip);
+
+    if (button_event_fd >= 0) {
+        close(button_event_fd);
+        button_event_fd = -1;
+    }
+}
+
+
+// Returns an eventfd that becomes readable whenever a button press is ready
+// to be collected with get_button_state0/1. The caller drains it.
+int gpio_get_event_fd(void) {
+    return button_event_fd;
 }
 
 // Returns and clears the current state of button 0 (one-shot)
@@ -461,32 +514,52 @@ void gpio_init(SharedDataStruct* shared_data_p) {
     data_line = gpiod_chip_get_line(chip, GPIO_DATA);
     if (!data_line)    { fprintf(stderr, "ERROR: Failed to get data GPIO line\n");     exit(1); }
 
-    latch_line0 = gpiod_chip_get_line(chip, GPIO_LATCH0);
-    if (!latch_line0)  { fprintf(stderr, "ERROR: Failed to get latch 0 GPIO line\n"); exit(1); }
+    latch_lines = calloc(config.number_of_hubs, sizeof(struct gpiod_line*));
+    if (!latch_lines)  { fprintf(stderr, "ERROR: Out of memory for latch lines\n"); exit(1); }
 
-    latch_line1 = gpiod_chip_get_line(chip, GPIO_LATCH1);
-    if (!latch_line1)  { fprintf(stderr, "ERROR: Failed to get latch 1 GPIO line\n"); exit(1); }
+    for (int hub = 0; hub < config.number_of_hubs; hub++) {
+        latch_lines[hub] = gpiod_chip_get_line(chip, config.hub[hub].latch_gpio);
+        if (!latch_lines[hub]) { fprintf(stderr, "ERROR: Failed to get latch GPIO line for hub %d\n", hub); exit(1); }
+    }
 
     speaker_line = gpiod_chip_get_line(chip, GPIO_SPEAKER);
     if (!speaker_line) { fprintf(stderr, "ERROR: Failed to get speaker GPIO line\n"); exit(1); }
 
-    // Configure buttons as inputs (hardware pull-ups fitted)
-    if (gpiod_line_request_input(button_line0, CONSUMER) < 0) {
-        fprintf(stderr, "ERROR: Failed to set button line 0 as input\n"); exit(1);
+    // Configure buttons as edge-event inputs (hardware pull-ups fitted)
+    if (gpiod_line_request_both_edges_events(button_line0, CONSUMER) < 0) {
+        fprintf(stderr, "ERROR: Failed to request button line 0 events\n"); exit(1);
     }
-    if (gpiod_line_request_input(button_line1, CONSUMER) < 0) {
-        fprintf(stderr, "ERROR: Failed to set button line 1 as input\n"); exit(1);
+    if (gpiod_line_request_both_edges_events(button_line1, CONSUMER) < 0) {
+        fprintf(stderr, "ERROR: Failed to request button line 1 events\n"); exit(1);
+    }
+
+    button_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (button_event_fd < 0) {
+        perror("Failed to create button eventfd");
+        exit(1);
     }
 
     // Configure outputs for 74HC595 LED drivers
     if (gpiod_line_request_output(clock_line,   CONSUMER, 0) < 0) { fprintf(stderr, "ERROR: Failed to set clock line as output\n");    exit(1); }
     if (gpiod_line_request_output(data_line,    CONSUMER, 0) < 0) { fprintf(stderr, "ERROR: Failed to set data line as output\n");     exit(1); }
-    if (gpiod_line_request_output(latch_line0,  CONSUMER, 0) < 0) { fprintf(stderr, "ERROR: Failed to set latch line 0 as output\n"); exit(1); }
-    if (gpiod_line_request_output(latch_line1,  CONSUMER, 0) < 0) { fprintf(stderr, "ERROR: Failed to set latch line 1 as output\n"); exit(1); }
+    for (int hub = 0; hub < config.number_of_hubs; hub++) {
+        if (gpiod_line_request_output(latch_lines[hub], CONSUMER, 0) < 0) {
+            fprintf(stderr, "ERROR: Failed to set latch line for hub %d as output\n", hub); exit(1);
+        }
+    }
     if (gpiod_line_request_output(speaker_line, CONSUMER, 0) < 0) { fprintf(stderr, "ERROR: Failed to set speaker line as output\n"); exit(1); }
 
+    // LED buffers, one chain of led_bits per hub
+    bit_count = 0;
+    for (int hub = 0; hub < config.number_of_hubs; hub++) {
+        hub_bit_offset[hub] = bit_count;
+        bit_count += config.hub[hub].led_bits;
+    }
+    bits = calloc(bit_count, 1);
+    prev_bits = calloc(bit_count, 1);
+    if (!bits || !prev_bits) { fprintf(stderr, "ERROR: Out of memory for LED buffers\n"); exit(1); }
+
     // Start the GPIO thread
-    memset(bits, 0, sizeof(bits));
     if (pthread_create(&gpio_thread, NULL, gpio_thread_function, shared_data_p) != 0) {
         perror("Failed to create GPIO thread");
         exit(1);
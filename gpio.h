@@ -5,6 +5,7 @@
 #define CONSUMER "usb_copier"
 
 #define GPIO_DELAY 1
+#define GPIO_LED_INTERVAL_MS 50
 #define SHORT_PRESS_TIME 150
 #define LONG_PRESS_TIME 1500
 
@@ -12,6 +13,7 @@
 void gpio_init(SharedDataStruct* shared_data_p); 
 void gpio_cleanup(void);
 void* gpio_thread_function(void* arg);
+int gpio_get_event_fd(void);
 
 ButtonStateEnum get_button_state0(void);
 ButtonStateEnum get_button_state1(void);
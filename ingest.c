@@ -0,0 +1,1094 @@
+#include "globals.h"
+#include "utilities.h"
+#include "shm.h"
+#include "audio.h"
+#include "queue.h"
+#include "ingest.h"
+#include <sys/statvfs.h>
+#include <ftw.h>
+
+/*
+ * Master ingest
+ * -------------
+ * Copies the master stick to the ramdrive, then has its MP3 files
+ * processed and checksummed. A manifest on the ramdrive records, for each
+ * file there,
+ *
+ *   - the size and modification time of the master's copy,
+ *   - a quick hash of its first and last QUICK_HASH_BYTES,
+ *   - its size on the ramdrive, after processing, and its CRC
+ *
+ * so loading a master again, or an updated one, only copies, processes
+ * and checksums the files that are new or have changed. Files no longer on
+ * the master are deleted, and crc.txt and total_size are rebuilt from the
+ * manifest rather than by reading every file again.
+ *
+ * The three stages overlap rather than running one after another. The
+ * master is walked first to decide what to copy; then a few copy workers
+ * take the files, so several reads are in flight on the stick at once.
+ * The MP3 files are copied first, largest first, and each is queued for
+ * the audio workers (audio.c) as it lands, so the longest recordings are
+ * started first and the last to finish is a short one. As each is
+ * processed it is queued for a checksum thread. Bounded queues
+ * (queue.c) join the stages, so the USB reads, the transcoding and the
+ * CRCs all proceed at once, and the LCD shows the progress of the copy and
+ * the transcoding together.
+ *
+ * The clients needn't wait for all of it. Before copying, FILE_LIST is
+ * written with every file in the order the clients copy them, and the
+ * file_state array in shared memory follows each one through INGESTED,
+ * PROCESSED and CHECKSUMMED. A client copies the files in list order and
+ * only waits when it reaches one that isn't CHECKSUMMED yet, so the sticks
+ * can be started while the last recordings are still being processed.
+ * master_ready is set once crc.txt is written, which verify waits for.
+ *
+ * The manifest is deleted before the ramdrive is touched and written again
+ * once the CRCs are done, so after a crash or a change to the processing
+ * settings the next load starts from an empty ramdrive, as it always did.
+ * A file whose processing failed goes to the sticks as it is, but is left
+ * out of the manifest so the next load tries it again.
+ *
+ * A master too big for the ramdrive, with STAGING_HEADROOM_PERCENT to
+ * spare, goes to [staging] dir on persistent storage instead, with its own
+ * manifest, and the ramdrive is emptied. shared_data_p->master_dir tells
+ * the clients which it is. Staged files are dropped from the page cache
+ * once checksummed, so staging a big master doesn't fill the memory; while
+ * the sticks copy, stage.c keeps the part they are reading cached.
+ */
+
+#define MANIFEST_VERSION 1
+#define QUICK_HASH_BYTES (64 * 1024)    // read from each end of a file
+#define INGEST_QUEUE_LENGTH 64
+#define STAGING_HEADROOM_PERCENT 5     // room for files growing when transcoded, and the temporary files
+#define INGEST_PROGRESS_MS 500          // how often progress_cb is called while copying
+#define INGEST_RATE_MIN_MS 1000         // copying time needed before the read speed is reported
+
+typedef struct {
+    char* path;                 // relative to master_dir
+    off_t size;                 // on the master
+    time_t mtime;               // on the master
+    uint64_t quick_hash;        // of the master's copy
+    off_t ram_size;             // on the ramdrive, once processed
+    uint32_t crc;               // of the processed file, if it's an MP3
+    bool seen;                  // found on the master this time
+    bool changed;               // copied this time, so to be processed and checksummed
+    bool failed;                // processing failed, so it is left out of the manifest and retried
+    int slot;                   // line in FILE_LIST, and index in file_state if below MAX_MASTER_FILES
+} ManifestEntryStruct;
+
+// A file to copy from the master
+typedef struct {
+    char* src_path;
+    char* rel_path;
+    char* dest_path;
+    const char* dest_name;      // the leaf of dest_path
+    off_t size;
+    time_t mtime;
+    int entry;                  // index in entries
+    bool mp3;
+} IngestFileStruct;
+
+static SharedDataStruct* shared_data_p = NULL;
+static char staging_dir[STRING_LEN] = "";
+static char master_dir[PATH_LEN] = RAMDIR_PATH;    // where this master goes: RAMDIR_PATH or under staging_dir ...
+static char manifest_file[PATH_LEN] = MANIFEST_FILE;     // ... and its manifest
+static ManifestEntryStruct* entries = NULL;
+static int entry_count = 0;
+static int entry_capacity = 0;
+static int loaded_count = 0;        // entries read from the manifest, sorted by path
+static atomic_bool halt = false;
+
+static IngestFileStruct* files = NULL;
+static int file_count = 0;
+static int file_capacity = 0;
+static int mp3_count = 0;
+static uint64_t copy_bytes = 0;             // to copy from the master ...
+static _Atomic off_t copy_done = 0;         // ... and copied so far
+static uint64_t copy_start_ms = 0;
+static _Atomic uint64_t copy_end_ms = 0;    // when the last copy worker finished
+static int copy_workers = INGEST_DEFAULT_WORKERS;
+static atomic_int next_file;                // next file for a copy worker to take ...
+static atomic_int current_file;             // ... and the last one taken, -1 for none
+static atomic_int copy_running;             // copy workers still going
+static atomic_bool copy_failed;
+static BoundedQueueStruct crc_queue;        // processed files waiting for their CRC
+static pthread_t crc_thread;
+static atomic_int checksummed;
+static atomic_int process_failures;         // MP3 files the audio workers couldn't process
+static bool pipeline_running = false;
+
+
+static bool is_mp3(const char* filename)
+{
+    size_t len = strlen(filename);
+    return len >= 4 && strcasecmp(filename + len - 4, ".mp3") == 0;
+}
+
+
+// The manifest's first line. A manifest written with other settings is ignored.
+static void manifest_header(char* header, size_t len)
+{
+    snprintf(header, len, "# usb_copier manifest %d %s\n", MANIFEST_VERSION, audio_settings_text());
+}
+
+
+// FNV-1a over the size and both ends of a file
+static bool quick_hash(const char* path, uint64_t* hash_p)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat statbuf;
+    uint8_t* buffer = malloc(QUICK_HASH_BYTES);
+    if (!buffer || fstat(fd, &statbuf) == -1) {
+        free(buffer);
+        close(fd);
+        return false;
+    }
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < 8; i++) {
+        hash = (hash ^ (((uint64_t)statbuf.st_size >> (i * 8)) & 0xFF)) * 0x100000001B3ULL;
+    }
+
+    off_t tail = (statbuf.st_size > 2 * QUICK_HASH_BYTES) ? statbuf.st_size - QUICK_HASH_BYTES : QUICK_HASH_BYTES;
+    off_t offsets[2] = { 0, tail };
+    bool ok = true;
+    for (int part = 0; part < 2 && ok && offsets[part] < statbuf.st_size; part++) {
+        ssize_t n = pread(fd, buffer, QUICK_HASH_BYTES, offsets[part]);
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            hash = (hash ^ buffer[i]) * 0x100000001B3ULL;
+        }
+    }
+
+    free(buffer);
+    close(fd);
+    *hash_p = hash;
+    return ok;
+}
+
+
+//------------------------------
+// Manifest
+//------------------------------
+
+static int compare_entries(const void* a, const void* b)
+{
+    return strcmp(((const ManifestEntryStruct*)a)->path, ((const ManifestEntryStruct*)b)->path);
+}
+
+
+// Looks up a path among the entries loaded from the manifest. Returns its index, or -1.
+static int find_entry(const char* path)
+{
+    ManifestEntryStruct key = { .path = (char*)path };
+    ManifestEntryStruct* entry_p = bsearch(&key, entries, loaded_count, sizeof(ManifestEntryStruct), compare_entries);
+    return entry_p ? (int)(entry_p - entries) : -1;
+}
+
+
+// Returns the index of a new entry for path, or -1 if out of memory
+static int add_entry(const char* path)
+{
+    if (entry_count == entry_capacity) {
+        int capacity = entry_capacity ? entry_capacity * 2 : 256;
+        ManifestEntryStruct* grown = realloc(entries, capacity * sizeof(ManifestEntryStruct));
+        if (!grown) return -1;
+        entries = grown;
+        entry_capacity = capacity;
+    }
+    ManifestEntryStruct* entry_p = &entries[entry_count];
+    memset(entry_p, 0, sizeof(ManifestEntryStruct));
+    entry_p->slot = -1;
+    entry_p->path = strdup(path);
+    if (!entry_p->path) return -1;
+    return entry_count++;
+}
+
+
+static void free_entries(void)
+{
+    for (int i = 0; i < entry_count; i++) free(entries[i].path);
+    free(entries);
+    entries = NULL;
+    entry_count = entry_capacity = loaded_count = 0;
+}
+
+
+// Reads the manifest left by the last load. Returns false if there isn't
+// one that can be trusted.
+static bool load_manifest(void)
+{
+    FILE* file = fopen(manifest_file, "r");
+    if (!file) return false;
+
+    char expected[STRING_LEN * 2];
+    char line[PATH_LEN + 128];
+    manifest_header(expected, sizeof(expected));
+    if (!fgets(line, sizeof(line), file) || strcmp(line, expected) != 0) {
+        printf("Master manifest is from other settings, reloading everything\n");
+        fclose(file);
+        return false;
+    }
+
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        long long size, mtime, ram_size;
+        unsigned long long hash;
+        unsigned int crc;
+        int path_start = 0;
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') {
+            ok = false;
+            break;
+        }
+        line[len - 1] = '\0';
+        if (sscanf(line, "%lld\t%lld\t%llx\t%lld\t%x\t%n", &size, &mtime, &hash, &ram_size, &crc, &path_start) != 5 ||
+            path_start == 0 || line[path_start] == '\0') {
+            ok = false;
+            break;
+        }
+
+        int i = add_entry(line + path_start);
+        if (i < 0) {
+            ok = false;
+            break;
+        }
+        entries[i].size = size;
+        entries[i].mtime = mtime;
+        entries[i].quick_hash = hash;
+        entries[i].ram_size = ram_size;
+        entries[i].crc = crc;
+    }
+    fclose(file);
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: Master manifest %s is damaged, reloading everything\n", manifest_file);
+        free_entries();
+        return false;
+    }
+    if (entry_count > 0) qsort(entries, entry_count, sizeof(ManifestEntryStruct), compare_entries);
+    loaded_count = entry_count;
+    return true;
+}
+
+
+// Writes crc.txt, under a temporary name first
+static int write_crc_file(void)
+{
+    char temp_file[PATH_LEN];
+    snprintf(temp_file, sizeof(temp_file), "%s.tmp", CRC_FILE);
+    FILE* crc_file = fopen(temp_file, "w");
+    if (!crc_file) {
+        fprintf(stderr, "Error: Cannot create CRC file %s\n", CRC_FILE);
+        return -1;
+    }
+    for (int i = 0; i < entry_count; i++) {
+        if (is_mp3(entries[i].path)) fprintf(crc_file, "%s\t%08x\n", entries[i].path, entries[i].crc);
+    }
+    if (fclose(crc_file) != 0 || rename(temp_file, CRC_FILE) != 0) {
+        fprintf(stderr, "ERROR: Writing %s: %s\n", CRC_FILE, strerror(errno));
+        unlink(temp_file);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Writes the manifest, under a temporary name first
+static int save_manifest(void)
+{
+    char temp_file[PATH_LEN + 8];
+    char header[STRING_LEN * 2];
+    int ret = 0;
+
+    snprintf(temp_file, sizeof(temp_file), "%s.tmp", manifest_file);
+    FILE* file = fopen(temp_file, "w");
+    if (!file) {
+        fprintf(stderr, "ERROR: Cannot create %s: %s\n", temp_file, strerror(errno));
+        return -1;
+    }
+    manifest_header(header, sizeof(header));
+    fputs(header, file);
+    for (int i = 0; i < entry_count; i++) {
+        // A name with a newline can't be stored, so that file is copied every time
+        if (strchr(entries[i].path, '\n')) continue;
+        if (entries[i].failed) continue;
+        fprintf(file, "%lld\t%lld\t%016llx\t%lld\t%08x\t%s\n", (long long)entries[i].size, (long long)entries[i].mtime,
+                (unsigned long long)entries[i].quick_hash, (long long)entries[i].ram_size, entries[i].crc,
+                entries[i].path);
+    }
+    if (fclose(file) != 0 || rename(temp_file, manifest_file) != 0) {
+        fprintf(stderr, "ERROR: Writing %s: %s\n", manifest_file, strerror(errno));
+        unlink(temp_file);
+        ret = -1;
+    }
+    return ret;
+}
+
+
+
+
+//------------------------------
+// Copy order
+//------------------------------
+
+// Compares one name in each path, up to the next '/', as strcmp would the names
+static int compare_component(const char* a, size_t len_a, const char* b, size_t len_b)
+{
+    int diff = memcmp(a, b, (len_a < len_b) ? len_a : len_b);
+    if (diff != 0) return diff;
+    return (len_a > len_b) - (len_a < len_b);
+}
+
+
+// copy_directory's order, which the clients used to copy in: within each
+// directory, the files by name, then the subdirectories by name
+static int compare_paths(const char* path_a, const char* path_b)
+{
+    while (true) {
+        const char* slash_a = strchr(path_a, '/');
+        const char* slash_b = strchr(path_b, '/');
+        if (!slash_a || !slash_b) {
+            if (slash_a || slash_b) return slash_a ? 1 : -1;    // files before subdirectories
+            return strcmp(path_a, path_b);
+        }
+        int diff = compare_component(path_a, slash_a - path_a, path_b, slash_b - path_b);
+        if (diff != 0) return diff;
+        path_a = slash_a + 1;
+        path_b = slash_b + 1;
+    }
+}
+
+
+static int compare_copy_order(const void* a, const void* b)
+{
+    return compare_paths(entries[*(const int*)a].path, entries[*(const int*)b].path);
+}
+
+
+static void set_file_state(const ManifestEntryStruct* entry_p, FileStateEnum state)
+{
+    if (entry_p->slot >= 0 && entry_p->slot < MAX_MASTER_FILES) {
+        atomic_store(&shared_data_p->file_state[entry_p->slot], state);
+    }
+}
+
+
+// Writes FILE_LIST in copy order and publishes each file's state, so the
+// clients can start while later files are still being processed. Returns
+// 0, or -1 on failure.
+static int write_file_list(void)
+{
+    shared_data_p->master_files = 0;
+    int* order = malloc((entry_count ? entry_count : 1) * sizeof(int));
+    if (!order) return -1;
+    for (int i = 0; i < entry_count; i++) order[i] = i;
+    if (entry_count > 0) qsort(order, entry_count, sizeof(int), compare_copy_order);
+
+    char temp_file[PATH_LEN];
+    snprintf(temp_file, sizeof(temp_file), "%s.tmp", FILE_LIST);
+    FILE* file = fopen(temp_file, "w");
+    if (!file) {
+        fprintf(stderr, "ERROR: Cannot create %s: %s\n", temp_file, strerror(errno));
+        free(order);
+        return -1;
+    }
+
+    int slot = 0;
+    for (int i = 0; i < entry_count; i++) {
+        ManifestEntryStruct* entry_p = &entries[order[i]];
+        // A name with a newline can't be listed, so isn't copied to the sticks
+        entry_p->slot = strchr(entry_p->path, '\n') ? -1 : slot++;
+        if (entry_p->slot < 0) continue;
+        fprintf(file, "%s\n", entry_p->path);
+        set_file_state(entry_p, entry_p->changed ? FILE_PENDING : FILE_CHECKSUMMED);
+    }
+    free(order);
+
+    if (fclose(file) != 0 || rename(temp_file, FILE_LIST) != 0) {
+        fprintf(stderr, "ERROR: Writing %s: %s\n", FILE_LIST, strerror(errno));
+        unlink(temp_file);
+        return -1;
+    }
+    if (slot > MAX_MASTER_FILES) {
+        printf("WARNING: %d files on the master; after the first %d the clients wait for them all\n", slot,
+               MAX_MASTER_FILES);
+    }
+    shared_data_p->master_files = slot;
+    return 0;
+}
+
+
+//------------------------------
+// Planning
+//------------------------------
+
+// Returns the index of a new file to copy, or -1 if out of memory
+static int add_file(const char* src_path, const char* rel_path, const struct stat* src_p)
+{
+    if (file_count == file_capacity) {
+        int capacity = file_capacity ? file_capacity * 2 : 256;
+        IngestFileStruct* grown = realloc(files, capacity * sizeof(IngestFileStruct));
+        if (!grown) return -1;
+        files = grown;
+        file_capacity = capacity;
+    }
+
+    IngestFileStruct* file_p = &files[file_count];
+    size_t len = strlen(master_dir) + strlen(rel_path) + 2;
+    file_p->src_path = strdup(src_path);
+    file_p->rel_path = strdup(rel_path);
+    file_p->dest_path = malloc(len);
+    if (!file_p->src_path || !file_p->rel_path || !file_p->dest_path) {
+        free(file_p->src_path);
+        free(file_p->rel_path);
+        free(file_p->dest_path);
+        return -1;
+    }
+    snprintf(file_p->dest_path, len, "%s/%s", master_dir, rel_path);
+    file_p->dest_name = strrchr(file_p->dest_path, '/') + 1;
+    file_p->size = src_p->st_size;
+    file_p->mtime = src_p->st_mtime;
+    file_p->entry = -1;
+    file_p->mp3 = is_mp3(rel_path);
+    return file_count++;
+}
+
+
+static void free_files(void)
+{
+    for (int i = 0; i < file_count; i++) {
+        free(files[i].src_path);
+        free(files[i].rel_path);
+        free(files[i].dest_path);
+    }
+    free(files);
+    files = NULL;
+    file_count = file_capacity = 0;
+}
+
+
+// The MP3 files largest first, so the audio workers get the longest jobs
+// first, then everything else in FILE_LIST order
+static int compare_files(const void* a, const void* b)
+{
+    const IngestFileStruct* file_a = a;
+    const IngestFileStruct* file_b = b;
+    if (file_a->mp3 != file_b->mp3) return file_a->mp3 ? -1 : 1;
+    if (file_a->mp3 && (file_a->size != file_b->size)) return (file_a->size > file_b->size) ? -1 : 1;
+    return compare_paths(file_a->rel_path, file_b->rel_path);
+}
+
+
+// Keeps the ramdrive's copy of a master file if it is up to date, or adds
+// it to the files to copy. Returns 0, or -1 on failure.
+static int plan_file(const char* src_path, const char* rel_path, const struct stat* src_p)
+{
+    char dest_path[PATH_LEN];
+    // plan_directory has checked the length
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-truncation"
+    snprintf(dest_path, sizeof(dest_path), "%s/%s", master_dir, rel_path);
+#pragma GCC diagnostic pop
+
+    int i = find_entry(rel_path);
+    if (i >= 0 && entries[i].seen) {
+        fprintf(stderr, "WARNING: Two files on the master are both copied to %s\n", rel_path);
+        return 0;
+    }
+
+    struct stat ram_stat;
+    uint64_t hash;
+    if (i >= 0 && entries[i].size == src_p->st_size && entries[i].mtime == src_p->st_mtime &&
+        stat(dest_path, &ram_stat) == 0 && ram_stat.st_size == entries[i].ram_size &&
+        quick_hash(src_path, &hash) && hash == entries[i].quick_hash) {
+        entries[i].seen = true;
+        shared_data_p->total_size += entries[i].ram_size;
+        return 0;
+    }
+
+    if ((i < 0 && (i = add_entry(rel_path)) < 0) || add_file(src_path, rel_path, src_p) < 0) {
+        fprintf(stderr, "ERROR: Out of memory listing the master\n");
+        return -1;
+    }
+    entries[i].seen = true;
+    entries[i].changed = true;
+    return 0;
+}
+
+
+// Walks a directory on the master, naming files on the ramdrive as
+// copy_directory does. Returns 0, or -1 on failure.
+static int plan_directory(const char* src_dir, const char* rel_dir)
+{
+    // Skip the windows hidden directory "System Volume Information"
+    if (strstr(src_dir, "System Volume Information")) {
+        printf("Ignoring \"System Volume Information\" hidden directory\n");
+        return 0;
+    }
+
+    char dest_dir[PATH_LEN * 2];
+    snprintf(dest_dir, sizeof(dest_dir), "%s%s%s", master_dir, rel_dir[0] ? "/" : "", rel_dir);
+    if (mkdir(dest_dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: Failed to create destination directory '%s'\n", dest_dir);
+        return -1;
+    }
+
+    DIR* dir = opendir(src_dir);
+    if (!dir) {
+        fprintf(stderr, "ERROR: Failed to open source directory '%s'\n", src_dir);
+        return -1;
+    }
+
+    struct dirent* entry;
+    struct stat statbuf;
+    char src_path[PATH_LEN];
+    char rel_path[PATH_LEN];
+    char dest_name[PATH_LEN];
+    int ret = 0;
+
+    while (ret == 0 && (entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (strlen(src_dir) + strlen(entry->d_name) + 2 > sizeof(src_path) ||
+            strlen(master_dir) + strlen(rel_dir) + strlen(entry->d_name) + 3 > sizeof(rel_path)) {
+            fprintf(stderr, "ERROR: Path too long: %s/%s\n", src_dir, entry->d_name);
+            ret = -1;
+            break;
+        }
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-truncation"
+        snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, entry->d_name);
+#pragma GCC diagnostic pop
+        if (stat(src_path, &statbuf) < 0) {
+            fprintf(stderr, "ERROR: Failed to stat '%s'\n", src_path);
+            ret = -1;
+            break;
+        }
+
+        if (S_ISDIR(statbuf.st_mode)) {
+            snprintf(rel_path, sizeof(rel_path), "%s%s%s", rel_dir, rel_dir[0] ? "/" : "", entry->d_name);
+            ret = plan_directory(src_path, rel_path);
+        }
+        else if (S_ISREG(statbuf.st_mode)) {
+            // As copy_directory: no characters FAT32 rejects, and MP3 names cut to 64
+            snprintf(dest_name, sizeof(dest_name), "%s", entry->d_name);
+            sanitize_filename(dest_name);
+            shorten_filename(dest_name, 64);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-truncation"
+            snprintf(rel_path, sizeof(rel_path), "%s%s%s", rel_dir, rel_dir[0] ? "/" : "", dest_name);
+#pragma GCC diagnostic pop
+            ret = plan_file(src_path, rel_path, &statbuf);
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+
+// Deletes whatever on the ramdrive is no longer on the master, including
+// directories the master no longer has. Returns how many files went.
+static int prune_directory(const char* mount_point, const char* dir_path, const char* rel_dir)
+{
+    DIR* dir = opendir(dir_path);
+    if (!dir) return 0;
+
+    struct dirent* entry;
+    struct stat statbuf;
+    char path[PATH_LEN];
+    char rel_path[PATH_LEN];
+    char master_path[PATH_LEN * 2];
+    int removed = 0;
+
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        snprintf(rel_path, sizeof(rel_path), "%s%s%s", rel_dir, rel_dir[0] ? "/" : "", entry->d_name);
+        if (lstat(path, &statbuf) == -1) continue;
+
+        if (S_ISDIR(statbuf.st_mode)) {
+            removed += prune_directory(mount_point, path, rel_path);
+            // Directory names aren't changed by the copy
+            snprintf(master_path, sizeof(master_path), "%s/%s", mount_point, rel_path);
+            if (stat(master_path, &statbuf) == -1 || !S_ISDIR(statbuf.st_mode)) {
+                rmdir(path);        // fails, as it should, unless empty
+            }
+        }
+        else {
+            int i = find_entry(rel_path);
+            if (i < 0 || !entries[i].seen) {
+                if (unlink(path) == 0) removed++;
+            }
+        }
+    }
+    closedir(dir);
+    return removed;
+}
+
+
+//------------------------------
+// Ramdrive or staging
+//------------------------------
+
+static int empty_errors = 0;
+
+// Runs "sudo rm -rf -- path" without a shell, for files left by a root
+// process in the sticky ramdrive
+static int sudo_remove(const char* path)
+{
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        execlp("sudo", "sudo", "rm", "-rf", "--", path, (char*)NULL);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+
+// nftw callback, visiting the contents of a directory before the directory
+static int remove_entry(const char* path, const struct stat* sb, int type, struct FTW* ftwbuf)
+{
+    (void)sb;
+    if (ftwbuf->level == 0) return 0;     // keep the directory itself
+
+    int ret = (type == FTW_DP) ? rmdir(path) : unlink(path);
+    int err = errno;
+    if (ret != 0 && err != ENOENT) {
+        if ((err != EACCES && err != EPERM) || sudo_remove(path) != 0) {
+            fprintf(stderr, "ERROR: Cannot delete %s: %s\n", path, strerror(err));
+            empty_errors++;
+        }
+    }
+    return 0;
+}
+
+
+// Deletes everything in dir, leaving dir itself
+static int empty_directory(const char* dir)
+{
+    empty_errors = 0;
+    if (nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0 || empty_errors > 0) {
+        fprintf(stderr, "ERROR: empty_directory %s failed\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Size of the file system holding path, or what is free on it
+static uint64_t filesystem_bytes(const char* path, bool free_only)
+{
+    struct statvfs fs;
+    if (statvfs(path, &fs) != 0) return 0;
+    return (uint64_t)(free_only ? fs.f_bavail : fs.f_blocks) * fs.f_frsize;
+}
+
+
+// Puts the master on the ramdrive if it fits, otherwise in the staging
+// directory. Returns false if it fits in neither.
+static bool choose_master_dir(const char* mount_point)
+{
+    uint64_t needed = get_directory_size(mount_point);
+    needed += needed / 100 * STAGING_HEADROOM_PERCENT;
+    uint64_t ramdrive = filesystem_bytes(RAMDIR_PATH, false);
+
+    snprintf(master_dir, sizeof(master_dir), "%s", RAMDIR_PATH);
+    snprintf(manifest_file, sizeof(manifest_file), "%s", MANIFEST_FILE);
+    if (needed <= ramdrive) {
+        snprintf(shared_data_p->master_dir, sizeof(shared_data_p->master_dir), "%s", master_dir);
+        return true;
+    }
+
+    printf("The master needs %.1fMB, the ramdrive has %.1fMB\n", needed / 1024.0 / 1024.0, ramdrive / 1024.0 / 1024.0);
+    if (staging_dir[0] == '\0') {
+        fprintf(stderr, "ERROR: The master is too big for the ramdrive, and [staging] dir is not set\n");
+        return false;
+    }
+
+    snprintf(master_dir, sizeof(master_dir), "%s/%s", staging_dir, STAGING_MASTER);
+    snprintf(manifest_file, sizeof(manifest_file), "%s/%s", staging_dir, STAGING_MANIFEST);
+    if ((mkdir(staging_dir, 0755) < 0 && errno != EEXIST) || (mkdir(master_dir, 0755) < 0 && errno != EEXIST)) {
+        fprintf(stderr, "ERROR: Cannot create staging directory %s: %s\n", master_dir, strerror(errno));
+        return false;
+    }
+
+    // What is staged already may be kept, or replaced
+    uint64_t staging = filesystem_bytes(master_dir, true) + get_directory_size(master_dir);
+    if (needed > staging) {
+        fprintf(stderr, "ERROR: The master needs %.1fMB, %s has %.1fMB\n", needed / 1024.0 / 1024.0, staging_dir,
+                staging / 1024.0 / 1024.0);
+        return false;
+    }
+    printf("Staging the master in %s\n", master_dir);
+    snprintf(shared_data_p->master_dir, sizeof(shared_data_p->master_dir), "%s", master_dir);
+
+    // The ramdrive's copy of an earlier master is no use now
+    unlink(MANIFEST_FILE);
+    empty_directory(RAMDIR_PATH);
+    return true;
+}
+
+
+// Once a staged file is final, frees the memory its pages are using
+static void drop_cached(const char* path)
+{
+    if (strcmp(master_dir, RAMDIR_PATH) == 0) return;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+
+//------------------------------
+// Pipeline
+//------------------------------
+
+// The last stage: checksums each MP3 file once it has been processed
+static void* crc_thread_function(void* arg)
+{
+    IngestFileStruct* file_p;
+    struct stat statbuf;
+    while ((file_p = queue_pop(&crc_queue))) {
+        ManifestEntryStruct* entry_p = &entries[file_p->entry];
+        if (stat(file_p->dest_path, &statbuf) == 0) entry_p->ram_size = statbuf.st_size;
+        entry_p->crc = compute_crc32(file_p->dest_path, NULL);
+        drop_cached(file_p->dest_path);
+        set_file_state(entry_p, FILE_CHECKSUMMED);
+        atomic_fetch_add(&checksummed, 1);
+    }
+    return NULL;
+}
+
+
+// Called by the audio workers as each file is done, successfully or not
+static void file_processed(void* tag, int ret)
+{
+    IngestFileStruct* file_p = tag;
+    if (ret != 0) {
+        entries[file_p->entry].failed = true;
+        atomic_fetch_add(&process_failures, 1);
+    }
+    set_file_state(&entries[file_p->entry], FILE_PROCESSED);
+    queue_push(&crc_queue, tag);
+}
+
+
+static bool start_pipeline(void)
+{
+    atomic_store(&checksummed, 0);
+    atomic_store(&process_failures, 0);
+    initialise_crc_table();
+    if (!queue_init(&crc_queue, INGEST_QUEUE_LENGTH)) return false;
+    if (pthread_create(&crc_thread, NULL, crc_thread_function, NULL) != 0) {
+        perror("pthread_create failed");
+        queue_destroy(&crc_queue);
+        return false;
+    }
+
+    uint64_t mp3_bytes = 0;
+    for (int i = 0; i < mp3_count; i++) mp3_bytes += files[i].size;
+    audio_start(shared_data_p, mp3_count, mp3_bytes, file_processed);
+    pipeline_running = true;
+    return true;
+}
+
+
+// Lets the processing and checksum stages finish what they have been given
+static void stop_pipeline(void)
+{
+    if (!pipeline_running) return;
+    audio_finish();
+    queue_close(&crc_queue);
+    if (pthread_join(crc_thread, NULL) != 0) {
+        perror("pthread_join failed");
+    }
+    queue_destroy(&crc_queue);
+    pipeline_running = false;
+}
+
+
+// Copies one planned file, and feeds it to the audio workers if it is an
+// MP3. Returns 0, or -1 on failure.
+static int copy_one_file(IngestFileStruct* file_p)
+{
+    if (copy_file(file_p->src_path, file_p->dest_path, &halt, &copy_done) < 0) {
+        fprintf(stderr, "ERROR: Failed to copy file: '%s' -> '%s'\n", file_p->src_path, file_p->dest_path);
+        return -1;
+    }
+    if (halt) return 0;
+    shared_data_p->total_size += file_p->size;
+
+    ManifestEntryStruct* entry_p = &entries[file_p->entry];
+    entry_p->size = file_p->size;
+    entry_p->mtime = file_p->mtime;
+    entry_p->ram_size = file_p->size;
+    entry_p->crc = 0;
+    if (!quick_hash(file_p->dest_path, &entry_p->quick_hash)) entry_p->quick_hash = 0;
+
+    if (file_p->mp3) {
+        set_file_state(entry_p, FILE_INGESTED);
+        audio_submit(file_p->dest_path, file_p->size, file_p);
+    }
+    else {
+        drop_cached(file_p->dest_path);
+        set_file_state(entry_p, FILE_CHECKSUMMED);      // nothing more to do
+    }
+    return 0;
+}
+
+
+// Takes files in copy order until there are none left. A failure stops
+// the other workers too.
+static void* copy_worker_function(void* arg)
+{
+    int i;
+    while (!halt && (i = atomic_fetch_add(&next_file, 1)) < file_count) {
+        atomic_store(&current_file, i);
+        if (copy_one_file(&files[i]) != 0) {
+            copy_failed = true;
+            halt = true;
+        }
+    }
+    if (atomic_fetch_sub(&copy_running, 1) == 1) copy_end_ms = shm_now_ms();
+    return NULL;
+}
+
+
+// Copies the planned files with copy_workers threads, calling progress_cb
+// with the latest file every INGEST_PROGRESS_MS. Returns 0, or -1 on failure.
+static int copy_files(copy_progress_cb progress_cb)
+{
+    pthread_t threads[INGEST_MAX_WORKERS];
+    int workers = (copy_workers < file_count) ? copy_workers : file_count;
+    int started = 0;
+
+    atomic_store(&next_file, 0);
+    atomic_store(&current_file, -1);
+    copy_failed = false;
+    copy_start_ms = shm_now_ms();
+    copy_end_ms = 0;
+    if (workers == 0) return 0;
+
+    atomic_store(&copy_running, workers);
+    for (; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, copy_worker_function, NULL) != 0) {
+            perror("pthread_create failed");
+            atomic_fetch_sub(&copy_running, workers - started);
+            break;
+        }
+    }
+
+    // With no workers, copy here
+    if (started == 0) {
+        atomic_store(&copy_running, 1);
+        copy_worker_function(NULL);
+    }
+    else {
+        printf("Copying %d files with %d workers\n", file_count, started);
+    }
+
+    while (atomic_load(&copy_running) > 0) {
+        int i = atomic_load(&current_file);
+        if (progress_cb && i >= 0) progress_cb(files[i].dest_name);
+        usleep(INGEST_PROGRESS_MS * 1000);
+    }
+    for (int i = 0; i < started; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            perror("pthread_join failed");
+        }
+    }
+
+    if (copy_end_ms == 0) copy_end_ms = shm_now_ms();
+    double seconds = (copy_end_ms - copy_start_ms) / 1000.0;
+    if (!copy_failed && seconds > 0) {
+        printf("Copied %.1fMB from the master in %.1fs, %.1fMB/s\n", copy_done / 1024.0 / 1024.0, seconds,
+               copy_done / 1024.0 / 1024.0 / seconds);
+    }
+    return copy_failed ? -1 : 0;
+}
+
+
+//------------------------------
+// Public
+//------------------------------
+
+// Once every file is final: crc.txt, the manifest and the new total size
+static void finish(void)
+{
+    off_t total = 0;
+    for (int i = 0; i < entry_count; i++) {
+        entries[i].changed = false;
+        total += entries[i].ram_size;
+    }
+    shared_data_p->total_size = total;
+    free_files();
+
+    write_crc_file();
+    save_manifest();
+    shared_data_p->master_ready = true;
+    printf("Master ready: %d files, %.1fMB\n", entry_count, total / 1024.0 / 1024.0);
+    if (process_failures > 0) {
+        fprintf(stderr, "ERROR: %d MP3 files could not be processed, and will be copied as they are\n",
+                (int)process_failures);
+    }
+}
+
+
+// After a failure the master never becomes ready, and master_failed tells
+// the clients to give up. Neither crc.txt nor the manifest is written, so
+// the next load starts again from scratch.
+static int abandon(void)
+{
+    stop_pipeline();
+    free_files();
+    unlink(CRC_FILE);
+    shared_data_p->master_failed = true;
+    return 1;
+}
+
+
+// Sets the directory on persistent storage for masters too big for the
+// ramdrive, "" for none, and the number of files read from the master at once
+void ingest_init(const char* dir, int workers)
+{
+    snprintf(staging_dir, sizeof(staging_dir), "%s", dir ? dir : "");
+    copy_workers = (workers < 1) ? 1 : (workers > INGEST_MAX_WORKERS) ? INGEST_MAX_WORKERS : workers;
+}
+
+
+// Brings the ramdrive up to date with the master mounted at mount_point,
+// calling progress_cb with the name of each file it copies. Processing and
+// checksumming run alongside and carry on after it returns, until
+// ingest_poll sees them finish. Returns 0, or 1 on failure.
+int ingest_master(SharedDataStruct* sdp, const char* mount_point, copy_progress_cb progress_cb)
+{
+    shared_data_p = sdp;
+    free_entries();
+    free_files();
+    halt = false;
+    copy_bytes = 0;
+    copy_done = 0;
+    mp3_count = 0;
+    shared_data_p->master_ready = false;
+    shared_data_p->master_failed = false;
+    shared_data_p->master_files = 0;
+
+    if (!choose_master_dir(mount_point)) {
+        return abandon();
+    }
+    if (!load_manifest() && empty_directory(master_dir) != 0) {
+        return abandon();
+    }
+    // Until the new one is written, the ramdrive can't be trusted
+    unlink(manifest_file);
+
+    shared_data_p->total_size = 0;
+    if (plan_directory(mount_point, "") != 0) {
+        fprintf(stderr, "ERROR: reading the master failed\n");
+        return abandon();
+    }
+
+    // New entries were added unsorted after the loaded ones
+    if (entry_count > 0) qsort(entries, entry_count, sizeof(ManifestEntryStruct), compare_entries);
+    loaded_count = entry_count;
+    int removed = prune_directory(mount_point, master_dir, "");
+
+    // Forget what has gone
+    int kept = 0;
+    for (int i = 0; i < entry_count; i++) {
+        if (!entries[i].seen) {
+            free(entries[i].path);
+            continue;
+        }
+        entries[kept++] = entries[i];
+    }
+    entry_count = loaded_count = kept;
+
+    // The entries don't move from here on, so the stages can update them in place.
+    // The MP3 files sort first, which start_pipeline relies on.
+    if (file_count > 0) qsort(files, file_count, sizeof(IngestFileStruct), compare_files);
+    for (int i = 0; i < file_count; i++) {
+        files[i].entry = find_entry(files[i].rel_path);
+        copy_bytes += files[i].size;
+        if (files[i].mp3) mp3_count++;
+    }
+    printf("Master: %d files, %d new or changed (%.1fMB), %d removed\n", entry_count, file_count,
+           copy_bytes / 1024.0 / 1024.0, removed);
+
+    if (write_file_list() != 0 || !start_pipeline()) {
+        fprintf(stderr, "ERROR: Cannot start the ingest pipeline\n");
+        return abandon();
+    }
+    if (copy_files(progress_cb) != 0) {
+        return abandon();
+    }
+    return 0;
+}
+
+
+// Stops the processing and checksumming that ingest_master left running,
+// for when the load fails after it returned
+void ingest_abandon(void)
+{
+    if (shared_data_p) abandon();
+}
+
+
+// The number of MP3 files of this master that could not be processed
+int ingest_failures(void)
+{
+    return atomic_load(&process_failures);
+}
+
+
+// Overall progress of the ingest, 0 to 100: bytes copied from the master
+// and bytes transcoded, against the total of each
+int ingest_progress(void)
+{
+    uint64_t total = copy_bytes + shared_data_p->ffmpeg_bytes;
+    uint64_t done = copy_done + shared_data_p->ffmpeg_bytes_done;
+    if (total == 0) return 100;
+    return (done >= total) ? 100 : (int)(done * 100 / total);
+}
+
+
+// Read speed from the master so far, in MB/s, and the seconds needed to
+// read the rest. Returns false until there is enough to go on.
+bool ingest_copy_rate(double* mb_per_s_p, int* eta_seconds_p)
+{
+    uint64_t elapsed_ms = shm_now_ms() - copy_start_ms;
+    off_t done = copy_done;
+    if (elapsed_ms < INGEST_RATE_MIN_MS || done <= 0) return false;
+
+    double bytes_per_s = done * 1000.0 / elapsed_ms;
+    *mb_per_s_p = bytes_per_s / 1024 / 1024;
+    *eta_seconds_p = (done >= (off_t)copy_bytes) ? 0 : (int)((copy_bytes - done) / bytes_per_s + 0.5);
+    return true;
+}
+
+
+// Called on each pass of the reactor. Once processing and checksumming have
+// caught up with ingest_master, writes crc.txt and the manifest and marks
+// the master ready. Returns true while they are still going.
+bool ingest_poll(void)
+{
+    if (!pipeline_running) return false;
+    if (atomic_load(&checksummed) < mp3_count) return true;
+
+    stop_pipeline();
+    finish();
+    return false;
+}
@@ -0,0 +1,18 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#define MANIFEST_FILE "/var/ramdrive/manifest.txt"
+#define STAGING_MASTER "master"             // in [staging] dir, for a master too big for the ramdrive ...
+#define STAGING_MANIFEST "manifest.txt"     // ... and its manifest
+#define INGEST_DEFAULT_WORKERS 4            // files read from the master at once
+#define INGEST_MAX_WORKERS 16
+
+void ingest_init(const char* dir, int workers);
+int ingest_master(SharedDataStruct* shared_data_p, const char* mount_point, copy_progress_cb progress_cb);
+int ingest_progress(void);
+bool ingest_copy_rate(double* mb_per_s_p, int* eta_seconds_p);
+bool ingest_poll(void);
+void ingest_abandon(void);
+int ingest_failures(void);
+
+#endif // INGEST_H
@@ -2,6 +2,7 @@
 #include "utilities.h"
 #include "gpio.h"
 #include "lcd.h"
+#include "trace.h"
 
 // -----------------------------------------------------------------------------
 // Module state
@@ -111,9 +112,11 @@ static void lcd_write_string_no_lock(const char* str, int line)
 
 void lcd_write_string(const char* str, int line)
 {
+    trace_begin(TRACE_LCD, str);
     pthread_mutex_lock(&lcd_mutex);
     lcd_write_string_no_lock(str, line);
     pthread_mutex_unlock(&lcd_mutex);
+    trace_end(TRACE_LCD, line);
 }
 
 
@@ -0,0 +1,402 @@
+#include "globals.h"
+#include "utilities.h"
+#include "shm.h"
+#include "metrics.h"
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * Metrics endpoint
+ * ----------------
+ * If [metrics] listen is set in copier.ini, a background thread serves the
+ * copier's telemetry in the Prometheus text format, e.g.
+ *
+ *     [metrics]
+ *     listen = 127.0.0.1:9101            ; TCP, or
+ *     listen = unix:/run/usbcopier.sock  ; a Unix socket
+ *
+ * Any HTTP request gets the whole page, so it can be scraped directly or
+ * read with "curl --unix-socket /run/usbcopier.sock http://localhost/".
+ * Channel figures and the ffmpeg queue are read straight from shared
+ * memory. The few that only the server knows (finished jobs, batch times)
+ * are counted here by the functions below.
+ */
+
+#define METRICS_IO_TIMEOUT_S 2      // give up on a scraper that stalls
+#define METRICS_REQUEST_LEN 1024
+
+// Failure reasons, in the order they are counted
+enum { RESULT_SUCCESS, RESULT_ERROR, RESULT_CANCELLED, RESULT_SLOW, RESULT_CRC, NUMBER_OF_RESULTS };
+static const char* result_names[NUMBER_OF_RESULTS] = { "success", "error", "cancelled", "slow", "crc" };
+
+static SharedDataStruct* shared_data_p = NULL;
+static int listen_fd = -1;
+static pthread_t metrics_thread;
+
+static _Atomic uint64_t jobs_total[NUMBER_OF_RESULTS];
+static _Atomic uint64_t batches_total[NUMBER_OF_BUTTONS];
+static atomic_bool batch_running[NUMBER_OF_BUTTONS];
+static atomic_int batch_makespan[NUMBER_OF_BUTTONS];
+
+
+//------------------------------
+// Counters kept by the server
+//------------------------------
+
+// Counts the result of a client that has exited
+void metrics_job_finished(const ChannelInfoStruct* channel_info_p)
+{
+    int result;
+
+    switch (channel_info_p->state) {
+        case SUCCESS:       result = RESULT_SUCCESS; break;
+        case CRC_FAILED:    result = RESULT_CRC; break;
+        default:
+            switch (channel_info_p->fail_reason) {
+                case FAIL_CANCELLED:    result = RESULT_CANCELLED; break;
+                case FAIL_SLOW:         result = RESULT_SLOW; break;
+                default:                result = RESULT_ERROR; break;
+            }
+    }
+    atomic_fetch_add(&jobs_total[result], 1);
+}
+
+
+void metrics_batch_started(int button_number)
+{
+    batch_running[button_number] = true;
+}
+
+
+// Records the time a batch took, unless it was cancelled
+void metrics_batch_finished(int button_number, int seconds, bool completed)
+{
+    batch_running[button_number] = false;
+    if (completed) {
+        batch_makespan[button_number] = seconds;
+        atomic_fetch_add(&batches_total[button_number], 1);
+    }
+}
+
+
+//------------------------------
+// Page generation
+//------------------------------
+
+// Reads the model of the drive in a channel from sysfs, e.g. "SanDisk Ultra"
+static void get_drive_model(const char* device_name, char* model, size_t model_len)
+{
+    char path[PATH_LEN];
+    char vendor[64] = "";
+    char product[64] = "";
+    const char* name = strrchr(device_name, '/');
+    name = name ? name + 1 : device_name;
+
+    model[0] = '\0';
+    if (name[0] == '\0') return;
+
+    snprintf(path, sizeof(path), "/sys/block/%s/device/vendor", name);
+    FILE* file = fopen(path, "r");
+    if (file) {
+        if (!fgets(vendor, sizeof(vendor), file)) vendor[0] = '\0';
+        fclose(file);
+    }
+    snprintf(path, sizeof(path), "/sys/block/%s/device/model", name);
+    file = fopen(path, "r");
+    if (file) {
+        if (!fgets(product, sizeof(product), file)) product[0] = '\0';
+        fclose(file);
+    }
+    trim(vendor);
+    trim(product);
+    snprintf(model, model_len, "%s%s%s", vendor, (vendor[0] && product[0]) ? " " : "", product);
+
+    // Keep the label value valid whatever the drive reports
+    for (char* p = model; *p; p++) {
+        if (*p == '"' || *p == '\\' || !isprint((unsigned char)*p)) *p = '_';
+    }
+}
+
+
+static void write_help(FILE* out, const char* name, const char* type, const char* help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+static void write_page(FILE* out)
+{
+    int channel_count = shared_data_p->channel_count;
+
+    write_help(out, "copier_channel_info", "gauge", "Drive in each channel. Always 1");
+    for (int i = 0; i < channel_count; i++) {
+        ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[i];
+        char name[STRING_LEN];
+        char path[STRING_LEN];
+        char model[STRING_LEN];
+        channel_get_device(channel_info_p, name, path);
+        get_drive_model(name, model, sizeof(model));
+        fprintf(out, "copier_channel_info{channel=\"%d\",hub=\"%d\",port=\"%d\",device=\"%s\",usb_path=\"%s\",model=\"%s\"} 1\n",
+                i, channel_info_p->hub_number, channel_info_p->port_number, name, path, model);
+    }
+
+    write_help(out, "copier_channel_state", "gauge", "Current ChannelStateEnum of each channel");
+    for (int i = 0; i < channel_count; i++) {
+        ChannelStateEnum state = shared_data_p->channel_info[i].state;
+        fprintf(out, "copier_channel_state{channel=\"%d\",state=\"%s\"} %d\n", i, get_state_name(state), state);
+    }
+
+    write_help(out, "copier_channel_bytes_written", "gauge", "Bytes copied to the drive by the current or last job");
+    for (int i = 0; i < channel_count; i++) {
+        fprintf(out, "copier_channel_bytes_written{channel=\"%d\"} %lld\n", i,
+                (long long)shared_data_p->channel_info[i].bytes_copied);
+    }
+
+    write_help(out, "copier_channel_bytes_verified", "gauge", "Bytes read back for verification by the current or last job");
+    for (int i = 0; i < channel_count; i++) {
+        fprintf(out, "copier_channel_bytes_verified{channel=\"%d\"} %lld\n", i,
+                (long long)shared_data_p->channel_info[i].bytes_verified);
+    }
+
+    write_help(out, "copier_channel_media_bytes_written", "gauge", "Bytes the block layer has written to the drive in the current or last job");
+    for (int i = 0; i < channel_count; i++) {
+        fprintf(out, "copier_channel_media_bytes_written{channel=\"%d\"} %llu\n", i,
+                (unsigned long long)shared_data_p->channel_info[i].media_bytes);
+    }
+
+    write_help(out, "copier_channel_write_amplification", "gauge", "Bytes written to the drive per byte of file data since copying started");
+    for (int i = 0; i < channel_count; i++) {
+        fprintf(out, "copier_channel_write_amplification{channel=\"%d\"} %.3f\n", i,
+                channel_write_amplification(&shared_data_p->channel_info[i]));
+    }
+
+    write_help(out, "copier_channel_io_in_flight", "gauge", "Write requests the drive has yet to complete");
+    for (int i = 0; i < channel_count; i++) {
+        fprintf(out, "copier_channel_io_in_flight{channel=\"%d\"} %u\n", i,
+                (unsigned)shared_data_p->channel_info[i].io_in_flight);
+    }
+
+    write_help(out, "copier_channel_throughput_bytes_per_second", "gauge", "Bytes copied or verified in the last second");
+    for (int i = 0; i < channel_count; i++) {
+        const ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[i];
+        uint32_t count = channel_info_p->throughput_count;
+        uint64_t kb = (count > 0) ? channel_info_p->throughput_kb[(count - 1) % THROUGHPUT_SAMPLES] : 0;
+        fprintf(out, "copier_channel_throughput_bytes_per_second{channel=\"%d\"} %llu\n", i, (unsigned long long)(kb * 1024));
+    }
+
+    write_help(out, "copier_channel_progress_ratio", "gauge", "Share of the job's expected time that is done, 0 to 1");
+    for (int i = 0; i < channel_count; i++) {
+        fprintf(out, "copier_channel_progress_ratio{channel=\"%d\"} %.3f\n", i,
+                shared_data_p->channel_info[i].progress_permille / 1000.0);
+    }
+
+    write_help(out, "copier_channel_eta_seconds", "gauge", "Expected time for the job to finish, -1 if not running");
+    for (int i = 0; i < channel_count; i++) {
+        fprintf(out, "copier_channel_eta_seconds{channel=\"%d\"} %d\n", i, (int)shared_data_p->channel_info[i].eta_seconds);
+    }
+
+    write_help(out, "copier_channel_phase_seconds", "gauge", "Time spent in each phase of the current or last job");
+    for (int i = 0; i < channel_count; i++) {
+        for (int phase = 0; phase < NUMBER_OF_PHASES; phase++) {
+            uint64_t ms = channel_phase_ms(&shared_data_p->channel_info[i], phase);
+            if (ms == 0) continue;
+            fprintf(out, "copier_channel_phase_seconds{channel=\"%d\",phase=\"%s\"} %.3f\n",
+                    i, get_phase_name(phase), ms / 1000.0);
+        }
+    }
+
+    write_help(out, "copier_jobs_total", "counter", "Client jobs finished, by result");
+    for (int result = 0; result < NUMBER_OF_RESULTS; result++) {
+        fprintf(out, "copier_jobs_total{result=\"%s\"} %lu\n", result_names[result],
+                (unsigned long)jobs_total[result]);
+    }
+
+    write_help(out, "copier_ffmpeg_queued", "gauge", "MP3 files waiting for ffmpeg");
+    int ffmpeg_running = shared_data_p->ffmpeg_running;
+    fprintf(out, "copier_ffmpeg_queued %d\n", shared_data_p->ffmpeg_files - shared_data_p->ffmpeg_done - ffmpeg_running);
+    write_help(out, "copier_ffmpeg_running", "gauge", "ffmpeg processes running");
+    fprintf(out, "copier_ffmpeg_running %d\n", (int)ffmpeg_running);
+    write_help(out, "copier_ffmpeg_workers", "gauge", "Size of the ffmpeg worker pool");
+    fprintf(out, "copier_ffmpeg_workers %d\n", shared_data_p->ffmpeg_workers);
+    write_help(out, "copier_ffmpeg_bytes", "gauge", "Total size of the MP3 files being optimised");
+    fprintf(out, "copier_ffmpeg_bytes %llu\n", (unsigned long long)shared_data_p->ffmpeg_bytes);
+    write_help(out, "copier_ffmpeg_bytes_done", "gauge", "Bytes of the MP3 files ffmpeg has read");
+    fprintf(out, "copier_ffmpeg_bytes_done %llu\n", (unsigned long long)shared_data_p->ffmpeg_bytes_done);
+
+    write_help(out, "copier_master_bytes", "gauge", "Size of the master files in the ramdrive");
+    fprintf(out, "copier_master_bytes %lld\n", (long long)shared_data_p->total_size);
+    write_help(out, "copier_master_ready", "gauge", "1 once every master file is processed and checksummed");
+    fprintf(out, "copier_master_ready %d\n", shared_data_p->master_ready ? 1 : 0);
+
+    struct statvfs ramdrive;
+    if (statvfs(RAMDIR_PATH, &ramdrive) == 0) {
+        uint64_t size = (uint64_t)ramdrive.f_blocks * ramdrive.f_frsize;
+        uint64_t used = size - (uint64_t)ramdrive.f_bfree * ramdrive.f_frsize;
+        write_help(out, "copier_ramdrive_size_bytes", "gauge", "Size of the ramdrive");
+        fprintf(out, "copier_ramdrive_size_bytes %llu\n", (unsigned long long)size);
+        write_help(out, "copier_ramdrive_used_bytes", "gauge", "Space used in the ramdrive");
+        fprintf(out, "copier_ramdrive_used_bytes %llu\n", (unsigned long long)used);
+    }
+
+    write_help(out, "copier_batch_running", "gauge", "1 while a batch started by this button is copying");
+    for (int button = 0; button < NUMBER_OF_BUTTONS; button++) {
+        fprintf(out, "copier_batch_running{button=\"%d\"} %d\n", button, batch_running[button] ? 1 : 0);
+    }
+    write_help(out, "copier_batch_makespan_seconds", "gauge", "Start to finish time of the last completed batch");
+    for (int button = 0; button < NUMBER_OF_BUTTONS; button++) {
+        fprintf(out, "copier_batch_makespan_seconds{button=\"%d\"} %d\n", button, (int)batch_makespan[button]);
+    }
+    write_help(out, "copier_batches_total", "counter", "Batches completed");
+    for (int button = 0; button < NUMBER_OF_BUTTONS; button++) {
+        fprintf(out, "copier_batches_total{button=\"%d\"} %lu\n", button, (unsigned long)batches_total[button]);
+    }
+}
+
+
+// Reads (and ignores) the request, then sends the page
+static void serve(int fd)
+{
+    struct timeval timeout = { .tv_sec = METRICS_IO_TIMEOUT_S };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[METRICS_REQUEST_LEN];
+    size_t request_len = 0;
+    while (request_len < sizeof(request) - 1) {
+        ssize_t n = read(fd, request + request_len, sizeof(request) - 1 - request_len);
+        if (n <= 0) break;
+        request_len += n;
+        request[request_len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+
+    char* body = NULL;
+    size_t body_len = 0;
+    FILE* out = open_memstream(&body, &body_len);
+    if (!out) {
+        perror("open_memstream");
+        return;
+    }
+    write_page(out);
+    fclose(out);
+
+    char header[STRING_LEN];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+        body_len);
+
+    if ((write(fd, header, header_len) == header_len) && (body_len > 0)) {
+        size_t sent = 0;
+        while (sent < body_len) {
+            ssize_t n = write(fd, body + sent, body_len - sent);
+            if (n <= 0) break;
+            sent += n;
+        }
+    }
+    free(body);
+}
+
+
+static void* metrics_thread_function(void* arg)
+{
+    (void)arg;
+
+    while (true) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EINTR) perror("metrics accept");
+            continue;
+        }
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+
+// Opens a Unix socket ("unix:/path") or a TCP socket ("address:port")
+static int open_listen_socket(const char* listen_address)
+{
+    int fd;
+
+    if (strncmp(listen_address, "unix:", 5) == 0) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        const char* path = listen_address + 5;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "ERROR: metrics socket path '%s' is too long\n", path);
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+        unlink(path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            perror("metrics socket");
+            if (fd != -1) close(fd);
+            return -1;
+        }
+    }
+    else {
+        char host[64];
+        int port;
+        const char* colon = strrchr(listen_address, ':');
+        struct sockaddr_in addr = { .sin_family = AF_INET };
+
+        if (!colon || (size_t)(colon - listen_address) >= sizeof(host) ||
+            sscanf(colon + 1, "%d", &port) != 1 || port <= 0 || port > 65535) {
+            fprintf(stderr, "ERROR: metrics listen address '%s' should be address:port or unix:path\n", listen_address);
+            return -1;
+        }
+        memcpy(host, listen_address, colon - listen_address);
+        host[colon - listen_address] = '\0';
+        if (inet_pton(AF_INET, host[0] ? host : "127.0.0.1", &addr.sin_addr) != 1) {
+            fprintf(stderr, "ERROR: metrics listen address '%s' is not an IPv4 address\n", host);
+            return -1;
+        }
+        addr.sin_port = htons(port);
+
+        int one = 1;
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd != -1) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd == -1 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            perror("metrics socket");
+            if (fd != -1) close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, 4) == -1) {
+        perror("metrics listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// Starts serving metrics if an address is configured. Problems are reported
+// but not fatal, as the copier works without them.
+void metrics_init(SharedDataStruct* sdp, const char* listen_address)
+{
+    shared_data_p = sdp;
+
+    if (!listen_address || listen_address[0] == '\0') return;
+
+    listen_fd = open_listen_socket(listen_address);
+    if (listen_fd < 0) {
+        fprintf(stderr, "ERROR: metrics endpoint disabled\n");
+        return;
+    }
+
+    if (pthread_create(&metrics_thread, NULL, metrics_thread_function, NULL) != 0) {
+        perror("metrics pthread_create");
+        close(listen_fd);
+        listen_fd = -1;
+        return;
+    }
+    pthread_detach(metrics_thread);
+    printf("Serving metrics on %s\n", listen_address);
+}
@@ -0,0 +1,10 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+void metrics_init(SharedDataStruct* shared_data_p, const char* listen_address);
+
+void metrics_job_finished(const ChannelInfoStruct* channel_info_p);
+void metrics_batch_started(int button_number);
+void metrics_batch_finished(int button_number, int seconds, bool completed);
+
+#endif // METRICS_H
@@ -0,0 +1,197 @@
+#include "globals.h"
+#include "utilities.h"
+#include "usb.h"
+#include "portmap.h"
+
+/*
+ * Persistent USB port map
+ * -----------------------
+ * map_usb_port_numbers() learns which USB socket (the topology string from
+ * extract_usb_path(), e.g. "3-1.3") belongs to which channel. The result
+ * is saved to USB_PORT_MAP_FILE so it only has to be repeated when the
+ * hardware changes:
+ *
+ *     # USB port map. Delete this file to force re-mapping.
+ *     version=1
+ *     channels=14
+ *     3-1.1	0
+ *     3-1.2	1
+ *     ...
+ *
+ * On start-up the file is validated against the live sysfs topology. Any
+ * problem (wrong version or channel count, duplicate entries, or a hub port
+ * that no longer exists) rejects the whole file and re-mapping is forced.
+ */
+
+
+// Returns true if the hub port that `device_path` is plugged into exists,
+// whether or not a drive is currently inserted. e.g. for "3-1.3" checks
+//   /sys/bus/usb/devices/3-1/3-1:1.0/3-1-port3
+// and for a root hub port such as "3-1" checks
+//   /sys/bus/usb/devices/usb3/3-0:1.0/usb3-port1
+bool usb_port_exists(const char* device_path)
+{
+    char device[64];      // usb device names are short, e.g. "3-1.3"
+    char hub[64];
+    char port_path[PATH_LEN];
+
+    // The usb device, e.g. 3-1.3, ignoring any ":config.interface" suffix
+    size_t len = strcspn(device_path, ":");
+    if (len == 0 || len >= sizeof(device)) return false;
+    memcpy(device, device_path, len);
+    device[len] = '\0';
+
+    const char* dot = strrchr(device, '.');
+    const char* dash = strchr(device, '-');
+    if (!dash) return false;
+
+    if (dot) {
+        // Port on an external hub
+        size_t hub_len = dot - device;
+        memcpy(hub, device, hub_len);
+        hub[hub_len] = '\0';
+        snprintf(port_path, sizeof(port_path), "/sys/bus/usb/devices/%s/%s:1.0/%s-port%s",
+                 hub, hub, hub, dot + 1);
+    }
+    else {
+        // Port on the root hub of bus N
+        size_t bus_len = dash - device;
+        memcpy(hub, device, bus_len);
+        hub[bus_len] = '\0';
+        snprintf(port_path, sizeof(port_path), "/sys/bus/usb/devices/usb%s/%s-0:1.0/usb%s-port%s",
+                 hub, hub, hub, dash + 1);
+    }
+
+    return access(port_path, F_OK) == 0;
+}
+
+
+// Returns true if `topology` is already assigned to a channel
+static bool is_mapped(const SharedDataStruct* shared_data_p, const char* topology)
+{
+    for (int device_id = 0; device_id < shared_data_p->channel_count; device_id++) {
+        if (strcmp(shared_data_p->channel_info[device_id].device_path, topology) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Loads and validates the saved port map into shared memory.
+// Returns false (leaving every device_path empty) if the map is missing
+// or doesn't match the hardware, in which case the caller must re-map.
+bool portmap_load(SharedDataStruct* shared_data_p)
+{
+    char line[STRING_LEN * 2];
+    char topology[STRING_LEN];
+    int version = -1;
+    int channels = -1;
+    int mapped = 0;
+    bool valid = true;
+
+    FILE* file = fopen(USB_PORT_MAP_FILE, "r");
+    if (!file) {
+        printf("No USB port map found (%s). Mapping required\n", USB_PORT_MAP_FILE);
+        return false;
+    }
+
+    for (int device_id = 0; device_id < shared_data_p->channel_count; device_id++) {
+        shared_data_p->channel_info[device_id].device_path[0] = '\0';
+    }
+
+    while (valid && fgets(line, sizeof(line), file)) {
+        trim(line);
+        if (line[0] == '\0' || line[0] == '#') continue;
+
+        if (sscanf(line, "version=%d", &version) == 1) continue;
+        if (sscanf(line, "channels=%d", &channels) == 1) continue;
+
+        int device_id;
+        if (sscanf(line, "%255s %d", topology, &device_id) != 2) {
+            fprintf(stderr, "ERROR: USB port map: bad line '%s'\n", line);
+            valid = false;
+        }
+        else if (version != PORTMAP_VERSION || channels != shared_data_p->channel_count) {
+            fprintf(stderr, "ERROR: USB port map: version %d with %d channels, expected version %d with %d\n",
+                    version, channels, PORTMAP_VERSION, shared_data_p->channel_count);
+            valid = false;
+        }
+        else if (device_id < 0 || device_id >= shared_data_p->channel_count) {
+            fprintf(stderr, "ERROR: USB port map: channel %d out of range\n", device_id);
+            valid = false;
+        }
+        else if (shared_data_p->channel_info[device_id].device_path[0] != '\0') {
+            fprintf(stderr, "ERROR: USB port map: channel %d mapped twice\n", device_id);
+            valid = false;
+        }
+        else if (is_mapped(shared_data_p, topology)) {
+            fprintf(stderr, "ERROR: USB port map: port %s mapped twice\n", topology);
+            valid = false;
+        }
+        else if (!usb_port_exists(topology)) {
+            fprintf(stderr, "ERROR: USB port map: port %s not found in sysfs\n", topology);
+            valid = false;
+        }
+        else {
+            strcpy(shared_data_p->channel_info[device_id].device_path, topology);
+            mapped++;
+        }
+    }
+
+    fclose(file);
+
+    if (valid && mapped == 0) {
+        fprintf(stderr, "ERROR: USB port map is empty\n");
+        valid = false;
+    }
+
+    if (!valid) {
+        for (int device_id = 0; device_id < shared_data_p->channel_count; device_id++) {
+            shared_data_p->channel_info[device_id].device_path[0] = '\0';
+        }
+    }
+
+    usb_rebuild_port_index(shared_data_p);
+
+    printf("USB port map %s: %d of %d channels mapped\n", valid ? "loaded" : "rejected", mapped, shared_data_p->channel_count);
+    return valid;
+}
+
+
+// Saves the port map held in shared memory. The file is written to a
+// temporary name and renamed, so a crash never leaves a half-written map.
+bool portmap_save(const SharedDataStruct* shared_data_p)
+{
+    char temp_file[PATH_LEN];
+    snprintf(temp_file, sizeof(temp_file), "%s.tmp", USB_PORT_MAP_FILE);
+
+    FILE* file = fopen(temp_file, "w");
+    if (!file) {
+        fprintf(stderr, "ERROR: Cannot create USB port map %s: %s\n", temp_file, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "# USB port map. Delete this file to force re-mapping.\n");
+    fprintf(file, "version=%d\n", PORTMAP_VERSION);
+    fprintf(file, "channels=%d\n", shared_data_p->channel_count);
+
+    for (int device_id = 0; device_id < shared_data_p->channel_count; device_id++) {
+        const char* path = shared_data_p->channel_info[device_id].device_path;
+        if (path[0] != '\0') {
+            fprintf(file, "%s\t%d\n", path, device_id);
+        }
+    }
+
+    bool ok = (fflush(file) == 0) && (fsync(fileno(file)) == 0);
+    if (fclose(file) != 0) ok = false;
+
+    if (!ok || rename(temp_file, USB_PORT_MAP_FILE) != 0) {
+        fprintf(stderr, "ERROR: Cannot save USB port map %s: %s\n", USB_PORT_MAP_FILE, strerror(errno));
+        unlink(temp_file);
+        return false;
+    }
+
+    printf("USB port map saved to %s\n", USB_PORT_MAP_FILE);
+    return true;
+}
@@ -0,0 +1,10 @@
+#ifndef PORTMAP_H
+#define PORTMAP_H
+
+#define PORTMAP_VERSION 1
+
+bool portmap_load(SharedDataStruct* shared_data_p);
+bool portmap_save(const SharedDataStruct* shared_data_p);
+bool usb_port_exists(const char* device_path);
+
+#endif // PORTMAP_H
@@ -0,0 +1,51 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static probes (USDT) for perf, bpftrace and SystemTap
+ * -----------------------------------------------------
+ * Each PROBE is a single nop in the code plus a note in the ELF file, so it
+ * costs nothing until a tracer attaches, which it can do to a running
+ * server or client. The makefile defines HAVE_SDT when <sys/sdt.h> (package
+ * systemtap-sdt-dev) is installed; without it the probes compile to nothing.
+ *
+ * List them:     sudo bpftrace -l 'usdt:./client:*'
+ * Use them, e.g. per-stick copy_file latency:
+ *     sudo bpftrace -p <pid> -e '
+ *         usdt:./client:usbcopier:copy_file_entry  { @start[tid] = nsecs; }
+ *         usdt:./client:usbcopier:copy_file_return { @us[arg0] = hist((nsecs - @start[tid]) / 1000); }'
+ *
+ * Probes (arguments in order, device_id is -1 in the server):
+ *     copy_file_entry(device_id, src_path, dest_path)
+ *     copy_file_return(device_id, src_path, bytes_copied, result)
+ *     copy_directory_entry(device_id, src_dir, dest_dir)
+ *     copy_directory_return(device_id, src_dir, total_bytes_copied, result)
+ *     crc_entry(device_id, filename)
+ *     crc_return(device_id, filename, bytes_read, crc)
+ *     command_entry(device_id, command)
+ *     command_return(device_id, command, exit_code)
+ *     verify_entry(device_id, partition_name)
+ *     verify_return(device_id, partition_name, bytes_verified, ok)
+ *     ffmpeg_entry(mp3_file)
+ *     ffmpeg_return(mp3_file, exit_code)
+ *     state_change(device_id, old_state, new_state, bytes_copied)
+ */
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROBE1(name, a)             DTRACE_PROBE1(usbcopier, name, a)
+#define PROBE2(name, a, b)          DTRACE_PROBE2(usbcopier, name, a, b)
+#define PROBE3(name, a, b, c)       DTRACE_PROBE3(usbcopier, name, a, b, c)
+#define PROBE4(name, a, b, c, d)    DTRACE_PROBE4(usbcopier, name, a, b, c, d)
+#else
+#define PROBE1(name, a)             do { } while (0)
+#define PROBE2(name, a, b)          do { } while (0)
+#define PROBE3(name, a, b, c)       do { } while (0)
+#define PROBE4(name, a, b, c, d)    do { } while (0)
+#endif
+
+
+// Channel reported by probes in shared code, set by the client at start-up
+extern int probe_device_id;
+
+#endif // PROBES_H
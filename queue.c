@@ -0,0 +1,86 @@
+#include "globals.h"
+#include "queue.h"
+
+/*
+ * Bounded queue
+ * -------------
+ * Connects the stages of the master ingest (see ingest.c): a producer
+ * blocks in queue_push while the queue is full, so a fast stage can't run
+ * unboundedly ahead of a slow one, and consumers block in queue_pop while
+ * it is empty. Once the producer calls queue_close, queue_pop returns the
+ * items left and then NULL, which tells each consumer to finish.
+ */
+
+
+bool queue_init(BoundedQueueStruct* queue_p, int capacity)
+{
+    memset(queue_p, 0, sizeof(BoundedQueueStruct));
+    queue_p->items = malloc(capacity * sizeof(void*));
+    if (!queue_p->items) return false;
+    queue_p->capacity = capacity;
+    pthread_mutex_init(&queue_p->mutex, NULL);
+    pthread_cond_init(&queue_p->not_empty, NULL);
+    pthread_cond_init(&queue_p->not_full, NULL);
+    return true;
+}
+
+
+// Only once every thread using the queue has finished with it
+void queue_destroy(BoundedQueueStruct* queue_p)
+{
+    if (!queue_p->items) return;
+    free(queue_p->items);
+    queue_p->items = NULL;
+    pthread_mutex_destroy(&queue_p->mutex);
+    pthread_cond_destroy(&queue_p->not_empty);
+    pthread_cond_destroy(&queue_p->not_full);
+}
+
+
+// Adds an item, waiting for room. Returns false if the queue has been closed.
+bool queue_push(BoundedQueueStruct* queue_p, void* item)
+{
+    pthread_mutex_lock(&queue_p->mutex);
+    while (queue_p->count == queue_p->capacity && !queue_p->closed) {
+        pthread_cond_wait(&queue_p->not_full, &queue_p->mutex);
+    }
+    bool ok = !queue_p->closed;
+    if (ok) {
+        queue_p->items[(queue_p->head + queue_p->count) % queue_p->capacity] = item;
+        queue_p->count++;
+        pthread_cond_signal(&queue_p->not_empty);
+    }
+    pthread_mutex_unlock(&queue_p->mutex);
+    return ok;
+}
+
+
+// Takes the oldest item, waiting for one. Returns NULL once the queue is
+// closed and empty.
+void* queue_pop(BoundedQueueStruct* queue_p)
+{
+    pthread_mutex_lock(&queue_p->mutex);
+    while (queue_p->count == 0 && !queue_p->closed) {
+        pthread_cond_wait(&queue_p->not_empty, &queue_p->mutex);
+    }
+    void* item = NULL;
+    if (queue_p->count > 0) {
+        item = queue_p->items[queue_p->head];
+        queue_p->head = (queue_p->head + 1) % queue_p->capacity;
+        queue_p->count--;
+        pthread_cond_signal(&queue_p->not_full);
+    }
+    pthread_mutex_unlock(&queue_p->mutex);
+    return item;
+}
+
+
+// No more items will be pushed
+void queue_close(BoundedQueueStruct* queue_p)
+{
+    pthread_mutex_lock(&queue_p->mutex);
+    queue_p->closed = true;
+    pthread_cond_broadcast(&queue_p->not_empty);
+    pthread_cond_broadcast(&queue_p->not_full);
+    pthread_mutex_unlock(&queue_p->mutex);
+}
@@ -0,0 +1,22 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+// Fixed-size FIFO of pointers between threads
+typedef struct {
+    void** items;
+    int capacity;
+    int head;
+    int count;
+    bool closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} BoundedQueueStruct;
+
+bool queue_init(BoundedQueueStruct* queue_p, int capacity);
+void queue_destroy(BoundedQueueStruct* queue_p);
+bool queue_push(BoundedQueueStruct* queue_p, void* item);
+void* queue_pop(BoundedQueueStruct* queue_p);
+void queue_close(BoundedQueueStruct* queue_p);
+
+#endif // QUEUE_H
@@ -3,12 +3,33 @@
 #include "lcd.h"
 #include "gpio.h"
 #include "usb.h"
+#include "portmap.h"
+#include "config.h"
+#include "watchdog.h"
+#include "shm.h"
+#include "metrics.h"
+#include "trace.h"
+#include "blockstat.h"
+#include "eta.h"
+#include "stickdb.h"
+#include "audio.h"
+#include "cache.h"
+#include "ingest.h"
+#include "budget.h"
+#include "stage.h"
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#define UI_TICK_MS 100      // LCD progress refresh interval while a hub is busy
+#define MAX_REACTOR_EVENTS 8
+#define INGEST_LCD_ROW 3    // progress of the MP3 files still being processed, on the READY screen
+#define PLAN_LCD_MS 3000    // how long the bit rate plan is shown before the master is read
 
 char buffer[STRING_LEN*2];
 SharedDataStruct* shared_data_p = NULL;
-static sem_t ffmpeg_sem;
-static pthread_mutex_t crc_file_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t ffmpeg_count_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char plan_text[STRING_LEN] = "";    // the bit rate plan, in one LCD row
 
 
 
@@ -27,7 +48,7 @@ void set_state(int device_id, ChannelStateEnum state) {
 
 // Sets the state of all USB Channels
 void set_all_states(ChannelStateEnum state) {
-	for (int device_id=0; device_id<MAX_USB_CHANNELS; device_id++) {
+	for (int device_id=0; device_id<shared_data_p->channel_count; device_id++) {
 		shared_data_p->channel_info[device_id].state = state;
 	}
 
@@ -35,233 +56,6 @@ void set_all_states(ChannelStateEnum state) {
 
 
 
-//------------------------------------------------------------------------------------------------
-//------------------------------------------------------------------------------------------------
-//------------------------------------------------------------------------------------------------
-// run_ffmpeg
-// 
-// Equalizes loudness, trims silence of beginning and reduces noise in quiet sections of an MP3 file
-//------------------------------------------------------------------------------------------------
-//------------------------------------------------------------------------------------------------
-//------------------------------------------------------------------------------------------------
-
-//ffmpeg -i MAY29006.mp3 -af 
-// "agate=mode=downward:ratio=1.2, silenceremove=start_periods=1:start_threshold=-45dB:start_silence=0.7, loudnorm=I=-18:TP=-2:LRA=11" 
-// -ar 44.1k -ab 128k -ac 1 output06.mp3
-int ffmpeg_complete_count = 0;
-int ffmpeg_file_count = 0;
-
-void* ffmpeg_thread_function(void* arg)
-{
-	char mp3_file[STRING_LEN];
-	char temp_file[STRING_LEN];
-	char buffer2[STRING_LEN*2];
-	
-	int ret = 0;
-	
-	strcpy(mp3_file, (char*)arg);
-	
-	const char* last_dot = strrchr(mp3_file, '.');
-	size_t base_len = last_dot - mp3_file;
-	
-	strncpy(temp_file, mp3_file, base_len);
-	temp_file[base_len] = 0;
-	strcat(temp_file, ".tmp");
-
-
-	// Use a semaphore to only allow 4 instances of ffmpeg to run at one time (one per cpu core)
-	if (sem_wait(&ffmpeg_sem) == -1)
-	{
-		fprintf(stderr, "ERROR: sem_wait failed\n");
-		return(NULL);
-	}
-	
-
-	// run ffmpeg. output in 128K mono
-	snprintf(buffer2, sizeof(buffer2), 
-		"ffmpeg -i \"%s\" -y -loglevel error -af \"%s\" -f mp3 -ar 44.1K -ab 128k -ac 1 \"%s\"", 
-		mp3_file, FFMPEG_FILTERS, temp_file);
-	ret = execute_command(-1, buffer2, false);
-	
-	if (sem_post(&ffmpeg_sem) == -1) {
-    	fprintf(stderr, "ERROR: sem_post failed\n");
-		return(NULL);
-	}
-		
-	printf("*******run_ffmpeg(%s) ....FINISHED\n", mp3_file);
-	
-	pthread_mutex_lock(&ffmpeg_count_mutex);
-    ffmpeg_complete_count++;
-    int percent_complete = (ffmpeg_complete_count*100) / ffmpeg_file_count;
-    pthread_mutex_unlock(&ffmpeg_count_mutex);
-
-	lcd_display_bargraph(percent_complete, 3);
-	
-	if (ret != 0) {
-		fprintf(stderr, "ERROR running ffmpeg\n");
-		return(NULL);
-	}
-
-	snprintf(buffer2, sizeof(buffer2), "rm \"%s\"", mp3_file);
-	if (execute_command(-1, buffer2, false) != 0) {
-		fprintf(stderr, "ERROR deleting %s\n", mp3_file);
-		return(NULL);
-	}
-		
-
-	snprintf(buffer2, sizeof(buffer2), "mv \"%s\" \"%s\"", temp_file, mp3_file);		
-	if (execute_command(-1, buffer2, false) != 0) {
-		fprintf(stderr, "ERROR renaming %s to %s\n", temp_file, mp3_file);
-	}
-	
-	
-	return NULL;
-}
-
-
-// Function to check if a file is an MP3
-int is_mp3(const char *filename) {
-    const char *ext = strrchr(filename, '.');
-    return ext && strcmp(ext, ".mp3") == 0;
-}
-
-
-// Multi-threaded Function to process all MP3 files in a directory, 4 at a time 
-int process_all_mp3_files(const char *dir_path) {
-	
-	int ret = 0;
-	pthread_t threads[MAX_FILES];
-	char* filenames[MAX_FILES];
-	
-	ffmpeg_file_count = 0;
-	
-    // Initialize the unnamed semaphore with value 4
-    if (sem_init(&ffmpeg_sem, 0, NUMBER_OF_FFMPEG_THREADS) == -1) {
-        perror("sem_init failed");
-        exit(1);
-    }
-
-    DIR *dir = opendir(dir_path);
-    if (!dir) {
-		fprintf(stderr, "ERROR opening directory %s\n", dir_path);
-		return -1;
-    }
-
-    struct dirent *entry;
-    char mp3_file[STRING_LEN*2];
-
-
-	// Get the path of each file in the directory
-    while ((entry = readdir(dir))) {			
-        if (entry->d_type != DT_DIR && is_mp3(entry->d_name)) {				
-            snprintf(mp3_file, sizeof(mp3_file), "%s/%s", dir_path, entry->d_name);
-			filenames[ffmpeg_file_count] = strdup(mp3_file);
-			ffmpeg_file_count++;
-		}
-	}
-		
-		
-    // Create a new thread for each file
-    for (int i = 0; i < ffmpeg_file_count; i++) {
-		if (pthread_create(&threads[i], NULL, ffmpeg_thread_function, (void*)filenames[i]) != 0) {
-			perror("pthread_create failed");
-			sem_destroy(&ffmpeg_sem);
-			exit(-1);				
-		}
-		//pthread_join(threads[i], NULL);  // waits for one thread to finish before starting the next
-    }
-
-
-    // Wait for all threads to complete
-    for (int i = 0; i < ffmpeg_file_count; i++) {
-        if (pthread_join(threads[i], NULL) != 0) {
-            perror("pthread_join failed");
-        }
-    }
-
-
-	// Free allocated strings
-	for (int i = 0; i < ffmpeg_file_count; i++) {
-		free(filenames[i]); 
-    }
-	
-    // Destroy the semaphore
-    sem_destroy(&ffmpeg_sem);
-
-    closedir(dir);
-
-	return ret;
-}
-
-
-
-//------------------------------------------------------------------------------------------------
-//------------------------------------------------------------------------------------------------
-//------------------------------------------------------------------------------------------------
-// Generate CRCs
-//------------------------------------------------------------------------------------------------
-//------------------------------------------------------------------------------------------------
-//------------------------------------------------------------------------------------------------
-
-void generate_crcs(char* path, FILE *crc_file) {
-
-	DIR *dir = opendir(path);
-    if (!dir) {
-        perror("opendir");
-        return;
-    }
-
-    struct dirent *entry;
-    struct stat statbuf;
-    char *subpath = NULL;
-
-    while ((entry = readdir(dir))) {
-		
-        // Skip "." and ".." entries
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        // Construct full path
-        size_t path_len = strlen(path) + strlen(entry->d_name) + 2; // +2 for '/' and '\0'
-        subpath = realloc(subpath, path_len);
-        snprintf(subpath, path_len, "%s/%s", path, entry->d_name);
-
-        // Get file stats
-        if (stat(subpath, &statbuf) == -1) {
-            perror("stat");
-            continue;
-        }
-
-        if (S_ISDIR(statbuf.st_mode)) {
-            // Recurse into subdirectory
-            generate_crcs(subpath, crc_file);
-			
-        } else if (S_ISREG(statbuf.st_mode)) {
-            // Check if file ends with ".mp3"
-            size_t len = strlen(entry->d_name);
-            if (len >= 4 && strcasecmp(&entry->d_name[len - 4], ".mp3") == 0) {
-				
-				// Write '<filename>[tab]<crc>' to the CRC file
-				uint32_t actual_crc = compute_crc32(subpath);				
-				
-				// mutex is for filewrites
-				pthread_mutex_lock(&crc_file_mutex);
-				const char* ptr = subpath + strlen(RAMDIR_PATH) + 1;  
-				fprintf(crc_file, "%s\t%08x\n", ptr, actual_crc);	
-				fflush(crc_file);
-				pthread_mutex_unlock(&crc_file_mutex);
-            }
-        }
-    }
-
-    free(subpath);
-    closedir(dir);
-	
-}
-
-
-
 //------------------------------------------------------------------------------------------------
 //------------------------------------------------------------------------------------------------
 //------------------------------------------------------------------------------------------------
@@ -277,12 +71,18 @@ int start_process(int device_id) {
 		
 	printf("Start client process for device number %d \n", device_id);
 	
-	if ((device_id < 0) || (device_id >= MAX_USB_CHANNELS)) {
+	if ((device_id < 0) || (device_id >= shared_data_p->channel_count)) {
 		fprintf(stderr, "ERROR: Start_processs: device_id %d invalid\n", device_id);
 		exit(1);
 	}
 	
 	ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[device_id];
+	channel_info_p->worker_pid = 0;
+	channel_info_p->fail_reason = FAIL_NONE;
+	channel_clear_commands(channel_info_p);
+	blockstat_start_job(channel_info_p);
+	stickdb_start_job(channel_info_p);
+	eta_start_job(channel_info_p);
 		
 	// Fork a new instance of the client process	
 	pid_t pid = fork();
@@ -305,6 +105,12 @@ int start_process(int device_id) {
         dup2(dev_null, STDIN_FILENO); // Redirect stdin
         close(dev_null);
 
+        // The server blocks SIGCHLD for its signalfd. Signal masks survive
+        // exec, so restore the default before running the client.
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
         // Prepare arguments
         sprintf(buffer, "%d", device_id);
 
@@ -322,12 +128,102 @@ int start_process(int device_id) {
         exit(EXIT_FAILURE);
 	}
 	
+	channel_info_p->pid = pid;
+	channel_info_p->exit_status = -1;
 	return pid;
 }
 
 
+// Collects the exit status of any client processes that have finished so
+// they don't linger as zombies. Only pids we started are waited for, so
+// system() calls made by other threads keep their own children.
+// Returns the number of clients reaped.
+int reap_clients(void) {
+	int reaped = 0;
+
+	for (int device_id=0; device_id<shared_data_p->channel_count; device_id++) {
+		ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[device_id];
+		if (channel_info_p->pid <= 0) continue;
+
+		int status;
+		pid_t pid = waitpid(channel_info_p->pid, &status, WNOHANG);
+		if (pid == 0) continue;   // still running
+
+		if (pid < 0) {
+			perror("waitpid");
+			channel_info_p->exit_status = 127;
+		}
+		else if (WIFEXITED(status)) {
+			channel_info_p->exit_status = WEXITSTATUS(status);
+		}
+		else if (WIFSIGNALED(status)) {
+			channel_info_p->exit_status = 128 + WTERMSIG(status);
+		}
+
+		printf("Client for device %d (pid %d) exited with status %d\n",
+			device_id, channel_info_p->pid, channel_info_p->exit_status);
+		print_channel_timing(channel_info_p);
+		channel_info_p->pid = 0;
+		reaped++;
+
+		// worker_pid is kept until the client itself has gone, which the
+		// watchdog sees to
+		if (watchdog_client_running(channel_info_p)) {
+			fprintf(stderr, "ERROR: Client for device %d (pid %d) is still running after sudo exited\n",
+				device_id, channel_info_p->worker_pid);
+		}
+
+		// A client that died without reporting a result would otherwise
+		// keep its hub busy for ever
+		ChannelStateEnum state = channel_info_p->state;
+		if ((state != SUCCESS) && (state != FAILED) && (state != CRC_FAILED)) {
+			fprintf(stderr, "ERROR: Client for device %d exited in state %s\n", device_id, get_state_name(state));
+			channel_info_p->state = FAILED;
+			channel_info_p->fail_reason = FAIL_ERROR;
+		}
+		metrics_job_finished(channel_info_p);
+		eta_job_finished(shared_data_p, channel_info_p);
+		stickdb_job_finished(shared_data_p, channel_info_p);
+	}
+
+	return reaped;
+}
+
+
+
 
 
+// Logs the events posted by the clients since the last SIGUSR1 doorbell
+void drain_client_events(void) {
+	ChannelEventStruct event;
+
+	for (int device_id=0; device_id<shared_data_p->channel_count; device_id++) {
+		ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[device_id];
+
+		while (channel_get_event(channel_info_p, &event)) {
+			switch (event.event) {
+				case EVENT_PHASE:
+					printf("[%d] %s\n", device_id, get_state_name(event.value));
+					break;
+				case EVENT_FILE_DONE:
+					printf("[%d] Copied file %d: %s\n", device_id, event.value, event.text);
+					break;
+				case EVENT_ERROR:
+					fprintf(stderr, "[%d] Client error: %s", device_id, event.text);
+					break;
+				default:
+					fprintf(stderr, "ERROR: [%d] Unknown client event %u\n", device_id, event.event);
+					break;
+			}
+		}
+
+		uint32_t dropped = atomic_exchange(&channel_info_p->events_dropped, 0);
+		if (dropped > 0) {
+			fprintf(stderr, "ERROR: [%d] %u client events were lost\n", device_id, dropped);
+		}
+	}
+}
+
 
 // quick power on check and visual indication we are ready
 void test_leds() {
@@ -345,7 +241,7 @@ void test_leds() {
 	usleep(200000);
 
 	printf("LED Test - Left to Right\n");
-	for (int device_id=0; device_id<MAX_USB_CHANNELS; device_id++) {		
+	for (int device_id=0; device_id<shared_data_p->channel_count; device_id++) {		
 		set_all_states(EMPTY);		
 		set_state(device_id, LED_TEST);
 		usleep(100000);
@@ -358,20 +254,22 @@ void test_leds() {
 
 
 // LCD progress callback used while loading the master from a USB stick.
-// copy_directory invokes this once per file, with the leaf filename.
+// ingest_master invokes this every half second while it copies, with the
+// leaf filename of the latest file.
 //
 // Layout on the 20x4 LCD:
-//   row 0: "Reading Master" (header, kept across calls)
-//   rows 1-3: filename, wrapped mid-word every 20 columns
+//   row 0: "Reading Master" and the overall percentage
+//   rows 1-2: filename, wrapped mid-word every 20 columns
+//   row 3: read speed from the master, and the time left to read it
 //
-// If the filename is longer than 60 characters (3 full rows of 20), it is
+// If the filename is longer than 40 characters (2 full rows of 20), it is
 // truncated from the middle: a fixed prefix + "..." + a fixed suffix that
 // preserves the file extension.
 //
 // HD44780 has no Unicode ellipsis, so plain ASCII "..." is used.
 static void load_master_progress(const char *filename) {
-    char display[61];   // 60 visible chars + null
-    const size_t MAX_VIS = 60;
+    char display[41];   // 40 visible chars + null
+    const size_t MAX_VIS = 40;
 
     if (!filename) filename = "";
     size_t len = strlen(filename);
@@ -381,22 +279,21 @@ static void load_master_progress(const char *filename) {
         display[len] = '\0';
     } else {
         // Middle-truncate: <prefix> "..." <suffix>
-        // Total visible = prefix + 3 + suffix = 60  =>  prefix + suffix = 57
+        // Total visible = prefix + 3 + suffix = 40  =>  prefix + suffix = 37
         // Split fairly evenly, slightly favouring the suffix so the
-        // file extension survives. 28 + 29 = 57.
-        const size_t prefix_len = 28;
-        const size_t suffix_len = 29;
+        // file extension survives. 18 + 19 = 37.
+        const size_t prefix_len = 18;
+        const size_t suffix_len = 19;
         memcpy(display, filename, prefix_len);
         memcpy(display + prefix_len, "...", 3);
         memcpy(display + prefix_len + 3, filename + len - suffix_len, suffix_len);
-        display[60] = '\0';
+        display[40] = '\0';
     }
 
-    // Slice into three 20-char rows. lcd_display_message pads short rows
+    // Slice into two 20-char rows. lcd_display_message pads short rows
     // with spaces, so trailing nulls are fine.
     char row1[21] = {0};
     char row2[21] = {0};
-    char row3[21] = {0};
     size_t shown = strlen(display);
 
     size_t take = shown > 20 ? 20 : shown;
@@ -407,20 +304,56 @@ static void load_master_progress(const char *filename) {
         take = remaining > 20 ? 20 : remaining;
         memcpy(row2, display + 20, take);
     }
-    if (shown > 40) {
-        size_t remaining = shown - 40;
-        take = remaining > 20 ? 20 : remaining;
-        memcpy(row3, display + 40, take);
+
+    // Nothing to show until a second of reading has been timed
+    char row3[STRING_LEN] = {0};
+    double mb_per_s;
+    int eta_seconds;
+    if (ingest_copy_rate(&mb_per_s, &eta_seconds)) {
+        char eta[16];
+        format_eta(eta, sizeof(eta), eta_seconds);
+        snprintf(row3, sizeof(row3), "%5.1fMB/s  ETA %s", mb_per_s, eta);
     }
 
-    lcd_display_message_no_flash("Reading Master", row1, row2, row3);
+    // Transcoding runs alongside, so the percentage covers both
+    char title[21];
+    snprintf(title, sizeof(title), "Reading Master %3d%%", ingest_progress());
+    lcd_display_message_no_flash(title, row1, row2, row3);
 }
 
 
 
 
+// If [audio] target_minutes is set, picks the MP3 bit rate that lets the
+// master at mount_point be written to a stick in that time, and shows the
+// expected write time before any transcoding starts
+static void plan_bit_rate(const char* mount_point) {
+	BudgetPlanStruct plan;
+	char rate[STRING_LEN];
+	char write_time[STRING_LEN];
+	char eta[16];
+
+	plan_text[0] = '\0';
+	audio_set_bit_rate(AUDIO_BIT_RATE);
+	if (config.target_minutes == 0) return;
+
+	if (!budget_plan(mount_point, config.target_minutes * 60, config.min_kbps, eta_copy_cost(), &plan) || plan.kbps == 0) {
+		fprintf(stderr, "ERROR: Cannot plan the bit rate, using %dK\n", AUDIO_BIT_RATE / 1000);
+		return;
+	}
+	audio_set_bit_rate(plan.kbps * 1000);
+
+	format_eta(eta, sizeof(eta), plan.write_seconds);
+	snprintf(rate, sizeof(rate), "%d kbps, %.0fMB", plan.kbps, plan.bytes / 1024.0 / 1024.0);
+	snprintf(write_time, sizeof(write_time), "%s per stick", eta);
+	snprintf(plan_text, sizeof(plan_text), "%dk, %s per stick", plan.kbps, eta);
+	lcd_display_message("Bit Rate Plan", rate, write_time, plan.met ? NULL : "Over the target");
+	usleep(PLAN_LCD_MS * 1000);
+}
+
+
 // Prompts the user to insert the master USB in slot one. 
-// Recursively copies all files to the ramdrive
+// Brings the ramdrive up to date with it, copying only what has changed
 int load_master() {
 	char name[STRING_LEN-1];
 	char path[STRING_LEN-1];
@@ -432,7 +365,7 @@ int load_master() {
 	// Wait for USB inserted
 	printf("Waiting for master USB to be inserted\n");
 	while(!usb_device_inserted(name, path)) {
-		usleep(100000);
+		usb_wait_for_event(-1);
 	}
 	
 	printf("found master : name=%s path=%s\n", name, path);
@@ -472,34 +405,45 @@ int load_master() {
 		return 1;
 	}
 
- 
-	// Empty the ramdrive
-    snprintf(buffer, sizeof(buffer), "sudo rm -rf %s/*", RAMDIR_PATH);
-	if (execute_command(-1, buffer, false) != 0) {
-		fprintf(stderr, "ERROR: empty_directory failed\n");
-        return 1;
+
+	plan_bit_rate(mount_point);
+
+	// A bigger read-ahead lets the stick stream while the workers read
+	int readahead_kb = usb_get_readahead_kb(name);
+	bool readahead_set = (config.ingest_readahead_kb > 0) && (readahead_kb >= 0) &&
+		(config.ingest_readahead_kb != readahead_kb) && usb_set_readahead_kb(name, config.ingest_readahead_kb);
+	if (readahead_set) {
+		printf("Read-ahead of %s raised from %dKB to %dKB\n", name, readahead_kb, config.ingest_readahead_kb);
 	}
 
-	
-	shared_data_p->total_size = 0;
-	bool halt = false;
-	if (copy_directory(mount_point, RAMDIR_PATH, &halt, &shared_data_p->total_size, load_master_progress) != 0) {
-		fprintf(stderr, "ERROR: copy_directory failed\n");
-        return 1;
+	// Copy whatever has changed since the ramdrive (or staging directory)
+	// was last loaded
+	int ret = ingest_master(shared_data_p, mount_point, load_master_progress);
+	if (readahead_set) {
+		usb_set_readahead_kb(name, readahead_kb);
+	}
+	if (ret != 0) {
+		snprintf(buffer, sizeof(buffer), "sudo umount %s", mount_point);
+		execute_command(-1, buffer, true);
+		return 1;
 	}
 
-	printf("Total Size=%lu\n", shared_data_p->total_size);
+	printf("Total Size=%lu\n", (unsigned long)shared_data_p->total_size);
 
     // Unmount the USB drive
 	snprintf(buffer, sizeof(buffer), "sync %s", mount_point);
 	if (execute_command(-1, buffer, false) != 0) {
 		fprintf(stderr, "VERIFY ERROR: Cannot sync device\n");
-		return false;
+		ingest_abandon();
+		snprintf(buffer, sizeof(buffer), "sudo umount %s", mount_point);
+		execute_command(-1, buffer, true);
+		return 1;
 	}
 	
 	snprintf(buffer, sizeof(buffer), "sudo umount %s", mount_point);
 	if (execute_command(-1, buffer, false) != 0) {
 		fprintf(stderr, "ERROR: Unmounting the USB drive %s\n", mount_point);
+		ingest_abandon();
 		return 1;
 	}
 
@@ -523,7 +467,7 @@ void map_usb_port_numbers(void)
 	bool done = false;
 	strcpy(message, "Push Button to skip");
 	
-	while ((channel_number < MAX_USB_CHANNELS) && !done)
+	while ((channel_number < shared_data_p->channel_count) && !done)
 	{
 		ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[channel_number];
 		channel_info_p->state = INDICATING;
@@ -558,9 +502,7 @@ void map_usb_port_numbers(void)
 				else {
 					sprintf(message, "[Port %d=%s]", channel_number+1, path);
 
-					strcpy(channel_info_p->device_name, name);
-					strcpy(channel_info_p->device_path, path);
-					channel_info_p->state = READY;
+					usb_assign_port(channel_number, name, path);
 					channel_number++;
 				}
 				
@@ -586,25 +528,43 @@ void map_usb_port_numbers(void)
 
 
 
-int run(int hub_number) {
+// Each push button controls the hubs whose config names that button.
+// With the standard two hub copier that is exactly one hub per button.
+static bool channel_on_button(const ChannelInfoStruct* channel_info_p, int button_number) {
+	return config.hub[channel_info_p->hub_number].button == button_number;
+}
+
+
+// Starts a client for every loaded port on the hubs controlled by a button
+int run(int button_number) {
 	
 	print_shared_data(shared_data_p);
 	
 	int result = 0;
 
-	for (int device_id=0; device_id<MAX_USB_CHANNELS; device_id++) {
+	for (int device_id=0; device_id<shared_data_p->channel_count; device_id++) {
 
 		ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[device_id];	
+		char device_name[STRING_LEN];
+		char device_path[STRING_LEN];
+		channel_get_device(channel_info_p, device_name, device_path);
 		
 		// Clears error lights from previous fails when the drive has been removed
-		if (!device_is_loaded(channel_info_p->device_name)) {
+		if (!device_is_loaded(device_name)) {
 			channel_info_p->state = EMPTY;
 		}
 		
-		if (channel_info_p->hub_number == hub_number) {
+		if (channel_on_button(channel_info_p, button_number)) {
 			
 			printf("%d=%s %s (%s)\n", device_id,
-				get_state_name(channel_info_p->state), channel_info_p->device_name, channel_info_p->device_path);
+				get_state_name(channel_info_p->state), device_name, device_path);
+
+			// A client failed by the watchdog may not have exited yet
+			if ((channel_info_p->pid > 0) || watchdog_client_running(channel_info_p)) {
+				fprintf(stderr, "ERROR: Previous client for device %d (pid %d, client %d) is still running\n",
+					device_id, channel_info_p->pid, channel_info_p->worker_pid);
+				continue;
+			}
 						
 			if ((channel_info_p->state == READY) || 
 			    (channel_info_p->state == SUCCESS) || 
@@ -626,27 +586,35 @@ int run(int hub_number) {
 
 
 
-// Tidily stop all running client processes on the specified hub
-void terminate(int hub_number) {
-	for (int device_id=0; device_id<MAX_USB_CHANNELS; device_id++) {		
+// Tidily stop all running client processes on the hubs controlled by a button
+void terminate(int button_number) {
+	for (int device_id=0; device_id<shared_data_p->channel_count; device_id++) {		
 		ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[device_id];
-		if (channel_info_p->hub_number == hub_number)
+		if (channel_on_button(channel_info_p, button_number))
 		{
 			printf("....Halting Channel %d\n", channel_info_p->port_number);
 			channel_info_p->halt = true;
+			if (channel_info_p->pid > 0) {
+				if (channel_info_p->fail_reason == FAIL_NONE) {
+					channel_info_p->fail_reason = FAIL_CANCELLED;
+				}
+				// Wakes the client if it is paused
+				channel_send_command(channel_info_p, CMD_HALT, 0);
+			}
 		}
 	}
 }
 
 
 
-// Monitors the button, starts and stops coping, 
-// and displays the progress of all ports in one USB hub
-void hub_main(int hub_number, ButtonStateEnum button_state) 
+// Monitors one button, starts and stops coping, and displays the progress
+// of all ports on the USB hubs it controls (two LCD rows per button).
+// Returns true while the hubs are busy and need periodic progress updates.
+bool hub_main(int button_number, ButtonStateEnum button_state) 
 {
-	static struct timeval start_time[NUMBER_OF_HUBS] = {0};
-	static struct timeval end_time[NUMBER_OF_HUBS] = {0};
-	static bool channel_busy[NUMBER_OF_HUBS] = {false};
+	static struct timeval start_time[NUMBER_OF_BUTTONS] = {0};
+	static struct timeval end_time[NUMBER_OF_BUTTONS] = {0};
+	static bool channel_busy[NUMBER_OF_BUTTONS] = {false};
 
 	// count the number of running, failed and finished processes for this hub
 	int copying = 0; 
@@ -654,17 +622,25 @@ void hub_main(int hub_number, ButtonStateEnum button_state)
 	int fail = 0; 
 	int pass = 0; 
 	off_t total_bytes_copied = 0;
-	int lcd_line = (hub_number==0) ? 2 : 0;
+	int total_permille = 0;
+	int eta_seconds = -1;
+	int lcd_line = (button_number==0) ? 0 : 2;
 
-	for (int i=0; i<MAX_USB_CHANNELS; i++)
+	for (int i=0; i<shared_data_p->channel_count; i++)
 	{		
 		ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[i];
 
-		if (channel_info_p->hub_number == hub_number)
+		if (channel_on_button(channel_info_p, button_number))
 		{
 			total_bytes_copied += channel_info_p->bytes_copied;
 			
+			// The hub is done when its slowest channel is
 			ChannelStateEnum state = channel_info_p->state;
+			if ((state >= STARTING) && (state <= CRC_FAILED)) {
+				total_permille += channel_info_p->progress_permille;
+				if (channel_info_p->eta_seconds > eta_seconds) eta_seconds = channel_info_p->eta_seconds;
+			}
+
 			if ((state == STARTING) || (state == ERASING) || 
 				(state == FORMATING) || (state == PARTITIONING) || (state == MOUNTING) ||
 				(state == COPYING) || (state == UNMOUNTING)) { 
@@ -682,39 +658,47 @@ void hub_main(int hub_number, ButtonStateEnum button_state)
 		}
 	}				
 
-	if (channel_busy[hub_number]) {
+	if (channel_busy[button_number]) {
 		// Usb hub is busy.
 		if (button_state == BUTTON_LONG_PRESS)
 		{
-			printf("Terminate %d\n", hub_number);
-			terminate(hub_number);
+			printf("Terminate %d\n", button_number);
+			terminate(button_number);
 			lcd_write_string("CANCELLED", lcd_line);
 			error_beep();
-			channel_busy[hub_number] = false;
+			channel_busy[button_number] = false;
+			metrics_batch_finished(button_number, 0, false);
+			trace_end(TRACE_BATCH, button_number);
 		} 
 		else {		
-			if (copying > 0) {
-			    // copying. Display progress so far
+			if ((copying > 0) || (verifying > 0)) {
+			    // copying or verifying. Display progress so far, weighted by
+			    // the expected time of each phase (see eta.c)
 				float percent;
 				int count = copying + verifying + pass + fail;
-				if ((count == 0) || (shared_data_p->total_size==0))
+				if (count == 0)
 					percent = 0;
 				else
-					percent = 100*total_bytes_copied / shared_data_p->total_size / count;
-				
-				sprintf(buffer, "Busy=%-2u OK=%-2u Bad=%-2u", copying + verifying, pass, fail);		
+					percent = total_permille / 10.0 / count;
+
+				// Busy/OK/Bad counts with the ETA on the right, shortened if
+				// they won't all fit on the line
+				char eta[16];
+				format_eta(eta, sizeof(eta), eta_seconds);
+				int len = snprintf(buffer, sizeof(buffer), "Busy%u OK%u Bad%u", copying + verifying, pass, fail);
+				if (len + 1 + (int)strlen(eta) > LCD_COLS) {
+					len = snprintf(buffer, sizeof(buffer), "%u/%u/%u", copying + verifying, pass, fail);
+				}
+				snprintf(buffer + len, sizeof(buffer) - len, "%*s", LCD_COLS - len, eta);
 				lcd_write_string(buffer, lcd_line);				
 				lcd_display_bargraph(percent, lcd_line+1);				
 			}
-			else if (verifying > 0) {
-				lcd_write_string("Verifying", lcd_line+1);
-			}
 			else 
 			{
 				// Copy has just finished. Display a summary
-				printf("Channel %d finished\n", hub_number);
-				gettimeofday(&end_time[hub_number], NULL);
-				int seconds = end_time[hub_number].tv_sec - start_time[hub_number].tv_sec;
+				printf("Button %d finished\n", button_number);
+				gettimeofday(&end_time[button_number], NULL);
+				int seconds = end_time[button_number].tv_sec - start_time[button_number].tv_sec;
 				
 				sprintf(buffer, "Done. OK=%-2u Bad=%-2u", pass, fail);		
 				lcd_write_string(buffer, lcd_line);				
@@ -729,7 +713,10 @@ void hub_main(int hub_number, ButtonStateEnum button_state)
 					beep();
 				}
 				
-				channel_busy[hub_number] = false;
+				channel_busy[button_number] = false;
+				metrics_batch_finished(button_number, seconds, true);
+				trace_end(TRACE_BATCH, button_number);
+				stickdb_sync(true);
 			}
 		}
 	}
@@ -737,15 +724,19 @@ void hub_main(int hub_number, ButtonStateEnum button_state)
 
 		// USB hub is not busy. Wait for a button press
 		if (button_state == BUTTON_SHORT_PRESS) {
-			printf("Channel %d start\n", hub_number);
-			gettimeofday(&start_time[hub_number], NULL);
-			channel_busy[hub_number] = true;
+			printf("Button %d start\n", button_number);
+			gettimeofday(&start_time[button_number], NULL);
+			channel_busy[button_number] = true;
+			metrics_batch_started(button_number);
+			trace_begin(TRACE_BATCH, (button_number == 0) ? "button 0" : "button 1");
 			lcd_write_string("", lcd_line);
 			lcd_write_string("", lcd_line+1);		
 			beep();
-			run(hub_number);
+			run(button_number);
 		}
 	}
+
+	return channel_busy[button_number];
 }
 
 
@@ -757,8 +748,250 @@ void hub_main(int hub_number, ButtonStateEnum button_state)
 //------------------------------------------------------------------------------------------------
 //------------------------------------------------------------------------------------------------
 
+// The READY screen, which says if the MP3 files are still being processed
+// or if any of them couldn't be
+static void display_ready(bool ingesting) {
+	char note[STRING_LEN];
+	int failures = ingest_failures();
+
+	if (ingesting) {
+		snprintf(note, sizeof(note), "Optimising MP3 files");
+	}
+	else if (failures > 0) {
+		snprintf(note, sizeof(note), "%d MP3 not optimised", failures);
+		long_beep();
+	}
+	else {
+		note[0] = '\0';
+	}
+	lcd_display_message("READY", note[0] ? note : NULL, "Push button to start", NULL);
+}
+
+
+//------------------------------------------------------------------------------------------------
+// Event reactor
+//
+// Once the copier is READY the main thread sleeps in epoll_wait() and is woken by
+//   - the GPIO thread, as soon as a button press has been classified
+//   - the USB monitor, as soon as a drive is inserted or removed
+//   - a signalfd, as soon as a client process exits (SIGCHLD), posts an
+//     event such as a phase change (SIGUSR1) or copier_ctl sends a command
+//     (CONTROL_SIGNAL)
+//   - a timerfd, every UI_TICK_MS, but only while a hub is busy copying,
+//     the watchdog is waiting for a failed client to exit or the master's
+//     MP3 files are still being processed
+//------------------------------------------------------------------------------------------------
+
+typedef enum {
+	REACTOR_BUTTONS = 1,
+	REACTOR_USB = 2,
+	REACTOR_SIGNAL = 3,
+	REACTOR_TIMER = 4
+} ReactorSourceEnum;
+
+
+// Sends a command from copier_ctl to the client on a channel. The server
+// does the sending so that it stays the command rings' only producer.
+static void control_request(int word, pid_t sender) {
+	int device_id;
+	int value;
+	ChannelCommandEnum command;
+
+	if (!control_unpack(word, &device_id, &command, &value) || (device_id >= shared_data_p->channel_count)) {
+		fprintf(stderr, "ERROR: Invalid request %08x from copier_ctl (pid %d)\n", (unsigned int)word, (int)sender);
+		return;
+	}
+
+	ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[device_id];
+	if (channel_info_p->pid <= 0) {
+		printf("[%d] copier_ctl: no client running\n", device_id);
+		return;
+	}
+
+	printf("[%d] copier_ctl: command %d value %d\n", device_id, (int)command, value);
+	if ((command == CMD_HALT) && (channel_info_p->fail_reason == FAIL_NONE)) {
+		channel_info_p->fail_reason = FAIL_CANCELLED;
+	}
+	channel_send_command(channel_info_p, command, value);
+}
+
+
+static void reactor_add(int epoll_fd, int fd, ReactorSourceEnum source) {
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = source };
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+
+// Drains an eventfd or timerfd so it stops being readable
+static void reactor_drain(int fd) {
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		perror("reactor read");
+	}
+}
+
+
+// Arms the UI tick timer while any hub is busy, disarms it when idle
+static void reactor_set_tick(int timer_fd, bool enabled) {
+	static bool armed = false;
+	if (enabled == armed) return;
+
+	struct itimerspec its = {0};
+	if (enabled) {
+		its.it_interval.tv_nsec = UI_TICK_MS * 1000000L;
+		its.it_value.tv_nsec = UI_TICK_MS * 1000000L;
+	}
+	if (timerfd_settime(timer_fd, 0, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		exit(1);
+	}
+	armed = enabled;
+}
+
+
+void run_reactor(int signal_fd) {
+
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd == -1) {
+		perror("timerfd_create");
+		exit(1);
+	}
+
+	reactor_add(epoll_fd, gpio_get_event_fd(), REACTOR_BUTTONS);
+	reactor_add(epoll_fd, usb_get_event_fd(), REACTOR_USB);
+	reactor_add(epoll_fd, signal_fd, REACTOR_SIGNAL);
+	reactor_add(epoll_fd, timer_fd, REACTOR_TIMER);
+
+	char name[STRING_LEN];
+	char path[STRING_LEN];
+	bool starting = true;
+	bool was_ingesting = true;
+
+	// Tick from the start, as the master may still be being processed
+	reactor_set_tick(timer_fd, true);
+
+	while (true) {
+		struct epoll_event events[MAX_REACTOR_EVENTS];
+		int count = epoll_wait(epoll_fd, events, MAX_REACTOR_EVENTS, -1);
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+
+		for (int i=0; i<count; i++) {
+			switch (events[i].data.u32) {
+				case REACTOR_BUTTONS:
+					reactor_drain(gpio_get_event_fd());
+					break;
+
+				case REACTOR_USB:
+					// Channel states are updated by the USB thread itself.
+					// Just drain the queues so they don't overflow.
+					reactor_drain(usb_get_event_fd());
+					while (usb_device_inserted(name, path)) {
+						printf("USB inserted: %s (%s)\n", name, path);
+					}
+					while (usb_device_removed(name, path)) {
+						printf("USB removed: %s (%s)\n", name, path);
+					}
+					break;
+
+				case REACTOR_SIGNAL: {
+					struct signalfd_siginfo info;
+					bool child_exited = false;
+					while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+						// Signals are coalesced, so reap every finished client
+						// and drain every event ring
+						if (info.ssi_signo == SIGCHLD) child_exited = true;
+						if (((int)info.ssi_signo == CONTROL_SIGNAL) && (info.ssi_code == SI_QUEUE)) {
+							control_request(info.ssi_int, info.ssi_pid);
+						}
+					}
+					drain_client_events();
+					if (child_exited) reap_clients();
+					break;
+				}
+
+				case REACTOR_TIMER:
+					reactor_drain(timer_fd);
+					break;
+			}
+		}
+
+		ButtonStateEnum button_state0 = get_button_state0();
+		ButtonStateEnum button_state1 = get_button_state1();
+
+		if (starting && ((button_state0 != BUTTON_NOT_PRESSED) || (button_state1 != BUTTON_NOT_PRESSED)))
+		{
+			lcd_clear();
+			starting = false;
+		}
+
+		// Finish the master once its last MP3 files are done
+		bool ingesting = ingest_poll();
+		if (starting && ingesting) {
+			lcd_display_bargraph(ingest_progress(), INGEST_LCD_ROW);
+		}
+		else if (starting && was_ingesting) {
+			display_ready(false);
+		}
+		was_ingesting = ingesting;
+
+		// Fail any stuck clients first so their hub can finish on this pass
+		bool killing = watchdog_check(shared_data_p);
+		blockstat_sample(shared_data_p);
+		eta_update(shared_data_p);
+		stage_update(shared_data_p);
+		stickdb_sync(false);
+
+		bool busy1 = hub_main(1, button_state1);
+		bool busy0 = hub_main(0, button_state0);
+		reactor_set_tick(timer_fd, busy0 || busy1 || killing || ingesting);
+	}
+}
+
+
 int main() {
 
+	config_load(CONFIG_FILE);
+	eta_init();
+	cache_init(config.cache_dir, config.cache_max_mb);
+	audio_init(config.audio_passthrough != 0, config.loudness_tolerance);
+	ingest_init(config.staging_dir, config.ingest_workers);
+	stage_init(config.stage_cache_mb);
+	stickdb_init();
+	int channel_count = config.number_of_hubs * config.ports_per_hub;
+	size_t shared_data_size = SHARED_DATA_SIZE(channel_count);
+
+	// Block SIGCHLD, the clients' SIGUSR1 doorbell and copier_ctl's requests
+	// before any threads are created so that they are only ever delivered
+	// through the reactor's signalfd
+	sigset_t signal_mask;
+	sigemptyset(&signal_mask);
+	sigaddset(&signal_mask, SIGCHLD);
+	sigaddset(&signal_mask, SIGUSR1);
+	sigaddset(&signal_mask, CONTROL_SIGNAL);
+	if (sigprocmask(SIG_BLOCK, &signal_mask, NULL) == -1) {
+		perror("sigprocmask");
+		exit(1);
+	}
+
+	int signal_fd = signalfd(-1, &signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd == -1) {
+		perror("signalfd");
+		exit(1);
+	}
+
     // Create shared memory object
     int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
     if (shm_fd == -1) {
@@ -767,13 +1000,13 @@ int main() {
     }
 	
     // Set size of shared memory 
-    if (ftruncate(shm_fd, sizeof(SharedDataStruct)) == -1) {
+    if (ftruncate(shm_fd, shared_data_size) == -1) {
         perror("ftruncate");
         exit(1);
     }
 
     // Map shared memory
-	shared_data_p = mmap(0, sizeof(SharedDataStruct), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	shared_data_p = mmap(0, shared_data_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
     if (shared_data_p == MAP_FAILED) {
         perror("mmap");
         exit(1);
@@ -786,94 +1019,89 @@ int main() {
     }
 
 	// initialise values in shared memory
-	memset(shared_data_p, 0, sizeof(SharedDataStruct));
+	memset(shared_data_p, 0, shared_data_size);
+	shared_data_p->number_of_hubs = config.number_of_hubs;
+	shared_data_p->ports_per_hub = config.ports_per_hub;
+	shared_data_p->trace_events = config.trace_events;
 	
-	for (int device_id=0; device_id<MAX_USB_CHANNELS; device_id++) {	
+	for (int device_id=0; device_id<channel_count; device_id++) {	
 		ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[device_id];	
 		channel_info_p->device_id = device_id;
-		channel_info_p->hub_number = device_id / PORTS_PER_CHANNEL;
-		channel_info_p->port_number = device_id % PORTS_PER_CHANNEL;
+		channel_info_p->hub_number = device_id / config.ports_per_hub;
+		channel_info_p->port_number = device_id % config.ports_per_hub;
 		channel_info_p->state = EMPTY;
 	}
+
+	// Marks the segment valid for the clients, so must come last
+	shm_init_header(shared_data_p, channel_count);
+
+	// Start a fresh set of trace files
+	trace_remove_all();
+	trace_init("server", -1, config.trace_events);
 	
+	// Load the saved USB port map before the USB monitor starts, so drives
+	// already plugged in can be matched to their channels
+	bool port_map_loaded = portmap_load(shared_data_p);
+
 	// Initialise the LCD etc
 	gpio_init(shared_data_p);
 	lcd_init(shared_data_p);
 	lcd_display_message("RPi USB Duplicator", "---", VERSION_STRING, "(Gary Bleads G0HJQ)");
 	usb_init(shared_data_p);
+	metrics_init(shared_data_p, config.metrics_listen);
 	
 	test_leds();
 	
-	load_master();
-
-	snprintf(buffer, sizeof(buffer), "Read %luMB", shared_data_p->total_size / 1024 / 1024);
-	lcd_display_message(buffer, NULL, "Optimising MP3 files", "Please Wait");
-	process_all_mp3_files(RAMDIR_PATH);
-
-	lcd_display_message("Calculating", "Checksums", NULL, NULL);
-	
-	// Save the CRCs for each file (including in subdirectories) to file crc.txt on the ramdrive
-	initialise_crc_table();
-	FILE *crc_file = fopen(CRC_FILE, "w");
-	if (!crc_file) {
-		fprintf(stderr, "Error: Cannot create CRC file %s\n", CRC_FILE);
-	   return 0;
+	// Until a master loads, there is nothing the sticks could be given
+	while (load_master() != 0) {
+		fprintf(stderr, "ERROR: Loading the master failed\n");
+		lcd_display_message("Master FAILED", "Please", "Remove Master USB", "and try again");
+		set_state(0, FAILED);
+		long_beep();
+		while(!usb_device_removed(NULL, NULL)) {
+			usb_wait_for_event(-1);
+		}
 	}
 
-	generate_crcs(RAMDIR_PATH, crc_file);
-	printf("Generate CRCs finished\n");
-		
-    if (fclose(crc_file) == -1) {
-        perror("close crc_file");
-        exit(1);
-    }
-
-	lcd_display_message(NULL, "Please", "Remove Master USB", NULL);
+	// The MP3 files carry on being processed in the background, and the
+	// sticks can be started meanwhile
+	lcd_display_message(plan_text[0] ? plan_text : NULL, "Please", "Remove Master USB", NULL);
 	set_state(0, READY);
 	beep();
 	
 	// Wait for USB removed
 	printf("Waiting for master USB to be removed\n");
 	while(!usb_device_removed(NULL, NULL)) {
-		usleep(100000);
+		usb_wait_for_event(-1);
 	}
 	
 	lcd_clear();
 	beep();
 
 	
-	// Ask the user to load a blank usb stick into each slot in turn
-	// so we can work out the channel number (and hence LEDs) to associate with each USB slot
-	get_button_state0();
-	get_button_state1();
-	map_usb_port_numbers();
-	get_button_state0();
-	get_button_state1();
+	if (port_map_loaded) {
+		// Hardware unchanged since the map was saved
+		usb_refresh_channel_states();
+	}
+	else {
+		// Ask the user to load a blank usb stick into each slot in turn
+		// so we can work out the channel number (and hence LEDs) to associate with each USB slot
+		get_button_state0();
+		get_button_state1();
+		map_usb_port_numbers();
+		get_button_state0();
+		get_button_state1();
+		portmap_save(shared_data_p);
+	}
 	
 	beep();
-	lcd_display_message("READY", NULL, "Push button to start", NULL);
+	display_ready(ingest_poll());
 	
-	bool starting = true;
-	while(true) {
-		
-		ButtonStateEnum button_state0 = get_button_state0();
-		ButtonStateEnum button_state1 = get_button_state1();
-
-		if (starting && ((button_state0 != BUTTON_NOT_PRESSED) || (button_state1 != BUTTON_NOT_PRESSED)))
-		{
-			lcd_clear();
-			starting = false;
-		}
-
-		hub_main(0, button_state1);
-		hub_main(1, button_state0);
-		
-		usleep(100000);
-	}
+	run_reactor(signal_fd);
 	
 	
     // Cleanup
-    if (munmap(shared_data_p, sizeof(SharedDataStruct)) == -1) {
+    if (munmap(shared_data_p, shared_data_size) == -1) {
         perror("munmap");
         exit(1);
     }
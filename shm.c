@@ -0,0 +1,390 @@
+#include "globals.h"
+#include "utilities.h"
+#include "shm.h"
+#include <signal.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/*
+ * Shared memory layout
+ * --------------------
+ * SHM_NAME holds a SharedDataStruct followed by one ChannelInfoStruct per
+ * USB port. The header records a magic number, ABI version and the sizes
+ * the server was built with, and magic is stored last, so a client or an
+ * external monitoring tool can check the layout matches before reading it.
+ *
+ * Counters and flags that change while copying (bytes_copied, state, halt
+ * ...) are C11 atomics, so 64-bit values are never read half written.
+ * device_name and device_path change together with state when a drive is
+ * inserted or removed, so they are published through each channel's
+ * device_seq seqlock and read with channel_get_device().
+ *
+ * The client also records when each phase of the job started and ended,
+ * the file it is on, bytes verified and a ring of one-second throughput
+ * samples, so the server can show where the time goes on each port.
+ *
+ * Each channel also has two single producer, single consumer rings. The
+ * server sends commands (halt, pause, resume, throttle, priority) and wakes
+ * a waiting client with a futex on the command ring's head. The client
+ * posts events (phase changes, files copied, errors) and rings a SIGUSR1
+ * doorbell on the server, which collects them through its signalfd.
+ *
+ * copier_ctl doesn't write to a command ring itself, which would make a
+ * second producer. It queues a CONTROL_SIGNAL on the server instead, with
+ * the request packed into the signal's int as
+ *
+ *   bits 24-30 channel, 20-23 command, 0-19 value
+ *
+ * and the server sends the command on its behalf.
+ */
+
+// The server has several threads that can send commands, so they take
+// turns to be the command rings' single producer
+static pthread_mutex_t command_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+_Static_assert(sizeof(ChannelInfoStruct) % CACHE_LINE_SIZE == 0, "ChannelInfoStruct must fill whole cache lines");
+_Static_assert(offsetof(SharedDataStruct, channel_info) % CACHE_LINE_SIZE == 0, "channel_info must be cache line aligned");
+
+
+// Fills in the header of a freshly zeroed segment. Call after the channels
+// have been initialised, as storing the magic number marks the segment valid.
+void shm_init_header(SharedDataStruct* shared_data_p, int channel_count)
+{
+    shared_data_p->abi_version = SHM_ABI_VERSION;
+    shared_data_p->header_size = sizeof(SharedDataStruct);
+    shared_data_p->channel_info_size = sizeof(ChannelInfoStruct);
+    shared_data_p->segment_size = SHARED_DATA_SIZE(channel_count);
+    shared_data_p->channel_count = channel_count;
+    shared_data_p->server_pid = getpid();
+    snprintf(shared_data_p->master_dir, sizeof(shared_data_p->master_dir), "%s", RAMDIR_PATH);
+
+    atomic_store_explicit(&shared_data_p->magic, SHM_MAGIC, memory_order_release);
+}
+
+
+// Returns true if the segment was written by a server with the same layout
+// and is big enough for the channels it claims to hold
+bool shm_check_header(const SharedDataStruct* shared_data_p, size_t mapped_size)
+{
+    if (mapped_size < sizeof(SharedDataStruct)) {
+        fprintf(stderr, "ERROR: shared memory is only %zu bytes\n", mapped_size);
+        return false;
+    }
+
+    uint32_t magic = atomic_load_explicit(&shared_data_p->magic, memory_order_acquire);
+    if (magic != SHM_MAGIC) {
+        fprintf(stderr, "ERROR: shared memory magic is 0x%08x, expected 0x%08x\n", magic, SHM_MAGIC);
+        return false;
+    }
+
+    if ((shared_data_p->abi_version != SHM_ABI_VERSION) ||
+        (shared_data_p->header_size != sizeof(SharedDataStruct)) ||
+        (shared_data_p->channel_info_size != sizeof(ChannelInfoStruct))) {
+        fprintf(stderr, "ERROR: shared memory ABI %u (%u/%u bytes), expected %u (%zu/%zu bytes)\n",
+                shared_data_p->abi_version, shared_data_p->header_size, shared_data_p->channel_info_size,
+                SHM_ABI_VERSION, sizeof(SharedDataStruct), sizeof(ChannelInfoStruct));
+        return false;
+    }
+
+    if ((shared_data_p->channel_count < 0) ||
+        (shared_data_p->segment_size != SHARED_DATA_SIZE(shared_data_p->channel_count)) ||
+        (shared_data_p->segment_size > mapped_size)) {
+        fprintf(stderr, "ERROR: shared memory holds %d channels in %lu bytes, but %zu are mapped\n",
+                shared_data_p->channel_count, (unsigned long)shared_data_p->segment_size, mapped_size);
+        return false;
+    }
+
+    return true;
+}
+
+
+// Records the drive now in a channel's port (or "" if none) and its state
+void channel_set_device(ChannelInfoStruct* channel_info_p, const char* name, ChannelStateEnum state)
+{
+    seqlock_write_begin(&channel_info_p->device_seq);
+    snprintf(channel_info_p->device_name, STRING_LEN, "%s", name);
+    atomic_store_explicit(&channel_info_p->state, state, memory_order_relaxed);
+    seqlock_write_end(&channel_info_p->device_seq);
+}
+
+
+// Assigns a USB socket to the channel while mapping ports, along with the
+// drive used to identify it and its state
+void channel_set_path(ChannelInfoStruct* channel_info_p, const char* name, const char* path,
+                      ChannelStateEnum state)
+{
+    seqlock_write_begin(&channel_info_p->device_seq);
+    snprintf(channel_info_p->device_name, STRING_LEN, "%s", name);
+    snprintf(channel_info_p->device_path, STRING_LEN, "%s", path);
+    atomic_store_explicit(&channel_info_p->state, state, memory_order_relaxed);
+    seqlock_write_end(&channel_info_p->device_seq);
+}
+
+
+// Takes a consistent copy of a channel's drive name and USB socket, either of
+// which may be NULL if not wanted. Returns the state that goes with them.
+ChannelStateEnum channel_get_device(ChannelInfoStruct* channel_info_p, char* name, char* path)
+{
+    ChannelStateEnum state;
+    unsigned seq;
+
+    do {
+        seq = seqlock_read_begin(&channel_info_p->device_seq);
+        if (name) memcpy(name, channel_info_p->device_name, STRING_LEN);
+        if (path) memcpy(path, channel_info_p->device_path, STRING_LEN);
+        state = atomic_load_explicit(&channel_info_p->state, memory_order_relaxed);
+    } while (seqlock_read_retry(&channel_info_p->device_seq, seq));
+
+    if (name) name[STRING_LEN - 1] = '\0';
+    if (path) path[STRING_LEN - 1] = '\0';
+    return state;
+}
+
+
+//------------------------------
+// Timing and throughput history
+//------------------------------
+
+// Milliseconds on the system-wide monotonic clock, so timestamps written by
+// one process can be compared with the clock in another
+uint64_t shm_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Clears the history at the start of a new copy job
+void channel_reset_stats(ChannelInfoStruct* channel_info_p)
+{
+    for (int phase = 0; phase < NUMBER_OF_PHASES; phase++) {
+        channel_info_p->phase_time[phase].start_ms = 0;
+        channel_info_p->phase_time[phase].end_ms = 0;
+    }
+    channel_info_p->bytes_verified = 0;
+    channel_info_p->throughput_count = 0;
+    channel_set_file(channel_info_p, 0, "");
+}
+
+
+// Ends whichever phase is running, then starts `phase` (if not NUMBER_OF_PHASES)
+void channel_start_phase(ChannelInfoStruct* channel_info_p, PhaseEnum phase)
+{
+    uint64_t now_ms = shm_now_ms();
+
+    for (int running = 0; running < NUMBER_OF_PHASES; running++) {
+        PhaseTimeStruct* time_p = &channel_info_p->phase_time[running];
+        if ((time_p->start_ms != 0) && (time_p->end_ms == 0)) {
+            time_p->end_ms = now_ms;
+        }
+    }
+
+    if (phase < NUMBER_OF_PHASES) {
+        channel_info_p->phase_time[phase].end_ms = 0;
+        channel_info_p->phase_time[phase].start_ms = now_ms;
+    }
+}
+
+
+// Milliseconds spent in a phase so far, or 0 if it hasn't run
+uint64_t channel_phase_ms(const ChannelInfoStruct* channel_info_p, PhaseEnum phase)
+{
+    uint64_t start_ms = channel_info_p->phase_time[phase].start_ms;
+    uint64_t end_ms = channel_info_p->phase_time[phase].end_ms;
+
+    if (start_ms == 0) return 0;
+    if (end_ms == 0) end_ms = shm_now_ms();
+    return (end_ms > start_ms) ? end_ms - start_ms : 0;
+}
+
+
+// Adds one second's throughput to the history
+void channel_add_throughput(ChannelInfoStruct* channel_info_p, uint32_t kb_per_second)
+{
+    uint32_t count = atomic_load_explicit(&channel_info_p->throughput_count, memory_order_relaxed);
+    atomic_store_explicit(&channel_info_p->throughput_kb[count % THROUGHPUT_SAMPLES], kb_per_second,
+                          memory_order_relaxed);
+    atomic_store_explicit(&channel_info_p->throughput_count, count + 1, memory_order_release);
+}
+
+
+// Records the file now being copied or verified
+void channel_set_file(ChannelInfoStruct* channel_info_p, int file_index, const char* filename)
+{
+    seqlock_write_begin(&channel_info_p->file_seq);
+    snprintf(channel_info_p->current_file, STRING_LEN, "%s", filename);
+    atomic_store_explicit(&channel_info_p->file_index, file_index, memory_order_relaxed);
+    seqlock_write_end(&channel_info_p->file_seq);
+}
+
+
+// Takes a consistent copy of the current file name. Returns its number.
+int channel_get_file(ChannelInfoStruct* channel_info_p, char* filename)
+{
+    int file_index;
+    unsigned seq;
+
+    do {
+        seq = seqlock_read_begin(&channel_info_p->file_seq);
+        memcpy(filename, channel_info_p->current_file, STRING_LEN);
+        file_index = atomic_load_explicit(&channel_info_p->file_index, memory_order_relaxed);
+    } while (seqlock_read_retry(&channel_info_p->file_seq, seq));
+
+    filename[STRING_LEN - 1] = '\0';
+    return file_index;
+}
+
+
+// Bytes of the files that are really on the drive. sendfile() returns once
+// the data is in the page cache, so while copying and syncing this is
+// limited by what the block layer has written. Falls back to bytes_copied
+// until the server has sampled the drive.
+off_t channel_progress_bytes(const ChannelInfoStruct* channel_info_p)
+{
+    off_t copied = atomic_load_explicit(&channel_info_p->bytes_copied, memory_order_relaxed);
+    ChannelStateEnum state = atomic_load_explicit(&channel_info_p->state, memory_order_relaxed);
+    off_t media = channel_info_p->media_copy_bytes;
+
+    if ((media == 0) || ((state != COPYING) && (state != UNMOUNTING))) return copied;
+    return (media < copied) ? media : copied;
+}
+
+
+// Bytes written to the drive per byte of file data since copying started,
+// or 0 if not known yet
+double channel_write_amplification(const ChannelInfoStruct* channel_info_p)
+{
+    off_t copied = atomic_load_explicit(&channel_info_p->bytes_copied, memory_order_relaxed);
+    uint64_t media = channel_info_p->media_copy_bytes;
+
+    if ((copied == 0) || (media == 0)) return 0;
+    return (double)media / copied;
+}
+
+//------------------------------
+// Command and event rings
+//------------------------------
+
+static bool ring_push(RingIndexStruct* ring_p, void* slots, size_t slot_size, const void* item)
+{
+    unsigned head = atomic_load_explicit(&ring_p->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring_p->tail, memory_order_acquire);
+    if (head - tail >= CHANNEL_RING_SIZE) return false;   // full
+
+    memcpy((char*)slots + (head % CHANNEL_RING_SIZE) * slot_size, item, slot_size);
+    atomic_store_explicit(&ring_p->head, head + 1, memory_order_release);
+    return true;
+}
+
+
+static bool ring_pop(RingIndexStruct* ring_p, const void* slots, size_t slot_size, void* item)
+{
+    unsigned tail = atomic_load_explicit(&ring_p->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring_p->head, memory_order_acquire);
+    if (head == tail) return false;   // empty
+
+    memcpy(item, (const char*)slots + (tail % CHANNEL_RING_SIZE) * slot_size, slot_size);
+    atomic_store_explicit(&ring_p->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+
+// Sends a command to the client on a channel, waking it if it is waiting.
+// Returns false if the ring is full.
+bool channel_send_command(ChannelInfoStruct* channel_info_p, ChannelCommandEnum command, int value)
+{
+    ChannelCommandStruct item = { .command = command, .value = value };
+
+    if (command == CMD_HALT) {
+        channel_info_p->halt = true;
+    }
+
+    pthread_mutex_lock(&command_mutex);
+    bool sent = ring_push(&channel_info_p->command_ring, channel_info_p->commands, sizeof(item), &item);
+    pthread_mutex_unlock(&command_mutex);
+
+    if (!sent) {
+        fprintf(stderr, "ERROR: command ring full for device %d\n", channel_info_p->device_id);
+        return false;
+    }
+
+    syscall(SYS_futex, &channel_info_p->command_ring.head, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+    return true;
+}
+
+
+// Discards commands left over from a previous client. Only call while no
+// client is running on the channel, as it takes the consumer's place.
+void channel_clear_commands(ChannelInfoStruct* channel_info_p)
+{
+    pthread_mutex_lock(&command_mutex);
+    unsigned head = atomic_load_explicit(&channel_info_p->command_ring.head, memory_order_relaxed);
+    atomic_store_explicit(&channel_info_p->command_ring.tail, head, memory_order_release);
+    pthread_mutex_unlock(&command_mutex);
+
+    channel_info_p->paused = false;
+    channel_info_p->throttle_kb = 0;
+}
+
+
+// Takes the next command for this client. Returns false if there are none.
+bool channel_get_command(ChannelInfoStruct* channel_info_p, ChannelCommandStruct* command_p)
+{
+    return ring_pop(&channel_info_p->command_ring, channel_info_p->commands, sizeof(*command_p), command_p);
+}
+
+
+// Sleeps until a command arrives or timeout_ms passes
+void channel_wait_command(ChannelInfoStruct* channel_info_p, int timeout_ms)
+{
+    unsigned head = atomic_load_explicit(&channel_info_p->command_ring.head, memory_order_acquire);
+    unsigned tail = atomic_load_explicit(&channel_info_p->command_ring.tail, memory_order_relaxed);
+    if (head != tail) return;
+
+    struct timespec timeout = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L };
+    syscall(SYS_futex, &channel_info_p->command_ring.head, FUTEX_WAIT, head, &timeout, NULL, 0);
+}
+
+
+// Packs a copier_ctl request into the int sent with CONTROL_SIGNAL
+int control_pack(int device_id, ChannelCommandEnum command, int value)
+{
+    return (device_id << 24) | ((int)command << 20) | (value & CONTROL_MAX_VALUE);
+}
+
+
+// Unpacks a copier_ctl request. Returns false if it isn't a valid command.
+bool control_unpack(int word, int* device_id_p, ChannelCommandEnum* command_p, int* value_p)
+{
+    *device_id_p = (word >> 24) & 0x7F;
+    *command_p = (word >> 20) & 0xF;
+    *value_p = word & CONTROL_MAX_VALUE;
+    return (*command_p >= CMD_HALT) && (*command_p <= CMD_PRIORITY);
+}
+
+
+// Posts an event from a client and rings the server's doorbell. If the
+// server has fallen behind the event is dropped and counted.
+void channel_post_event(const SharedDataStruct* shared_data_p, ChannelInfoStruct* channel_info_p,
+                        ChannelEventEnum event, int value, const char* text)
+{
+    ChannelEventStruct item = { .event = event, .value = value };
+    snprintf(item.text, sizeof(item.text), "%s", text ? text : "");
+
+    if (!ring_push(&channel_info_p->event_ring, channel_info_p->events, sizeof(item), &item)) {
+        atomic_fetch_add_explicit(&channel_info_p->events_dropped, 1, memory_order_relaxed);
+    }
+
+    if (shared_data_p->server_pid > 0) {
+        kill(shared_data_p->server_pid, SIGUSR1);
+    }
+}
+
+
+// Takes the next event posted by the client on a channel. Returns false if
+// there are none.
+bool channel_get_event(ChannelInfoStruct* channel_info_p, ChannelEventStruct* event_p)
+{
+    return ring_pop(&channel_info_p->event_ring, channel_info_p->events, sizeof(*event_p), event_p);
+}
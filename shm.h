@@ -0,0 +1,72 @@
+#ifndef SHM_H
+#define SHM_H
+
+/*
+ * Seqlock for the multi-field parts of ChannelInfoStruct.
+ *
+ * The writer makes the sequence odd, updates the fields, then makes it even
+ * again. A reader copies the fields and retries if the sequence was odd or
+ * changed meanwhile, so it never blocks the writer and never sees half an
+ * update. Writers must be serialised by the caller: after start-up they
+ * all run under usb_mutex.
+ */
+
+static inline void seqlock_write_begin(atomic_uint* seq_p)
+{
+    unsigned seq = atomic_load_explicit(seq_p, memory_order_relaxed);
+    atomic_store_explicit(seq_p, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void seqlock_write_end(atomic_uint* seq_p)
+{
+    unsigned seq = atomic_load_explicit(seq_p, memory_order_relaxed);
+    atomic_store_explicit(seq_p, seq + 1, memory_order_release);
+}
+
+static inline unsigned seqlock_read_begin(atomic_uint* seq_p)
+{
+    unsigned seq;
+    while ((seq = atomic_load_explicit(seq_p, memory_order_acquire)) & 1) {
+        sched_yield();
+    }
+    return seq;
+}
+
+// Returns true if the fields read since seqlock_read_begin() may be torn
+static inline bool seqlock_read_retry(atomic_uint* seq_p, unsigned seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq_p, memory_order_relaxed) != seq;
+}
+
+
+void shm_init_header(SharedDataStruct* shared_data_p, int channel_count);
+bool shm_check_header(const SharedDataStruct* shared_data_p, size_t mapped_size);
+
+void channel_set_device(ChannelInfoStruct* channel_info_p, const char* name, ChannelStateEnum state);
+void channel_set_path(ChannelInfoStruct* channel_info_p, const char* name, const char* path,
+                      ChannelStateEnum state);
+ChannelStateEnum channel_get_device(ChannelInfoStruct* channel_info_p, char* name, char* path);
+
+uint64_t shm_now_ms(void);
+void channel_reset_stats(ChannelInfoStruct* channel_info_p);
+void channel_start_phase(ChannelInfoStruct* channel_info_p, PhaseEnum phase);
+uint64_t channel_phase_ms(const ChannelInfoStruct* channel_info_p, PhaseEnum phase);
+void channel_add_throughput(ChannelInfoStruct* channel_info_p, uint32_t kb_per_second);
+void channel_set_file(ChannelInfoStruct* channel_info_p, int file_index, const char* filename);
+int channel_get_file(ChannelInfoStruct* channel_info_p, char* filename);
+off_t channel_progress_bytes(const ChannelInfoStruct* channel_info_p);
+double channel_write_amplification(const ChannelInfoStruct* channel_info_p);
+
+bool channel_send_command(ChannelInfoStruct* channel_info_p, ChannelCommandEnum command, int value);
+void channel_clear_commands(ChannelInfoStruct* channel_info_p);
+bool channel_get_command(ChannelInfoStruct* channel_info_p, ChannelCommandStruct* command_p);
+void channel_wait_command(ChannelInfoStruct* channel_info_p, int timeout_ms);
+int control_pack(int device_id, ChannelCommandEnum command, int value);
+bool control_unpack(int word, int* device_id_p, ChannelCommandEnum* command_p, int* value_p);
+void channel_post_event(const SharedDataStruct* shared_data_p, ChannelInfoStruct* channel_info_p,
+                        ChannelEventEnum event, int value, const char* text);
+bool channel_get_event(ChannelInfoStruct* channel_info_p, ChannelEventStruct* event_p);
+
+#endif // SHM_H
@@ -0,0 +1,172 @@
+#include "globals.h"
+#include "shm.h"
+#include "stage.h"
+
+/*
+ * Staged master read cache
+ * ------------------------
+ * A master too big for the ramdrive is staged on persistent storage (see
+ * ingest.c), and every stick reads it from there. Left to itself the page
+ * cache either keeps the whole master, squeezing everything else, or lets
+ * the leading stick's pages go before the others have read them, so each
+ * file is read from the disk once per stick.
+ *
+ * The clients copy FILE_LIST in order, so a client's bytes_copied is its
+ * position in the list's files laid end to end. While sticks are copying
+ * a staged master, the server keeps [staging] cache_mb of it cached ahead
+ * of the slowest stick:
+ *
+ *   - POSIX_FADV_WILLNEED reads ahead, at most STAGE_STEP_MB per pass, so
+ *     the leading sticks find their files in memory
+ *   - POSIX_FADV_DONTNEED drops what every stick has already copied
+ *
+ * Nothing is done for a master on the ramdrive, which is memory anyway.
+ */
+
+#define STAGE_INTERVAL_MS 250
+#define STAGE_STEP_MB 16
+#define MB (1024 * 1024)
+
+typedef struct {
+    char* path;
+    off_t start;                    // where the file starts in the list
+    off_t size;
+} StageFileStruct;
+
+static off_t window_bytes = 0;
+static StageFileStruct* files = NULL;
+static int file_count = 0;
+static bool loaded = false;
+static off_t total_bytes = 0;
+static off_t fetched = 0;           // WILLNEED has been given up to here ...
+static off_t dropped = 0;           // ... and DONTNEED below here
+static uint64_t last_update_ms = 0;
+
+
+static void free_files(void)
+{
+    for (int i = 0; i < file_count; i++) free(files[i].path);
+    free(files);
+    files = NULL;
+    file_count = 0;
+    loaded = false;
+    total_bytes = 0;
+    fetched = 0;
+    dropped = 0;
+}
+
+
+// Reads FILE_LIST and the size of each file in master_dir
+static void load_files(const char* master_dir)
+{
+    loaded = true;
+    FILE* list = fopen(FILE_LIST, "r");
+    if (!list) {
+        fprintf(stderr, "ERROR: Cannot open %s\n", FILE_LIST);
+        return;
+    }
+
+    char line[PATH_LEN];
+    char path[PATH_LEN * 2];
+    struct stat statbuf;
+    int allocated = 0;
+
+    while (fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0') continue;
+        snprintf(path, sizeof(path), "%s/%s", master_dir, line);
+        if (stat(path, &statbuf) != 0) statbuf.st_size = 0;
+
+        if (file_count == allocated) {
+            allocated = allocated ? allocated * 2 : 256;
+            StageFileStruct* p = realloc(files, allocated * sizeof(StageFileStruct));
+            if (!p) break;
+            files = p;
+        }
+        files[file_count].path = strdup(path);
+        if (!files[file_count].path) break;
+        files[file_count].start = total_bytes;
+        files[file_count].size = statbuf.st_size;
+        total_bytes += statbuf.st_size;
+        file_count++;
+    }
+    fclose(list);
+}
+
+
+// Gives advice for the part of the list from..to
+static void advise(off_t from, off_t to, int advice)
+{
+    for (int i = 0; i < file_count && from < to; i++) {
+        StageFileStruct* file_p = &files[i];
+        off_t end = file_p->start + file_p->size;
+        if (end <= from) continue;
+        if (file_p->start >= to) break;
+
+        off_t offset = from - file_p->start;
+        off_t len = (to < end ? to : end) - from;
+        int fd = open(file_p->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        posix_fadvise(fd, offset, len, advice);
+        close(fd);
+        from += len;
+    }
+}
+
+
+// Sets the read cache for a staged master, 0 to leave it to the kernel
+void stage_init(int cache_mb)
+{
+    window_bytes = (off_t)cache_mb * MB;
+}
+
+
+// Called on each reactor wake-up. Moves the cache window along behind the
+// sticks, at most every STAGE_INTERVAL_MS.
+void stage_update(SharedDataStruct* shared_data_p)
+{
+    uint64_t now_ms = shm_now_ms();
+    if (now_ms - last_update_ms < STAGE_INTERVAL_MS) return;
+    last_update_ms = now_ms;
+
+    if ((window_bytes == 0) || !shared_data_p->master_ready ||
+        (strcmp(shared_data_p->master_dir, RAMDIR_PATH) == 0)) {
+        if (loaded) free_files();
+        return;
+    }
+    if (!loaded) load_files(shared_data_p->master_dir);
+
+    // The slowest stick still copying
+    off_t slowest = -1;
+    for (int i = 0; i < shared_data_p->channel_count; i++) {
+        ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[i];
+        if (channel_info_p->state != COPYING) continue;
+        off_t position = channel_info_p->bytes_copied;
+        if ((slowest < 0) || (position < slowest)) slowest = position;
+    }
+    if (slowest < 0) {
+        fetched = 0;
+        dropped = 0;
+        return;
+    }
+
+    // A stick that has just started is behind what was dropped, and may be
+    // behind what was fetched
+    if (slowest < dropped) {
+        dropped = slowest;
+        fetched = slowest;
+    }
+    if (slowest > dropped) {
+        advise(dropped, slowest, POSIX_FADV_DONTNEED);
+        dropped = slowest;
+    }
+
+    if (fetched < slowest) fetched = slowest;
+    off_t target = slowest + window_bytes;
+    if (target > total_bytes) target = total_bytes;
+    if (target > fetched + (off_t)STAGE_STEP_MB * MB) target = fetched + (off_t)STAGE_STEP_MB * MB;
+    if (target > fetched) {
+        advise(fetched, target, POSIX_FADV_WILLNEED);
+        fetched = target;
+    }
+}
@@ -0,0 +1,7 @@
+#ifndef STAGE_H
+#define STAGE_H
+
+void stage_init(int cache_mb);
+void stage_update(SharedDataStruct* shared_data_p);
+
+#endif // STAGE_H
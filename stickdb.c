@@ -0,0 +1,382 @@
+#include "globals.h"
+#include "utilities.h"
+#include "shm.h"
+#include "stickdb.h"
+#include <limits.h>
+
+/*
+ * Stick database
+ * --------------
+ * Sticks bought in different batches vary a lot in speed and reliability.
+ * When a client starts the server reads the stick's USB identity from sysfs
+ * (idVendor, idProduct, serial, link speed and capacity), and when it exits
+ * appends a StickRecordStruct with the phase times and outcome to
+ * STICKDB_TMPFS_FILE. Appending to tmpfs costs nothing during a batch; the
+ * file is copied to STICKDB_FILE on the SD card at the end of each batch,
+ * and at most every STICKDB_SYNC_MS otherwise.
+ *
+ * The records are summed per model (vendor, product and capacity). Once a
+ * model has STICKDB_MIN_JOBS jobs it is flagged if too many fail, or if it
+ * writes much slower than the sticks as a whole. eta.c uses a known model's
+ * own phase costs instead of the average ones.
+ *
+ * "./copier_sticks" prints the per-model report from either file.
+ */
+
+#define STICKDB_SYNC_MS (10 * 60 * 1000)
+#define STICKDB_MIN_JOBS 5          // jobs before a model can be flagged
+#define STICKDB_MIN_TIMED 3         // successful jobs before a model's costs are used for the ETA
+#define STICKDB_FAIL_PERCENT 20     // failed or stopped by the watchdog
+#define STICKDB_SLOW_FRACTION 0.5   // of the average write speed
+#define MB (1024.0 * 1024.0)
+
+StickModelStruct stick_models[STICKDB_MAX_MODELS];
+int stick_model_count = 0;
+
+// Identity of the stick in each channel, filled in when its job starts
+static StickRecordStruct channel_sticks[MAX_USB_CHANNELS];
+static bool dirty = false;          // records in tmpfs not yet copied to the SD card
+static uint64_t last_sync_ms = 0;
+
+
+//------------------------------
+// Models
+//------------------------------
+
+static uint32_t capacity_gb(uint64_t capacity)
+{
+    return (uint32_t)((capacity + 500000000ULL) / 1000000000ULL);     // as printed on the stick
+}
+
+
+static StickModelStruct* find_model(const StickRecordStruct* record_p, bool create)
+{
+    uint32_t gb = capacity_gb(record_p->capacity);
+
+    for (int i = 0; i < stick_model_count; i++) {
+        StickModelStruct* model_p = &stick_models[i];
+        if ((model_p->vendor_id == record_p->vendor_id) && (model_p->product_id == record_p->product_id) &&
+            (model_p->capacity_gb == gb)) {
+            return model_p;
+        }
+    }
+    if (!create || stick_model_count == STICKDB_MAX_MODELS) return NULL;
+
+    StickModelStruct* model_p = &stick_models[stick_model_count++];
+    memset(model_p, 0, sizeof(StickModelStruct));
+    model_p->vendor_id = record_p->vendor_id;
+    model_p->product_id = record_p->product_id;
+    model_p->capacity_gb = gb;
+    snprintf(model_p->product, sizeof(model_p->product), "%.*s", (int)sizeof(record_p->product), record_p->product);
+    return model_p;
+}
+
+
+// Adds a record to its model's totals. Cancelled jobs say nothing about the stick.
+static StickModelStruct* add_record(const StickRecordStruct* record_p)
+{
+    if (record_p->fail_reason == FAIL_CANCELLED) return NULL;
+
+    StickModelStruct* model_p = find_model(record_p, true);
+    if (!model_p) return NULL;
+
+    model_p->jobs++;
+    model_p->speed_mbps = record_p->speed_mbps;
+    if (record_p->state == SUCCESS) model_p->ok++;
+    if (record_p->fail_reason == FAIL_SLOW) model_p->slow++;
+
+    // Only the copy phase has to have been timed. The others may have been
+    // skipped, e.g. verify turned off, and then rightly cost nothing.
+    double payload_mb = record_p->payload_bytes / MB;
+    uint32_t write_ms = record_p->phase_ms[PHASE_COPY] + record_p->phase_ms[PHASE_SYNC];
+    if ((record_p->state != SUCCESS) || (payload_mb < 1) || (record_p->phase_ms[PHASE_COPY] == 0)) return model_p;
+
+    model_p->timed++;
+    model_p->write_mbps += payload_mb * 1000 / write_ms;
+    if (record_p->phase_ms[PHASE_VERIFY] > 0) {
+        model_p->read_mbps += (record_p->verified_bytes / MB) * 1000 / record_p->phase_ms[PHASE_VERIFY];
+    }
+    for (int phase = 0; phase < NUMBER_OF_PHASES; phase++) {
+        bool per_mb = (phase == PHASE_COPY) || (phase == PHASE_VERIFY);
+        model_p->cost[phase] += per_mb ? record_p->phase_ms[phase] / payload_mb : record_p->phase_ms[phase];
+    }
+    return model_p;
+}
+
+
+// Flags the models that fail too often or write much slower than the rest
+static void update_flags(void)
+{
+    double fleet_mbps = 0;
+    uint32_t fleet_timed = 0;
+    for (int i = 0; i < stick_model_count; i++) {
+        fleet_mbps += stick_models[i].write_mbps;
+        fleet_timed += stick_models[i].timed;
+    }
+    if (fleet_timed > 0) fleet_mbps /= fleet_timed;
+
+    for (int i = 0; i < stick_model_count; i++) {
+        StickModelStruct* model_p = &stick_models[i];
+        bool unreliable = (model_p->jobs - model_p->ok) * 100 >= STICKDB_FAIL_PERCENT * model_p->jobs;
+        bool slow = (model_p->slow * 100 >= STICKDB_FAIL_PERCENT * model_p->jobs) ||
+                    ((model_p->timed > 0) && (model_p->write_mbps / model_p->timed < STICKDB_SLOW_FRACTION * fleet_mbps));
+        model_p->flagged = (model_p->jobs >= STICKDB_MIN_JOBS) && (unreliable || slow);
+    }
+}
+
+
+static const char* flag_reason(const StickModelStruct* model_p)
+{
+    if (!model_p->flagged) return "";
+    if ((model_p->jobs - model_p->ok) * 100 >= STICKDB_FAIL_PERCENT * model_p->jobs) return "UNRELIABLE";
+    return "SLOW";
+}
+
+
+// Reads a database file into stick_models, calling record_cb, if not NULL,
+// for each record. Returns false if the file can't be read.
+bool stickdb_read(const char* filename, void (*record_cb)(const StickRecordStruct* record_p))
+{
+    stick_model_count = 0;
+
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+
+    StickRecordStruct record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.version != STICKDB_VERSION) continue;
+        record.serial[sizeof(record.serial) - 1] = '\0';
+        record.product[sizeof(record.product) - 1] = '\0';
+        add_record(&record);
+        if (record_cb) record_cb(&record);
+    }
+    fclose(file);
+
+    update_flags();
+    return true;
+}
+
+
+void stickdb_print_report(FILE* out)
+{
+    fprintf(out, "%-9s %4s %5s %5s %4s %6s %6s %7s  %s\n",
+            "VID:PID", "GB", "LINK", "JOBS", "OK%", "WRITE", "READ", "FORMAT", "MODEL");
+    for (int i = 0; i < stick_model_count; i++) {
+        const StickModelStruct* model_p = &stick_models[i];
+        double timed = model_p->timed ? model_p->timed : 1;
+
+        fprintf(out, "%04x:%04x %4u %5u %5u %3u%% %6.1f %6.1f %6.1fs  %s%s%s\n",
+                model_p->vendor_id, model_p->product_id, model_p->capacity_gb, model_p->speed_mbps,
+                model_p->jobs, model_p->jobs ? model_p->ok * 100 / model_p->jobs : 0,
+                model_p->write_mbps / timed, model_p->read_mbps / timed, model_p->cost[PHASE_FORMAT] / timed / 1000,
+                model_p->product, model_p->flagged ? "  " : "", flag_reason(model_p));
+    }
+}
+
+
+//------------------------------
+// Recording, in the server
+//------------------------------
+
+static bool read_attribute(const char* dir, const char* attribute, char* value, size_t len)
+{
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", dir, attribute);
+
+    value[0] = '\0';
+    FILE* file = fopen(path, "r");
+    if (!file) return false;
+    if (!fgets(value, len, file)) value[0] = '\0';
+    fclose(file);
+    trim(value);
+    return value[0] != '\0';
+}
+
+
+// Fills in the USB identity and capacity of a disk such as "/dev/sda".
+// The USB device is the first directory above the disk's sysfs node that
+// has an idVendor.
+static bool read_identity(const char* device_name, StickRecordStruct* record_p)
+{
+    const char* name = strrchr(device_name, '/');
+    name = name ? name + 1 : device_name;
+    if (name[0] == '\0') return false;
+
+    char path[PATH_LEN];
+    char dir[PATH_MAX];
+    char value[STRING_LEN];
+    snprintf(path, sizeof(path), "/sys/block/%s", name);
+    if (read_attribute(path, "size", value, sizeof(value))) {
+        record_p->capacity = strtoull(value, NULL, 10) * 512;
+    }
+    if (!realpath(path, dir)) return false;
+
+    char* slash;
+    while (!read_attribute(dir, "idVendor", value, sizeof(value))) {
+        slash = strrchr(dir, '/');
+        if (!slash || slash == dir) return false;
+        *slash = '\0';
+    }
+    record_p->vendor_id = strtoul(value, NULL, 16);
+    if (read_attribute(dir, "idProduct", value, sizeof(value))) record_p->product_id = strtoul(value, NULL, 16);
+    if (read_attribute(dir, "speed", value, sizeof(value))) record_p->speed_mbps = atoi(value);
+    read_attribute(dir, "serial", record_p->serial, sizeof(record_p->serial));
+
+    char manufacturer[STRING_LEN];
+    read_attribute(dir, "manufacturer", manufacturer, sizeof(manufacturer));
+    read_attribute(dir, "product", value, sizeof(value));
+    snprintf(record_p->product, sizeof(record_p->product), "%.14s%s%.14s",
+             manufacturer, (manufacturer[0] && value[0]) ? " " : "", value);
+    return true;
+}
+
+
+static bool copy_whole_file(const char* src_path, const char* dest_path, bool sync)
+{
+    int src_fd = open(src_path, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0) return false;
+    int dest_fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dest_fd < 0) {
+        close(src_fd);
+        return false;
+    }
+
+    char buffer[64 * 1024];
+    ssize_t n = 0;
+    bool ok = true;
+    while (ok && (n = read(src_fd, buffer, sizeof(buffer))) > 0) {
+        ok = (write(dest_fd, buffer, n) == n);
+    }
+    if (n < 0) ok = false;
+    if (ok && sync) ok = (fsync(dest_fd) == 0);
+
+    close(src_fd);
+    if (close(dest_fd) != 0) ok = false;
+    return ok;
+}
+
+
+// Brings the tmpfs copy up to date with the SD card after a reboot, and
+// loads the models. Called at start-up.
+void stickdb_init(void)
+{
+    struct stat saved, working;
+    bool have_saved = (stat(STICKDB_FILE, &saved) == 0);
+    bool have_working = (stat(STICKDB_TMPFS_FILE, &working) == 0);
+
+    if (have_saved && (!have_working || working.st_size < saved.st_size)) {
+        if (!copy_whole_file(STICKDB_FILE, STICKDB_TMPFS_FILE, false)) {
+            fprintf(stderr, "ERROR: Cannot copy %s to %s: %s\n", STICKDB_FILE, STICKDB_TMPFS_FILE, strerror(errno));
+        }
+    }
+    else if (have_working) {
+        // The server stopped before its last records were saved
+        dirty = (!have_saved || working.st_size > saved.st_size);
+    }
+
+    // Drop a record cut short by a crash
+    if ((stat(STICKDB_TMPFS_FILE, &working) == 0) && (working.st_size % sizeof(StickRecordStruct) != 0)) {
+        if (truncate(STICKDB_TMPFS_FILE, working.st_size - working.st_size % sizeof(StickRecordStruct)) == -1) {
+            perror("stickdb truncate");
+        }
+    }
+
+    last_sync_ms = shm_now_ms();
+    if (stickdb_read(STICKDB_TMPFS_FILE, NULL) && (stick_model_count > 0)) {
+        printf("Stick models:\n");
+        stickdb_print_report(stdout);
+    }
+}
+
+
+// Reads the identity of the stick in a channel. Called by the server just
+// before it starts the client.
+void stickdb_start_job(const ChannelInfoStruct* channel_info_p)
+{
+    StickRecordStruct* record_p = &channel_sticks[channel_info_p->device_id];
+    char name[STRING_LEN];
+    char path[STRING_LEN];
+
+    memset(record_p, 0, sizeof(StickRecordStruct));
+    channel_get_device((ChannelInfoStruct*)channel_info_p, name, path);
+    if (!read_identity(name, record_p)) {
+        fprintf(stderr, "ERROR: Cannot read the USB identity of %s\n", name);
+        record_p->vendor_id = 0;
+    }
+}
+
+
+// Appends the record of a finished job. Called when its client has exited.
+void stickdb_job_finished(const SharedDataStruct* shared_data_p, const ChannelInfoStruct* channel_info_p)
+{
+    StickRecordStruct* record_p = &channel_sticks[channel_info_p->device_id];
+    if (record_p->vendor_id == 0) return;
+
+    record_p->version = STICKDB_VERSION;
+    record_p->time = time(NULL);
+    record_p->state = channel_info_p->state;
+    record_p->fail_reason = channel_info_p->fail_reason;
+    record_p->payload_bytes = shared_data_p->total_size;
+    record_p->verified_bytes = channel_info_p->bytes_verified;
+    record_p->hub_number = channel_info_p->hub_number;
+    record_p->port_number = channel_info_p->port_number;
+    for (int phase = 0; phase < NUMBER_OF_PHASES; phase++) {
+        record_p->phase_ms[phase] = channel_phase_ms(channel_info_p, phase);
+    }
+
+    int fd = open(STICKDB_TMPFS_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Cannot open %s: %s\n", STICKDB_TMPFS_FILE, strerror(errno));
+        return;
+    }
+    if (write(fd, record_p, sizeof(StickRecordStruct)) != sizeof(StickRecordStruct)) {
+        fprintf(stderr, "ERROR: Cannot write %s: %s\n", STICKDB_TMPFS_FILE, strerror(errno));
+    }
+    close(fd);
+    dirty = true;
+
+    StickModelStruct* model_p = add_record(record_p);
+    update_flags();
+    if (model_p && model_p->flagged) {
+        printf("WARNING: %04x:%04x %s %uGB is %s: %u of %u jobs OK\n", model_p->vendor_id, model_p->product_id,
+               model_p->product, model_p->capacity_gb, flag_reason(model_p), model_p->ok, model_p->jobs);
+    }
+}
+
+
+// Copies the records to the SD card if any are new. Called on each reactor
+// wake-up, when it only copies every STICKDB_SYNC_MS, and with force set at
+// the end of a batch.
+void stickdb_sync(bool force)
+{
+    if (!dirty) return;
+    uint64_t now_ms = shm_now_ms();
+    if (!force && (now_ms - last_sync_ms < STICKDB_SYNC_MS)) return;
+    last_sync_ms = now_ms;
+
+    char temp_file[PATH_LEN];
+    snprintf(temp_file, sizeof(temp_file), "%s.tmp", STICKDB_FILE);
+    if (!copy_whole_file(STICKDB_TMPFS_FILE, temp_file, true) || (rename(temp_file, STICKDB_FILE) != 0)) {
+        fprintf(stderr, "ERROR: Cannot save %s: %s\n", STICKDB_FILE, strerror(errno));
+        unlink(temp_file);
+        return;
+    }
+    dirty = false;
+}
+
+
+// Fills in the average phase costs of the model in a channel, if it has
+// enough successful jobs. Returns false if not.
+bool stickdb_model_costs(int device_id, double cost[NUMBER_OF_PHASES])
+{
+    const StickRecordStruct* record_p = &channel_sticks[device_id];
+    if (record_p->vendor_id == 0) return false;
+
+    const StickModelStruct* model_p = find_model(record_p, false);
+    if (!model_p || model_p->timed < STICKDB_MIN_TIMED) return false;
+
+    for (int phase = 0; phase < NUMBER_OF_PHASES; phase++) {
+        cost[phase] = model_p->cost[phase] / model_p->timed;
+    }
+    return true;
+}
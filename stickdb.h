@@ -0,0 +1,61 @@
+#ifndef STICKDB_H
+#define STICKDB_H
+
+#define STICKDB_VERSION 1
+#define STICKDB_PHASES 8            // phase slots in a record, room for NUMBER_OF_PHASES to grow
+#define STICKDB_MAX_MODELS 64
+
+// One finished job, as stored in the database. Fixed size, so the file is
+// just an array of these.
+typedef struct {
+    uint32_t version;               // STICKDB_VERSION
+    uint32_t time;                  // when the job finished, Unix time
+    uint16_t vendor_id;             // USB idVendor
+    uint16_t product_id;            // USB idProduct
+    uint16_t speed_mbps;            // USB link speed, e.g. 480
+    uint8_t state;                  // ChannelStateEnum: SUCCESS, FAILED or CRC_FAILED
+    uint8_t fail_reason;            // FailReasonEnum
+    uint64_t capacity;              // bytes
+    uint64_t payload_bytes;         // master size
+    uint64_t verified_bytes;
+    uint32_t phase_ms[STICKDB_PHASES];
+    uint8_t hub_number;
+    uint8_t port_number;
+    char serial[24];
+    char product[30];               // manufacturer and product strings
+} StickRecordStruct;
+
+_Static_assert(sizeof(StickRecordStruct) == 128, "StickRecordStruct is stored on disk");
+_Static_assert(NUMBER_OF_PHASES <= STICKDB_PHASES, "StickRecordStruct has too few phase slots");
+
+// Totals for one model, i.e. vendor, product and capacity
+typedef struct {
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint32_t capacity_gb;
+    char product[30];
+    uint16_t speed_mbps;            // link speed of the latest job
+    uint32_t jobs;                  // excluding cancelled ones
+    uint32_t ok;
+    uint32_t slow;                  // stopped by the watchdog
+    uint32_t timed;                 // successful jobs that copied at least 1 MB with a copy time;
+                                    // a phase the job skipped counts as 0 ms
+    double write_mbps;              // sums over the timed jobs
+    double read_mbps;
+    double cost[NUMBER_OF_PHASES];  // as in eta.c: ms per MB for copy and verify, ms for the rest
+    bool flagged;
+} StickModelStruct;
+
+extern StickModelStruct stick_models[STICKDB_MAX_MODELS];
+extern int stick_model_count;
+
+bool stickdb_read(const char* filename, void (*record_cb)(const StickRecordStruct* record_p));
+void stickdb_print_report(FILE* out);
+
+void stickdb_init(void);
+void stickdb_start_job(const ChannelInfoStruct* channel_info_p);
+void stickdb_job_finished(const SharedDataStruct* shared_data_p, const ChannelInfoStruct* channel_info_p);
+void stickdb_sync(bool force);
+bool stickdb_model_costs(int device_id, double cost[NUMBER_OF_PHASES]);
+
+#endif // STICKDB_H
@@ -0,0 +1,125 @@
+#include "globals.h"
+#include "trace.h"
+#include <sys/syscall.h>
+
+TraceBufferStruct* trace_buffer_p = NULL;
+
+static const char* trace_type_names[NUMBER_OF_TRACE_TYPES] = {
+    "command", "copy_file", "crc", "phase", "lcd", "usb", "batch"
+};
+
+static __thread int32_t trace_tid = 0;
+
+
+const char* get_trace_type_name(TraceTypeEnum type)
+{
+    if ((unsigned)type < NUMBER_OF_TRACE_TYPES) return trace_type_names[type];
+    return "unknown";
+}
+
+
+// Deletes the trace files of an earlier run. Called by the server at
+// start-up, before any client has started. The clients run as root, and
+// TRACE_DIR is sticky, so their files are removed through sudo. Each
+// client also recreates its own file when it starts.
+void trace_remove_all(void)
+{
+    DIR* dir = opendir(TRACE_DIR);
+    if (!dir) return;
+
+    struct dirent* entry;
+    char path[PATH_LEN];
+    char command[PATH_LEN + 32];
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, TRACE_PREFIX, strlen(TRACE_PREFIX)) != 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", TRACE_DIR, entry->d_name);
+        if (unlink(path) == 0 || errno == ENOENT) continue;
+
+        if ((errno == EACCES || errno == EPERM) && !strchr(path, '\'')) {
+            snprintf(command, sizeof(command), "sudo rm -f '%s'", path);
+            if (system(command) == 0) continue;
+        }
+        fprintf(stderr, "ERROR: Cannot delete old trace file %s: %s\n", path, strerror(errno));
+    }
+    closedir(dir);
+}
+
+
+// Creates this process's trace ring, truncating any left by an earlier
+// process with the same label, so a stale ring the server couldn't delete
+// is never read as this run's. Returns false, leaving tracing off, if
+// events is 0 or the file can't be created.
+bool trace_init(const char* label, int channel, int events)
+{
+    if (events <= 0) return false;
+
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s%s", TRACE_DIR, TRACE_PREFIX, label);
+    size_t size = TRACE_FILE_SIZE(events);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Cannot create trace file %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, size) == -1) {
+        fprintf(stderr, "ERROR: Cannot size trace file %s: %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    TraceBufferStruct* buffer_p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (buffer_p == MAP_FAILED) {
+        perror("trace mmap");
+        return false;
+    }
+
+    // The file is new, so already zero
+    buffer_p->version = TRACE_VERSION;
+    buffer_p->pid = getpid();
+    buffer_p->channel = channel;
+    buffer_p->capacity = events;
+    buffer_p->record_size = sizeof(TraceRecordStruct);
+    snprintf(buffer_p->label, sizeof(buffer_p->label), "%s", label);
+    atomic_store_explicit(&buffer_p->magic, TRACE_MAGIC, memory_order_release);
+
+    trace_buffer_p = buffer_p;
+    return true;
+}
+
+
+// Appends one event. Safe to call from any thread of the process.
+void trace_record(TraceTypeEnum type, TraceKindEnum kind, int64_t value, const char* text)
+{
+    TraceBufferStruct* buffer_p = trace_buffer_p;
+    if (!buffer_p) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (trace_tid == 0) trace_tid = syscall(SYS_gettid);
+
+    uint64_t index = atomic_fetch_add_explicit(&buffer_p->head, 1, memory_order_relaxed);
+    TraceRecordStruct* record_p = &buffer_p->records[index % buffer_p->capacity];
+
+    // Invalidate the slot first, so a reader can't mistake a half written
+    // record for the one it replaces
+    atomic_store_explicit(&record_p->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    record_p->time_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record_p->tid = trace_tid;
+    record_p->channel = buffer_p->channel;
+    record_p->type = type;
+    record_p->kind = kind;
+    record_p->value = value;
+    if (text) {
+        strncpy(record_p->text, text, TRACE_TEXT_LEN - 1);
+        record_p->text[TRACE_TEXT_LEN - 1] = '\0';
+    }
+    else {
+        record_p->text[0] = '\0';
+    }
+
+    atomic_store_explicit(&record_p->seq, index + 1, memory_order_release);
+}
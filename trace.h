@@ -0,0 +1,94 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Trace recorder
+ * --------------
+ * Each process (the server and every client) records timestamped events in a
+ * ring buffer of its own, a file in TRACE_DIR mapped into memory. Recording
+ * an event is a clock read, an atomic increment and a 64 byte store, so
+ * tracing can be left on. Old events are overwritten once the ring is full.
+ * copier_trace merges the files into a timeline or a summary.
+ *
+ * All processes use CLOCK_MONOTONIC, so their timestamps can be compared.
+ */
+
+#define TRACE_DIR "/dev/shm"
+#define TRACE_PREFIX "usb_copier_trace."    // followed by "server" or "clientNN"
+#define TRACE_MAGIC 0x43525454              // "TTRC"
+#define TRACE_VERSION 1
+#define TRACE_TEXT_LEN 32
+#define TRACE_DEFAULT_EVENTS 16384          // 1MB per process
+#define TRACE_MAX_EVENTS (1024 * 1024)
+
+
+typedef enum {
+	TRACE_COMMAND,      // execute_command, text = the command, end value = exit code
+	TRACE_COPY_FILE,    // copy_file, text = file name, end value = bytes copied
+	TRACE_CRC,          // compute_crc32, text = file name, end value = bytes read
+	TRACE_PHASE,        // client state change, value = ChannelStateEnum, text = its name
+	TRACE_LCD,          // lcd_write_string, text = the line written
+	TRACE_USB,          // drive inserted (value 1) or removed (value 0), text = device
+	TRACE_BATCH,        // a button's batch, from start to finish, value = button
+	NUMBER_OF_TRACE_TYPES
+} TraceTypeEnum;
+
+typedef enum {
+	TRACE_BEGIN,
+	TRACE_END,
+	TRACE_INSTANT
+} TraceKindEnum;
+
+
+typedef struct {
+	_Atomic uint64_t seq;       // index + 1 once the record is complete
+	uint64_t time_ns;           // CLOCK_MONOTONIC
+	int32_t tid;
+	int16_t channel;            // -1 in the server
+	uint8_t type;               // TraceTypeEnum
+	uint8_t kind;               // TraceKindEnum
+	int64_t value;
+	char text[TRACE_TEXT_LEN];
+} TraceRecordStruct;
+
+typedef struct {
+	_Atomic uint32_t magic;     // TRACE_MAGIC once the header is filled in
+	uint32_t version;           // TRACE_VERSION
+	int32_t pid;
+	int32_t channel;
+	uint32_t capacity;          // number of records in the ring
+	uint32_t record_size;       // sizeof(TraceRecordStruct)
+	char label[16];
+	_Atomic uint64_t head;      // records ever written
+	_Alignas(CACHE_LINE_SIZE) TraceRecordStruct records[];
+} TraceBufferStruct;
+
+_Static_assert(sizeof(TraceRecordStruct) == 64, "TraceRecordStruct should fill one cache line");
+
+#define TRACE_FILE_SIZE(capacity) (sizeof(TraceBufferStruct) + (size_t)(capacity) * sizeof(TraceRecordStruct))
+
+
+extern TraceBufferStruct* trace_buffer_p;
+
+void trace_remove_all(void);
+bool trace_init(const char* label, int channel, int events);
+void trace_record(TraceTypeEnum type, TraceKindEnum kind, int64_t value, const char* text);
+const char* get_trace_type_name(TraceTypeEnum type);
+
+// Tracing is off until trace_init() succeeds, and then these cost one test
+static inline void trace_begin(TraceTypeEnum type, const char* text)
+{
+	if (trace_buffer_p) trace_record(type, TRACE_BEGIN, 0, text);
+}
+
+static inline void trace_end(TraceTypeEnum type, int64_t value)
+{
+	if (trace_buffer_p) trace_record(type, TRACE_END, value, NULL);
+}
+
+static inline void trace_instant(TraceTypeEnum type, int64_t value, const char* text)
+{
+	if (trace_buffer_p) trace_record(type, TRACE_INSTANT, value, text);
+}
+
+#endif // TRACE_H
@@ -1,21 +1,35 @@
 #include "globals.h"
 #include "utilities.h"
 #include "usb.h"
+#include "shm.h"
 #include "lcd.h"
+#include "trace.h"
+#include <poll.h>
+#include <sys/eventfd.h>
 
 /*
  * USB monitor
  * -----------
- * A background thread polls /sys/block every 200ms for removable sd* devices.
+ * A background thread listens on a libudev netlink monitor for "block"
+ * events on removable sd* disks. The set of present disks is seeded by one
+ * udev enumeration pass at start-up and then kept up to date from the events.
+ *
+ * Events are coalesced: a change is only committed once the event stream has
+ * been quiet for USB_SETTLE_MS (or USB_SETTLE_MAX_MS has passed since the
+ * first event of a burst), so a powered hub bringing up seven sticks at once
+ * produces a single pass. A disk with a partition table is held back until
+ * its first partition node exists, because the clients mount <disk>1.
+ *
  * Inserts and removals are placed in two small FIFO event queues, guarded by
  * a mutex, so the main thread can drain them without racing or losing events.
- *
- * TODO: replace the polling with a libudev netlink monitor for lower latency
- * and lower CPU. libudev is already included via globals.h.
+ * An eventfd is signalled whenever events are queued so the main thread can
+ * sleep on it instead of polling the queues.
  */
 
 #define USB_EVENT_QUEUE_LEN (MAX_USB_CHANNELS * 2)
-#define USB_POLL_INTERVAL_US 200000
+#define USB_SETTLE_MS 250            // quiet time that ends a burst of udev events
+#define USB_SETTLE_MAX_MS 1000       // longest a burst can delay a commit
+#define USB_PARTITION_WAIT_MS 3000   // give up waiting for partitions after this
 
 typedef struct {
     NamePathStruct events[USB_EVENT_QUEUE_LEN];
@@ -30,10 +44,23 @@ static volatile bool    usb_monitor_stop = false;
 
 static UsbEventQueue    inserted_queue;
 static UsbEventQueue    removed_queue;
+static int              usb_event_fd = -1;
+static int              usb_stop_fd = -1;
+
+static struct udev*         udev_p;
+static struct udev_monitor* udev_monitor_p;
 
 static SharedDataStruct* shared_data_p;
 static NamePathStruct    usb_devices_loaded[MAX_USB_CHANNELS];
 
+// Open-addressed hash index from device_path to device_id, rebuilt whenever
+// the port map changes. Slots hold device_id + 1 so that 0 means empty.
+#define PORT_INDEX_SIZE (MAX_USB_CHANNELS * 4)
+
+static pthread_rwlock_t  port_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int               port_index[PORT_INDEX_SIZE];
+static bool              port_index_built = false;
+
 
 // Bounded string copy that always null-terminates and is opaque to GCC's
 // format-truncation analysis. `dst_size` must be > 0.
@@ -140,12 +167,105 @@ bool device_is_loaded(char* device_name)
 }
 
 
+// Read-ahead of a disk such as "/dev/sda" in KB, from sysfs, or -1 if it
+// can't be read
+int usb_get_readahead_kb(const char* device_name)
+{
+    const char* name = strrchr(device_name, '/');
+    name = name ? name + 1 : device_name;
+
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "/sys/block/%s/queue/read_ahead_kb", name);
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+    int kb;
+    if (fscanf(file, "%d", &kb) != 1) kb = -1;
+    fclose(file);
+    return kb;
+}
+
+
+// Sets the read-ahead of a disk and its partitions. blockdev counts in
+// 512 byte sectors, and needs root for BLKRASET.
+bool usb_set_readahead_kb(const char* device_name, int kb)
+{
+    char command[STRING_LEN + 64];
+    snprintf(command, sizeof(command), "sudo blockdev --setra %d %s", kb * 2, device_name);
+    return execute_command(-1, command, false) == 0;
+}
+
+
+// FNV-1a hash of a USB port path
+static uint32_t hash_path(const char* path)
+{
+    uint32_t hash = 2166136261u;
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+// Assigns the USB socket `path` to a channel while mapping ports. `name` is
+// the drive that was inserted to identify it.
+void usb_assign_port(int device_id, const char* name, const char* path)
+{
+    pthread_mutex_lock(&usb_mutex);
+    channel_set_path(&shared_data_p->channel_info[device_id], name, path, READY);
+    pthread_mutex_unlock(&usb_mutex);
+
+    usb_rebuild_port_index(shared_data_p);
+}
+
+
+// Rebuilds the device_path -> device_id index from the port map held in
+// shared memory. Call after any channel's device_path has been changed.
+void usb_rebuild_port_index(const SharedDataStruct* sdp)
+{
+    pthread_rwlock_wrlock(&port_index_lock);
+    memset(port_index, 0, sizeof(port_index));
+
+    for (int device_id = 0; device_id < sdp->channel_count; device_id++) {
+        const char* path = sdp->channel_info[device_id].device_path;
+        if (path[0] == '\0') continue;
+
+        uint32_t slot = hash_path(path) % PORT_INDEX_SIZE;
+        while (port_index[slot] != 0) {
+            slot = (slot + 1) % PORT_INDEX_SIZE;
+        }
+        port_index[slot] = device_id + 1;
+    }
+
+    port_index_built = true;
+    pthread_rwlock_unlock(&port_index_lock);
+}
+
+
 // Returns -1 if the path is invalid
 int get_device_id_from_path(const SharedDataStruct* sdp, const char* path)
 {
-    if (!sdp || !path) return -1;
+    if (!sdp || !path || path[0] == '\0') return -1;
+
+    pthread_rwlock_rdlock(&port_index_lock);
+    if (port_index_built) {
+        int device_id = -1;
+        uint32_t slot = hash_path(path) % PORT_INDEX_SIZE;
+        while (port_index[slot] != 0) {
+            int candidate = port_index[slot] - 1;
+            if (strcmp(sdp->channel_info[candidate].device_path, path) == 0) {
+                device_id = candidate;
+                break;
+            }
+            slot = (slot + 1) % PORT_INDEX_SIZE;
+        }
+        pthread_rwlock_unlock(&port_index_lock);
+        return device_id;
+    }
+    pthread_rwlock_unlock(&port_index_lock);
 
-    for (int device_id = 0; device_id < MAX_USB_CHANNELS; device_id++) {
+    // No index yet - fall back to a linear search
+    for (int device_id = 0; device_id < sdp->channel_count; device_id++) {
         const ChannelInfoStruct* channel_info_p = &sdp->channel_info[device_id];
         if (strcmp(channel_info_p->device_path, path) == 0) {
             return device_id;
@@ -155,6 +275,31 @@ int get_device_id_from_path(const SharedDataStruct* sdp, const char* path)
 }
 
 
+// Sets every mapped channel to READY if a drive is loaded in its port, or
+// EMPTY if not. Used once the port map is known, as drives inserted before
+// then could not be matched to a channel.
+void usb_refresh_channel_states(void)
+{
+    pthread_mutex_lock(&usb_mutex);
+
+    for (int device_id = 0; device_id < shared_data_p->channel_count; device_id++) {
+        channel_set_device(&shared_data_p->channel_info[device_id], "", EMPTY);
+    }
+
+    for (int i = 0; i < MAX_USB_CHANNELS; i++) {
+        if (usb_devices_loaded[i].device_path[0] == '\0') continue;
+
+        int device_id = get_device_id_from_path(shared_data_p, usb_devices_loaded[i].device_path);
+        if (device_id >= 0) {
+            channel_set_device(&shared_data_p->channel_info[device_id],
+                               usb_devices_loaded[i].device_name, READY);
+        }
+    }
+
+    pthread_mutex_unlock(&usb_mutex);
+}
+
+
 //------------------------------------------------------------------------------------------------
 // List of usb devices currently loaded
 // (Used to detect insertions or removals)
@@ -205,170 +350,341 @@ static int find_in_devices_loaded_list(const char* path)
 
 
 //------------------------------------------------------------------------------------------------
-// Monitor USB Drives thread
+// Present device set (only touched by the monitor thread)
 //------------------------------------------------------------------------------------------------
 
-/**
- * @brief Thread function to monitor USB drive insertions and removals.
- * @param arg Unused.
- * @return NULL.
- */
-void* monitor_usb_drives_thread_function(void* arg)
+typedef struct {
+    NamePathStruct device;
+    bool     has_partition_table;   // udev found a partition table on the disk
+    uint64_t first_seen_ms;         // when the disk was first reported
+} PresentDeviceStruct;
+
+static PresentDeviceStruct usb_devices_present[MAX_USB_CHANNELS];
+static int                 usb_devices_present_count = 0;
+
+
+static uint64_t monotonic_ms(void)
 {
-    (void)arg;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    printf("Monitoring for USB drive events in thread...\n");
-    char link_path[PATH_LEN];
+
+// Returns the whole-disk device for a disk or partition event, or NULL if the
+// device isn't a removable sd* disk. The returned device is owned by `dev`.
+static struct udev_device* get_removable_disk(struct udev_device* dev)
+{
+    const char* devtype = udev_device_get_devtype(dev);
+    if (!devtype) return NULL;
+
+    struct udev_device* disk = dev;
+    if (strcmp(devtype, "partition") == 0) {
+        disk = udev_device_get_parent_with_subsystem_devtype(dev, "block", "disk");
+        if (!disk) return NULL;
+    }
+    else if (strcmp(devtype, "disk") != 0) {
+        return NULL;
+    }
+
+    // Only interested in sdX devices
+    const char* sysname = udev_device_get_sysname(disk);
+    if (!sysname || strncmp(sysname, "sd", 2) != 0) return NULL;
+
+    const char* removable = udev_device_get_sysattr_value(disk, "removable");
+    if (!removable || atoi(removable) != 1) return NULL;
+
+    return disk;
+}
+
+
+static int find_present_device(const char* name)
+{
+    for (int i = 0; i < usb_devices_present_count; i++) {
+        if (strcmp(usb_devices_present[i].device.device_name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+static void add_present_device(struct udev_device* disk)
+{
+    char name[STRING_LEN];
     char path[PATH_LEN];
-    char buff[STRING_LEN];
-    NamePathStruct usb_devices[MAX_USB_CHANNELS]; // list of USB drives actually present
-    int usb_devices_count;
-    struct dirent* ent;
 
-    while (!usb_monitor_stop) {
+    safe_copy_prefixed(name, sizeof(name), "/dev/", udev_device_get_sysname(disk));
+    extract_usb_path(udev_device_get_syspath(disk), path);
+    bool has_partition_table = udev_device_get_property_value(disk, "ID_PART_TABLE_TYPE") != NULL;
+
+    int i = find_present_device(name);
+    if (i < 0) {
+        if (usb_devices_present_count >= MAX_USB_CHANNELS) {
+            fprintf(stderr, "WARNING: more than %d removable sd* devices found; ignoring extras\n",
+                    MAX_USB_CHANNELS);
+            return;
+        }
+        i = usb_devices_present_count++;
+        usb_devices_present[i].first_seen_ms = monotonic_ms();
+    }
+
+    safe_copy(usb_devices_present[i].device.device_name, STRING_LEN, name);
+    safe_copy(usb_devices_present[i].device.device_path, STRING_LEN, path);
+    usb_devices_present[i].has_partition_table = has_partition_table;
+}
+
+
+// By the time a disk's "remove" event arrives its sysfs node has gone, so
+// it is matched by name alone
+static void remove_present_device(const char* sysname)
+{
+    char name[STRING_LEN];
+    safe_copy_prefixed(name, sizeof(name), "/dev/", sysname);
+
+    int i = find_present_device(name);
+    if (i < 0) return;
+
+    usb_devices_present[i] = usb_devices_present[--usb_devices_present_count];
+}
 
-        // ----- Scan /sys/block for currently-present removable devices -----
 
-        DIR* dir = opendir("/sys/block");
-        if (dir == NULL) {
-            perror("Failed to open /sys/block");
-            // Don't exit the whole process - just wait and retry.
-            usleep(USB_POLL_INTERVAL_US);
-            continue;
+// A disk is ready once the partition the clients will mount (<disk>1) exists,
+// or straight away if it has no partition table to wait for
+static bool device_is_ready(const PresentDeviceStruct* present, uint64_t now_ms)
+{
+    if (!present->has_partition_table) return true;
+    if (now_ms - present->first_seen_ms >= USB_PARTITION_WAIT_MS) return true;
+
+    char partition[PATH_LEN];
+    const char* name = strrchr(present->device.device_name, '/');
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-truncation"
+    snprintf(partition, sizeof(partition), "/sys/class/block/%s1", name ? name + 1 : present->device.device_name);
+#pragma GCC diagnostic pop
+    return access(partition, F_OK) == 0;
+}
+
+
+static void handle_udev_event(struct udev_device* dev)
+{
+    const char* action = udev_device_get_action(dev);
+    if (!action) return;
+
+    if (strcmp(action, "remove") == 0) {
+        // Partitions are removed along with their disk, so only the disk
+        // counts. Its attributes can't be read any more, but only removable
+        // disks were added to the present set in the first place.
+        const char* devtype = udev_device_get_devtype(dev);
+        const char* sysname = udev_device_get_sysname(dev);
+        if (devtype && sysname && strcmp(devtype, "disk") == 0) {
+            remove_present_device(sysname);
         }
+    }
+    else if (strcmp(action, "add") == 0 || strcmp(action, "change") == 0) {
+        struct udev_device* disk = get_removable_disk(dev);
+        if (disk) add_present_device(disk);
+    }
+}
 
-        memset(usb_devices, 0, sizeof(usb_devices));
-        usb_devices_count = 0;
 
-        while ((ent = readdir(dir)) != NULL) {
+// Seeds the present device set with the drives already plugged in at start-up
+static void enumerate_present_devices(void)
+{
+    struct udev_enumerate* enumerate = udev_enumerate_new(udev_p);
+    if (!enumerate) {
+        fprintf(stderr, "ERROR: udev_enumerate_new failed\n");
+        return;
+    }
 
-            // Only interested in sdX devices
-            if (strncmp(ent->d_name, "sd", 2) != 0) continue;
+    udev_enumerate_add_match_subsystem(enumerate, "block");
+    udev_enumerate_add_match_property(enumerate, "DEVTYPE", "disk");
+    udev_enumerate_add_match_sysname(enumerate, "sd*");
+    udev_enumerate_scan_devices(enumerate);
 
-            // Check if the device is removable
-            snprintf(path, sizeof(path), "/sys/block/%s/removable", ent->d_name);
-            FILE* f = fopen(path, "r");
-            if (!f) continue;
+    struct udev_list_entry* entry;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+        struct udev_device* dev = udev_device_new_from_syspath(udev_p, udev_list_entry_get_name(entry));
+        if (!dev) continue;
 
-            bool removable = false;
-            if (fgets(buff, sizeof(buff), f) != NULL && atoi(buff) == 1) {
-                removable = true;
-            }
-            fclose(f);
-            if (!removable) continue;
-
-            // Only now that we've accepted this device do we check capacity.
-            // (Checking earlier would count non-sd entries like loop/mmcblk.)
-            if (usb_devices_count >= MAX_USB_CHANNELS) {
-                fprintf(stderr, "WARNING: more than %d removable sd* devices found; ignoring extras\n",
-                        MAX_USB_CHANNELS);
-                break;
-            }
+        if (get_removable_disk(dev)) {
+            add_present_device(dev);
+        }
+        udev_device_unref(dev);
+    }
 
-            // Resolve the symbolic link to get the USB port path
-            snprintf(path, sizeof(path), "/sys/block/%s", ent->d_name);
-            ssize_t len = readlink(path, link_path, sizeof(link_path) - 1);
-            if (len == -1) {
-                perror("Failed to read symbolic link");
-                continue;
-            }
-            link_path[len] = '\0';
+    udev_enumerate_unref(enumerate);
+}
 
-            extract_usb_path(link_path, path);
 
-            // Fill in this slot with bounded, null-terminating copies
-            safe_copy_prefixed(usb_devices[usb_devices_count].device_name,
-                               STRING_LEN, "/dev/", ent->d_name);
-            safe_copy(usb_devices[usb_devices_count].device_path,
-                      STRING_LEN, path);
-            usb_devices_count++;
+// Compares the ready devices in usb_devices_present against usb_devices_loaded
+// and queues the differences as insert/remove events.
+// Returns true if some devices are still waiting for their partitions.
+static bool commit_present_devices(void)
+{
+    NamePathStruct usb_devices[MAX_USB_CHANNELS]; // list of USB drives actually present
+    int usb_devices_count = 0;
+    bool waiting = false;
+    uint64_t now_ms = monotonic_ms();
+
+    for (int i = 0; i < usb_devices_present_count; i++) {
+        if (device_is_ready(&usb_devices_present[i], now_ms)) {
+            usb_devices[usb_devices_count++] = usb_devices_present[i].device;
         }
+        else {
+            waiting = true;
+        }
+    }
+
+    // ----- Compare against usb_devices_loaded to detect changes -----
+    //
+    // Everything below touches shared state, so hold the mutex for the
+    // whole diff. The critical section is bounded by MAX_USB_CHANNELS^2
+    // string comparisons, which is trivial.
+
+    pthread_mutex_lock(&usb_mutex);
+    bool changed = false;
+
+    // Insertions: entries in usb_devices that aren't in usb_devices_loaded
+    for (int i = 0; i < usb_devices_count; i++) {
+        if (find_in_devices_loaded_list(usb_devices[i].device_path) < 0) {
+            changed = true;
+            add_to_devices_loaded_list(usb_devices[i].device_name,
+                                       usb_devices[i].device_path);
 
-        closedir(dir);
-
-        // ----- Compare against usb_devices_loaded to detect changes -----
-        //
-        // Everything below touches shared state, so hold the mutex for the
-        // whole diff. The critical section is bounded by MAX_USB_CHANNELS^2
-        // string comparisons, which is trivial.
-
-        pthread_mutex_lock(&usb_mutex);
-
-        // Insertions: entries in usb_devices that aren't in usb_devices_loaded
-        for (int i = 0; i < usb_devices_count; i++) {
-            if (find_in_devices_loaded_list(usb_devices[i].device_path) < 0) {
-                add_to_devices_loaded_list(usb_devices[i].device_name,
-                                           usb_devices[i].device_path);
-
-                queue_push(&inserted_queue,
-                           usb_devices[i].device_name,
-                           usb_devices[i].device_path);
-
-                if (shared_data_p) {
-                    int device_id = get_device_id_from_path(shared_data_p,
-                                                            usb_devices[i].device_path);
-                    printf("add usb device. path=%s, device_id=%d\n",
-                           usb_devices[i].device_path, device_id);
-
-                    if (device_id >= 0) {
-                        ChannelInfoStruct* client_info_p =
-                            &shared_data_p->channel_info[device_id];
-                        client_info_p->state = READY;
-                        safe_copy(client_info_p->device_name, STRING_LEN,
-                                  usb_devices[i].device_name);
-                    }
+            queue_push(&inserted_queue,
+                       usb_devices[i].device_name,
+                       usb_devices[i].device_path);
+            trace_instant(TRACE_USB, 1, usb_devices[i].device_name);
+
+            if (shared_data_p) {
+                int device_id = get_device_id_from_path(shared_data_p,
+                                                        usb_devices[i].device_path);
+                printf("add usb device. path=%s, device_id=%d\n",
+                       usb_devices[i].device_path, device_id);
+
+                if (device_id >= 0) {
+                    channel_set_device(&shared_data_p->channel_info[device_id],
+                                       usb_devices[i].device_name, READY);
                 }
             }
         }
+    }
 
-        // Removals: entries in usb_devices_loaded that aren't in usb_devices
-        for (int i = 0; i < MAX_USB_CHANNELS; i++) {
-            if (usb_devices_loaded[i].device_path[0] == '\0') continue;
+    // Removals: entries in usb_devices_loaded that aren't in usb_devices
+    for (int i = 0; i < MAX_USB_CHANNELS; i++) {
+        if (usb_devices_loaded[i].device_path[0] == '\0') continue;
 
-            bool found = false;
-            for (int j = 0; j < usb_devices_count; j++) {
-                if (strcmp(usb_devices[j].device_path,
-                           usb_devices_loaded[i].device_path) == 0) {
-                    found = true;
-                    break;
-                }
+        bool found = false;
+        for (int j = 0; j < usb_devices_count; j++) {
+            if (strcmp(usb_devices[j].device_path,
+                       usb_devices_loaded[i].device_path) == 0) {
+                found = true;
+                break;
             }
-            if (found) continue;
+        }
+        if (found) continue;
+
+        // Device is no longer present.
+        changed = true;
+        int device_id = -1;
+        if (shared_data_p) {
+            device_id = get_device_id_from_path(shared_data_p,
+                                                usb_devices_loaded[i].device_path);
+        }
+        printf("Removed usb device. id=%d, path=%s\n",
+               device_id, usb_devices_loaded[i].device_path);
+
+        queue_push(&removed_queue,
+                   usb_devices_loaded[i].device_name,
+                   usb_devices_loaded[i].device_path);
+        trace_instant(TRACE_USB, 0, usb_devices_loaded[i].device_name);
+
+        // Remove from the loaded list
+        usb_devices_loaded[i].device_name[0] = '\0';
+        usb_devices_loaded[i].device_path[0] = '\0';
+
+        if (shared_data_p && device_id >= 0) {
+            ChannelInfoStruct* client_info_p =
+                &shared_data_p->channel_info[device_id];
+
+            // Preserve FAILED/CRC_FAILED so the operator can see which
+            // slot failed even after the stick is pulled.
+            if (client_info_p->state != FAILED &&
+                client_info_p->state != CRC_FAILED) {
+                channel_set_device(client_info_p, "", EMPTY);
+            }
+        }
+    }
 
-            // Device is no longer present.
-            int device_id = -1;
-            if (shared_data_p) {
-                device_id = get_device_id_from_path(shared_data_p,
-                                                    usb_devices_loaded[i].device_path);
+    pthread_mutex_unlock(&usb_mutex);
+
+    if (changed) {
+        uint64_t one = 1;
+        if (write(usb_event_fd, &one, sizeof(one)) != sizeof(one)) {
+            fprintf(stderr, "ERROR: Failed to signal USB event\n");
+        }
+    }
+
+    return waiting;
+}
+
+
+//------------------------------------------------------------------------------------------------
+// Monitor USB Drives thread
+//------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Thread function to monitor USB drive insertions and removals.
+ * @param arg Unused.
+ * @return NULL.
+ */
+void* monitor_usb_drives_thread_function(void* arg)
+{
+    (void)arg;
+
+    printf("Monitoring for USB drive events in thread...\n");
+
+    enumerate_present_devices();
+    bool waiting = commit_present_devices();
+
+    struct pollfd fds[2] = {
+        { .fd = udev_monitor_get_fd(udev_monitor_p), .events = POLLIN },
+        { .fd = usb_stop_fd,                         .events = POLLIN },
+    };
+    bool     in_burst = false;
+    uint64_t burst_start_ms = 0;
+
+    while (!usb_monitor_stop) {
+
+        int timeout = (in_burst || waiting) ? USB_SETTLE_MS : -1;
+        int ready = poll(fds, 2, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("USB monitor poll failed");
+            break;
+        }
+        if (fds[1].revents & POLLIN) break;
+
+        if (fds[0].revents & POLLIN) {
+            struct udev_device* dev;
+            while ((dev = udev_monitor_receive_device(udev_monitor_p)) != NULL) {
+                handle_udev_event(dev);
+                udev_device_unref(dev);
             }
-            printf("Removed usb device. id=%d, path=%s\n",
-                   device_id, usb_devices_loaded[i].device_path);
-
-            queue_push(&removed_queue,
-                       usb_devices_loaded[i].device_name,
-                       usb_devices_loaded[i].device_path);
-
-            // Remove from the loaded list
-            usb_devices_loaded[i].device_name[0] = '\0';
-            usb_devices_loaded[i].device_path[0] = '\0';
-
-            if (shared_data_p && device_id >= 0) {
-                ChannelInfoStruct* client_info_p =
-                    &shared_data_p->channel_info[device_id];
-
-                // Preserve FAILED/CRC_FAILED so the operator can see which
-                // slot failed even after the stick is pulled.
-                if (client_info_p->state != FAILED &&
-                    client_info_p->state != CRC_FAILED) {
-                    client_info_p->state = EMPTY;
-                    client_info_p->device_name[0] = '\0';
-                }
+
+            if (!in_burst) {
+                in_burst = true;
+                burst_start_ms = monotonic_ms();
             }
-        }
 
-        pthread_mutex_unlock(&usb_mutex);
+            // Keep collecting until the burst goes quiet, but don't let a
+            // continuous stream of events hold back the commit for ever
+            if (monotonic_ms() - burst_start_ms < USB_SETTLE_MAX_MS) continue;
+        }
 
-        usleep(USB_POLL_INTERVAL_US);
+        in_burst = false;
+        waiting = commit_present_devices();
     }
 
     return NULL;
@@ -413,6 +729,34 @@ bool usb_device_removed(char* name, char* path)
 }
 
 
+// Returns an eventfd that becomes readable whenever insert or removal events
+// have been queued. Drain it with usb_wait_for_event() or read().
+int usb_get_event_fd(void)
+{
+    return usb_event_fd;
+}
+
+
+// Sleeps until USB events have been queued or timeout_ms expires (-1 waits
+// forever). Returns true if woken by an event. Events queued before the call
+// are not lost - the eventfd stays readable until drained.
+bool usb_wait_for_event(int timeout_ms)
+{
+    struct pollfd pfd = { .fd = usb_event_fd, .events = POLLIN };
+
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready <= 0) {
+        return false;
+    }
+
+    uint64_t count;
+    if (read(usb_event_fd, &count, sizeof(count)) != sizeof(count) && errno != EAGAIN) {
+        perror("Failed to read USB eventfd");
+    }
+    return true;
+}
+
+
 void usb_init(SharedDataStruct* shared_data)
 {
     if (!shared_data) {
@@ -420,6 +764,32 @@ void usb_init(SharedDataStruct* shared_data)
         exit(1);
     }
 
+    usb_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    usb_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (usb_event_fd < 0 || usb_stop_fd < 0) {
+        perror("Failed to create USB eventfd");
+        exit(1);
+    }
+
+    // Listen for block device events once udev has finished processing them,
+    // so properties such as ID_PART_TABLE_TYPE are available
+    udev_p = udev_new();
+    if (!udev_p) {
+        fprintf(stderr, "ERROR: udev_new failed\n");
+        exit(1);
+    }
+
+    udev_monitor_p = udev_monitor_new_from_netlink(udev_p, "udev");
+    if (!udev_monitor_p ||
+        udev_monitor_filter_add_match_subsystem_devtype(udev_monitor_p, "block", NULL) < 0 ||
+        udev_monitor_enable_receiving(udev_monitor_p) < 0) {
+        fprintf(stderr, "ERROR: Failed to create udev monitor\n");
+        exit(1);
+    }
+
+    // A hub full of sticks generates a lot of events at once
+    udev_monitor_set_receive_buffer_size(udev_monitor_p, 1024 * 1024);
+
     pthread_mutex_lock(&usb_mutex);
     shared_data_p = shared_data;
     memset(usb_devices_loaded, 0, sizeof(usb_devices_loaded));
@@ -441,13 +811,30 @@ void usb_cleanup(void)
 {
     usb_monitor_stop = true;
 
-    // Join the thread so it's not leaked. Worst case we wait one poll interval.
+    // Wake the thread and join it so it's not leaked
+    uint64_t one = 1;
+    if (write(usb_stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Failed to stop USB monitor");
+    }
     pthread_join(usb_monitor_thread, NULL);
 
+    udev_monitor_unref(udev_monitor_p);
+    udev_unref(udev_p);
+    udev_monitor_p = NULL;
+    udev_p = NULL;
+
     pthread_mutex_lock(&usb_mutex);
     shared_data_p = NULL;
     queue_init(&inserted_queue);
     queue_init(&removed_queue);
     pthread_mutex_unlock(&usb_mutex);
-}
 
+    if (usb_event_fd >= 0) {
+        close(usb_event_fd);
+        usb_event_fd = -1;
+    }
+    if (usb_stop_fd >= 0) {
+        close(usb_stop_fd);
+        usb_stop_fd = -1;
+    }
+}
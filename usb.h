@@ -6,8 +6,15 @@ void usb_init(SharedDataStruct* shared_data_p);
 void usb_cleanup();
 bool usb_device_inserted(char* name, char* path);
 bool usb_device_removed(char* name, char* path);
+int usb_get_event_fd(void);
+bool usb_wait_for_event(int timeout_ms);
 bool device_is_loaded(char* device_name);
+int usb_get_readahead_kb(const char* device_name);
+bool usb_set_readahead_kb(const char* device_name, int kb);
 int get_device_id_from_path(const SharedDataStruct* sdp, const char* path);
+void usb_rebuild_port_index(const SharedDataStruct* sdp);
+void usb_assign_port(int device_id, const char* name, const char* path);
+void usb_refresh_channel_states(void);
 
 #endif // USB_H
 
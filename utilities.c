@@ -1,10 +1,14 @@
 #include "globals.h"
 #include "utilities.h"
+#include "shm.h"
+#include "trace.h"
+#include "probes.h"
 #include <sys/sendfile.h>
 
 #define CRC32_POLY 0x04C11DB7  // Standard CRC-32 polynomial
 
 uint32_t crc32_table[256];
+int probe_device_id = -1;
 
 //------------------------------------------------------------------------------
 // Functions to aid debugging
@@ -35,6 +39,19 @@ const char* get_state_name(const ChannelStateEnum state)
 }
 
 
+const char* get_fail_reason_name(const FailReasonEnum fail_reason)
+{
+	switch (fail_reason) {
+		case FAIL_NONE: 		return "NONE";
+		case FAIL_ERROR: 		return "ERROR";
+		case FAIL_CANCELLED: 	return "CANCELLED";
+		case FAIL_SLOW: 		return "SLOW";
+	}
+	
+	return "UNKNOWN" ;
+}
+
+
 
 /**
  * Display the contents of the client_info struct for debugging purposes
@@ -45,23 +62,110 @@ void print_client_info(const ChannelInfoStruct* client_info_p) {
 	printf("  PORT NUM      %u\n", client_info_p->port_number);
 	printf("  HALT          %s\n", client_info_p->halt ? "true" : "false");
 	printf("  STATE         %s\n", get_state_name(client_info_p->state));
+	printf("  FAIL REASON   %s\n", get_fail_reason_name(client_info_p->fail_reason));
 	printf("  START_TIME    %lu\n", client_info_p->start_time);
 	printf("  DEVICE_NAME   %s\n", client_info_p->device_name);
 	printf("  DEVICE_PATH   %s\n", client_info_p->device_path);
-	printf("  BYTES COPIED  %lu\n\n", client_info_p->bytes_copied);
+	printf("  BYTES COPIED  %lu\n", client_info_p->bytes_copied);
+	printf("  BYTES VERIFIED %lu\n", client_info_p->bytes_verified);
+	printf("  FILE NUMBER   %d\n\n", client_info_p->file_index);
 }	
 
 
+const char* get_phase_name(const PhaseEnum phase)
+{
+	switch (phase) {
+		case PHASE_ERASE: 		return "erase";
+		case PHASE_PARTITION: 	return "partition";
+		case PHASE_FORMAT: 		return "format";
+		case PHASE_MOUNT: 		return "mount";
+		case PHASE_COPY: 		return "copy";
+		case PHASE_SYNC: 		return "sync";
+		case PHASE_VERIFY: 		return "verify";
+		case NUMBER_OF_PHASES: 	break;
+	}
+	
+	return "unknown" ;
+}
+
+
+// The phase of the job each state belongs to, for the timing history.
+// Returns NUMBER_OF_PHASES once the job has finished.
+PhaseEnum get_phase(ChannelStateEnum state) {
+	switch (state) {
+		case ERASING:		return PHASE_ERASE;
+		case PARTITIONING:	return PHASE_PARTITION;
+		case FORMATING:		return PHASE_FORMAT;
+		case MOUNTING:		return PHASE_MOUNT;
+		case COPYING:		return PHASE_COPY;
+		case UNMOUNTING:	return PHASE_SYNC;
+		case VERIFYING:		return PHASE_VERIFY;
+		default:			return NUMBER_OF_PHASES;
+	}
+}
+
+
+// Prints how long each phase of a channel's last job took, and the range of
+// its one-second throughput samples, e.g.
+//   [3] format 2.1s mount 0.3s copy 95.2s sync 10.1s verify 20.4s | 1.2/8.5/11.0 MB/s
+void print_channel_timing(const ChannelInfoStruct* channel_info_p)
+{
+	char line[STRING_LEN*2];
+	int len = snprintf(line, sizeof(line), "[%d]", channel_info_p->device_id);
+
+	for (int phase = 0; phase < NUMBER_OF_PHASES; phase++) {
+		uint64_t ms = channel_phase_ms(channel_info_p, phase);
+		if (ms > 0 && len < (int)sizeof(line)) {
+			len += snprintf(line + len, sizeof(line) - len, " %s %lu.%lus",
+				get_phase_name(phase), (unsigned long)(ms / 1000), (unsigned long)(ms % 1000 / 100));
+		}
+	}
+
+	uint32_t count = channel_info_p->throughput_count;
+	uint32_t samples = (count < THROUGHPUT_SAMPLES) ? count : THROUGHPUT_SAMPLES;
+	uint32_t min_kb = UINT32_MAX, max_kb = 0;
+	uint64_t total_kb = 0;
+	uint32_t busy = 0;
+
+	// Idle seconds (waiting for mkfs etc.) would swamp the figures, so only
+	// count seconds in which data moved
+	for (uint32_t i = 0; i < samples; i++) {
+		uint32_t kb = channel_info_p->throughput_kb[i];
+		if (kb == 0) continue;
+		if (kb < min_kb) min_kb = kb;
+		if (kb > max_kb) max_kb = kb;
+		total_kb += kb;
+		busy++;
+	}
+
+	if (busy > 0 && len < (int)sizeof(line)) {
+		len += snprintf(line + len, sizeof(line) - len, " | %.1f/%.1f/%.1f MB/s over last %us",
+			min_kb / 1024.0, total_kb / 1024.0 / busy, max_kb / 1024.0, samples);
+	}
+
+	// Media bytes per file byte. Well above 1 means FAT metadata or
+	// formatting is costing real write time.
+	double amplification = channel_write_amplification(channel_info_p);
+	if (amplification > 0 && len < (int)sizeof(line)) {
+		snprintf(line + len, sizeof(line) - len, " | %luMB to media, write amplification %.2f",
+			(unsigned long)(channel_info_p->media_bytes / 1024 / 1024), amplification);
+	}
+
+	printf("%s\n", line);
+}
+
+
 
 /**
  * Displays the contents of the entire shared memory area
  */
 void print_shared_data(const SharedDataStruct* shared_data_p) {
 	printf("\n\n\nSHARED DATA\n==========================\n");
-	printf("ShareDataStruct size = %lu\n", sizeof(SharedDataStruct));
+	printf("ShareDataStruct size = %lu\n", SHARED_DATA_SIZE(shared_data_p->channel_count));
+	printf("HUBS = %d x %d ports\n", shared_data_p->number_of_hubs, shared_data_p->ports_per_hub);
 	printf("DEVICE INFO :\n");
 
-	for (int i=0; i<MAX_USB_CHANNELS; i++)
+	for (int i=0; i<shared_data_p->channel_count; i++)
 	{
 		print_client_info(&shared_data_p->channel_info[i]);
 	}
@@ -77,7 +181,7 @@ void print_shared_data(const SharedDataStruct* shared_data_p) {
 
 int get_device_id_from_hub_and_port_number(const SharedDataStruct* shared_data_p, int hub_number, int port_number) {
 	
-	for (int device_id=0; device_id<MAX_USB_CHANNELS; device_id++)
+	for (int device_id=0; device_id<shared_data_p->channel_count; device_id++)
 	{
 		const ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[device_id];
 		if ((channel_info_p->port_number == port_number) && (channel_info_p->hub_number == hub_number)) {
@@ -164,7 +268,11 @@ int execute_command(const int device_id, const char *cmd, const bool ignore_erro
 		printf("[%d] Executing: %s\n", device_id, cmd);
 	}		
 	
+    trace_begin(TRACE_COMMAND, cmd);
+    PROBE2(command_entry, device_id, cmd);
     int ret = system(cmd);
+    PROBE3(command_return, device_id, cmd, (ret == -1) ? -1 : WEXITSTATUS(ret));
+    trace_end(TRACE_COMMAND, (ret == -1) ? -1 : WEXITSTATUS(ret));
     if (ret == -1) {
         fprintf(stderr, "ERROR: Failed to execute '%s': %s\n", cmd, strerror(errno));
         return -1;
@@ -192,6 +300,18 @@ int compare_names(const void *a, const void *b) {
 }
 
 
+static copy_chunk_cb copy_chunk_hook = NULL;
+
+// Installs a function for copy_file to call before each chunk, or NULL for
+// none. The client uses it to act on commands from the server.
+void set_copy_chunk_hook(copy_chunk_cb hook) {
+	copy_chunk_hook = hook;
+}
+
+
+static int copy_file_untraced(const char *src_path, const char *dest_path,
+                              atomic_bool *halt_p, _Atomic off_t *bytes_copied_p);
+
 /**
  * Function to copy a single file (ignoring permissions) and return its size.
  * Uses sendfile(2) for a zero-copy kernel-side transfer. Falls back to a
@@ -200,11 +320,26 @@ int compare_names(const void *a, const void *b) {
  * @param src_path Source file path
  * @param dest_path Destination file path
  * @param halt_p Pointer to the halt flag. Aborts copy if true
- * @param bytes_copied_p Pointer to store the bytes copied (output, accumulated)
+ * @param bytes_copied_p Pointer to store the bytes copied (output, accumulated).
+ *        Updated atomically so other processes can read it while copying
  * @return 0 on success or halted, -1 on failure
  */
 int copy_file(const char *src_path, const char *dest_path,
-              bool *halt_p, off_t *bytes_copied_p) {
+              atomic_bool *halt_p, _Atomic off_t *bytes_copied_p) {
+
+    const char *leaf = strrchr(src_path, '/');
+    off_t start_bytes = *bytes_copied_p;
+
+    trace_begin(TRACE_COPY_FILE, leaf ? leaf + 1 : src_path);
+    PROBE3(copy_file_entry, probe_device_id, src_path, dest_path);
+    int ret = copy_file_untraced(src_path, dest_path, halt_p, bytes_copied_p);
+    PROBE4(copy_file_return, probe_device_id, src_path, (int64_t)(*bytes_copied_p - start_bytes), ret);
+    trace_end(TRACE_COPY_FILE, *bytes_copied_p - start_bytes);
+    return ret;
+}
+
+static int copy_file_untraced(const char *src_path, const char *dest_path,
+                              atomic_bool *halt_p, _Atomic off_t *bytes_copied_p) {
 	
     char error_msg[STRING_LEN];
     struct stat stat_buf;
@@ -242,6 +377,8 @@ int copy_file(const char *src_path, const char *dest_path,
 
     while (remaining > 0) {
 
+        if (copy_chunk_hook) copy_chunk_hook();
+
         if (*halt_p) {
             close(src_fd);
             close(dest_fd);
@@ -276,7 +413,7 @@ int copy_file(const char *src_path, const char *dest_path,
         }
 
         remaining -= sent;
-        *bytes_copied_p += sent;
+        atomic_fetch_add_explicit(bytes_copied_p, sent, memory_order_relaxed);
     }
 
     // ---- Fallback path: kernel refused sendfile for this pair ----
@@ -290,7 +427,7 @@ int copy_file(const char *src_path, const char *dest_path,
             return -1;
         }
         // Undo any bytes we attributed to the aborted sendfile attempt.
-        *bytes_copied_p -= (stat_buf.st_size - remaining);
+        atomic_fetch_sub_explicit(bytes_copied_p, stat_buf.st_size - remaining, memory_order_relaxed);
 
         char *buffer = malloc(CHUNK);
         if (!buffer) {
@@ -302,6 +439,7 @@ int copy_file(const char *src_path, const char *dest_path,
 
         ssize_t bytes_read;
         while ((bytes_read = read(src_fd, buffer, CHUNK)) > 0) {
+            if (copy_chunk_hook) copy_chunk_hook();
             if (*halt_p) {
                 free(buffer);
                 close(src_fd);
@@ -316,7 +454,7 @@ int copy_file(const char *src_path, const char *dest_path,
                 close(dest_fd);
                 return -1;
             }
-            *bytes_copied_p += bytes_read;
+            atomic_fetch_add_explicit(bytes_copied_p, bytes_read, memory_order_relaxed);
         }
 
         free(buffer);
@@ -380,6 +518,50 @@ void shorten_filename(char *filename, size_t max_len) {
 
 
 
+/**
+ * Function to add up the sizes of the files under a directory
+ * @param path Directory path
+ * @return total size in bytes, 0 if the directory can't be read
+ */
+uint64_t get_directory_size(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+
+    uint64_t total = 0;
+    struct dirent *entry;
+    struct stat statbuf;
+    char entry_path[PATH_LEN];
+
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name) >= (int)sizeof(entry_path)) {
+            continue;
+        }
+        if (lstat(entry_path, &statbuf) == -1) {
+            continue;
+        }
+
+        if (S_ISDIR(statbuf.st_mode)) {
+            total += get_directory_size(entry_path);
+        }
+        else if (S_ISREG(statbuf.st_mode)) {
+            total += statbuf.st_size;
+        }
+    }
+
+    closedir(dir);
+    return total;
+}
+
+
+static int copy_directory_untraced(const char *src_dir, const char *dest_dir,
+                                   atomic_bool* halt_p, _Atomic off_t *bytes_copied_p,
+                                   copy_progress_cb progress_cb);
+
 /**
  * Function to recursively copy a directory and return total file size
  * @param src_dir Source directory path
@@ -390,8 +572,18 @@ void shorten_filename(char *filename, size_t max_len) {
  * @return 0 on success or halted, -1 on failure
  */
 int copy_directory(const char *src_dir, const char *dest_dir, 
-				   bool* halt_p, off_t *bytes_copied_p,
+				   atomic_bool* halt_p, _Atomic off_t *bytes_copied_p,
                    copy_progress_cb progress_cb) {
+
+    PROBE3(copy_directory_entry, probe_device_id, src_dir, dest_dir);
+    int ret = copy_directory_untraced(src_dir, dest_dir, halt_p, bytes_copied_p, progress_cb);
+    PROBE4(copy_directory_return, probe_device_id, src_dir, (int64_t)(bytes_copied_p ? *bytes_copied_p : 0), ret);
+    return ret;
+}
+
+static int copy_directory_untraced(const char *src_dir, const char *dest_dir,
+                                   atomic_bool* halt_p, _Atomic off_t *bytes_copied_p,
+                                   copy_progress_cb progress_cb) {
 	
     char error_msg[600];
 
@@ -579,13 +771,19 @@ void initialise_crc_table() {
 
 
 
-uint32_t compute_crc32(char *filename) {
+// CRC of the first CRC_SIZE bytes of a file. The bytes read are also added
+// to *bytes_read_p, unless it is NULL.
+uint32_t compute_crc32(char *filename, _Atomic off_t *bytes_read_p) {
     FILE *file = fopen(filename, "rb");
     if (!file) {
         fprintf(stderr, "VERIFY ERROR : Compute CRC cannot open file %s\n", filename);
         return 0;
     }
 
+    const char *leaf = strrchr(filename, '/');
+    trace_begin(TRACE_CRC, leaf ? leaf + 1 : filename);
+    PROBE2(crc_entry, probe_device_id, filename);
+
     uint32_t crc = 0xFFFFFFFF;
     uint32_t crc_bytes = 0;
     unsigned char buf[65536];
@@ -600,10 +798,15 @@ uint32_t compute_crc32(char *filename) {
             crc = (crc << 8) ^ crc32_table[((crc >> 24) ^ buf[i]) & 0xFF];
         }
         crc_bytes += n;
+        if (bytes_read_p) {
+            atomic_fetch_add_explicit(bytes_read_p, n, memory_order_relaxed);
+        }
     }
 
     crc ^= 0xFFFFFFFF;
     fclose(file);
+    PROBE4(crc_return, probe_device_id, filename, crc_bytes, crc);
+    trace_end(TRACE_CRC, crc_bytes);
     return crc;
 }
 
@@ -6,6 +6,14 @@ void trim(char *str);
 
 const char* get_state_name(const ChannelStateEnum state);
 
+const char* get_fail_reason_name(const FailReasonEnum fail_reason);
+
+const char* get_phase_name(const PhaseEnum phase);
+
+PhaseEnum get_phase(ChannelStateEnum state);
+
+void print_channel_timing(const ChannelInfoStruct* channel_info_p);
+
 int execute_command(const int device_id, const char *cmd, const bool ignore_errors);
 
 uint64_t get_directory_size(const char *path);
@@ -18,12 +26,20 @@ uint64_t get_directory_size(const char *path);
  * Callback runs synchronously on the calling thread, so keep it cheap.
  */
 typedef void (*copy_progress_cb)(const char *filename);
+
+/*
+ * Optional hook called by copy_file before each ~1MB chunk. It may block
+ * (to pause or throttle the copy) or set the halt flag.
+ */
+typedef void (*copy_chunk_cb)(void);
+
+void set_copy_chunk_hook(copy_chunk_cb hook);
  
 int copy_file(const char *src_path, const char *dest_path,
-              bool *halt_p, off_t *bytes_copied_p);
+              atomic_bool *halt_p, _Atomic off_t *bytes_copied_p);
  
-int copy_directory(const char *src_dir, const char *dest_dir, bool* halt_p, 
-				off_t *bytes_copied_p, copy_progress_cb progress_cb);
+int copy_directory(const char *src_dir, const char *dest_dir, atomic_bool* halt_p, 
+				_Atomic off_t *bytes_copied_p, copy_progress_cb progress_cb);
 
 void print_shared_data(const SharedDataStruct* shared_data_p);
 
@@ -33,7 +49,7 @@ int get_device_id_from_hub_and_port_number(const SharedDataStruct* shared_data_p
 
 void initialise_crc_table();
 
-uint32_t compute_crc32(char *filename);
+uint32_t compute_crc32(char *filename, _Atomic off_t *bytes_read_p);
 
 void shorten_filename(char *filename, size_t max_len);
 
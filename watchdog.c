@@ -0,0 +1,253 @@
+#include "globals.h"
+#include "utilities.h"
+#include "config.h"
+#include "watchdog.h"
+#include "shm.h"
+#include <signal.h>
+
+/*
+ * Stall watchdog
+ * --------------
+ * A hub only finishes when every client on it has finished, so one stick
+ * that slows to a crawl, or hangs in mkfs or sync, would hold up all the
+ * others. On each reactor wake-up the server checks every running client:
+ *
+ *   - COPYING: bytes_copied must grow by at least min_copy_rate_kb per
+ *     second over each rate_window, and must not stand still for longer
+ *     than stall_timeout.
+ *   - any other working phase (formatting, sync, verify ...) must finish
+ *     within phase_timeout.
+ *
+ * A client that trips is marked FAILED with reason FAIL_SLOW straight away,
+ * so the rest of its hub can complete, and is asked to halt. If it hasn't
+ * exited kill_grace seconds later its process group is sent SIGTERM, then
+ * SIGKILL after the same delay again.
+ *
+ * The clients run as root under sudo and the server doesn't, so a signal
+ * the server isn't allowed to send is sent again through "sudo kill". The
+ * port stays blocked until the client program itself has gone, not just
+ * the sudo above it: a client that outlives its sudo is killed, and no new
+ * client is started on the stick until it has exited.
+ */
+
+typedef struct {
+    pid_t pid;                  // client these figures belong to
+    ChannelStateEnum state;     // phase seen on the last check
+    uint64_t phase_start_ms;
+    uint64_t window_start_ms;   // start of the current copy rate window
+    off_t window_bytes;
+    off_t last_bytes;
+    uint64_t last_progress_ms;  // last time bytes_copied changed
+    uint64_t tripped_ms;        // 0 until the watchdog fails this client
+    int signals_sent;           // 0, then 1 after SIGTERM, 2 after SIGKILL
+    bool orphan_killed;         // SIGKILL sent to a client whose sudo has exited
+} WatchdogChannelStruct;
+
+static WatchdogChannelStruct watchdog_channels[MAX_USB_CHANNELS];
+
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Returns true for the states in which a client is actively working
+static bool is_working(ChannelStateEnum state)
+{
+    return (state == STARTING) || (state == ERASING) || (state == FORMATING) ||
+           (state == PARTITIONING) || (state == MOUNTING) || (state == COPYING) ||
+           (state == UNMOUNTING) || (state == VERIFYING);
+}
+
+
+// Fails the channel and asks the client to stop
+static void trip(ChannelInfoStruct* channel_info_p, WatchdogChannelStruct* watch_p,
+                 uint64_t now_ms, const char* reason)
+{
+    fprintf(stderr, "ERROR: Watchdog: device %d (%s) %s in state %s. Failing it\n",
+            channel_info_p->device_id, channel_info_p->device_name, reason,
+            get_state_name(channel_info_p->state));
+
+    channel_info_p->fail_reason = FAIL_SLOW;
+    channel_info_p->state = FAILED;
+    channel_send_command(channel_info_p, CMD_HALT, 0);
+    watch_p->tripped_ms = now_ms;
+}
+
+
+// Sends a signal to a process, or to a process group if pid is negative,
+// through sudo if the server isn't allowed to. Returns false on failure.
+static bool send_signal(pid_t pid, int signal_number, const char* signal_name)
+{
+    if (kill(pid, signal_number) == 0 || errno == ESRCH) return true;
+    if (errno != EPERM) {
+        fprintf(stderr, "ERROR: Watchdog: kill(%d, %s) failed: %s\n", pid, signal_name, strerror(errno));
+        return false;
+    }
+
+    char command[STRING_LEN];
+    snprintf(command, sizeof(command), "sudo kill -s %s -- %d", signal_name + 3, pid);
+    if (execute_command(-1, command, true) != 0) {
+        fprintf(stderr, "ERROR: Watchdog: '%s' failed\n", command);
+        return false;
+    }
+    return true;
+}
+
+
+// Signals the client program and anything it has started. Until the client
+// has recorded its pid only the sudo above it is known: SIGTERM is passed
+// on by sudo, but SIGKILL isn't, so its children are killed first.
+static void signal_client(const ChannelInfoStruct* channel_info_p, int signal_number, const char* signal_name)
+{
+    pid_t worker_pid = channel_info_p->worker_pid;
+    printf("Watchdog: sending %s to device %d (pid %d, client %d)\n", signal_name,
+           channel_info_p->device_id, channel_info_p->pid, worker_pid);
+
+    if (worker_pid > 0) {
+        send_signal(-worker_pid, signal_number, signal_name);
+        return;
+    }
+
+    if (signal_number == SIGKILL) {
+        char command[STRING_LEN];
+        snprintf(command, sizeof(command), "sudo pkill -KILL -P %d", channel_info_p->pid);
+        execute_command(-1, command, true);
+    }
+    send_signal(channel_info_p->pid, signal_number, signal_name);
+}
+
+
+// Returns true while the client program on a channel is still running,
+// whether or not the sudo the server started it with has exited. Forgets
+// worker_pid once it has gone.
+bool watchdog_client_running(ChannelInfoStruct* channel_info_p)
+{
+    pid_t worker_pid = channel_info_p->worker_pid;
+    if (worker_pid <= 0) return false;
+
+    // The client runs as root, so the server may only be refused
+    if (kill(worker_pid, 0) == 0 || errno == EPERM) return true;
+    channel_info_p->worker_pid = 0;
+    return false;
+}
+
+
+// Checks the progress of every running client against the configured limits.
+// Returns true while a failed client has still to exit, so the caller keeps
+// calling this periodically even though no hub is busy.
+bool watchdog_check(SharedDataStruct* shared_data_p)
+{
+    const WatchdogConfigStruct* limits_p = &config.watchdog;
+    uint64_t now_ms = monotonic_ms();
+    bool pending = false;
+    char reason[STRING_LEN];
+
+    for (int device_id = 0; device_id < shared_data_p->channel_count; device_id++) {
+        ChannelInfoStruct* channel_info_p = &shared_data_p->channel_info[device_id];
+        WatchdogChannelStruct* watch_p = &watchdog_channels[device_id];
+
+        // sudo has exited. Make sure the client it ran has too
+        if (channel_info_p->pid <= 0) {
+            if (watchdog_client_running(channel_info_p)) {
+                if (!watch_p->orphan_killed) {
+                    fprintf(stderr, "ERROR: Watchdog: device %d client (pid %d) outlived sudo. Killing it\n",
+                            device_id, channel_info_p->worker_pid);
+                    signal_client(channel_info_p, SIGKILL, "SIGKILL");
+                    watch_p->orphan_killed = true;
+                }
+                pending = true;
+            }
+            else {
+                watch_p->orphan_killed = false;
+            }
+            continue;
+        }
+
+        // A new client. Start watching it from scratch
+        if (watch_p->pid != channel_info_p->pid) {
+            memset(watch_p, 0, sizeof(*watch_p));
+            watch_p->pid = channel_info_p->pid;
+            watch_p->state = channel_info_p->state;
+            watch_p->phase_start_ms = now_ms;
+        }
+
+        // Already failed. Escalate until it exits and reap_clients() clears the pid
+        if (watch_p->tripped_ms != 0) {
+            uint64_t grace_ms = (uint64_t)limits_p->kill_grace * 1000;
+            uint64_t waited_ms = now_ms - watch_p->tripped_ms;
+
+            if ((watch_p->signals_sent == 0) && (waited_ms >= grace_ms)) {
+                signal_client(channel_info_p, SIGTERM, "SIGTERM");
+                watch_p->signals_sent = 1;
+            }
+            else if ((watch_p->signals_sent == 1) && (waited_ms >= 2 * grace_ms)) {
+                signal_client(channel_info_p, SIGKILL, "SIGKILL");
+                watch_p->signals_sent = 2;
+            }
+
+            if (watch_p->signals_sent < 2) {
+                pending = true;
+            }
+            continue;
+        }
+
+        ChannelStateEnum state = channel_info_p->state;
+        off_t bytes = channel_info_p->bytes_copied;
+
+        // A paused client, or one waiting for the server to finish a master
+        // file, isn't expected to make progress, so restart its clocks
+        bool idle = channel_info_p->paused || channel_info_p->waiting;
+        if ((state != watch_p->state) || idle) {
+            watch_p->state = state;
+            watch_p->phase_start_ms = now_ms;
+            watch_p->window_start_ms = now_ms;
+            watch_p->window_bytes = bytes;
+            watch_p->last_bytes = bytes;
+            watch_p->last_progress_ms = now_ms;
+        }
+
+        if (!is_working(state) || idle) continue;
+
+        if (state == COPYING) {
+            if (bytes != watch_p->last_bytes) {
+                watch_p->last_bytes = bytes;
+                watch_p->last_progress_ms = now_ms;
+            }
+
+            if ((limits_p->stall_timeout > 0) &&
+                (now_ms - watch_p->last_progress_ms >= (uint64_t)limits_p->stall_timeout * 1000)) {
+                snprintf(reason, sizeof(reason), "has copied nothing for %ds", limits_p->stall_timeout);
+                trip(channel_info_p, watch_p, now_ms, reason);
+                pending = true;
+                continue;
+            }
+
+            uint64_t window_ms = now_ms - watch_p->window_start_ms;
+            // A client throttled by the server is allowed to be slow
+            if ((limits_p->min_copy_rate_kb > 0) && (channel_info_p->throttle_kb == 0) &&
+                (window_ms >= (uint64_t)limits_p->rate_window * 1000)) {
+                uint64_t rate_kb = (uint64_t)(bytes - watch_p->window_bytes) * 1000 / 1024 / window_ms;
+                if (rate_kb < (uint64_t)limits_p->min_copy_rate_kb) {
+                    snprintf(reason, sizeof(reason), "is copying at %luKB/s", (unsigned long)rate_kb);
+                    trip(channel_info_p, watch_p, now_ms, reason);
+                    pending = true;
+                    continue;
+                }
+                watch_p->window_start_ms = now_ms;
+                watch_p->window_bytes = bytes;
+            }
+        }
+        else if ((limits_p->phase_timeout > 0) &&
+                 (now_ms - watch_p->phase_start_ms >= (uint64_t)limits_p->phase_timeout * 1000)) {
+            snprintf(reason, sizeof(reason), "has been stuck for %ds", limits_p->phase_timeout);
+            trip(channel_info_p, watch_p, now_ms, reason);
+            pending = true;
+        }
+    }
+
+    return pending;
+}
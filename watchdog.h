@@ -0,0 +1,7 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+bool watchdog_check(SharedDataStruct* shared_data_p);
+bool watchdog_client_running(ChannelInfoStruct* channel_info_p);
+
+#endif // WATCHDOG_H